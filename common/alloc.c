@@ -868,10 +868,11 @@ int option_state_allocate (ptr, file, line)
 	}
 
 	size = sizeof **ptr + (universe_count - 1) * sizeof (void *);
-	*ptr = dmalloc (size, file, line);
+	*ptr = dmalloc_transient (size, file, line);
 	if (*ptr) {
 		memset (*ptr, 0, size);
 		(*ptr) -> universe_count = universe_count;
+		(*ptr) -> stamp = ++option_state_stamp;
 		(*ptr) -> refcnt = 1;
 		rc_register (file, line,
 			     ptr, *ptr, (*ptr) -> refcnt, 0, RC_MISC);
@@ -1114,6 +1115,8 @@ int packet_dereference (ptr, file, line)
 #endif
 	}
 
+	if (packet -> memo)
+		expression_memo_free (&packet -> memo);
 	if (packet -> options)
 		option_state_dereference (&packet -> options, file, line);
 	if (packet -> interface)
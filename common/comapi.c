@@ -466,12 +466,42 @@ isc_result_t dhcp_control_set_value  (omapi_object_t *h,
 }
 
 
+/* The counters of each object pool are read-only values of the control
+   object, named after the pool: "lease-state-in-use", for example. */
+static const char *pool_counter_names [] = {
+	"in-use", "free", "high-water", "allocations", "slabs", "released"
+};
+#define POOL_COUNTERS \
+	(sizeof pool_counter_names / sizeof pool_counter_names [0])
+
+static unsigned long pool_counter (struct dmalloc_pool *pool, unsigned i)
+{
+	switch (i) {
+	      case 0:
+		return pool -> in_use;
+	      case 1:
+		return pool -> free;
+	      case 2:
+		return (pool -> high_water > pool -> peak
+			? pool -> high_water : pool -> peak);
+	      case 3:
+		return pool -> allocations;
+	      case 4:
+		return pool -> slabs;
+	      default:
+		return pool -> released;
+	}
+}
+
 isc_result_t dhcp_control_get_value (omapi_object_t *h, omapi_object_t *id,
 				   omapi_data_string_t *name,
 				   omapi_value_t **value)
 {
 	dhcp_control_object_t *control;
+	struct dmalloc_pool *pool;
+	char buf [64];
 	isc_result_t status;
+	unsigned i;
 
 	if (h -> type != dhcp_type_control)
 		return DHCP_R_INVALIDARG;
@@ -481,6 +511,17 @@ isc_result_t dhcp_control_get_value (omapi_object_t *h, omapi_object_t *id,
 		return omapi_make_int_value (value,
 					     name, (int)control -> state, MDL);
 
+	for (pool = dmalloc_pools; pool; pool = pool -> next) {
+		for (i = 0; i < POOL_COUNTERS; i++) {
+			snprintf (buf, sizeof buf, "%s-%s",
+				  pool -> name, pool_counter_names [i]);
+			if (!omapi_ds_strcmp (name, buf))
+				return omapi_make_uint_value
+					(value, name,
+					 (unsigned)pool_counter (pool, i), MDL);
+		}
+	}
+
 	/* Try to find some inner object that can take the value. */
 	if (h -> inner && h -> inner -> type -> get_value) {
 		status = ((*(h -> inner -> type -> get_value))
@@ -526,7 +567,10 @@ isc_result_t dhcp_control_stuff_values (omapi_object_t *c,
 					omapi_object_t *h)
 {
 	dhcp_control_object_t *control;
+	struct dmalloc_pool *pool;
+	char buf [64];
 	isc_result_t status;
+	unsigned i;
 
 	if (h -> type != dhcp_type_control)
 		return DHCP_R_INVALIDARG;
@@ -543,6 +587,24 @@ isc_result_t dhcp_control_stuff_values (omapi_object_t *c,
 	if (status != ISC_R_SUCCESS)
 		return status;
 
+	for (pool = dmalloc_pools; pool; pool = pool -> next) {
+		for (i = 0; i < POOL_COUNTERS; i++) {
+			snprintf (buf, sizeof buf, "%s-%s",
+				  pool -> name, pool_counter_names [i]);
+			status = omapi_connection_put_name (c, buf);
+			if (status != ISC_R_SUCCESS)
+				return status;
+			status = omapi_connection_put_uint32
+				(c, sizeof (u_int32_t));
+			if (status != ISC_R_SUCCESS)
+				return status;
+			status = omapi_connection_put_uint32
+				(c, (u_int32_t)pool_counter (pool, i));
+			if (status != ISC_R_SUCCESS)
+				return status;
+		}
+	}
+
 	/* Write out the inner object, if any. */
 	if (h -> inner && h -> inner -> type -> stuff_values) {
 		status = ((*(h -> inner -> type -> stuff_values))
@@ -794,6 +856,25 @@ isc_result_t dhcp_shared_network_get_value (omapi_object_t *h,
 	return ISC_R_NOTFOUND;
 }
 
+static void
+subnet_tree_node_free(struct subnet_tree_node *n)
+{
+	if (n == NULL)
+		return;
+	subnet_tree_node_free(n->child[0]);
+	subnet_tree_node_free(n->child[1]);
+	dfree(n, MDL);
+}
+
+/* Release a subnet index built by subnet_tree_add(). */
+void
+subnet_tree_free(struct subnet_tree *tree)
+{
+	subnet_tree_node_free(tree->root[0]);
+	subnet_tree_node_free(tree->root[1]);
+	memset(tree, 0, sizeof(*tree));
+}
+
 isc_result_t dhcp_shared_network_destroy (omapi_object_t *h,
 					  const char *file, int line)
 {
@@ -814,6 +895,7 @@ isc_result_t dhcp_shared_network_destroy (omapi_object_t *h,
 	}
 	if (shared_network -> subnets)
 		subnet_dereference (&shared_network -> subnets, file, line);
+	subnet_tree_free (&shared_network -> subnet_tree);
 	if (shared_network -> interface)
 		interface_dereference (&shared_network -> interface,
 				       file, line);
@@ -45,6 +45,15 @@ struct interface_info *fallback_interface = 0;
 
 int interfaces_invalidated;
 int quiet_interface_discovery;
+
+/* Map from the kernel's interface index to the interface it names, so
+   that received packets can be matched with their interface without
+   calling if_nametoindex() on every interface.   The table holds
+   references and is rebuilt from the interface list on demand. */
+static struct interface_info **ifindex_map;
+static unsigned ifindex_map_max;
+static int ifindex_map_valid;
+static TIME ifindex_map_built;
 u_int16_t local_port = 0;
 u_int16_t remote_port = 0;
 u_int16_t relay_port = 0;
@@ -1020,6 +1029,9 @@ discover_interfaces(int state) {
 #endif
 	} /* for (tmp = interfaces; ... */
 
+	/* The interface list may have changed. */
+	interface_ifindex_invalidate();
+
 	if (state == DISCOVER_SERVER && wifcount == 0) {
 		log_info ("%s", "");
 		log_fatal ("Not configured to listen on any interfaces!");
@@ -1101,65 +1113,79 @@ isc_result_t got_one (h)
 						 possible MTU. */
 		struct dhcp_packet packet;
 	} u;
-	struct interface_info *ip;
+	struct interface_info *rip, *ip;
+	isc_result_t status;
 
 	if (h -> type != dhcp_type_interface)
 		return DHCP_R_INVALIDARG;
-	ip = (struct interface_info *)h;
-
-      again:
-	if ((result =
-	     receive_packet (ip, u.packbuf, sizeof u, &from, &hfrom)) < 0) {
-		log_error ("receive_packet failed on %s: %m", ip -> name);
-		return ISC_R_UNEXPECTED;
-	}
-	if (result == 0)
-		return ISC_R_UNEXPECTED;
+	rip = (struct interface_info *)h;
 
 	/*
-	 * If we didn't at least get the fixed portion of the BOOTP
-	 * packet, drop the packet.
-	 * Previously we allowed packets with no sname or filename
-	 * as we were aware of at least one client that did.  But
-	 * a bug caused short packets to not work and nobody has
-	 * complained, it seems rational to tighten up that
-	 * restriction.
+	 * The receive path may return several packets for one wakeup,
+	 * e.g. bpf, or a recvmmsg() batch.  Keep going until whatever
+	 * was buffered on the receiving interface has been handled, even
+	 * if some of those packets turn out to be unusable.
 	 */
-	if (result < DHCP_FIXED_NON_UDP)
-		return ISC_R_UNEXPECTED;
+	do {
+		status = ISC_R_SUCCESS;
+		ip = rip;
+
+		if ((result = receive_packet (rip, u.packbuf, sizeof u,
+					      &from, &hfrom)) < 0) {
+			log_error ("receive_packet failed on %s: %m",
+				   rip -> name);
+			status = ISC_R_UNEXPECTED;
+			continue;
+		}
+		if (result == 0) {
+			status = ISC_R_UNEXPECTED;
+			continue;
+		}
+
+		/*
+		 * If we didn't at least get the fixed portion of the BOOTP
+		 * packet, drop the packet.
+		 * Previously we allowed packets with no sname or filename
+		 * as we were aware of at least one client that did.  But
+		 * a bug caused short packets to not work and nobody has
+		 * complained, it seems rational to tighten up that
+		 * restriction.
+		 */
+		if (result < DHCP_FIXED_NON_UDP) {
+			status = ISC_R_UNEXPECTED;
+			continue;
+		}
 
 #if defined(IP_PKTINFO) && defined(IP_RECVPKTINFO) && defined(USE_V4_PKTINFO)
-	{
-		/* We retrieve the ifindex from the unused hfrom variable */
-		unsigned int ifindex;
+		{
+			/* We retrieve the ifindex from the unused hfrom
+			   variable */
+			unsigned int ifindex;
 
-		memcpy(&ifindex, hfrom.hbuf, sizeof (ifindex));
+			memcpy(&ifindex, hfrom.hbuf, sizeof (ifindex));
 
-		/*
-		 * Seek forward from the first interface to find the matching
-		 * source interface by interface index.
-		 */
-		ip = interfaces;
-		while ((ip != NULL) && (if_nametoindex(ip->name) != ifindex))
-			ip = ip->next;
-		if (ip == NULL)
-			return ISC_R_NOTFOUND;
-	}
+			/* Find the source interface by interface index. */
+			ip = interface_find_by_ifindex(ifindex);
+			if (ip == NULL) {
+				status = ISC_R_NOTFOUND;
+				continue;
+			}
+		}
 #endif
 
-	if (bootp_packet_handler) {
-		ifrom.len = 4;
-		memcpy (ifrom.iabuf, &from.sin_addr, ifrom.len);
+		if (bootp_packet_handler) {
+			ifrom.len = 4;
+			memcpy (ifrom.iabuf, &from.sin_addr, ifrom.len);
 
-		(*bootp_packet_handler) (ip, &u.packet, (unsigned)result,
-					 from.sin_port, ifrom, &hfrom);
-	}
+			(*bootp_packet_handler) (ip, &u.packet,
+						 (unsigned)result,
+						 from.sin_port, ifrom, &hfrom);
+		}
 
-	/* If there is buffered data, read again.    This is for, e.g.,
-	   bpf, which may return two packets at once. */
-	if (ip -> rbuf_offset != ip -> rbuf_len)
-		goto again;
-	return ISC_R_SUCCESS;
+	/* If there is buffered data, read again. */
+	} while (rip -> rbuf_offset != rip -> rbuf_len);
+
+	return status;
 }
 
 #ifdef DHCPv6
@@ -1203,11 +1229,8 @@ got_one_v6(omapi_object_t *h) {
 		ifrom.len = 16;
 		memcpy(ifrom.iabuf, &from.sin6_addr, ifrom.len);
 
-		/* Seek forward to find the matching source interface. */
-		ip = interfaces;
-		while ((ip != NULL) && (if_nametoindex(ip->name) != if_idx))
-			ip = ip->next;
-
+		/* Find the matching source interface. */
+		ip = interface_find_by_ifindex(if_idx);
 		if (ip == NULL)
 			return ISC_R_NOTFOUND;
 
@@ -1494,6 +1517,7 @@ isc_result_t dhcp_interface_remove (omapi_object_t *lp,
 	}
 	if (!ip)
 		return ISC_R_NOTFOUND;
+	interface_ifindex_invalidate();
 
 	/* add the interface to the dummy_interface list */
 	if (dummy_interfaces) {
@@ -1582,4 +1606,87 @@ void interface_snorf (struct interface_info *tmp, int ir)
 		interface_dereference (&interfaces, MDL);
 	}
 	interface_reference (&interfaces, tmp, MDL);
+	interface_ifindex_invalidate();
+}
+
+/* Drop the ifindex map; it is rebuilt on the next lookup.   Must be
+   called whenever interfaces are added to or removed from the
+   interface list. */
+void interface_ifindex_invalidate ()
+{
+	unsigned i;
+
+	for (i = 0; i < ifindex_map_max; i++) {
+		if (ifindex_map [i])
+			interface_dereference (&ifindex_map [i], MDL);
+	}
+	ifindex_map_valid = 0;
+}
+
+/* Drop the ifindex map and release its storage, at shutdown. */
+void interface_ifindex_free ()
+{
+	interface_ifindex_invalidate ();
+	if (ifindex_map)
+		dfree (ifindex_map, MDL);
+	ifindex_map = (struct interface_info **)0;
+	ifindex_map_max = 0;
+}
+
+static void interface_ifindex_rebuild ()
+{
+	struct interface_info *ip, **map;
+	unsigned ifindex, max;
+
+	interface_ifindex_invalidate ();
+
+	for (ip = interfaces; ip; ip = ip -> next) {
+		ifindex = if_nametoindex (ip -> name);
+		if (ifindex == 0)
+			continue;
+
+		if (ifindex >= ifindex_map_max) {
+			max = ifindex_map_max ? ifindex_map_max : 16;
+			while (max <= ifindex)
+				max *= 2;
+			map = dmalloc (max * sizeof *map, MDL);
+			if (!map)
+				log_fatal ("No memory for interface index map.");
+			if (ifindex_map) {
+				memcpy (map, ifindex_map,
+					ifindex_map_max * sizeof *map);
+				dfree (ifindex_map, MDL);
+			}
+			ifindex_map = map;
+			ifindex_map_max = max;
+		}
+
+		/* If two interfaces claim the same index, the first one
+		   on the list wins, as it did with the linear search. */
+		if (!ifindex_map [ifindex])
+			interface_reference (&ifindex_map [ifindex], ip, MDL);
+	}
+
+	ifindex_map_valid = 1;
+	ifindex_map_built = cur_time;
+}
+
+/* Find the interface with the given kernel interface index. */
+struct interface_info *interface_find_by_ifindex (unsigned ifindex)
+{
+	if (!ifindex_map_valid)
+		interface_ifindex_rebuild ();
+
+	/* The kernel may have renumbered an interface since the map was
+	   built (e.g., it was deleted and recreated), so on a miss try
+	   again with a fresh map, but at most once a second so that
+	   traffic on interfaces we don't know about can't force a
+	   rebuild for every packet. */
+	if ((ifindex >= ifindex_map_max || !ifindex_map [ifindex]) &&
+	    ifindex_map_built != cur_time)
+		interface_ifindex_rebuild ();
+
+	if (ifindex >= ifindex_map_max)
+		return NULL;
+	return ifindex_map [ifindex];
 }
@@ -31,7 +31,145 @@
 #include <sys/time.h>
 
 struct timeout *timeouts;
-static struct timeout *free_timeouts;
+static struct dmalloc_pool timeout_pool =
+	DMALLOC_POOL ("timeout", struct timeout);
+
+/*
+ * The timeout list is indexed by the object the timeout was registered
+ * for, so that add_timeout() and cancel_timeout() can find an existing
+ * (func, what) entry without walking every pending timeout.  The index
+ * is an open hash table whose size is a power of two; it doubles when
+ * the number of pending timeouts exceeds the number of buckets.
+ */
+static struct timeout **timeout_index;
+static unsigned timeout_index_size;
+static unsigned timeout_count;
+
+#define TIMEOUT_INDEX_MIN 256
+
+static unsigned
+timeout_hash(const void *what, unsigned size)
+{
+	u_int64_t v = (u_int64_t)(uintptr_t)what;
+
+	/* Allocations are aligned, so mix the low bits in from above. */
+	v *= 0x9e3779b97f4a7c15ULL;
+	return ((unsigned)(v >> 32) & (size - 1));
+}
+
+static void
+timeout_index_grow(void)
+{
+	struct timeout **nindex, *q, *next;
+	unsigned nsize, i, h;
+
+	nsize = timeout_index_size ? timeout_index_size * 2
+				   : TIMEOUT_INDEX_MIN;
+	nindex = dmalloc(nsize * sizeof(*nindex), MDL);
+	if (nindex == NULL)
+		log_fatal("add_timeout: no memory for timeout index!");
+
+	for (i = 0; i < timeout_index_size; i++) {
+		for (q = timeout_index[i]; q != NULL; q = next) {
+			next = q->hnext;
+			h = timeout_hash(q->what, nsize);
+			q->hnext = nindex[h];
+			nindex[h] = q;
+		}
+	}
+
+	if (timeout_index != NULL)
+		dfree(timeout_index, MDL);
+	timeout_index = nindex;
+	timeout_index_size = nsize;
+}
+
+/* Find the pending timeout for (where, what); a NULL where matches
+   any function registered for what. */
+static struct timeout *
+timeout_find(void (*where)(void *), void *what)
+{
+	struct timeout *q;
+
+	if (timeout_index == NULL)
+		return NULL;
+
+	for (q = timeout_index[timeout_hash(what, timeout_index_size)];
+	     q != NULL; q = q->hnext) {
+		if ((where == NULL || q->func == where) && q->what == what)
+			return q;
+	}
+	return NULL;
+}
+
+/* Returns nonzero if t is currently on the timeout list. */
+static int
+timeout_pending(struct timeout *t)
+{
+	struct timeout *q;
+
+	if (timeout_index == NULL)
+		return 0;
+
+	for (q = timeout_index[timeout_hash(t->what, timeout_index_size)];
+	     q != NULL; q = q->hnext) {
+		if (q == t)
+			return 1;
+	}
+	return 0;
+}
+
+/* Insert q into the timeout list after prev (at the head if prev is
+   NULL) and add it to the index. */
+static void
+timeout_link(struct timeout *q, struct timeout *prev)
+{
+	unsigned h;
+
+	if (timeout_count >= timeout_index_size)
+		timeout_index_grow();
+
+	q->prev = prev;
+	if (prev != NULL) {
+		q->next = prev->next;
+		prev->next = q;
+	} else {
+		q->next = timeouts;
+		timeouts = q;
+	}
+	if (q->next != NULL)
+		q->next->prev = q;
+
+	h = timeout_hash(q->what, timeout_index_size);
+	q->hnext = timeout_index[h];
+	timeout_index[h] = q;
+	timeout_count++;
+}
+
+/* Remove q from the timeout list and from the index. */
+static void
+timeout_unlink(struct timeout *q)
+{
+	struct timeout **tp;
+
+	if (q->prev != NULL)
+		q->prev->next = q->next;
+	else
+		timeouts = q->next;
+	if (q->next != NULL)
+		q->next->prev = q->prev;
+	q->next = q->prev = NULL;
+
+	for (tp = &timeout_index[timeout_hash(q->what, timeout_index_size)];
+	     *tp != NULL; tp = &(*tp)->hnext) {
+		if (*tp == q) {
+			*tp = q->hnext;
+			break;
+		}
+	}
+	q->hnext = NULL;
+	timeout_count--;
+}
 
 void set_time(TIME t)
 {
@@ -55,12 +193,11 @@ struct timeval *process_outstanding_timeouts (struct timeval *tvp)
 		    ((timeouts -> when . tv_sec == cur_tv . tv_sec) &&
 		     (timeouts -> when . tv_usec <= cur_tv . tv_usec))) {
 			t = timeouts;
-			timeouts = timeouts -> next;
+			timeout_unlink(t);
 			(*(t -> func)) (t -> what);
 			if (t -> unref)
 				(*t -> unref) (&t -> what, MDL);
-			t -> next = free_timeouts;
-			free_timeouts = t;
+			dmalloc_pool_put(&timeout_pool, t, MDL);
 			goto another;
 		}
 		if (tvp) {
@@ -140,26 +277,18 @@ isclib_timer_callback(isc_task_t  *taskp,
 		      isc_event_t *eventp)
 {
 	struct timeout *t = (struct timeout *)eventp->ev_arg;
-	struct timeout *q, *r;
+	struct timeout *q = NULL;
 
 	/* Get the current time... */
 	gettimeofday (&cur_tv, (struct timezone *)0);
 
 	/*
-	 * Find the timeout on the dhcp list and remove it.
-	 * As the list isn't ordered we search the entire list
+	 * Make sure the timeout is still on the dhcp list, using the
+	 * index rather than walking the list, and remove it.
 	 */
-
-	r = NULL;
-	for (q = timeouts; q; q = q->next) {
-		if (q == t) {
-			if (r)
-				r->next = q->next;
-			else
-				timeouts = q->next;
-			break;
-		}
-		r = q;
+	if (timeout_pending(t)) {
+		q = t;
+		timeout_unlink(q);
 	}
 
 	/*
@@ -175,9 +304,8 @@ isclib_timer_callback(isc_task_t  *taskp,
 		if (q->unref) {
 			(*q->unref) (&q->what, MDL);
 		}
-		q->next = free_timeouts;
 		isc_timer_detach(&q->isc_timeout);
-		free_timeouts = q;
+		dmalloc_pool_put(&timeout_pool, q, MDL);
 	} else {
 		/*
 		 * Hmm, we should clean up the timer structure but aren't
@@ -210,34 +338,19 @@ void add_timeout (when, where, what, ref, unref)
 	isc_time_t expires;
 
 	/* See if this timeout supersedes an existing timeout. */
-	t = (struct timeout *)0;
-	for (q = timeouts; q; q = q->next) {
-		if ((where == NULL || q->func == where) &&
-		    q->what == what) {
-			if (t)
-				t->next = q->next;
-			else
-				timeouts = q->next;
-			usereset = 1;
-			break;
-		}
-		t = q;
+	q = timeout_find(where, what);
+	if (q != NULL) {
+		timeout_unlink(q);
+		usereset = 1;
 	}
 
 	/* If we didn't supersede a timeout, allocate a timeout
 	   structure now. */
 	if (!q) {
-		if (free_timeouts) {
-			q = free_timeouts;
-			free_timeouts = q->next;
-		} else {
-			q = ((struct timeout *)
-			     dmalloc(sizeof(struct timeout), MDL));
-			if (!q) {
-				log_fatal("add_timeout: no memory!");
-			}
+		q = dmalloc_pool_get(&timeout_pool, MDL);
+		if (!q) {
+			log_fatal("add_timeout: no memory!");
 		}
-		memset(q, 0, sizeof *q);
 		q->func = where;
 		q->ref = ref;
 		q->unref = unref;
@@ -312,36 +425,28 @@ void add_timeout (when, where, what, ref, unref)
 		if (!timeouts || (timeouts->when.tv_sec > q-> when.tv_sec) ||
 		    ((timeouts->when.tv_sec == q->when.tv_sec) &&
 		     (timeouts->when.tv_usec > q->when.tv_usec))) {
-			q->next = timeouts;
-			timeouts = q;
+			timeout_link(q, NULL);
 			return;
 		}
 
-		/* Middle of list? */
+		/* Middle or end of list. */
 		for (t = timeouts; t->next; t = t->next) {
 			if ((t->next->when.tv_sec > q->when.tv_sec) ||
 			    ((t->next->when.tv_sec == q->when.tv_sec) &&
 			     (t->next->when.tv_usec > q->when.tv_usec))) {
-				q->next = t->next;
-				t->next = q;
-				return;
+				break;
 			}
 		}
-
-		/* End of list. */
-		t->next = q;
-		q->next = (struct timeout *)0;
+		timeout_link(q, t);
 		return;
 	}
 #endif
 	/*
 	 * Don't bother sorting the DHCP list, just add it to the front.
-	 * Eventually the list should be removed as we migrate the callers
-	 * to the native ISC timer functions, if it becomes a performance
-	 * problem before then we may need to order the list.
+	 * The isclib does the ordering for dispatch, and lookups by
+	 * (func, what) go through the timeout index.
 	 */
-	q->next  = timeouts;
-	timeouts = q;
+	timeout_link(q, NULL);
 
 	isc_interval_set(&interval, sec, usec * 1000);
 	status = isc_time_nowplusinterval(&expires, &interval);
@@ -378,20 +483,14 @@ void cancel_timeout (where, what)
 	void (*where) (void *);
 	void *what;
 {
-	struct timeout *t, *q;
+	struct timeout *q;
 
 	/* Look for this timeout on the list, and unlink it if we find it. */
-	t = (struct timeout *)0;
-	for (q = timeouts; q; q = q -> next) {
-		if (q->func == where && q->what == what) {
-			if (t)
-				t->next = q->next;
-			else
-				timeouts = q->next;
-			break;
-		}
-		t = q;
-	}
+	if (where == NULL)
+		return;
+	q = timeout_find(where, what);
+	if (q != NULL)
+		timeout_unlink(q);
 
 	/*
 	 * If we found the timeout, cancel it and put it on the free list.
@@ -409,31 +508,29 @@ void cancel_timeout (where, what)
 
 		if (q->unref)
 			(*q->unref) (&q->what, MDL);
-		q->next = free_timeouts;
-		free_timeouts = q;
+		dmalloc_pool_put(&timeout_pool, q, MDL);
 	}
 }
 
 #if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
 void cancel_all_timeouts ()
 {
-	struct timeout *t, *n;
-	for (t = timeouts; t; t = n) {
-		n = t->next;
+	struct timeout *t;
+	while ((t = timeouts) != NULL) {
+		timeout_unlink(t);
 		isc_timer_detach(&t->isc_timeout);
 		if (t->unref && t->what)
 			(*t->unref) (&t->what, MDL);
-		t->next = free_timeouts;
-		free_timeouts = t;
+		dmalloc_pool_put(&timeout_pool, t, MDL);
 	}
 }
 
 void relinquish_timeouts ()
 {
-	struct timeout *t, *n;
-	for (t = free_timeouts; t; t = n) {
-		n = t->next;
-		dfree(t, MDL);
+	if (timeout_index != NULL) {
+		dfree(timeout_index, MDL);
+		timeout_index = NULL;
+		timeout_index_size = 0;
 	}
 }
 #endif
@@ -235,6 +235,15 @@ void if_deregister_receive (info)
 	   are closed */
 	close (info -> rfdesc);
 	info -> rfdesc = -1;
+
+	/* Drop any frames still waiting in the receive batch. */
+	if (info -> rbuf) {
+		dfree (info -> rbuf, MDL);
+		info -> rbuf = NULL;
+	}
+	info -> rbuf_max = 0;
+	info -> rbuf_offset = 0;
+	info -> rbuf_len = 0;
 	if (!quiet_interface_discovery)
 		log_info ("Disabling input on LPF/%s/%s%s%s",
 			  info -> name,
@@ -370,6 +379,78 @@ ssize_t send_packet (interface, packet, raw, len, from, to, hto)
 #endif /* USE_LPF_SEND */
 
 #ifdef USE_LPF_RECEIVE
+#if defined (MSG_WAITFORONE) && (RECEIVE_BATCH_SIZE > 1)
+/*
+ * Frames read from an LPF socket with a single recvmmsg() call.  The
+ * batch hangs off the interface's rbuf; rbuf_len is the number of
+ * frames read and rbuf_offset the next one to hand out, so got_one()
+ * keeps calling receive_packet() until the batch is drained, as it
+ * does for the BPF read buffer.
+ */
+#define LPF_FRAME_SIZE 1536
+
+struct lpf_batch {
+	struct mmsghdr msgs[RECEIVE_BATCH_SIZE];
+	struct iovec iov[RECEIVE_BATCH_SIZE];
+#ifdef PACKET_AUXDATA
+	union {
+		struct cmsghdr align;
+		unsigned char buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+	} cmsg[RECEIVE_BATCH_SIZE];
+#endif
+	unsigned char frames[RECEIVE_BATCH_SIZE][LPF_FRAME_SIZE];
+};
+
+/* Read as many waiting frames as will fit in the interface's batch.
+   Returns the number of frames read, 0 if none were waiting, or -1
+   on error. */
+static int
+lpf_batch_fill(struct interface_info *interface)
+{
+	struct lpf_batch *batch;
+	int i, count;
+
+	if (interface->rbuf == NULL) {
+		batch = dmalloc(sizeof(*batch), MDL);
+		if (batch == NULL)
+			log_fatal("No memory for LPF receive batch.");
+		interface->rbuf = (unsigned char *)batch;
+		interface->rbuf_max = sizeof(*batch);
+	}
+	batch = (struct lpf_batch *)interface->rbuf;
+
+	/* recvmmsg() updates the lengths, so reset them every time. */
+	for (i = 0; i < RECEIVE_BATCH_SIZE; i++) {
+		batch->iov[i].iov_base = batch->frames[i];
+		batch->iov[i].iov_len = LPF_FRAME_SIZE;
+		memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+#ifdef PACKET_AUXDATA
+		batch->msgs[i].msg_hdr.msg_control = batch->cmsg[i].buf;
+		batch->msgs[i].msg_hdr.msg_controllen =
+			sizeof(batch->cmsg[i].buf);
+#endif
+	}
+
+	interface->rbuf_offset = 0;
+	interface->rbuf_len = 0;
+
+	/* The socket is readable, so this won't wait; MSG_DONTWAIT just
+	   stops it from blocking if the frame was already consumed. */
+	count = recvmmsg(interface->rfdesc, batch->msgs, RECEIVE_BATCH_SIZE,
+			 MSG_DONTWAIT, NULL);
+	if (count < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+
+	interface->rbuf_len = count;
+	return count;
+}
+#endif /* MSG_WAITFORONE && RECEIVE_BATCH_SIZE > 1 */
+
 ssize_t receive_packet (interface, buf, len, from, hfrom)
 	struct interface_info *interface;
 	unsigned char *buf;
@@ -380,12 +461,32 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 	int length = 0;
 	int offset = 0;
 	int csum_ready = 1;
-	unsigned char ibuf [1536];
+	unsigned char *ibuf;
 	unsigned bufix = 0;
 	unsigned paylen;
+#if defined (MSG_WAITFORONE) && (RECEIVE_BATCH_SIZE > 1)
+	struct mmsghdr *frame;
+	struct msghdr *mp;
+
+	/* Hand out the next frame of the current batch, reading a new
+	   batch once it has been used up. */
+	if (interface->rbuf_offset >= interface->rbuf_len) {
+		length = lpf_batch_fill(interface);
+		if (length <= 0)
+			return length;
+	}
+	frame = &((struct lpf_batch *)interface->rbuf)->
+		msgs[interface->rbuf_offset++];
+	mp = &frame->msg_hdr;
+	ibuf = mp->msg_iov->iov_base;
+	length = frame->msg_len;
+	if (length <= 0)
+		return 0;
+#else
+	unsigned char frame [1536];
 	struct iovec iov = {
-		.iov_base = ibuf,
-		.iov_len = sizeof ibuf,
+		.iov_base = frame,
+		.iov_len = sizeof frame,
 	};
 #ifdef PACKET_AUXDATA
 	/*
@@ -407,10 +508,13 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 		.msg_controllen = 0,
 	};
 #endif /* PACKET_AUXDATA */
+	struct msghdr *mp = &msg;
 
+	ibuf = frame;
 	length = recvmsg (interface->rfdesc, &msg, 0);
 	if (length <= 0)
 		return length;
+#endif /* MSG_WAITFORONE && RECEIVE_BATCH_SIZE > 1 */
 
 #ifdef PACKET_AUXDATA
 	{
@@ -433,7 +537,7 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 	 *  checksum offloading is enabled on the interface.  */
 	struct cmsghdr *cmsg;
 
-	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	for (cmsg = CMSG_FIRSTHDR(mp); cmsg; cmsg = CMSG_NXTHDR(mp, cmsg)) {
 		if (cmsg->cmsg_level == SOL_PACKET &&
 		    cmsg->cmsg_type == PACKET_AUXDATA) {
 			struct tpacket_auxdata *aux = (void *)CMSG_DATA(cmsg);
@@ -33,6 +33,9 @@
 
 struct option *vendor_cfg_option;
 
+/* Source of option_state stamps; see struct option_state. */
+unsigned long option_state_stamp;
+
 static int pretty_text(char **, char *, const unsigned char **,
 			 const unsigned char *, int);
 static int pretty_dname(char **, char *, const unsigned char *,
@@ -43,6 +46,11 @@ static int prepare_option_buffer(struct universe *universe, struct buffer *bp,
 				 unsigned char *buffer, unsigned length,
 				 unsigned code, int terminatep,
 				 struct option_cache **opp);
+static unsigned option_table_code(struct option_table *, unsigned);
+static int option_table_find(struct option_table *, unsigned);
+static int save_option_span(struct universe *, struct option_state *,
+			    struct buffer *, unsigned char *, unsigned,
+			    unsigned);
 
 /* Parse all available options out of the specified packet. */
 /* Note, the caller is responsible for allocating packet->options. */
@@ -216,6 +224,25 @@ int parse_option_buffer (options, buffer, length, universe)
 			continue;
 		}
 
+		/* Options in a universe with an option table are only
+		   made into option caches when they are first used. */
+		if (universe->lookup_func == lookup_hashed_option &&
+		    (universe->index >= options->universe_count ||
+		     options->universes[universe->index] == NULL ||
+		     option_table_find(options->universes[universe->index],
+				       code) < 0)) {
+			if (!save_option_span(universe, options, bp,
+					      bp->data + offset, len, code)) {
+				log_error("parse_option_buffer: No memory.");
+				buffer_dereference(&bp, MDL);
+				option_dereference(&option, MDL);
+				return (0);
+			}
+			option_dereference(&option, MDL);
+			offset += len;
+			continue;
+		}
+
 		op = lookup_option(universe, options, code);
 		if (op == NULL) {
 			/* If we don't have an option create one */
@@ -554,7 +581,8 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 	int i;
 	struct option_cache *op;
 	struct data_string ds;
-	pair pp, *hash;
+	struct option_table *table;
+	unsigned j, code;
 	int overload_used = 0;
 	int of1 = 0, of2 = 0;
 
@@ -749,18 +777,14 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 		 * taking the 1Q99 DHCP futures work into account.
 		 */
 		if (cfg_options->site_code_min) {
-		    for (i = 0; i < OPTION_HASH_SIZE; i++) {
-			hash = cfg_options->universes[dhcp_universe.index];
-			if (hash) {
-			    for (pp = hash[i]; pp; pp = pp->cdr) {
-				op = (struct option_cache *)(pp->car);
-				if (op->option->code <
-				     cfg_options->site_code_min &&
+		    table = cfg_options->universes[dhcp_universe.index];
+		    if (table) {
+			for (j = 0; j < table->count; j++) {
+				code = option_table_code(table, j);
+				if (code < cfg_options->site_code_min &&
 				    priority_len < PRIORITY_COUNT &&
-				    op->option->code != DHO_DHCP_AGENT_OPTIONS)
-					priority_list[priority_len++] =
-						op->option->code;
-			    }
+				    code != DHO_DHCP_AGENT_OPTIONS)
+					priority_list[priority_len++] = code;
 			}
 		    }
 		}
@@ -770,17 +794,14 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 		 * is no site option space, we'll be cycling through the
 		 * dhcp option space.
 		 */
-		for (i = 0; i < OPTION_HASH_SIZE; i++) {
-		    hash = cfg_options->universes[cfg_options->site_universe];
-		    if (hash != NULL)
-			for (pp = hash[i]; pp; pp = pp->cdr) {
-				op = (struct option_cache *)(pp->car);
-				if (op->option->code >=
-				     cfg_options->site_code_min &&
+		table = cfg_options->universes[cfg_options->site_universe];
+		if (table != NULL) {
+			for (j = 0; j < table->count; j++) {
+				code = option_table_code(table, j);
+				if (code >= cfg_options->site_code_min &&
 				    priority_len < PRIORITY_COUNT &&
-				    op->option->code != DHO_DHCP_AGENT_OPTIONS)
-					priority_list[priority_len++] =
-						op->option->code;
+				    code != DHO_DHCP_AGENT_OPTIONS)
+					priority_list[priority_len++] = code;
 			}
 		}
 
@@ -1249,6 +1270,8 @@ store_options(int *ocount,
 	struct option_cache *oc;
 	struct option *option = NULL;
 	unsigned code;
+	unsigned char seen[256 / 8];
+	int mask_ix, routers_ix;
 
 	/*
 	 * These arguments are relative to the start of the buffer, so
@@ -1283,43 +1306,48 @@ store_options(int *ocount,
 
 	memset (&od, 0, sizeof od);
 
-	/* Eliminate duplicate options from the parameter request list.
-	 * Enforce RFC-mandated ordering of options that are present.
+	/* Eliminate duplicate options from the parameter request list,
+	 * keeping the first of each.   Every code below 256 is tracked in
+	 * a bitmap, so this is linear in the length of the list.
 	 */
-	for (i = 0; i < priority_len; i++) {
-		/* Eliminate duplicates. */
-		tto = 0;
-		for (ix = i + 1; ix < priority_len + tto; ix++) {
-			if (tto)
-				priority_list [ix - tto] =
-					priority_list [ix];
-			if (priority_list [i] == priority_list [ix]) {
-				tto++;
-				priority_len--;
-			}
-		}
-
-		/* Enforce ordering of SUBNET_MASK options, according to
-		 * RFC2132 Section 3.3:
-		 *
-		 *   If both the subnet mask and the router option are
-		 *   specified in a DHCP reply, the subnet mask option MUST
-		 *   be first.
-		 *
-		 * This guidance does not specify what to do if the client
-		 * PRL explicitly requests the options out of order, it is
-		 * a general statement.
-		 */
-		if (priority_list[i] == DHO_SUBNET_MASK) {
-			for (ix = i - 1 ; ix >= 0 ; ix--) {
-				if (priority_list[ix] == DHO_ROUTERS) {
-                                        /* swap */
-					priority_list[ix] = DHO_SUBNET_MASK;
-					priority_list[i] = DHO_ROUTERS;
+	memset(seen, 0, sizeof seen);
+	mask_ix = routers_ix = -1;
+	for (i = ix = 0; i < priority_len; i++) {
+		code = priority_list[i];
+		if (code < 256) {
+			if (seen[code / 8] & (1 << (code % 8)))
+				continue;
+			seen[code / 8] |= 1 << (code % 8);
+		} else {
+			for (tto = 0; tto < ix; tto++)
+				if (priority_list[tto] == code)
 					break;
-				}
-			}
+			if (tto < ix)
+				continue;
 		}
+		if (code == DHO_SUBNET_MASK)
+			mask_ix = ix;
+		else if (code == DHO_ROUTERS)
+			routers_ix = ix;
+		priority_list[ix++] = code;
+	}
+	priority_len = ix;
+
+	/* Enforce ordering of SUBNET_MASK options, according to
+	 * RFC2132 Section 3.3:
+	 *
+	 *   If both the subnet mask and the router option are
+	 *   specified in a DHCP reply, the subnet mask option MUST
+	 *   be first.
+	 *
+	 * This guidance does not specify what to do if the client
+	 * PRL explicitly requests the options out of order, it is
+	 * a general statement.
+	 */
+	if (mask_ix >= 0 && routers_ix >= 0 && routers_ix < mask_ix) {
+		/* swap */
+		priority_list[routers_ix] = DHO_SUBNET_MASK;
+		priority_list[mask_ix] = DHO_ROUTERS;
 	}
 
 	/* Copy out the options in the order that they appear in the
@@ -1427,13 +1455,20 @@ store_options(int *ocount,
 		    continue;
 	    }
 
-	    /* Find the value of the option... */
+	    /* Find the value of the option...  A constant one (most of
+	       the configured options) is used as it is, without taking
+	       another reference to its buffer. */
 	    od.len = 0;
 	    if (oc) {
-		/* No need to check the return as we check od.len below */
-		(void) evaluate_option_cache (&od, packet,
-					      lease, client_state, in_options,
-					      cfg_options, scope, oc, MDL);
+		if (oc->data.data != NULL && !have_encapsulation) {
+		    od = oc->data;
+		    od.buffer = NULL;
+		} else {
+		    /* No need to check the return as we check od.len below */
+		    (void) evaluate_option_cache (&od, packet, lease,
+						  client_state, in_options,
+						  cfg_options, scope, oc, MDL);
+		}
 
 		/* If we have encapsulation for this option, and an oc
 		 * lookup succeeded, but the evaluation failed, it is
@@ -2468,29 +2503,166 @@ struct option_cache *lookup_option (universe, options, code)
 	return (struct option_cache *)0;
 }
 
+/*
+ * Options in the DHCPv4, DHCPv6, server and other fixed-width option
+ * spaces are kept in an option_table: an array of slots in the order
+ * the options were saved, with a direct index from option code to slot
+ * for the codes below OPTION_INDEX_SIZE.   That makes lookup, save and
+ * delete constant time for everything except the occasional large
+ * code (DHCPv6 or VSIO enterprise numbers), which are found by walking
+ * the slots.   These are still called the hashed option functions,
+ * because that is what they were, and what universes refer to them as.
+ */
+static unsigned
+option_table_code(struct option_table *table, unsigned slot)
+{
+	if (table->slots[slot] != NULL)
+		return (table->slots[slot]->option->code);
+	return (table->spans[slot].code);
+}
+
+static int
+option_table_find(struct option_table *table, unsigned code)
+{
+	unsigned i;
+
+	if (code < OPTION_INDEX_SIZE)
+		return (table->index[code] - 1);
+
+	for (i = 0; i < table->count; i++)
+		if (option_table_code(table, i) == code)
+			return (i);
+	return (-1);
+}
+
+/* Return the option cache in a slot, making it first if the option
+   hasn't been looked at since it was parsed. */
+static struct option_cache *
+option_table_get(struct universe *universe, struct option_table *table,
+		 unsigned slot)
+{
+	struct option_span *span;
+
+	if (table->slots[slot] == NULL) {
+		span = &table->spans[slot];
+		if (!prepare_option_buffer(universe, span->buffer, span->data,
+					   span->len, span->code, 1,
+					   &table->slots[slot])) {
+			log_error("No memory for option %s.%u.",
+				  universe->name, span->code);
+			return (NULL);
+		}
+		buffer_dereference(&span->buffer, MDL);
+	}
+	return (table->slots[slot]);
+}
+
+/* Allocate memory for an option table or its arrays.   A table lives as
+   long as the option state that owns it, so it only comes from the
+   packet arena if the option state did. */
+static void *
+option_table_alloc(const void *owner, size_t size)
+{
+	if (dmalloc_is_transient(owner))
+		return (dmalloc_transient(size, MDL));
+	return (dmalloc(size, MDL));
+}
+
+/* Make room for another slot.   Returns 0 if out of memory. */
+static int
+option_table_grow(struct option_table *table, int spans)
+{
+	struct option_cache **slots;
+	struct option_span *sp = NULL;
+	unsigned max = table->max;
+
+	if (table->count == max) {
+		max += OPTION_TABLE_INCREMENT;
+		slots = option_table_alloc(table, max * sizeof(*slots));
+		if (!slots)
+			return (0);
+		if (table->spans) {
+			sp = option_table_alloc(table, max * sizeof(*sp));
+			if (!sp) {
+				dfree(slots, MDL);
+				return (0);
+			}
+			memcpy(sp, table->spans,
+			       table->count * sizeof(*sp));
+			dfree(table->spans, MDL);
+			table->spans = sp;
+		}
+		if (table->slots) {
+			memcpy(slots, table->slots,
+			       table->count * sizeof(*slots));
+			dfree(table->slots, MDL);
+		}
+		table->slots = slots;
+		table->max = max;
+	}
+	if (spans && !table->spans) {
+		table->spans = option_table_alloc(table,
+						  max * sizeof(*table->spans));
+		if (!table->spans)
+			return (0);
+	}
+	return (1);
+}
+
 struct option_cache *lookup_hashed_option (universe, options, code)
 	struct universe *universe;
 	struct option_state *options;
 	unsigned code;
 {
-	int hashix;
-	pair bptr;
-	pair *hash;
+	struct option_table *table;
+	int slot;
 
-	/* Make sure there's a hash table. */
+	/* Make sure there's a table. */
 	if (universe -> index >= options -> universe_count ||
 	    !(options -> universes [universe -> index]))
 		return (struct option_cache *)0;
 
-	hash = options -> universes [universe -> index];
+	table = options -> universes [universe -> index];
+
+	slot = option_table_find(table, code);
+	if (slot < 0)
+		return (struct option_cache *)0;
+	return (option_table_get(universe, table, slot));
+}
 
-	hashix = compute_option_hash (code);
-	for (bptr = hash [hashix]; bptr; bptr = bptr -> cdr) {
-		if (((struct option_cache *)(bptr -> car)) -> option -> code ==
-		    code)
-			return (struct option_cache *)(bptr -> car);
+/*
+ * Note an option found in a packet without making an option cache for
+ * it yet.   The caller has checked that there isn't one already, and
+ * that the universe keeps its options in an option_table.
+ */
+static int
+save_option_span(struct universe *universe, struct option_state *options,
+		 struct buffer *bp, unsigned char *data, unsigned len,
+		 unsigned code)
+{
+	struct option_table *table = options->universes[universe->index];
+	struct option_span *span;
+
+	options->stamp = ++option_state_stamp;
+	if (!table) {
+		table = option_table_alloc(options, sizeof(*table));
+		if (!table)
+			return (0);
+		options->universes[universe->index] = (void *)table;
 	}
-	return (struct option_cache *)0;
+	if (!option_table_grow(table, 1))
+		return (0);
+
+	span = &table->spans[table->count];
+	buffer_reference(&span->buffer, bp, MDL);
+	span->data = data;
+	span->len = len;
+	span->code = code;
+	table->slots[table->count] = NULL;
+	table->count++;
+	if (code < OPTION_INDEX_SIZE)
+		table->index[code] = table->count;
+	return (1);
 }
 
 /* Save a specified buffer into an option cache. */
@@ -2771,6 +2943,7 @@ void
 save_option(struct universe *universe, struct option_state *options,
 	    struct option_cache *oc)
 {
+	options->stamp = ++option_state_stamp;
 	if (universe->save_func)
 		(*universe->save_func)(universe, options, oc, ISC_FALSE);
 	else
@@ -2782,6 +2955,7 @@ void
 also_save_option(struct universe *universe, struct option_state *options,
 		 struct option_cache *oc)
 {
+	options->stamp = ++option_state_stamp;
 	if (universe->save_func)
 		(*universe->save_func)(universe, options, oc, ISC_TRUE);
 	else
@@ -2792,68 +2966,57 @@ void
 save_hashed_option(struct universe *universe, struct option_state *options,
 		   struct option_cache *oc, isc_boolean_t appendp)
 {
-	int hashix;
-	pair bptr;
-	pair *hash = options -> universes [universe -> index];
+	struct option_table *table = options -> universes [universe -> index];
 	struct option_cache **ocloc;
+	unsigned code = oc->option->code;
+	int slot;
 
 	if (oc -> refcnt == 0)
 		abort ();
 
-	/* Compute the hash. */
-	hashix = compute_option_hash (oc -> option -> code);
-
-	/* If there's no hash table, make one. */
-	if (!hash) {
-		hash = (pair *)dmalloc (OPTION_HASH_SIZE * sizeof *hash, MDL);
-		if (!hash) {
+	/* If there's no table, make one. */
+	if (!table) {
+		table = option_table_alloc(options, sizeof(*table));
+		if (!table) {
 			log_error ("no memory to store %s.%s",
 				   universe -> name, oc -> option -> name);
 			return;
 		}
-		memset (hash, 0, OPTION_HASH_SIZE * sizeof *hash);
-		options -> universes [universe -> index] = (void *)hash;
-	} else {
-		/* Try to find an existing option matching the new one. */
-		for (bptr = hash [hashix]; bptr; bptr = bptr -> cdr) {
-			if (((struct option_cache *)
-			     (bptr -> car)) -> option -> code ==
-			    oc -> option -> code)
-				break;
-		}
-
-		/* Deal with collisions on the hash list. */
-		if (bptr) {
-			ocloc = (struct option_cache **)&bptr->car;
-
-			/*
-			 * If appendp is set, append it onto the tail of the
-			 * ->next list.  If it is not set, rotate it into
-			 * position at the head of the list.
-			 */
-			if (appendp) {
-				do {
-					ocloc = &(*ocloc)->next;
-				} while (*ocloc != NULL);
-			} else {
-				option_cache_dereference(ocloc, MDL);
-			}
+		options -> universes [universe -> index] = (void *)table;
+	} else if ((slot = option_table_find(table, code)) >= 0) {
+		/* Deal with an existing option with the same code. */
+		ocloc = &table->slots[slot];
 
-			option_cache_reference(ocloc, oc, MDL);
-			return;
+		/*
+		 * If appendp is set, append it onto the tail of the
+		 * ->next list.  If it is not set, replace it.
+		 */
+		if (appendp) {
+			if (option_table_get(universe, table, slot) == NULL)
+				return;
+			do {
+				ocloc = &(*ocloc)->next;
+			} while (*ocloc != NULL);
+		} else if (*ocloc != NULL) {
+			option_cache_dereference(ocloc, MDL);
+		} else {
+			buffer_dereference(&table->spans[slot].buffer, MDL);
 		}
+
+		option_cache_reference(ocloc, oc, MDL);
+		return;
 	}
 
-	/* Otherwise, just put the new one at the head of the list. */
-	bptr = new_pair (MDL);
-	if (!bptr) {
-		log_error ("No memory for option_cache reference.");
+	/* Otherwise, add it in a new slot. */
+	if (!option_table_grow(table, 0)) {
+		log_error ("no memory to store %s.%s",
+			   universe -> name, oc -> option -> name);
 		return;
 	}
-	bptr -> cdr = hash [hashix];
-	bptr -> car = 0;
-	option_cache_reference ((struct option_cache **)&bptr -> car, oc, MDL);
-	hash [hashix] = bptr;
+	option_cache_reference(&table->slots[table->count], oc, MDL);
+	table->count++;
+	if (code < OPTION_INDEX_SIZE)
+		table->index[code] = table->count;
 }
 
 void delete_option (universe, options, code)
@@ -2861,6 +3024,7 @@ void delete_option (universe, options, code)
 	struct option_state *options;
 	int code;
 {
+	options -> stamp = ++option_state_stamp;
 	if (universe -> delete_func)
 		(*universe -> delete_func) (universe, options, code);
 	else
@@ -2873,31 +3037,36 @@ void delete_hashed_option (universe, options, code)
 	struct option_state *options;
 	int code;
 {
-	int hashix;
-	pair bptr, prev = (pair)0;
-	pair *hash = options -> universes [universe -> index];
+	struct option_table *table = options -> universes [universe -> index];
+	unsigned last;
+	int slot;
 
 	/* There may not be any options in this space. */
-	if (!hash)
+	if (!table)
 		return;
 
-	/* Try to find an existing option matching the new one. */
-	hashix = compute_option_hash (code);
-	for (bptr = hash [hashix]; bptr; bptr = bptr -> cdr) {
-		if (((struct option_cache *)(bptr -> car)) -> option -> code
-		    == code)
-			break;
-		prev = bptr;
-	}
-	/* If we found one, wipe it out... */
-	if (bptr) {
-		if (prev)
-			prev -> cdr = bptr -> cdr;
-		else
-			hash [hashix] = bptr -> cdr;
-		option_cache_dereference
-			((struct option_cache **)(&bptr -> car), MDL);
-		free_pair (bptr, MDL);
+	slot = option_table_find(table, code);
+	if (slot < 0)
+		return;
+
+	/* Wipe it out, and move the last option into its slot. */
+	if (table->slots[slot] != NULL)
+		option_cache_dereference(&table->slots[slot], MDL);
+	else
+		buffer_dereference(&table->spans[slot].buffer, MDL);
+	if ((unsigned)code < OPTION_INDEX_SIZE)
+		table->index[code] = 0;
+	table->count--;
+	if (slot != table->count) {
+		last = option_table_code(table, table->count);
+		table->slots[slot] = table->slots[table->count];
+		table->slots[table->count] = NULL;
+		if (table->spans) {
+			table->spans[slot] = table->spans[table->count];
+			table->spans[table->count].buffer = NULL;
+		}
+		if (last < OPTION_INDEX_SIZE)
+			table->index[last] = slot + 1;
 	}
 }
 
@@ -2959,28 +3128,30 @@ int hashed_option_state_dereference (universe, state, file, line)
 	const char *file;
 	int line;
 {
-	pair *heads;
-	pair cp, next;
-	int i;
+	struct option_table *table;
+	unsigned i;
 
-	/* Get the pointer to the array of hash table bucket heads. */
-	heads = (pair *)(state -> universes [universe -> index]);
-	if (!heads)
+	table = (struct option_table *)(state -> universes [universe -> index]);
+	if (!table)
 		return 0;
 
-	/* For each non-null head, loop through all the buckets dereferencing
-	   the attached option cache structures and freeing the buckets. */
-	for (i = 0; i < OPTION_HASH_SIZE; i++) {
-		for (cp = heads [i]; cp; cp = next) {
-			next = cp -> cdr;
-			option_cache_dereference
-				((struct option_cache **)&cp -> car,
-				 file, line);
-			free_pair (cp, file, line);
-		}
+	/* Dereference the option caches in each slot, or the buffers
+	   holding the options that were never looked at, then free the
+	   table. */
+	for (i = 0; i < table->count; i++) {
+		if (table->slots[i] != NULL)
+			option_cache_dereference(&table->slots[i],
+						 file, line);
+		else
+			buffer_dereference(&table->spans[i].buffer,
+					   file, line);
 	}
 
-	dfree (heads, file, line);
+	if (table->slots)
+		dfree(table->slots, file, line);
+	if (table->spans)
+		dfree(table->spans, file, line);
+	dfree (table, file, line);
 	state -> universes [universe -> index] = (void *)0;
 	return 1;
 }
@@ -3210,29 +3381,29 @@ int hashed_option_space_encapsulate (result, packet, lease, client_state,
 	struct binding_scope **scope;
 	struct universe *universe;
 {
-	pair p, *hash;
+	struct option_table *table;
+	struct option_cache *oc;
 	int status;
-	int i;
+	unsigned i;
 
 	if (universe -> index >= cfg_options -> universe_count)
 		return 0;
 
-	hash = cfg_options -> universes [universe -> index];
-	if (!hash)
+	table = cfg_options -> universes [universe -> index];
+	if (!table)
 		return 0;
 
-	/* For each hash bucket, and each configured option cache within
-	 * that bucket, append the option onto the buffer in encapsulated
-	 * format appropriate to the universe.
+	/* For each configured option cache, append the option onto the
+	 * buffer in encapsulated format appropriate to the universe.
 	 */
 	status = 0;
-	for (i = 0; i < OPTION_HASH_SIZE; i++) {
-		for (p = hash [i]; p; p = p -> cdr) {
-			if (store_option(result, universe, packet, lease,
-					 client_state, in_options, cfg_options,
-					 scope, (struct option_cache *)p->car))
-				status = 1;
-		}
+	for (i = 0; i < table->count; i++) {
+		oc = option_table_get(universe, table, i);
+		if (oc != NULL &&
+		    store_option(result, universe, packet, lease,
+				 client_state, in_options, cfg_options,
+				 scope, oc))
+			status = 1;
 	}
 
 	if (search_subencapsulation(result, packet, lease, client_state,
@@ -3797,24 +3968,22 @@ void hashed_option_space_foreach (struct packet *packet, struct lease *lease,
 						struct binding_scope **,
 						struct universe *, void *))
 {
-	pair *hash;
-	int i;
+	struct option_table *table;
+	unsigned i;
 	struct option_cache *oc;
 
 	if (cfg_options -> universe_count <= u -> index)
 		return;
 
-	hash = cfg_options -> universes [u -> index];
-	if (!hash)
+	table = cfg_options -> universes [u -> index];
+	if (!table)
 		return;
-	for (i = 0; i < OPTION_HASH_SIZE; i++) {
-		pair p;
-		/* XXX save _all_ options! XXX */
-		for (p = hash [i]; p; p = p -> cdr) {
-			oc = (struct option_cache *)p -> car;
+	/* XXX save _all_ options! XXX */
+	for (i = 0; i < table->count; i++) {
+		oc = option_table_get(u, table, i);
+		if (oc != NULL)
 			(*func) (oc, packet, lease, client_state,
 				 in_options, cfg_options, scope, u, stuff);
-		}
 	}
 }
 
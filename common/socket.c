@@ -452,6 +452,16 @@ void if_deregister_receive (info)
 	close(info->rfdesc);
 	info->rfdesc = -1;
 #endif /* IP_PKTINFO... */
+
+	/* Drop any packets still waiting in the receive batch. */
+	if (info->rbuf != NULL) {
+		dfree(info->rbuf, MDL);
+		info->rbuf = NULL;
+	}
+	info->rbuf_max = 0;
+	info->rbuf_offset = 0;
+	info->rbuf_len = 0;
+
 	if (!quiet_interface_discovery)
 		log_info ("Disabling input on Socket/%s%s%s",
 		      info -> name,
@@ -936,6 +946,163 @@ ssize_t send_packet6(struct interface_info *interface,
 #endif /* DHCPv6 */
 
 #ifdef USE_SOCKET_RECEIVE
+#if defined (MSG_WAITFORONE) && (RECEIVE_BATCH_SIZE > 1)
+/*
+ * Packets read from the socket with a single recvmmsg() call.  The
+ * batch hangs off the interface's rbuf; rbuf_len is the number of
+ * packets read and rbuf_offset the next one to hand out, so got_one()
+ * keeps calling receive_packet() until the batch is drained.
+ */
+#define SOCKET_FRAME_SIZE 4096
+
+struct socket_batch {
+	struct mmsghdr msgs[RECEIVE_BATCH_SIZE];
+	struct iovec iov[RECEIVE_BATCH_SIZE];
+	struct sockaddr_in from[RECEIVE_BATCH_SIZE];
+#if defined(IP_PKTINFO) && defined(IP_RECVPKTINFO) && defined(USE_V4_PKTINFO)
+	union {
+		struct cmsghdr align;
+		unsigned char buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+	} cmsg[RECEIVE_BATCH_SIZE];
+#endif
+	unsigned char frames[RECEIVE_BATCH_SIZE][SOCKET_FRAME_SIZE];
+};
+
+/* Read as many waiting packets as will fit in the interface's batch.
+   Returns the number of packets read, 0 if none were waiting, or -1
+   on error. */
+static int
+socket_batch_fill(struct interface_info *interface)
+{
+	struct socket_batch *batch;
+	int i, count;
+#ifdef IGNORE_HOSTUNREACH
+	int retry = 0;
+#endif
+
+	if (interface->rbuf == NULL) {
+		batch = dmalloc(sizeof(*batch), MDL);
+		if (batch == NULL)
+			log_fatal("No memory for socket receive batch.");
+		interface->rbuf = (unsigned char *)batch;
+		interface->rbuf_max = sizeof(*batch);
+	}
+	batch = (struct socket_batch *)interface->rbuf;
+
+	interface->rbuf_offset = 0;
+	interface->rbuf_len = 0;
+
+#ifdef IGNORE_HOSTUNREACH
+	do {
+#endif
+	/* recvmmsg() updates the lengths, so reset them every time. */
+	for (i = 0; i < RECEIVE_BATCH_SIZE; i++) {
+		batch->iov[i].iov_base = batch->frames[i];
+		batch->iov[i].iov_len = SOCKET_FRAME_SIZE;
+		memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+		batch->msgs[i].msg_hdr.msg_name = &batch->from[i];
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->from[i]);
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+#if defined(IP_PKTINFO) && defined(IP_RECVPKTINFO) && defined(USE_V4_PKTINFO)
+		memset(&batch->cmsg[i], 0, sizeof(batch->cmsg[i]));
+		batch->msgs[i].msg_hdr.msg_control = batch->cmsg[i].buf;
+		batch->msgs[i].msg_hdr.msg_controllen =
+			sizeof(batch->cmsg[i].buf);
+#endif
+	}
+
+	/* The socket is readable, so this won't wait; MSG_DONTWAIT just
+	   stops it from blocking if the data was already consumed, e.g.
+	   through another interface sharing the same socket. */
+	count = recvmmsg(interface->rfdesc, batch->msgs, RECEIVE_BATCH_SIZE,
+			 MSG_DONTWAIT, NULL);
+#ifdef IGNORE_HOSTUNREACH
+	} while (count < 0 &&
+		 (errno == EHOSTUNREACH ||
+		  errno == ECONNREFUSED) &&
+		 retry++ < 10);
+#endif
+
+	if (count < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+
+	interface->rbuf_len = count;
+	return count;
+}
+
+ssize_t receive_packet (interface, buf, len, from, hfrom)
+	struct interface_info *interface;
+	unsigned char *buf;
+	size_t len;
+	struct sockaddr_in *from;
+	struct hardware *hfrom;
+{
+	struct socket_batch *batch;
+	struct mmsghdr *mm;
+	int result;
+#if defined(IP_PKTINFO) && defined(IP_RECVPKTINFO) && defined(USE_V4_PKTINFO)
+	struct cmsghdr *cmsg;
+	struct in_pktinfo *pktinfo;
+	unsigned int ifindex;
+#endif
+
+	/*
+	 * The normal Berkeley socket interface doesn't give us any way
+	 * to know what hardware interface we received the message on,
+	 * but we should at least make sure the structure is emptied.
+	 */
+	memset(hfrom, 0, sizeof(*hfrom));
+
+	/* Hand out the next packet of the current batch, reading a new
+	   batch once it has been used up. */
+	if (interface->rbuf_offset >= interface->rbuf_len) {
+		result = socket_batch_fill(interface);
+		if (result <= 0)
+			return result;
+	}
+	batch = (struct socket_batch *)interface->rbuf;
+	mm = &batch->msgs[interface->rbuf_offset];
+
+	result = mm->msg_len;
+	if (result > len)
+		result = len;
+	memcpy(from, &batch->from[interface->rbuf_offset], sizeof(*from));
+	memcpy(buf, batch->frames[interface->rbuf_offset], result);
+	interface->rbuf_offset++;
+
+#if defined(IP_PKTINFO) && defined(IP_RECVPKTINFO) && defined(USE_V4_PKTINFO)
+	/*
+	 * Find the control message with our interface index and pass
+	 * it back to the caller using the unused hfrom parameter, as
+	 * in the unbatched case below.
+	 */
+	cmsg = CMSG_FIRSTHDR(&mm->msg_hdr);
+	while (cmsg != NULL) {
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+			ifindex = pktinfo->ipi_ifindex;
+			memcpy(hfrom->hbuf, &ifindex, sizeof(ifindex));
+			return (result);
+		}
+		cmsg = CMSG_NXTHDR(&mm->msg_hdr, cmsg);
+	}
+
+	/*
+	 * We didn't find the necessary control message
+	 * flag it as an error
+	 */
+	errno = EIO;
+	return (-1);
+#else
+	return (result);
+#endif /* IP_PKTINFO ... */
+}
+#else /* MSG_WAITFORONE && RECEIVE_BATCH_SIZE > 1 */
 ssize_t receive_packet (interface, buf, len, from, hfrom)
 	struct interface_info *interface;
 	unsigned char *buf;
@@ -1059,6 +1226,7 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 	return (result);
 }
 
+#endif /* MSG_WAITFORONE && RECEIVE_BATCH_SIZE > 1 */
 #endif /* USE_SOCKET_RECEIVE */
 
 #ifdef DHCPv6
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2026 Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmarks for libdhcp.   These are not unit tests and are not run by
+ * "make check"; build them with "make common_bench" in this directory
+ * and run ./common_bench.   Each benchmark prints how long it took.
+ */
+
+#include <config.h>
+#include <sys/time.h>
+#include "dhcpd.h"
+
+/* Number of timers used by the insert/supersede/cancel benchmark. */
+#define TIMER_BENCH_COUNT 1000000
+
+/* Number of replies built by the cons_options benchmark. */
+#define CONS_OPTIONS_BENCH_COUNT 100000
+
+static double
+elapsed(struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+static void
+timer_func(void *what) {
+}
+
+/* Insert, supersede and cancel a large number of timers. */
+static void
+timer_bench(void) {
+	struct timeval when, start;
+	char *objs;
+	int i;
+
+	gettimeofday(&cur_tv, NULL);
+
+	objs = malloc(TIMER_BENCH_COUNT);
+	if (objs == NULL)
+		log_fatal("no memory");
+
+	when.tv_usec = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < TIMER_BENCH_COUNT; i++) {
+		when.tv_sec = cur_tv.tv_sec + 3600 + (i % 3600);
+		add_timeout(&when, timer_func, &objs[i], NULL, NULL);
+	}
+	printf("timers insert:    %d in %.3fs\n",
+	       TIMER_BENCH_COUNT, elapsed(&start));
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < TIMER_BENCH_COUNT; i++) {
+		when.tv_sec = cur_tv.tv_sec + 7200 + (i % 3600);
+		add_timeout(&when, timer_func, &objs[i], NULL, NULL);
+	}
+	printf("timers supersede: %d in %.3fs\n",
+	       TIMER_BENCH_COUNT, elapsed(&start));
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < TIMER_BENCH_COUNT; i++)
+		cancel_timeout(timer_func, &objs[i]);
+	printf("timers cancel:    %d in %.3fs\n",
+	       TIMER_BENCH_COUNT, elapsed(&start));
+
+	free(objs);
+}
+
+/* Build the options of a typical reply: fourteen configured options and
+   a ten-entry parameter request list with a duplicate in it. */
+static void
+cons_options_bench(void) {
+	struct option_state *options = NULL;
+	struct dhcp_packet outpacket;
+	struct data_string prl;
+	struct timeval start;
+	unsigned char prl_codes[] = {
+		DHO_SUBNET_MASK, DHO_ROUTERS, DHO_DOMAIN_NAME_SERVERS,
+		DHO_DOMAIN_NAME, DHO_HOST_NAME, DHO_BROADCAST_ADDRESS,
+		DHO_NTP_SERVERS, DHO_INTERFACE_MTU, DHO_DOMAIN_SEARCH,
+		DHO_SUBNET_MASK
+	};
+	unsigned codes[] = {
+		DHO_SUBNET_MASK, DHO_ROUTERS, DHO_DOMAIN_NAME_SERVERS,
+		DHO_DOMAIN_NAME, DHO_BROADCAST_ADDRESS, DHO_NTP_SERVERS,
+		DHO_INTERFACE_MTU, DHO_TIME_OFFSET, DHO_LOG_SERVERS,
+		DHO_DHCP_LEASE_TIME, DHO_DHCP_RENEWAL_TIME,
+		DHO_DHCP_REBINDING_TIME, DHO_DHCP_SERVER_IDENTIFIER,
+		DHO_DHCP_MESSAGE_TYPE
+	};
+	int i;
+
+	initialize_common_option_spaces();
+	if (!option_state_allocate(&options, MDL))
+		log_fatal("cannot allocate option state");
+	for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+		if (!add_option(options, codes[i], "\x0a\x00\x00\x01", 4))
+			log_fatal("add_option %u failed", codes[i]);
+	}
+
+	memset(&prl, 0, sizeof(prl));
+	prl.data = prl_codes;
+	prl.len = sizeof(prl_codes);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < CONS_OPTIONS_BENCH_COUNT; i++) {
+		cons_options(NULL, &outpacket, NULL, NULL, 0, NULL, options,
+			     &global_scope, 0, 0, 0, &prl, NULL);
+	}
+	printf("cons_options:     %d replies in %.3fs\n",
+	       CONS_OPTIONS_BENCH_COUNT, elapsed(&start));
+
+	option_state_dereference(&options, MDL);
+}
+
+int
+main(int argc, char **argv) {
+	dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			    NULL, NULL);
+
+	timer_bench();
+	cons_options_bench();
+
+	return (0);
+}
@@ -266,6 +266,288 @@ ATF_TC_BODY(add_option_ref_cnt, tc)
     }
 }
 
+ATF_TC(option_table);
+
+ATF_TC_HEAD(option_table, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+        "Verify saving, looking up and deleting options in an option table.");
+}
+
+ATF_TC_BODY(option_table, tc)
+{
+    struct option_state *options = NULL;
+    struct option_table *table;
+    struct option_cache *oc;
+    unsigned codes[] = { DHO_SUBNET_MASK, DHO_ROUTERS,
+                         DHO_DOMAIN_NAME_SERVERS, DHO_DOMAIN_NAME };
+    int i;
+
+    initialize_common_option_spaces();
+    if (!option_state_allocate(&options, MDL)) {
+        atf_tc_fail("cannot allocate option state");
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (!add_option(options, codes[i], "abcd", 4)) {
+            atf_tc_fail("add_option %u returned 0", codes[i]);
+        }
+    }
+
+    // Saving an option that is already there replaces it.
+    if (!add_option(options, DHO_ROUTERS, "wxyz", 4)) {
+        atf_tc_fail("add_option returned 0");
+    }
+    table = options->universes[dhcp_universe.index];
+    if (table->count != 4) {
+        atf_tc_fail("expected 4 options, have %u", table->count);
+    }
+    oc = lookup_option(&dhcp_universe, options, DHO_ROUTERS);
+    if (oc == NULL || memcmp(oc->data.data, "wxyz", 4) != 0) {
+        atf_tc_fail("option was not replaced");
+    }
+
+    // Deleting one moves the last option into its slot.
+    delete_option(&dhcp_universe, options, DHO_SUBNET_MASK);
+    if (table->count != 3) {
+        atf_tc_fail("expected 3 options, have %u", table->count);
+    }
+    if (lookup_option(&dhcp_universe, options, DHO_SUBNET_MASK) != NULL) {
+        atf_tc_fail("deleted option is still there");
+    }
+    for (i = 1; i < 4; i++) {
+        oc = lookup_option(&dhcp_universe, options, codes[i]);
+        if (oc == NULL || oc->option->code != codes[i]) {
+            atf_tc_fail("option %u is missing", codes[i]);
+        }
+    }
+
+    // Deleting an option that isn't there does nothing.
+    delete_option(&dhcp_universe, options, DHO_SUBNET_MASK);
+    if (table->count != 3) {
+        atf_tc_fail("expected 3 options, have %u", table->count);
+    }
+
+    option_state_dereference(&options, MDL);
+}
+
+ATF_TC(option_lazy_parse);
+
+ATF_TC_HEAD(option_lazy_parse, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+        "Verify received options are made into option caches on first use.");
+}
+
+ATF_TC_BODY(option_lazy_parse, tc)
+{
+    struct option_state *options = NULL;
+    struct option_table *table;
+    struct option_cache *oc;
+    unsigned char buffer[] = {
+        DHO_HOST_NAME, 3, 'f', 'o', 'o',
+        DHO_DHCP_PARAMETER_REQUEST_LIST, 2, DHO_SUBNET_MASK, DHO_ROUTERS,
+        DHO_HOST_NAME, 3, 'b', 'a', 'r',
+        DHO_END
+    };
+
+    initialize_common_option_spaces();
+    if (!option_state_allocate(&options, MDL)) {
+        atf_tc_fail("cannot allocate option state");
+    }
+
+    if (!parse_option_buffer(options, buffer, sizeof(buffer),
+                             &dhcp_universe)) {
+        atf_tc_fail("parse_option_buffer failed");
+    }
+
+    // The host name was seen twice, so it has been concatenated.
+    table = options->universes[dhcp_universe.index];
+    if (table->count != 2) {
+        atf_tc_fail("expected 2 options, have %u", table->count);
+    }
+    if (table->slots[0] == NULL || table->slots[1] != NULL) {
+        atf_tc_fail("wrong options were made into option caches");
+    }
+    oc = lookup_option(&dhcp_universe, options, DHO_HOST_NAME);
+    if (oc == NULL || oc->data.len != 6 ||
+        memcmp(oc->data.data, "foobar", 6) != 0) {
+        atf_tc_fail("host name is wrong");
+    }
+
+    // The other one is made when it is first looked up.
+    oc = lookup_option(&dhcp_universe, options,
+                       DHO_DHCP_PARAMETER_REQUEST_LIST);
+    if (oc == NULL || oc->data.len != 2 ||
+        oc->data.data[0] != DHO_SUBNET_MASK ||
+        oc->data.data[1] != DHO_ROUTERS) {
+        atf_tc_fail("parameter request list is wrong");
+    }
+    if (table->slots[1] != oc) {
+        atf_tc_fail("option cache was not kept");
+    }
+
+    option_state_dereference(&options, MDL);
+}
+
+ATF_TC(cons_options_prl);
+
+ATF_TC_HEAD(cons_options_prl, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+        "Verify that cons_options() sends requested options once each, "
+        "in the order of the parameter request list.");
+}
+
+ATF_TC_BODY(cons_options_prl, tc)
+{
+    struct option_state *options = NULL;
+    struct dhcp_packet outpacket;
+    struct data_string prl;
+    /* Routers before subnet mask, a code that isn't configured, and
+     * both of the first two repeated at the end. */
+    unsigned char prl_codes[] = {
+        DHO_ROUTERS, DHO_SUBNET_MASK, DHO_DOMAIN_NAME_SERVERS,
+        DHO_DOMAIN_NAME, DHO_HOST_NAME, DHO_BROADCAST_ADDRESS,
+        DHO_NTP_SERVERS, DHO_INTERFACE_MTU, DHO_SUBNET_MASK,
+        DHO_ROUTERS
+    };
+    unsigned codes[] = {
+        DHO_SUBNET_MASK, DHO_ROUTERS, DHO_DOMAIN_NAME_SERVERS,
+        DHO_DOMAIN_NAME, DHO_BROADCAST_ADDRESS, DHO_NTP_SERVERS,
+        DHO_INTERFACE_MTU, DHO_TIME_OFFSET, DHO_LOG_SERVERS,
+        DHO_DHCP_LEASE_TIME, DHO_DHCP_RENEWAL_TIME,
+        DHO_DHCP_REBINDING_TIME, DHO_DHCP_SERVER_IDENTIFIER,
+        DHO_DHCP_MESSAGE_TYPE
+    };
+    /* The server's own options come first, then the PRL with the
+     * duplicates dropped and the subnet mask moved ahead of the
+     * routers (RFC2132 section 3.3). */
+    unsigned expected[] = {
+        DHO_DHCP_MESSAGE_TYPE, DHO_DHCP_SERVER_IDENTIFIER,
+        DHO_DHCP_LEASE_TIME, DHO_DHCP_RENEWAL_TIME,
+        DHO_DHCP_REBINDING_TIME, DHO_SUBNET_MASK, DHO_ROUTERS,
+        DHO_DOMAIN_NAME_SERVERS, DHO_DOMAIN_NAME,
+        DHO_BROADCAST_ADDRESS, DHO_NTP_SERVERS, DHO_INTERFACE_MTU
+    };
+    unsigned char *opt;
+    int i, n, len;
+
+    initialize_common_option_spaces();
+    if (!option_state_allocate(&options, MDL)) {
+        atf_tc_fail("cannot allocate option state");
+    }
+    for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+        if (!add_option(options, codes[i], "\x0a\x00\x00\x01", 4)) {
+            atf_tc_fail("add_option %u returned 0", codes[i]);
+        }
+    }
+
+    memset(&prl, 0, sizeof(prl));
+    prl.data = prl_codes;
+    prl.len = sizeof(prl_codes);
+
+    memset(&outpacket, 0, sizeof(outpacket));
+    len = cons_options(NULL, &outpacket, NULL, NULL, 0, NULL, options,
+                       &global_scope, 0, 0, 0, &prl, NULL);
+    ATF_REQUIRE(len > DHCP_FIXED_NON_UDP);
+
+    /* Walk the options after the cookie, up to the end option. */
+    opt = &outpacket.options[4];
+    for (n = 0; *opt != DHO_END; n++) {
+        ATF_REQUIRE(opt + 2 <= (unsigned char *)&outpacket + len);
+        if (n >= sizeof(expected) / sizeof(expected[0])) {
+            atf_tc_fail("unexpected option %u", opt[0]);
+        }
+        if (opt[0] != expected[n]) {
+            atf_tc_fail("option %d is %u, expected %u",
+                        n, opt[0], expected[n]);
+        }
+        ATF_CHECK_EQ(opt[1], 4);
+        opt += 2 + opt[1];
+    }
+    ATF_CHECK_EQ(n, sizeof(expected) / sizeof(expected[0]));
+
+    option_state_dereference(&options, MDL);
+}
+
+ATF_TC(expression_memo);
+
+ATF_TC_HEAD(expression_memo, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+        "Verify that data expressions are memoized per packet.");
+}
+
+ATF_TC_BODY(expression_memo, tc)
+{
+    struct packet *packet = NULL;
+    struct expression *expr = NULL;
+    struct data_string data;
+    unsigned code = DHO_HOST_NAME;
+    unsigned long hits;
+    int i;
+
+    initialize_common_option_spaces();
+    if (!packet_allocate(&packet, MDL) ||
+        !option_state_allocate(&packet->options, MDL)) {
+        atf_tc_fail("cannot allocate packet");
+    }
+    if (!add_option(packet->options, DHO_HOST_NAME, "foo", 3)) {
+        atf_tc_fail("add_option failed");
+    }
+
+    if (!expression_allocate(&expr, MDL)) {
+        atf_tc_fail("cannot allocate expression");
+    }
+    expr->op = expr_option;
+    if (!option_code_hash_lookup(&expr->data.option, dhcp_universe.code_hash,
+                                 &code, 0, MDL)) {
+        atf_tc_fail("cannot find option definition?");
+    }
+
+    // The first evaluation misses, the ones after it hit.
+    hits = expression_memo_hits;
+    for (i = 0; i < 3; i++) {
+        memset(&data, 0, sizeof(data));
+        if (!evaluate_data_expression(&data, packet, NULL, NULL,
+                                      packet->options, NULL, &global_scope,
+                                      expr, MDL)) {
+            atf_tc_fail("evaluation %d failed", i);
+        }
+        if (data.len != 3 || memcmp(data.data, "foo", 3)) {
+            atf_tc_fail("evaluation %d gave the wrong value", i);
+        }
+        data_string_forget(&data, MDL);
+    }
+    ATF_CHECK_EQ(expression_memo_hits - hits, 2);
+    ATF_CHECK(packet->memo != NULL);
+
+    // Changing the packet's options makes the memoized value stale.
+    delete_option(&dhcp_universe, packet->options, DHO_HOST_NAME);
+    memset(&data, 0, sizeof(data));
+    ATF_CHECK(!evaluate_data_expression(&data, packet, NULL, NULL,
+                                        packet->options, NULL, &global_scope,
+                                        expr, MDL));
+    if (!add_option(packet->options, DHO_HOST_NAME, "bar", 3)) {
+        atf_tc_fail("add_option failed");
+    }
+    ATF_CHECK(evaluate_data_expression(&data, packet, NULL, NULL,
+                                       packet->options, NULL, &global_scope,
+                                       expr, MDL));
+    ATF_CHECK(data.len == 3 && !memcmp(data.data, "bar", 3));
+    data_string_forget(&data, MDL);
+
+    // Other option states aren't memoized.
+    hits = expression_memo_hits;
+    ATF_CHECK(!evaluate_data_expression(&data, packet, NULL, NULL, NULL,
+                                        NULL, &global_scope, expr, MDL));
+    ATF_CHECK_EQ(expression_memo_hits, hits);
+
+    expression_dereference(&expr, MDL);
+    packet_dereference(&packet, MDL);
+}
+
 /* This macro defines main() method that will call specified
    test cases. tp and simple_test_case names can be whatever you want
    as long as it is a valid variable identifier. */
@@ -275,6 +557,10 @@ ATF_TP_ADD_TCS(tp)
     ATF_TP_ADD_TC(tp, pretty_print_option);
     ATF_TP_ADD_TC(tp, parse_X);
     ATF_TP_ADD_TC(tp, add_option_ref_cnt);
+    ATF_TP_ADD_TC(tp, option_table);
+    ATF_TP_ADD_TC(tp, option_lazy_parse);
+    ATF_TP_ADD_TC(tp, cons_options_prl);
+    ATF_TP_ADD_TC(tp, expression_memo);
 
     return (atf_no_error());
 }
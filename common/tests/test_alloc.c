@@ -637,6 +637,175 @@ ATF_TC_BODY(dmalloc_small, tc) {
     checkBuffer(0X0FFFFFFF, MDL);
 }
 
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+ATF_TC(dmalloc_arena);
+
+ATF_TC_HEAD(dmalloc_arena, tc) {
+    atf_tc_set_md_var(tc, "descr", "packet arena reset and escape test");
+}
+
+ATF_TC_BODY(dmalloc_arena, tc) {
+    unsigned char *objs[64], *first, *kept;
+    struct buffer *bp = NULL;
+    unsigned long allocations, resets, escapes;
+    int i;
+
+    /*
+     * Outside of a packet, transient allocations aren't from the arena.
+     */
+    allocations = dmalloc_arena_allocations;
+    objs[0] = dmalloc_transient(10, MDL);
+    if (objs[0] == NULL) {
+        atf_tc_fail("dmalloc_transient failed");
+    }
+    ATF_CHECK(!dmalloc_is_transient(objs[0]));
+    dfree(objs[0], MDL);
+    ATF_CHECK_EQ(dmalloc_arena_allocations, allocations);
+
+    /*
+     * If everything allocated for a packet is freed, the next packet
+     * starts at the same place.
+     */
+    resets = dmalloc_arena_resets;
+    dmalloc_arena_enter();
+    for (i = 0; i < 64; i++) {
+        objs[i] = dmalloc_transient(100, MDL);
+        if (objs[i] == NULL) {
+            atf_tc_fail("dmalloc_transient failed");
+        }
+        memset(objs[i], i, 100);
+    }
+    ATF_CHECK_EQ(dmalloc_arena_allocations, allocations + 64);
+    first = objs[0];
+    for (i = 0; i < 64; i++) {
+        if (objs[i][99] != i) {
+            atf_tc_fail("object %d overwritten", i);
+        }
+        ATF_CHECK(dmalloc_is_transient(objs[i]));
+        dfree(objs[i], MDL);
+    }
+    dmalloc_arena_leave();
+    ATF_CHECK_EQ(dmalloc_arena_resets, resets + 1);
+
+    /*
+     * Buffers may be kept by a lease or a binding scope, so they never
+     * come from the arena.
+     */
+    dmalloc_arena_enter();
+    if (!buffer_allocate(&bp, 100, MDL)) {
+        atf_tc_fail("buffer_allocate failed");
+    }
+    ATF_CHECK(!dmalloc_is_transient(bp));
+    buffer_dereference(&bp, MDL);
+
+    objs[0] = dmalloc_transient(100, MDL);
+    ATF_CHECK(first == objs[0]);
+
+    /*
+     * An object that outlives the packet stays where it is; the next
+     * packet carries on after it in the same chunk.
+     */
+    escapes = dmalloc_arena_escapes;
+    kept = objs[0];
+    dmalloc_arena_leave();
+    ATF_CHECK_EQ(dmalloc_arena_escapes, escapes + 1);
+
+    dmalloc_arena_enter();
+    objs[0] = dmalloc_transient(100, MDL);
+    ATF_CHECK(objs[0] > kept);
+    ATF_CHECK(dmalloc_is_transient(objs[0]));
+    memset(objs[0], 0xff, 100);
+    dfree(objs[0], MDL);
+    dmalloc_arena_leave();
+
+    ATF_CHECK_EQ(kept[99], 0);
+    dfree(kept, MDL);
+}
+#endif
+
+ATF_TC(dmalloc_pool);
+
+ATF_TC_HEAD(dmalloc_pool, tc) {
+    atf_tc_set_md_var(tc, "descr", "typed object pool reuse and trim test");
+}
+
+struct pool_test_object {
+    int value;
+    char pad[36];
+};
+
+ATF_TC_BODY(dmalloc_pool, tc) {
+    static struct dmalloc_pool pool =
+        DMALLOC_POOL("test", struct pool_test_object);
+    struct pool_test_object *objs[1000];
+    struct dmalloc_pool *p;
+    int i;
+
+    cur_tv.tv_sec = 1000;
+
+    /*
+     * Objects come back zeroed and distinct, and the pool registers
+     * itself for reporting.
+     */
+    for (i = 0; i < 1000; i++) {
+        objs[i] = dmalloc_pool_get(&pool, MDL);
+        if (objs[i] == NULL) {
+            atf_tc_fail("dmalloc_pool_get failed");
+        }
+        if (objs[i]->value != 0 || objs[i]->pad[35] != 0) {
+            atf_tc_fail("object %d not zeroed", i);
+        }
+        objs[i]->value = i;
+        memset(objs[i]->pad, 0xff, sizeof(objs[i]->pad));
+    }
+    for (i = 0; i < 1000; i++) {
+        if (objs[i]->value != i) {
+            atf_tc_fail("object %d overwritten", i);
+        }
+    }
+    for (p = dmalloc_pools; p != NULL; p = p->next) {
+        if (p == &pool) {
+            break;
+        }
+    }
+    ATF_CHECK(p == &pool);
+    ATF_CHECK_EQ(pool.in_use, 1000);
+    ATF_CHECK_EQ(pool.allocations, 1000);
+
+    for (i = 0; i < 1000; i++) {
+        dmalloc_pool_put(&pool, objs[i], MDL);
+    }
+    ATF_CHECK_EQ(pool.in_use, 0);
+
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+    /*
+     * Right after the burst the memory is kept for reuse.
+     */
+    ATF_CHECK(pool.slabs > 1);
+    ATF_CHECK_EQ(pool.released, 0);
+    objs[0] = dmalloc_pool_get(&pool, MDL);
+    ATF_CHECK(pool.free + 1 >= 1000);
+
+    /*
+     * One trim interval later the burst is still the high-water mark;
+     * one more and the slabs that are no longer needed are released.
+     */
+    cur_tv.tv_sec += 301;
+    dmalloc_pool_put(&pool, objs[0], MDL);
+    ATF_CHECK(pool.slabs > 1);
+    ATF_CHECK_EQ(pool.high_water, 1000);
+
+    cur_tv.tv_sec += 301;
+    objs[0] = dmalloc_pool_get(&pool, MDL);
+    dmalloc_pool_put(&pool, objs[0], MDL);
+    ATF_CHECK_EQ(pool.high_water, 1);
+    ATF_CHECK_EQ(pool.slabs, 1);
+    ATF_CHECK(pool.released > 0);
+#endif
+}
+
 ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, buffer_allocate);
@@ -655,6 +824,11 @@ ATF_TP_ADD_TCS(tp)
     ATF_TP_ADD_TC(tp, dmalloc_med2);
     ATF_TP_ADD_TC(tp, dmalloc_med3);
     ATF_TP_ADD_TC(tp, dmalloc_small);
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+    ATF_TP_ADD_TC(tp, dmalloc_arena);
+#endif
+    ATF_TP_ADD_TC(tp, dmalloc_pool);
 
     return (atf_no_error());
 }
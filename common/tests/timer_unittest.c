@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2026 Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+#include <atf-c.h>
+#include <sys/time.h>
+#include "dhcpd.h"
+
+/* Number of timers used by the timer_many test. */
+#define TIMER_MANY_COUNT 1000
+
+static void
+timer_func_a(void *what) {
+}
+
+static void
+timer_func_b(void *what) {
+}
+
+static int
+count_timeouts(void) {
+	struct timeout *t;
+	int count = 0;
+
+	for (t = timeouts; t != NULL; t = t->next)
+		count++;
+	return (count);
+}
+
+ATF_TC(timer_supersede);
+
+ATF_TC_HEAD(timer_supersede, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that add_timeout supersedes "
+			  "and cancel_timeout removes by (func, what).");
+}
+
+ATF_TC_BODY(timer_supersede, tc)
+{
+	struct timeval when;
+	char objs[3];
+
+	dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			    NULL, NULL);
+	gettimeofday(&cur_tv, NULL);
+	when.tv_sec = cur_tv.tv_sec + 3600;
+	when.tv_usec = 0;
+
+	add_timeout(&when, timer_func_a, &objs[0], NULL, NULL);
+	add_timeout(&when, timer_func_b, &objs[0], NULL, NULL);
+	add_timeout(&when, timer_func_a, &objs[1], NULL, NULL);
+	if (count_timeouts() != 3)
+		atf_tc_fail("expected 3 timeouts, have %d", count_timeouts());
+
+	/* Same (func, what) replaces the existing entry. */
+	when.tv_sec++;
+	add_timeout(&when, timer_func_a, &objs[0], NULL, NULL);
+	if (count_timeouts() != 3)
+		atf_tc_fail("supersede added a timeout: %d", count_timeouts());
+
+	/* A NULL function supersedes any timeout for the object. */
+	add_timeout(&when, NULL, &objs[1], NULL, NULL);
+	if (count_timeouts() != 3)
+		atf_tc_fail("NULL supersede added a timeout: %d",
+			    count_timeouts());
+
+	/* Cancelling an unknown pair is a no-op. */
+	cancel_timeout(timer_func_b, &objs[2]);
+	if (count_timeouts() != 3)
+		atf_tc_fail("bogus cancel removed a timeout");
+
+	cancel_timeout(timer_func_a, &objs[0]);
+	cancel_timeout(timer_func_b, &objs[0]);
+	cancel_timeout(timer_func_a, &objs[1]);
+	if (count_timeouts() != 0)
+		atf_tc_fail("cancel left %d timeouts", count_timeouts());
+}
+
+ATF_TC(timer_many);
+
+ATF_TC_HEAD(timer_many, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Insert, supersede and cancel many "
+			  "timers.");
+}
+
+ATF_TC_BODY(timer_many, tc)
+{
+	struct timeval when;
+	char objs[TIMER_MANY_COUNT];
+	struct timeout *t;
+	int i;
+
+	dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			    NULL, NULL);
+	gettimeofday(&cur_tv, NULL);
+
+	when.tv_usec = 0;
+	for (i = 0; i < TIMER_MANY_COUNT; i++) {
+		when.tv_sec = cur_tv.tv_sec + 3600 + (i % 60);
+		add_timeout(&when, timer_func_a, &objs[i], NULL, NULL);
+	}
+	for (i = 0; i < TIMER_MANY_COUNT; i++) {
+		when.tv_sec = cur_tv.tv_sec + 7200 + (i % 60);
+		add_timeout(&when, timer_func_a, &objs[i], NULL, NULL);
+	}
+	if (count_timeouts() != TIMER_MANY_COUNT)
+		atf_tc_fail("expected %d timeouts, have %d",
+			    TIMER_MANY_COUNT, count_timeouts());
+
+	/* Superseded timers have moved.   The list isn't kept sorted, so
+	   only their times are checked. */
+	for (t = timeouts; t != NULL; t = t->next) {
+		if (t->when.tv_sec < cur_tv.tv_sec + 7200)
+			atf_tc_fail("timer was not superseded");
+	}
+
+	for (i = 0; i < TIMER_MANY_COUNT; i += 2)
+		cancel_timeout(timer_func_a, &objs[i]);
+	if (count_timeouts() != TIMER_MANY_COUNT / 2)
+		atf_tc_fail("expected %d timeouts after cancel, have %d",
+			    TIMER_MANY_COUNT / 2, count_timeouts());
+	for (i = 1; i < TIMER_MANY_COUNT; i += 2)
+		cancel_timeout(timer_func_a, &objs[i]);
+
+	if (timeouts != NULL)
+		atf_tc_fail("cancel left %d timeouts", count_timeouts());
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, timer_supersede);
+	ATF_TP_ADD_TC(tp, timer_many);
+
+	return (atf_no_error());
+}
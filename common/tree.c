@@ -38,6 +38,43 @@
 struct binding_scope *global_scope;
 
 static int do_host_lookup (struct data_string *, struct dns_host_entry *);
+static int evaluate_data_expression_uncached (struct data_string *,
+					      struct packet *, struct lease *,
+					      struct client_state *,
+					      struct option_state *,
+					      struct option_state *,
+					      struct binding_scope **,
+					      struct expression *,
+					      const char *, int);
+
+/*
+ * Per-packet memo of data expression results.   While a packet is
+ * processed the same expressions (option agent.remote-id, hardware,
+ * substrings of the vendor class...) are evaluated over and over by
+ * class matching, permit lists, host lookups and the DDNS code.   The
+ * result of an expression that only depends on the packet and its
+ * options is kept in a small open-addressed table hanging off the
+ * packet, keyed by the expression node.   Each entry also records the
+ * stamp of the packet's option state, so that saving or deleting an
+ * option in it makes the older entries miss.
+ */
+struct expression_memo_entry {
+	struct expression *expr;
+	unsigned long stamp;
+	int status;
+	struct data_string value;
+};
+
+struct expression_memo {
+	unsigned count;
+	unsigned size;			/* A power of two. */
+	struct expression_memo_entry *entries;
+};
+
+#define EXPRESSION_MEMO_INITIAL	16
+
+unsigned long expression_memo_hits;
+unsigned long expression_memo_misses;
 
 #define DS_SPRINTF_SIZE 128
 
@@ -1123,6 +1160,177 @@ int evaluate_boolean_expression (result, packet, lease, client_state,
 	return 0;
 }
 
+/* Return nonzero if the value of expr only depends on the packet and the
+   options it came with.   The answer is kept in the expression's flags. */
+static int expression_memo_ok (struct expression *expr)
+{
+	int ok;
+
+	if (!expr)
+		return 0;
+	if (expr -> flags & EXPR_MEMO_CHECKED)
+		return (expr -> flags & EXPR_MEMO) != 0;
+
+	switch (expr -> op) {
+	      case expr_const_data:
+	      case expr_const_int:
+	      case expr_option:
+	      case expr_hardware:
+	      case expr_filename:
+	      case expr_sname:
+		ok = 1;
+		break;
+
+	      case expr_substring:
+		ok = (expression_memo_ok (expr -> data.substring.expr) &&
+		      expr -> data.substring.offset -> op == expr_const_int &&
+		      expr -> data.substring.len -> op == expr_const_int);
+		break;
+
+	      case expr_suffix:
+		ok = (expression_memo_ok (expr -> data.suffix.expr) &&
+		      expr -> data.suffix.len -> op == expr_const_int);
+		break;
+
+	      case expr_packet:
+		ok = (expr -> data.packet.offset -> op == expr_const_int &&
+		      expr -> data.packet.len -> op == expr_const_int);
+		break;
+
+	      case expr_lcase:
+		ok = expression_memo_ok (expr -> data.lcase);
+		break;
+
+	      case expr_ucase:
+		ok = expression_memo_ok (expr -> data.ucase);
+		break;
+
+	      case expr_concat:
+		ok = (expression_memo_ok (expr -> data.concat [0]) &&
+		      expression_memo_ok (expr -> data.concat [1]));
+		break;
+
+	      case expr_pick_first_value:
+		ok = (expression_memo_ok (expr -> data.pick_first_value.car) &&
+		      (!expr -> data.pick_first_value.cdr ||
+		       expression_memo_ok
+				(expr -> data.pick_first_value.cdr)));
+		break;
+
+	      case expr_binary_to_ascii:
+		ok = (expr -> data.b2a.base -> op == expr_const_int &&
+		      expr -> data.b2a.width -> op == expr_const_int &&
+		      expression_memo_ok (expr -> data.b2a.separator) &&
+		      expression_memo_ok (expr -> data.b2a.buffer));
+		break;
+
+	      case expr_reverse:
+		ok = (expr -> data.reverse.width -> op == expr_const_int &&
+		      expression_memo_ok (expr -> data.reverse.buffer));
+		break;
+
+	      default:
+		ok = 0;
+		break;
+	}
+
+	expr -> flags |= EXPR_MEMO_CHECKED | (ok ? EXPR_MEMO : 0);
+	return ok;
+}
+
+static struct expression_memo_entry *
+expression_memo_slot (struct expression_memo *memo, struct expression *expr)
+{
+	unsigned i;
+
+	i = ((uintptr_t)expr >> 4) & (memo -> size - 1);
+	while (memo -> entries [i].expr && memo -> entries [i].expr != expr)
+		i = (i + 1) & (memo -> size - 1);
+	return &memo -> entries [i];
+}
+
+/* Find the entry for expr in packet's memo, adding an empty one if there
+   is none.   Returns NULL only if there's no memory. */
+static struct expression_memo_entry *
+expression_memo_entry (struct packet *packet, struct expression *expr)
+{
+	struct expression_memo *memo = packet -> memo;
+	struct expression_memo_entry *old, *entry;
+	unsigned size, i;
+
+	if (!memo) {
+		memo = dmalloc_transient (sizeof *memo, MDL);
+		if (!memo)
+			return NULL;
+		memo -> entries = dmalloc_transient
+			(EXPRESSION_MEMO_INITIAL * sizeof *memo -> entries,
+			 MDL);
+		if (!memo -> entries) {
+			dfree (memo, MDL);
+			return NULL;
+		}
+		memo -> size = EXPRESSION_MEMO_INITIAL;
+		packet -> memo = memo;
+	}
+
+	entry = expression_memo_slot (memo, expr);
+	if (entry -> expr)
+		return entry;
+
+	/* Keep the table at most three quarters full. */
+	if ((memo -> count + 1) * 4 > memo -> size * 3) {
+		old = memo -> entries;
+		size = memo -> size;
+		memo -> entries = dmalloc_transient
+			(size * 2 * sizeof *memo -> entries, MDL);
+		if (!memo -> entries) {
+			memo -> entries = old;
+			return NULL;
+		}
+		memo -> size = size * 2;
+		for (i = 0; i < size; i++) {
+			if (old [i].expr)
+				*expression_memo_slot (memo, old [i].expr) =
+					old [i];
+		}
+		dfree (old, MDL);
+		entry = expression_memo_slot (memo, expr);
+	}
+
+	expression_reference (&entry -> expr, expr, MDL);
+	memo -> count++;
+	return entry;
+}
+
+void expression_memo_free (struct expression_memo **memop)
+{
+	struct expression_memo *memo = *memop;
+	unsigned i;
+
+	if (!memo)
+		return;
+	for (i = 0; i < memo -> size; i++) {
+		if (memo -> entries [i].expr) {
+			data_string_forget (&memo -> entries [i].value, MDL);
+			expression_dereference (&memo -> entries [i].expr,
+						MDL);
+		}
+	}
+	dfree (memo -> entries, MDL);
+	dfree (memo, MDL);
+	*memop = NULL;
+}
+
+void expression_memo_report ()
+{
+	unsigned long total = expression_memo_hits + expression_memo_misses;
+
+	if (total)
+		log_info ("Expression memo: %lu hits, %lu misses (%lu%%).",
+			  expression_memo_hits, expression_memo_misses,
+			  expression_memo_hits * 100 / total);
+}
+
 int evaluate_data_expression (result, packet, lease, client_state,
 			      in_options, cfg_options, scope, expr, file, line)
 	struct data_string *result;
@@ -1135,6 +1343,60 @@ int evaluate_data_expression (result, packet, lease, client_state,
 	struct expression *expr;
 	const char *file;
 	int line;
+{
+	struct expression_memo_entry *entry;
+	int status;
+
+	/* Constants are cheaper to copy than to look up. */
+	if (!packet || !in_options || in_options != packet -> options ||
+	    expr -> op == expr_const_data || !expression_memo_ok (expr))
+		return evaluate_data_expression_uncached
+			(result, packet, lease, client_state, in_options,
+			 cfg_options, scope, expr, file, line);
+
+	if (packet -> memo) {
+		entry = expression_memo_slot (packet -> memo, expr);
+		if (entry -> expr && entry -> stamp == in_options -> stamp) {
+			expression_memo_hits++;
+			if (entry -> status)
+				data_string_copy (result, &entry -> value,
+						  file, line);
+			return entry -> status;
+		}
+	}
+	expression_memo_misses++;
+
+	status = evaluate_data_expression_uncached
+		(result, packet, lease, client_state, in_options,
+		 cfg_options, scope, expr, file, line);
+
+	/* Evaluating subexpressions may have grown the table, so the
+	   entry is only looked up now. */
+	entry = expression_memo_entry (packet, expr);
+	if (entry) {
+		data_string_forget (&entry -> value, MDL);
+		entry -> stamp = in_options -> stamp;
+		entry -> status = status;
+		if (status)
+			data_string_copy (&entry -> value, result, MDL);
+	}
+	return status;
+}
+
+static int evaluate_data_expression_uncached (result, packet, lease,
+					      client_state, in_options,
+					      cfg_options, scope, expr,
+					      file, line)
+	struct data_string *result;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *cfg_options;
+	struct binding_scope **scope;
+	struct expression *expr;
+	const char *file;
+	int line;
 {
 	struct data_string data, other;
 	unsigned long offset, len, i;
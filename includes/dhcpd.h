@@ -196,6 +196,22 @@ typedef time_t TIME;
 # define LEASE_HASH_SIZE	100003
 #endif
 
+/* Number of packets the LPF and socket back ends read with one recvmmsg()
+ * call, on systems that have it.  Set this to 1 to read one packet per
+ * system call.
+ */
+#if !defined (RECEIVE_BATCH_SIZE)
+# define RECEIVE_BATCH_SIZE	32
+#endif
+
+/* Most IPv6 leases expired or cleaned up by one run of the expiry timer.
+ * Any more that are due are left to a run scheduled straight after, so
+ * packets are served in between.
+ */
+#if !defined (V6_EXPIRY_BUDGET)
+# define V6_EXPIRY_BUDGET	1000
+#endif
+
 /* It is not known what the worst case subclass hash size is.  We estimate
  * high, I think.
  */
@@ -218,17 +234,14 @@ typedef time_t TIME;
 #endif
 
 
-/* How many options are likely to appear in a single packet? */
-#if !defined (OPTION_HASH_SIZE)
-# define OPTION_HASH_SIZE 17
-# define OPTION_HASH_PTWO 32	/* Next power of two above option hash. */
-# define OPTION_HASH_EXP 5	/* The exponent for that power of two. */
-#endif
+/* Option codes below this are looked up directly in an option_table;
+   larger ones are searched for. */
+#define OPTION_INDEX_SIZE 256
 
-#define compute_option_hash(x) \
-	(((x) & (OPTION_HASH_PTWO - 1)) + \
-	 (((x) >> OPTION_HASH_EXP) & \
-	  (OPTION_HASH_PTWO - 1))) % OPTION_HASH_SIZE;
+/* How many more slots to add when an option_table fills up. */
+#if !defined (OPTION_TABLE_INCREMENT)
+# define OPTION_TABLE_INCREMENT 16
+#endif
 
 /* Lease queue information.  We have two ways of storing leases.
  * The original is a linear linked list which is slower but uses
@@ -393,11 +406,32 @@ struct option_cache {
 	u_int32_t flags;
 };
 
+/* An option received in a packet that hasn't been looked at yet. */
+struct option_span {
+	struct buffer *buffer;
+	unsigned char *data;
+	unsigned len;
+	unsigned code;
+};
+
+/* The options stored in an option_state for one of the universes that
+   uses the hashed option functions.   Options parsed out of a packet
+   are only turned into option caches when they are first used; until
+   then their slot is NULL and the matching span says where they are. */
+struct option_table {
+	unsigned count, max;
+	struct option_cache **slots;		/* In the order saved. */
+	struct option_span *spans;		/* NULL if nothing pending. */
+	u_int16_t index [OPTION_INDEX_SIZE];	/* Code to slot + 1. */
+};
+
 struct option_state {
 	int refcnt;
 	int universe_count;
 	int site_universe;
 	int site_code_min;
+	unsigned long stamp;		/* Changes when an option is saved
+					   or deleted. */
 	void *universes [1];
 };
 
@@ -475,6 +509,9 @@ struct packet {
 
 	/* Relay port check */
 	isc_boolean_t relay_source_port;
+
+	/* Results of expressions already evaluated for this packet. */
+	struct expression_memo *memo;
 };
 
 /*
@@ -553,36 +590,37 @@ struct on_star {
 };
 
 /* A dhcp lease declaration structure. */
+/* The fields used by the allocator and by lease expiry are kept
+   together at the start of the structure, so that walking a pool's
+   leases touches as few cache lines as possible; the ones only used
+   once a lease has been found come after them.  Leases in a range are
+   allocated in one array per range (see new_leases()), so the hot parts
+   of neighbouring leases are evenly spaced in memory. */
 struct lease {
 	OMAPI_OBJECT_PREAMBLE;
-	struct lease *next;
-#if defined (BINARY_LEASES)
-	struct lease *prev;
-	struct leasechain *lc;
-#endif
-	struct lease *n_uid, *n_hw;
 
-	struct iaddr ip_addr;
-	TIME starts, ends, sort_time;
-#if defined (BINARY_LEASES)
-	long int sort_tiebreaker;
-#endif
-	char *client_hostname;
-	struct binding_scope *scope;
-	struct host_decl *host;
-	struct subnet *subnet;
-	struct pool *pool;
-	struct class *billing_class;
-	struct option_chain_head *agent_options;
-
-	/* insert the structure directly */
-	struct on_star on_star;
+	/* Hot fields. */
+	struct lease *next;
+	TIME ends, sort_time;
+	unsigned expiry_slot;		/* Position in the expiry index. */
 
-	unsigned char *uid;
-	unsigned short uid_len;
-	unsigned short uid_max;
-	unsigned char uid_buf [7];
-	struct hardware hardware_addr;
+	/*
+	 * The lease's binding state is its current state.  The next binding
+	 * state is the next state this lease will move into by expiration,
+	 * or timers in general.  The desired binding state is used on lease
+	 * updates; the caller is attempting to move the lease to the desired
+	 * binding state (and this may either succeed or fail, so the binding
+	 * state must be preserved).
+	 *
+	 * The 'rewind' binding state is used in failover processing.  It
+	 * is used for an optimization when out of communications; it allows
+	 * the server to "rewind" a lease to the previous state acknowledged
+	 * by the peer, and progress forward from that point.
+	 */
+	binding_state_t binding_state;
+	binding_state_t next_binding_state;
+	binding_state_t desired_binding_state;
+	binding_state_t rewind_binding_state;
 
 	u_int8_t flags;
 #       define STATIC_LEASE		1
@@ -603,23 +641,30 @@ struct lease {
 					 RESERVED_LEASE | \
 					 BOOTP_LEASE)
 
-	/*
-	 * The lease's binding state is its current state.  The next binding
-	 * state is the next state this lease will move into by expiration,
-	 * or timers in general.  The desired binding state is used on lease
-	 * updates; the caller is attempting to move the lease to the desired
-	 * binding state (and this may either succeed or fail, so the binding
-	 * state must be preserved).
-	 *
-	 * The 'rewind' binding state is used in failover processing.  It
-	 * is used for an optimization when out of communications; it allows
-	 * the server to "rewind" a lease to the previous state acknowledged
-	 * by the peer, and progress forward from that point.
-	 */
-	binding_state_t binding_state;
-	binding_state_t next_binding_state;
-	binding_state_t desired_binding_state;
-	binding_state_t rewind_binding_state;
+	/* Set when a lease has been disqualified for cache-threshold reuse */
+	unsigned short cannot_reuse;
+
+#if defined (BINARY_LEASES)
+	struct lease *prev;
+	struct leasechain *lc;
+	long int sort_tiebreaker;
+#endif
+	struct pool *pool;
+	struct iaddr ip_addr;
+	u_int32_t last_xid; /* XID we sent in this lease's BNDUPD */
+	TIME starts;
+
+	/* Cold fields. */
+	struct lease *n_uid, *n_hw;
+	char *client_hostname;
+	struct binding_scope *scope;
+	struct host_decl *host;
+	struct subnet *subnet;
+	struct class *billing_class;
+	struct option_chain_head *agent_options;
+
+	/* insert the structure directly */
+	struct on_star on_star;
 
 	struct lease_state *state;
 
@@ -634,7 +679,6 @@ struct lease {
 	TIME tsfp;	/* Time sent from partner. */
 	TIME atsfp;	/* Actual time sent from partner. */
 	TIME cltt;	/* Client last transaction time. */
-	u_int32_t last_xid; /* XID we sent in this lease's BNDUPD */
 	struct lease *next_pending;
 
 	/*
@@ -645,8 +689,11 @@ struct lease {
 	 */
 	struct dhcp_ddns_cb *ddns_cb;
 
-	/* Set when a lease has been disqualified for cache-threshold reuse */
-	unsigned short cannot_reuse;
+	unsigned char *uid;
+	unsigned short uid_len;
+	unsigned short uid_max;
+	unsigned char uid_buf [7];
+	struct hardware hardware_addr;
 };
 
 struct lease_state {
@@ -817,6 +864,7 @@ struct lease_state {
 #define SV_BIND_LOCAL_ADDRESS6		98
 #define SV_PING_CLTT_SECS		99
 #define SV_PING_TIMEOUT_MS		100
+#define SV_BINARY_LEASE_FILE		101
 
 #if !defined (DEFAULT_PING_TIMEOUT)
 # define DEFAULT_PING_TIMEOUT 1
@@ -1013,8 +1061,9 @@ struct permit {
 #if defined (BINARY_LEASES)
 struct leasechain {
 	struct lease **list; /* lease list */
-	size_t total;	     /* max number of elements in this list,
-			      * including free pointers at the end if any */
+	struct lease **base; /* start of the array; list may be further in */
+	size_t total;	     /* max number of elements in the array,
+			      * including free pointers at either end */
 	size_t nelem;	     /* the number of elements, also the next index to use */
 	size_t growth;	     /* the growth factor to use when increase an array
 			      * this is set after parsing the pools and before
@@ -1035,7 +1084,6 @@ struct pool {
 	LEASE_STRUCT backup;
 	LEASE_STRUCT abandoned;
 	LEASE_STRUCT reserved;
-	TIME next_event_time;
 	int lease_count;
 	int free_leases;
 	int backup_leases;
@@ -1050,6 +1098,20 @@ struct pool {
 	int low_threshold;	/* low threshold to restart logging */
 };
 
+/* Longest-prefix-match index over a set of subnets, one path-compressed
+   binary trie per address family.  See subnet_tree_add() in mdb.c. */
+struct subnet_tree_node {
+	struct subnet_tree_node *child[2];
+	struct subnet *subnet;
+	int bits;
+	unsigned char key[16];
+};
+
+struct subnet_tree {
+	struct subnet_tree_node *root[2];	/* IPv4, IPv6 */
+	int unindexed;		/* subnets with a non-contiguous netmask */
+};
+
 struct shared_network {
 	OMAPI_OBJECT_PREAMBLE;
 	struct shared_network *next;
@@ -1059,6 +1121,7 @@ struct shared_network {
 	int flags;
 
 	struct subnet *subnets;
+	struct subnet_tree subnet_tree;	/* index over subnets */
 	struct interface_info *interface;
 	struct pool *pools;
 	struct ipv6_pond *ipv6_pond;
@@ -1086,6 +1149,7 @@ struct collection {
 
 	const char *name;
 	struct class *classes;
+	struct class_index *index;	/* Built by check_collection(). */
 };
 
 /* Used as an argument to parse_clasS_decl() */
@@ -1122,6 +1186,10 @@ struct class {
 	struct expression *submatch;
 	int spawning;
 
+	/* Compiled forms of expr and submatch. */
+	struct match_program *expr_program;
+	struct match_program *submatch_program;
+
 	struct group *group;
 
 	/* Statements to execute if class matches. */
@@ -1446,6 +1514,8 @@ typedef void (*tvref_t)(void *, void *, const char *, int);
 typedef void (*tvunref_t)(void *, const char *, int);
 struct timeout {
 	struct timeout *next;
+	struct timeout *prev;		/* timeouts list back link */
+	struct timeout *hnext;		/* timeout index bucket chain */
 	struct timeval when;
 	void (*func) (void *);
 	void *what;
@@ -1713,6 +1783,8 @@ struct ipv6_pool {
 	iasubopt_hash_t *leases;		/* non-free leases */
 	isc_uint64_t num_active;		/* count of active leases */
 	isc_uint64_t num_abandoned;		/* count of abandoned leases */
+	isc_uint64_t capacity;			/* most leases the pool can
+						   hold, see IPV6_POOL_FULL */
 	isc_heap_t *active_timeouts;		/* timeouts for active leases */
 	int num_inactive;			/* count of inactive leases */
 	isc_heap_t *inactive_timeouts;		/* timeouts for expired or
@@ -1721,6 +1793,13 @@ struct ipv6_pool {
 						   this pool */
 	struct subnet *subnet;			/* subnet for this pool */
 	struct ipv6_pond *ipv6_pond;		/* pond for this pool */
+	time_t next_expiry;			/* next lease timeout */
+	int expiry_index;			/* index in the expiry heap,
+						   0 if not on it */
+	u_int8_t *free_index;			/* free prefix buddy tree,
+						   prefix pools only */
+	int free_index_depth;			/* units - bits when indexed */
+	isc_uint64_t num_free;			/* free prefixes in the index */
 };
 
 /*!
@@ -1748,6 +1827,9 @@ struct ipv6_pond {
 	struct ipv6_pool **ipv6_pools;	/* NULL-terminated array */
 	int last_ipv6_pool;		/* offset of last IPv6 pool
 					   used to issue a lease */
+	int num_na_pools;		/* address pools in ipv6_pools */
+	u_int32_t permit_gen;		/* reply the permit result is for */
+	int permit_ok;			/* cached permit result */
 	isc_uint64_t num_total;	    /* Total number of elements in the pond */
 	isc_uint64_t num_active;    /* Number of elements in the pond in use */
 	isc_uint64_t num_abandoned;	/* count of abandoned leases */
@@ -1759,6 +1841,14 @@ struct ipv6_pond {
 #endif
 };
 
+/*
+ * A pool starts out with the capacity of its range.  When an exhaustive
+ * search of it finds nothing free, the capacity is lowered to what is in
+ * use, which takes reserved interface IDs and host reservations into
+ * account.  Allocation skips a pool while it is full.
+ */
+#define IPV6_POOL_FULL(pool) ((pool)->num_active >= (pool)->capacity)
+
 /*
  * Max addresses in a pond that can be supported by log threshold
  * Currently based on max value supported by isc_uint64_t.
@@ -1865,6 +1955,7 @@ HASH_FUNCTIONS_DECL (class, const char *, struct class, class_hash_t)
 /* options.c */
 
 extern struct option *vendor_cfg_option;
+extern unsigned long option_state_stamp;
 int parse_options (struct packet *);
 int parse_option_buffer (struct option_state *, const unsigned char *,
 			 unsigned, struct universe *);
@@ -2122,6 +2213,7 @@ extern int ddns_update_style;
 extern u_int16_t ddns_conflict_mask;
 #endif
 extern int dont_use_fsync;
+extern int binary_lease_file;
 extern int server_id_check;
 
 #ifdef EUI_64
@@ -2320,6 +2412,10 @@ struct expression *parse_domain_name(struct parse *cfile);
 
 /* tree.c */
 extern struct binding_scope *global_scope;
+extern unsigned long expression_memo_hits;
+extern unsigned long expression_memo_misses;
+void expression_memo_free (struct expression_memo **);
+void expression_memo_report (void);
 pair cons (caddr_t, pair);
 int make_const_option_cache (struct option_cache **, struct buffer **,
 			     u_int8_t *, unsigned, struct option *,
@@ -2491,10 +2587,6 @@ int write_group (struct group_object *);
 /* salloc.c */
 void relinquish_lease_hunks (void);
 struct lease *new_leases (unsigned, const char *, int);
-#if defined (DEBUG_MEMORY_LEAKAGE) || \
-		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
-void relinquish_free_lease_states (void);
-#endif
 OMAPI_OBJECT_ALLOC_DECL (lease, struct lease, dhcp_type_lease)
 OMAPI_OBJECT_ALLOC_DECL (class, struct class, dhcp_type_class)
 OMAPI_OBJECT_ALLOC_DECL (subclass, struct class, dhcp_type_subclass)
@@ -3095,10 +3187,16 @@ int write_billing_class (struct class *);
 void commit_leases_timeout (void *);
 int commit_leases (void);
 int commit_leases_timed (void);
+#if defined (ASYNC_FSYNC)
+int commit_leases_async (void (*)(void));
+#endif
 void db_startup (int);
 int new_lease_file (int test_mode);
 int group_writer (struct group_object *);
 int write_ia(const struct ia_xx *);
+int lease_journal_check (const char *, unsigned);
+isc_result_t lease_journal_read (const char *, unsigned, const char *);
+isc_result_t lease_journal_dump (const char *, FILE *);
 
 /* packet.c */
 u_int32_t checksum (unsigned char *, unsigned, u_int32_t);
@@ -3251,6 +3349,8 @@ extern struct executable_statement *default_classification_rules;
 
 void classification_setup (void);
 void classify_client (struct packet *);
+void class_index_invalidate (void);
+void class_index_free (struct collection *);
 int check_collection (struct packet *, struct lease *, struct collection *);
 void classify (struct packet *, struct class *);
 isc_result_t unlink_class (struct class **class);
@@ -3259,6 +3359,17 @@ isc_result_t find_class (struct class **, const char *,
 void unbill_class (struct lease *);
 int bill_class (struct lease *, struct class *);
 
+/* classvm.c */
+struct match_program;
+void match_program_compile(struct match_program **, struct expression *, int);
+void match_program_free(struct match_program **);
+int match_program_boolean(int *, struct match_program *, struct packet *,
+			  struct lease *, struct option_state *,
+			  struct binding_scope **);
+int match_program_data(struct data_string *, struct match_program *,
+		       struct packet *, struct lease *, struct option_state *,
+		       struct binding_scope **);
+
 /* execute.c */
 int execute_statements (struct binding_value **result,
 			struct packet *, struct lease *,
@@ -3295,6 +3406,7 @@ extern omapi_object_type_t *dhcp_type_control;
 extern dhcp_control_object_t *dhcp_control_object;
 
 void dhcp_common_objects_setup (void);
+void subnet_tree_free(struct subnet_tree *);
 
 isc_result_t dhcp_group_set_value  (omapi_object_t *, omapi_object_t *,
 				    omapi_data_string_t *,
@@ -3505,6 +3617,9 @@ isc_result_t dhcp_interface_remove (omapi_object_t *,
 				    omapi_object_t *);
 void interface_stash (struct interface_info *);
 void interface_snorf (struct interface_info *, int);
+void interface_ifindex_invalidate (void);
+void interface_ifindex_free (void);
+struct interface_info *interface_find_by_ifindex (unsigned);
 
 isc_result_t binding_scope_set_value (struct binding_scope *, int,
 				      omapi_data_string_t *,
@@ -3563,6 +3678,9 @@ void new_shared_network_interface (struct parse *,
 				   struct shared_network *,
 				   const char *);
 int subnet_inner_than(const struct subnet *, const struct subnet *, int);
+void subnet_tree_add(struct subnet_tree *, struct subnet *, int);
+struct subnet *subnet_tree_lookup(const struct subnet_tree *,
+				  const struct iaddr *);
 void enter_subnet (struct subnet *);
 void enter_lease (struct lease *);
 int supersede_lease (struct lease *, struct lease *, int, int, int, int);
@@ -3574,7 +3692,10 @@ void abandon_lease (struct lease *, const char *);
 /* this appears to be unused and I plan to remove it SAR */
 void dissociate_lease (struct lease *);
 #endif
-void pool_timer (void *);
+void lease_expiry_schedule (struct lease *);
+void lease_expiry_cancel (struct lease *);
+void lease_expiry_requeue (struct pool *);
+void lease_expiry_run (void *);
 int find_lease_by_uid (struct lease **, const unsigned char *,
 		       unsigned, const char *, int);
 int find_lease_by_hw_addr (struct lease **, const unsigned char *,
@@ -3856,6 +3977,8 @@ isc_result_t create_prefix6(struct ipv6_pool *pool,
 			    time_t soft_lifetime_end_time);
 isc_boolean_t prefix6_exists(const struct ipv6_pool *pool,
 			     const struct in6_addr *pref, u_int8_t plen);
+isc_boolean_t prefix6_pool_space(const struct ipv6_pool *pool,
+				 isc_uint64_t *num_free, int *largest);
 
 isc_result_t add_ipv6_pool(struct ipv6_pool *pool);
 isc_result_t find_ipv6_pool(struct ipv6_pool **pool, u_int16_t type,
@@ -3875,6 +3998,8 @@ isc_result_t release_leases(struct ia_xx *ia);
 isc_result_t decline_leases(struct ia_xx *ia);
 void schedule_lease_timeout(struct ipv6_pool *pool);
 void schedule_all_ipv6_lease_timeouts();
+extern time_t ipv6_expiry_backlog;
+extern isc_uint64_t ipv6_expiry_deferred;
 
 void mark_hosts_unavailable(void);
 void mark_phosts_unavailable(void);
@@ -37,6 +37,18 @@
 # define KEY_HASH_SIZE		1009
 #endif
 
+/* Resizable tables grow once they hold more than HASH_MAX_LOAD entries
+ * per bucket.  The old buckets are then moved into the new array
+ * HASH_REHASH_STEP at a time on each add or delete, so no single
+ * operation pays for the whole rehash. */
+#if !defined (HASH_MAX_LOAD)
+# define HASH_MAX_LOAD		2
+#endif
+
+#if !defined (HASH_REHASH_STEP)
+# define HASH_REHASH_STEP	64
+#endif
+
 /* The purpose of the hashed_object_t struct is to not match anything else. */
 typedef struct {
 	int foo;
@@ -63,8 +75,25 @@ struct hash_table {
 	hash_comparator_t cmp;
 	unsigned (*do_hash)(const void *, unsigned, unsigned);
 
-	/* This must remain the last entry in this table. */
-	struct hash_bucket *buckets [1];
+	/* Number of entries, across both bucket arrays while resizing. */
+	unsigned entry_count;
+	int resizable;
+	/* Nonzero while hash_foreach() runs; resizing is held off. */
+	int foreach_depth;
+
+	/* While a resize is in progress, old_buckets holds the previous
+	 * array; buckets below rehash_index have already been moved. */
+	struct hash_bucket **old_buckets;
+	unsigned old_count;
+	unsigned rehash_index;
+
+	/* Current bucket array, hash_count entries.  Resizable tables
+	 * must be walked with hash_foreach() rather than directly. */
+	struct hash_bucket **buckets;
+
+	/* Initial bucket array.
+	 * This must remain the last entry in this table. */
+	struct hash_bucket *initial_buckets [1];
 };
 
 struct named_hash {
@@ -83,6 +112,7 @@ int name##_hash_lookup (type **, hashtype *, bufarg, unsigned,		      \
 unsigned char * name##_hash_report(hashtype *);				      \
 int name##_hash_foreach (hashtype *, hash_foreach_func);		      \
 int name##_new_hash (hashtype **, unsigned, const char *, int);		      \
+void name##_hash_enable_resize (hashtype *);				      \
 void name##_free_hash_table (hashtype **, const char *, int);
 
 
@@ -128,12 +158,16 @@ int name##_new_hash (hashtype **tp, unsigned c, const char *file, int line)   \
 			 hasher, file, line);				      \
 }									      \
 									      \
+void name##_hash_enable_resize (hashtype *table)			      \
+{									      \
+	hash_enable_resize ((struct hash_table *)table);		      \
+}									      \
+									      \
 void name##_free_hash_table (hashtype **table, const char *file, int line)    \
 {									      \
 	free_hash_table ((struct hash_table **)table, file, line);	      \
 }
 
-void relinquish_hash_bucket_hunks (void);
 int new_hash_table (struct hash_table **, unsigned, const char *, int);
 void free_hash_table (struct hash_table **, const char *, int);
 struct hash_bucket *new_hash_bucket (const char *, int);
@@ -148,6 +182,7 @@ unsigned do_id_hash(const void *, unsigned, unsigned);
 unsigned do_number_hash(const void *, unsigned, unsigned);
 unsigned do_ip4_hash(const void *, unsigned, unsigned);
 unsigned char *hash_report(struct hash_table *);
+void hash_enable_resize(struct hash_table *);
 void add_hash (struct hash_table *,
 		      const void *, unsigned, hashed_object_t *,
 		      const char *, int);
@@ -557,6 +557,39 @@ isc_result_t omapi_handle_td_lookup (omapi_object_t **, omapi_typed_data_t *);
 
 void * dmalloc (size_t, const char *, int);
 void dfree (void *, const char *, int);
+void * dmalloc_transient (size_t, const char *, int);
+void dmalloc_arena_enter (void);
+void dmalloc_arena_leave (void);
+int dmalloc_is_transient (const void *);
+
+/* A pool of fixed-size objects; see dmalloc_pool_get() in alloc.c. */
+struct dmalloc_pool_slab;
+struct dmalloc_pool {
+	const char *name;
+	size_t size;
+	struct dmalloc_pool_slab *partial;	/* Slabs with free objects. */
+	unsigned long slabs;		/* Slabs allocated. */
+	unsigned long released;		/* Slabs given back. */
+	unsigned long allocations;	/* Objects handed out, ever. */
+	unsigned long in_use;
+	unsigned long free;
+	unsigned long peak;		/* In use, this trim interval. */
+	unsigned long high_water;	/* In use, last trim interval. */
+	time_t trim_time;
+	int registered;
+	struct dmalloc_pool *next;
+};
+#define DMALLOC_POOL(name, type) { name, sizeof (type) }
+extern struct dmalloc_pool *dmalloc_pools;
+void * dmalloc_pool_get (struct dmalloc_pool *, const char *, int);
+void dmalloc_pool_put (struct dmalloc_pool *, void *, const char *, int);
+void dmalloc_pool_trim (struct dmalloc_pool *);
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+extern unsigned long dmalloc_arena_allocations;
+extern unsigned long dmalloc_arena_resets;
+extern unsigned long dmalloc_arena_escapes;
+#endif
 #if defined (DEBUG_MEMORY_LEAKAGE) || defined (DEBUG_MALLOC_POOL) || \
 		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
 void dmalloc_reuse (void *, const char *, int, int);
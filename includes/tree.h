@@ -281,6 +281,8 @@ struct expression {
 	} data;
 	int flags;
 #	define EXPR_EPHEMERAL	1
+#	define EXPR_MEMO_CHECKED	2	/* EXPR_MEMO is valid. */
+#	define EXPR_MEMO	4	/* Value may be memoized. */
 };
 
 /* DNS host entry structure... */
@@ -393,6 +393,7 @@ struct option_def configs[] = {
         { "bind-local-address6", "f",           "server",  98, 0},
 	{ "ping-cltt-secs", "T",		"server",  99, 0},
 	{ "ping-timeout-ms", "T",		"server", 100, 0},
+	{ "binary-lease-file", "f",		"server", 101, 0},
 	{ NULL, NULL, NULL, 0, 0 }
 };
 
@@ -1132,6 +1133,11 @@ get_config_comments(unsigned code)
 					"supported");
 		TAILQ_INSERT_TAIL(&comments, comment);
 		goto no_ping;
+	case 101: /* binary-lease-file */
+		comment = createComment("/// binary-lease-file is an "
+					"internal ISC DHCP feature");
+		TAILQ_INSERT_TAIL(&comments, comment);
+		break;
 	}
 	return &comments;
 }
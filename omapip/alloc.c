@@ -53,6 +53,246 @@ static void print_rc_hist_entry (int);
 static int dmalloc_failures;
 static char out_of_memory[] = "Run out of memory.";
 
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+/*
+ * Packet arena.   Handling one packet allocates and frees a good many
+ * short-lived option states, option tables and memo tables.   While the
+ * server is handling a packet (between dmalloc_arena_enter() and
+ * dmalloc_arena_leave()), dmalloc_transient() carves such objects out of
+ * a chunk with a bump pointer instead of calling malloc().   Only objects
+ * that are released with the packet, or with the lease state that waits
+ * for a delayed ACK, are allocated this way; anything that may be kept
+ * by a lease, a binding scope or a class comes from the heap.
+ *
+ * The objects are still reference counted and freed one at a time with
+ * dfree(), which only counts them down.   When the packet is done and
+ * nothing in the chunk is alive, the chunk is reset as a whole and
+ * reused for the next packet.   Otherwise the next packet carries on
+ * after the objects that are still alive, and a full chunk stays around
+ * until the last of them is freed.   If too many chunks are kept alive
+ * that way, transient allocations fall back to malloc() until enough of
+ * them have been released.
+ *
+ * Chunks are aligned to their size, so the chunk an object is in can be
+ * found from the object's address.   When memory debugging is enabled
+ * the arena is compiled out and every allocation is tracked as usual.
+ */
+#define ARENA_CHUNK_SIZE	32768
+#define ARENA_MAX_OBJECT	2048
+#define ARENA_ALIGN		16
+#define ARENA_MAX_RETAINED	32	/* Full chunks kept alive. */
+#define ARENA_MAX_SPARE		4
+#define ARENA_MAX_CHUNKS	(ARENA_MAX_RETAINED + 2)
+
+struct arena_chunk {
+	struct arena_chunk *next;	/* On the spare list. */
+	size_t used;
+	unsigned live;
+};
+
+#define ARENA_HEADER_SIZE \
+	((sizeof (struct arena_chunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* Chunks that may still hold live objects, including the current one. */
+static struct arena_chunk *arena_chunks [ARENA_MAX_CHUNKS];
+static int arena_chunk_count;
+static uintptr_t arena_low, arena_high;
+
+static struct arena_chunk *arena_current;
+static struct arena_chunk *arena_spare;
+static int arena_spare_count;
+static int arena_depth;
+static int arena_bypass;
+
+unsigned long dmalloc_arena_allocations;
+unsigned long dmalloc_arena_resets;
+unsigned long dmalloc_arena_escapes;
+
+static void
+arena_range(void) {
+	uintptr_t addr;
+	int i;
+
+	arena_low = arena_high = 0;
+	for (i = 0; i < arena_chunk_count; i++) {
+		addr = (uintptr_t)arena_chunks [i];
+		if (i == 0 || addr < arena_low)
+			arena_low = addr;
+		if (addr + ARENA_CHUNK_SIZE > arena_high)
+			arena_high = addr + ARENA_CHUNK_SIZE;
+	}
+}
+
+/* Give back a chunk with no live objects in it. */
+static void
+arena_release(struct arena_chunk *chunk) {
+	int i;
+
+	for (i = 0; i < arena_chunk_count; i++) {
+		if (arena_chunks [i] == chunk) {
+			arena_chunks [i] = arena_chunks [--arena_chunk_count];
+			break;
+		}
+	}
+	arena_range();
+
+	if (arena_spare_count < ARENA_MAX_SPARE) {
+		chunk -> next = arena_spare;
+		arena_spare = chunk;
+		arena_spare_count++;
+	} else
+		free (chunk);
+
+	/* Enough escaped objects are gone to use the arena again. */
+	if (arena_bypass && arena_chunk_count <= ARENA_MAX_RETAINED / 2)
+		arena_bypass = 0;
+}
+
+static struct arena_chunk *
+arena_new_chunk(void) {
+	struct arena_chunk *chunk;
+	void *mem;
+
+	if (arena_chunk_count == ARENA_MAX_CHUNKS)
+		return NULL;
+	if (arena_spare) {
+		chunk = arena_spare;
+		arena_spare = chunk -> next;
+		arena_spare_count--;
+	} else {
+		if (posix_memalign (&mem, ARENA_CHUNK_SIZE, ARENA_CHUNK_SIZE))
+			return NULL;
+		chunk = mem;
+	}
+	chunk -> next = NULL;
+	chunk -> used = ARENA_HEADER_SIZE;
+	chunk -> live = 0;
+	arena_chunks [arena_chunk_count++] = chunk;
+	arena_range();
+	return chunk;
+}
+
+/* Stop using the current chunk.   If nothing in it is alive any more it
+   is released, otherwise it stays around until its objects are freed. */
+static void
+arena_retire(void) {
+	struct arena_chunk *chunk = arena_current;
+
+	arena_current = NULL;
+	if (!chunk -> live)
+		arena_release (chunk);
+	else if (arena_chunk_count > ARENA_MAX_RETAINED)
+		arena_bypass = 1;
+}
+
+/* Return the chunk ptr was allocated from, or NULL if it isn't from the
+   arena. */
+static struct arena_chunk *
+arena_chunk_of(const void *ptr) {
+	struct arena_chunk *chunk;
+	uintptr_t addr = (uintptr_t)ptr;
+	int i;
+
+	if (addr < arena_low || addr >= arena_high)
+		return NULL;
+	chunk = (struct arena_chunk *)(addr & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1));
+	for (i = 0; i < arena_chunk_count; i++)
+		if (arena_chunks [i] == chunk)
+			return chunk;
+	return NULL;
+}
+
+/* If ptr was allocated from the arena, count it as freed and return 1. */
+static int
+arena_free(void *ptr) {
+	struct arena_chunk *chunk = arena_chunk_of (ptr);
+
+	if (!chunk)
+		return 0;
+	if (--chunk -> live == 0 && chunk != arena_current)
+		arena_release (chunk);
+	return 1;
+}
+
+/* Start handling a packet.   Calls may be nested. */
+void
+dmalloc_arena_enter(void) {
+	arena_depth++;
+}
+
+/* Done handling a packet. */
+void
+dmalloc_arena_leave(void) {
+	if (--arena_depth > 0 || !arena_current)
+		return;
+
+	if (!arena_current -> live) {
+		/* Nothing escaped: start the next packet from scratch. */
+		arena_current -> used = ARENA_HEADER_SIZE;
+		dmalloc_arena_resets++;
+	} else {
+		/* The next packet goes on after what is still alive. */
+		dmalloc_arena_escapes++;
+	}
+}
+
+/* Return 1 if ptr was allocated from the packet arena.   Memory that
+   belongs to such an object can come from the arena as well. */
+int
+dmalloc_is_transient(const void *ptr) {
+	return arena_chunk_of (ptr) != NULL;
+}
+
+/* Allocate memory that is normally freed before the current packet is
+   done with.   Outside of a packet, this is the same as dmalloc(). */
+void *
+dmalloc_transient(size_t size, const char *file, int line) {
+	size_t len = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	void *foo;
+
+	if (!arena_depth || arena_bypass || !size ||
+	    size > ARENA_MAX_OBJECT)
+		return dmalloc (size, file, line);
+
+	if (arena_current &&
+	    arena_current -> used + len > ARENA_CHUNK_SIZE)
+		arena_retire ();
+	if (!arena_current) {
+		if (arena_bypass)
+			return dmalloc (size, file, line);
+		arena_current = arena_new_chunk ();
+		if (!arena_current)
+			return dmalloc (size, file, line);
+	}
+
+	foo = (unsigned char *)arena_current + arena_current -> used;
+	arena_current -> used += len;
+	arena_current -> live++;
+	dmalloc_arena_allocations++;
+	memset (foo, 0, size);
+	return foo;
+}
+#else
+void
+dmalloc_arena_enter(void) {
+}
+
+void
+dmalloc_arena_leave(void) {
+}
+
+void *
+dmalloc_transient(size_t size, const char *file, int line) {
+	return dmalloc (size, file, line);
+}
+
+int
+dmalloc_is_transient(const void *ptr) {
+	return 0;
+}
+#endif
+
 void *
 dmalloc(size_t size, const char *file, int line) {
 	unsigned char *foo;
@@ -147,6 +387,11 @@ dfree(void *ptr, const char *file, int line) {
 		log_error ("dfree %s(%d): free on null pointer.", file, line);
 		return;
 	}
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	if (arena_free (ptr))
+		return;
+#endif
 #if defined (DEBUG_MEMORY_LEAKAGE) || defined (DEBUG_MALLOC_POOL) || \
 		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
 	{
@@ -203,6 +448,229 @@ dfree(void *ptr, const char *file, int line) {
 	free (ptr);
 }
 
+/*
+ * Typed object pools.   A pool hands out objects of one type - lease
+ * states, timeouts, hash buckets - carved out of slabs of
+ * POOL_SLAB_SIZE bytes, and takes them back for reuse.   Unlike the
+ * free lists they replace, pools give memory back: a slab whose objects
+ * are all free is released as long as the pool still has enough free
+ * objects to get back to its high-water mark, which is the largest
+ * number of objects that were in use during the last trim interval.
+ *
+ * Slabs are aligned to their size, so the slab an object came from is
+ * found from the object's address.   Pools are put on the dmalloc_pools
+ * list the first time they are used, so that their counters can be
+ * reported through the control object.   When memory debugging is
+ * enabled, pool objects are allocated and freed one at a time with
+ * dmalloc() and dfree(), so that each of them is tracked.
+ */
+#define POOL_SLAB_SIZE		16384
+#define POOL_ALIGN		16
+#define POOL_MAX_OBJECT		(POOL_SLAB_SIZE / 8)
+#define POOL_TRIM_INTERVAL	300
+
+struct dmalloc_pool_slab {
+	struct dmalloc_pool_slab *prev, *next;	/* On the partial list. */
+	void *free;
+	unsigned free_count;
+	unsigned capacity;
+};
+
+#define POOL_HEADER_SIZE \
+	((sizeof (struct dmalloc_pool_slab) + POOL_ALIGN - 1) & \
+	 ~(POOL_ALIGN - 1))
+#define POOL_OBJECT_SIZE(pool) \
+	(((pool) -> size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+struct dmalloc_pool *dmalloc_pools;
+
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+static void
+pool_link(struct dmalloc_pool *pool, struct dmalloc_pool_slab *slab) {
+	slab -> prev = NULL;
+	slab -> next = pool -> partial;
+	if (pool -> partial)
+		pool -> partial -> prev = slab;
+	pool -> partial = slab;
+}
+
+static void
+pool_unlink(struct dmalloc_pool *pool, struct dmalloc_pool_slab *slab) {
+	if (slab -> prev)
+		slab -> prev -> next = slab -> next;
+	else
+		pool -> partial = slab -> next;
+	if (slab -> next)
+		slab -> next -> prev = slab -> prev;
+	slab -> prev = slab -> next = NULL;
+}
+
+/* Nonzero if the pool can do without capacity of its free objects. */
+static int
+pool_excess(struct dmalloc_pool *pool, unsigned capacity) {
+	unsigned long want;
+
+	want = pool -> high_water > pool -> peak ?
+		pool -> high_water : pool -> peak;
+	return (pool -> free >= capacity &&
+		pool -> free - capacity >= want - pool -> in_use);
+}
+
+static void
+pool_release(struct dmalloc_pool *pool, struct dmalloc_pool_slab *slab) {
+	pool_unlink (pool, slab);
+	pool -> free -= slab -> capacity;
+	pool -> slabs--;
+	pool -> released++;
+	free (slab);
+}
+
+static struct dmalloc_pool_slab *
+pool_new_slab(struct dmalloc_pool *pool) {
+	struct dmalloc_pool_slab *slab;
+	size_t len = POOL_OBJECT_SIZE (pool);
+	unsigned char *p;
+	void *mem;
+	unsigned i;
+
+	if (posix_memalign (&mem, POOL_SLAB_SIZE, POOL_SLAB_SIZE))
+		return NULL;
+	slab = mem;
+	slab -> capacity = (POOL_SLAB_SIZE - POOL_HEADER_SIZE) / len;
+	slab -> free_count = slab -> capacity;
+
+	/* Thread the free list through the objects in address order. */
+	slab -> free = NULL;
+	p = (unsigned char *)slab + POOL_HEADER_SIZE +
+		(slab -> capacity - 1) * len;
+	for (i = 0; i < slab -> capacity; i++, p -= len) {
+		*(void **)p = slab -> free;
+		slab -> free = p;
+	}
+
+	pool_link (pool, slab);
+	pool -> free += slab -> capacity;
+	pool -> slabs++;
+	return slab;
+}
+#endif
+
+/* Release the empty slabs the pool does not need. */
+void
+dmalloc_pool_trim(struct dmalloc_pool *pool) {
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	struct dmalloc_pool_slab *slab, *next;
+
+	for (slab = pool -> partial; slab; slab = next) {
+		next = slab -> next;
+		if (slab -> free_count == slab -> capacity &&
+		    pool_excess (pool, slab -> capacity))
+			pool_release (pool, slab);
+	}
+#endif
+}
+
+/* Once per trim interval, the peak use during the interval becomes the
+   new high-water mark, and slabs beyond it are released. */
+static void
+pool_tick(struct dmalloc_pool *pool) {
+	if (cur_time < pool -> trim_time)
+		return;
+	pool -> high_water = pool -> peak;
+	pool -> peak = pool -> in_use;
+	pool -> trim_time = cur_time + POOL_TRIM_INTERVAL;
+	dmalloc_pool_trim (pool);
+}
+
+/* Get a zeroed object from the pool. */
+void *
+dmalloc_pool_get(struct dmalloc_pool *pool, const char *file, int line) {
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	struct dmalloc_pool_slab *slab;
+#endif
+	void *foo;
+
+	if (!pool -> registered) {
+		pool -> next = dmalloc_pools;
+		dmalloc_pools = pool;
+		pool -> registered = 1;
+		pool -> trim_time = cur_time + POOL_TRIM_INTERVAL;
+	}
+
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	if (POOL_OBJECT_SIZE (pool) > POOL_MAX_OBJECT) {
+		foo = dmalloc (pool -> size, file, line);
+		if (!foo)
+			return NULL;
+	} else {
+		slab = pool -> partial;
+		if (!slab) {
+			slab = pool_new_slab (pool);
+			if (!slab) {
+				log_error ("%s(%d): no memory for %s pool.",
+					   file, line, pool -> name);
+				return NULL;
+			}
+		}
+		foo = slab -> free;
+		slab -> free = *(void **)foo;
+		if (--slab -> free_count == 0)
+			pool_unlink (pool, slab);
+		pool -> free--;
+		memset (foo, 0, pool -> size);
+	}
+#else
+	foo = dmalloc (pool -> size, file, line);
+	if (!foo)
+		return NULL;
+#endif
+
+	pool -> allocations++;
+	if (++pool -> in_use > pool -> peak)
+		pool -> peak = pool -> in_use;
+	return foo;
+}
+
+/* Return an object to the pool it came from. */
+void
+dmalloc_pool_put(struct dmalloc_pool *pool, void *ptr,
+		 const char *file, int line) {
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	struct dmalloc_pool_slab *slab;
+#endif
+
+	if (!ptr)
+		return;
+	pool -> in_use--;
+
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	if (POOL_OBJECT_SIZE (pool) > POOL_MAX_OBJECT)
+		dfree (ptr, file, line);
+	else {
+		slab = (struct dmalloc_pool_slab *)
+			((uintptr_t)ptr & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+		*(void **)ptr = slab -> free;
+		slab -> free = ptr;
+		if (slab -> free_count++ == 0)
+			pool_link (pool, slab);
+		pool -> free++;
+		if (slab -> free_count == slab -> capacity &&
+		    pool_excess (pool, slab -> capacity))
+			pool_release (pool, slab);
+	}
+#else
+	dfree (ptr, file, line);
+#endif
+
+	pool_tick (pool);
+}
+
 #if defined (DEBUG_MEMORY_LEAKAGE) || defined (DEBUG_MALLOC_POOL) || \
 		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
 /* For allocation functions that keep their own free lists, we want to
@@ -30,6 +30,13 @@
 
 #include <omapip/omapip_p.h>
 #include <errno.h>
+#include <sys/uio.h>
+
+/* The most pieces of queued output omapi_connection_writer() will hand
+   to a single writev(). */
+#if !defined (OMAPI_WRITEV_MAX)
+# define OMAPI_WRITEV_MAX 16
+#endif
 
 #if defined (TRACING)
 static void trace_connection_input_input (trace_type_t *, unsigned, char *);
@@ -450,6 +457,9 @@ isc_result_t omapi_connection_writer (omapi_object_t *h)
 	unsigned bytes_this_write;
 	int bytes_written;
 	unsigned first_byte;
+	unsigned niov, i, len, rest;
+	struct iovec iov [OMAPI_WRITEV_MAX];
+	omapi_buffer_t *iovbuf [OMAPI_WRITEV_MAX];
 	omapi_buffer_t *buffer;
 	omapi_connection_object_t *c;
 
@@ -461,71 +471,92 @@ isc_result_t omapi_connection_writer (omapi_object_t *h)
 	if (!c -> out_bytes)
 		return ISC_R_SUCCESS;
 
-	buffer = c -> outbufs;
-
 	while (c -> out_bytes) {
-		if (!buffer)
-			return ISC_R_UNEXPECTED;
-		if (BYTES_IN_BUFFER (buffer)) {
+		/* Gather up whatever is queued across the output buffers,
+		   so that several small messages go out in one system
+		   call.   A buffer whose data wraps around contributes
+		   two pieces. */
+		niov = 0;
+		bytes_this_write = 0;
+		for (buffer = c -> outbufs;
+		     buffer && niov < OMAPI_WRITEV_MAX;
+		     buffer = buffer -> next) {
+			if (!BYTES_IN_BUFFER (buffer))
+				continue;
 			if (buffer -> head == (sizeof buffer -> buf) - 1)
 				first_byte = 0;
 			else
 				first_byte = buffer -> head + 1;
 
-			if (first_byte > buffer -> tail) {
-				bytes_this_write = (sizeof buffer -> buf -
-						   first_byte);
-			} else {
-				bytes_this_write =
-					buffer -> tail - first_byte;
+			if (first_byte > buffer -> tail)
+				len = sizeof buffer -> buf - first_byte;
+			else
+				len = buffer -> tail - first_byte;
+			iov [niov].iov_base = &buffer -> buf [first_byte];
+			iov [niov].iov_len = len;
+			iovbuf [niov++] = buffer;
+			bytes_this_write += len;
+
+			if (first_byte > buffer -> tail &&
+			    buffer -> tail > 0 && niov < OMAPI_WRITEV_MAX) {
+				iov [niov].iov_base = &buffer -> buf [0];
+				iov [niov].iov_len = buffer -> tail;
+				iovbuf [niov++] = buffer;
+				bytes_this_write += buffer -> tail;
 			}
-			bytes_written = write (c -> socket,
-					       &buffer -> buf [first_byte],
-					       bytes_this_write);
-			/* If the write failed with EWOULDBLOCK or we wrote
-			   zero bytes, a further write would block, so we have
-			   flushed as much as we can for now.   Other errors
-			   are really errors. */
-			if (bytes_written < 0) {
-				if (errno == EWOULDBLOCK || errno == EAGAIN)
-					return ISC_R_INPROGRESS;
-				else if (errno == EPIPE)
-					return ISC_R_NOCONN;
+		}
+		if (!niov)
+			return ISC_R_UNEXPECTED;
+
+		bytes_written = writev (c -> socket, iov, niov);
+		/* If the write failed with EWOULDBLOCK or we wrote
+		   zero bytes, a further write would block, so we have
+		   flushed as much as we can for now.   Other errors
+		   are really errors. */
+		if (bytes_written < 0) {
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return ISC_R_INPROGRESS;
+			else if (errno == EPIPE)
+				return ISC_R_NOCONN;
 #ifdef EDQUOT
-				else if (errno == EFBIG || errno == EDQUOT)
+			else if (errno == EFBIG || errno == EDQUOT)
 #else
-				else if (errno == EFBIG)
+			else if (errno == EFBIG)
 #endif
-					return ISC_R_NORESOURCES;
-				else if (errno == ENOSPC)
-					return ISC_R_NOSPACE;
-				else if (errno == EIO)
-					return ISC_R_IOERROR;
-				else if (errno == EINVAL)
-					return DHCP_R_INVALIDARG;
-				else if (errno == ECONNRESET)
-					return ISC_R_SHUTTINGDOWN;
-				else
-					return ISC_R_UNEXPECTED;
-			}
-			if (bytes_written == 0)
-				return ISC_R_INPROGRESS;
+				return ISC_R_NORESOURCES;
+			else if (errno == ENOSPC)
+				return ISC_R_NOSPACE;
+			else if (errno == EIO)
+				return ISC_R_IOERROR;
+			else if (errno == EINVAL)
+				return DHCP_R_INVALIDARG;
+			else if (errno == ECONNRESET)
+				return ISC_R_SHUTTINGDOWN;
+			else
+				return ISC_R_UNEXPECTED;
+		}
+		if (bytes_written == 0)
+			return ISC_R_INPROGRESS;
 
+		/* Consume what was written from each buffer in turn. */
+		rest = bytes_written;
+		for (i = 0; i < niov && rest; i++) {
+			len = iov [i].iov_len < rest ? iov [i].iov_len : rest;
 #if defined (TRACING)
 			if (trace_record ()) {
 				isc_result_t status;
-				trace_iov_t iov [2];
+				trace_iov_t tiov [2];
 				int32_t connect_index;
 
 				connect_index = htonl (c -> index);
 
-				iov [0].buf = (char *)&connect_index;
-				iov [0].len = sizeof connect_index;
-				iov [1].buf = &buffer -> buf [buffer -> tail];
-				iov [1].len = bytes_written;
+				tiov [0].buf = (char *)&connect_index;
+				tiov [0].len = sizeof connect_index;
+				tiov [1].buf = iov [i].iov_base;
+				tiov [1].len = len;
 
 				status = (trace_write_packet_iov
-					  (trace_connection_input, 2, iov,
+					  (trace_connection_input, 2, tiov,
 					   MDL));
 				if (status != ISC_R_SUCCESS) {
 					trace_stop ();
@@ -535,19 +566,17 @@ isc_result_t omapi_connection_writer (omapi_object_t *h)
 				}
 			}
 #endif
-
-			buffer -> head = first_byte + bytes_written - 1;
-			c -> out_bytes -= bytes_written;
-
-			/* If we didn't finish out the write, we filled the
-			   O.S. output buffer and a further write would block,
-			   so stop trying to flush now. */
-			if (bytes_written != bytes_this_write)
-				return ISC_R_INPROGRESS;
+			iovbuf [i] -> head = ((char *)iov [i].iov_base -
+					      iovbuf [i] -> buf) + len - 1;
+			rest -= len;
 		}
+		c -> out_bytes -= bytes_written;
 
-		if (!BYTES_IN_BUFFER (buffer))
-			buffer = buffer -> next;
+		/* If we didn't finish out the write, we filled the
+		   O.S. output buffer and a further write would block,
+		   so stop trying to flush now. */
+		if (bytes_written != bytes_this_write)
+			return ISC_R_INPROGRESS;
 	}
 
 	/* Get rid of any output buffers we emptied. */
@@ -91,10 +91,20 @@ int new_hash_table (tp, count, file, line)
 	if (!rval)
 		return 0;
 	rval -> hash_count = count;
+	rval -> buckets = rval -> initial_buckets;
 	*tp = rval;
 	return 1;
 }
 
+/* Release a bucket array unless it is the one allocated along with
+   the table itself. */
+static void
+free_bucket_array(struct hash_table *table, struct hash_bucket **array)
+{
+	if (array != NULL && array != table->initial_buckets)
+		dfree(array, MDL);
+}
+
 void free_hash_table (tp, file, line)
 	struct hash_table **tp;
 	const char *file;
@@ -104,90 +114,50 @@ void free_hash_table (tp, file, line)
 
 #if defined (DEBUG_MEMORY_LEAKAGE) || \
 		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
-	int i;
+	int i, pass;
+	unsigned count;
+	struct hash_bucket **array;
 	struct hash_bucket *hbc, *hbn = (struct hash_bucket *)0;
 
-	for (i = 0; ptr != NULL && i < ptr -> hash_count; i++) {
-	    for (hbc = ptr -> buckets [i]; hbc; hbc = hbn) {
-		hbn = hbc -> next;
-		if (ptr -> dereferencer && hbc -> value)
-		    (*ptr -> dereferencer) (&hbc -> value, MDL);
+	for (pass = 0; ptr != NULL && pass < 2; pass++) {
+	    if (pass == 0) {
+		array = ptr -> buckets;
+		count = ptr -> hash_count;
+	    } else {
+		array = ptr -> old_buckets;
+		count = ptr -> old_count;
 	    }
-	    for (hbc = ptr -> buckets [i]; hbc; hbc = hbn) {
-		hbn = hbc -> next;
-		free_hash_bucket (hbc, MDL);
+	    for (i = 0; array != NULL && i < count; i++) {
+		for (hbc = array [i]; hbc; hbc = hbn) {
+		    hbn = hbc -> next;
+		    if (ptr -> dereferencer && hbc -> value)
+			(*ptr -> dereferencer) (&hbc -> value, MDL);
+		}
+		for (hbc = array [i]; hbc; hbc = hbn) {
+		    hbn = hbc -> next;
+		    free_hash_bucket (hbc, MDL);
+		}
+		array [i] = (struct hash_bucket *)0;
 	    }
-	    ptr -> buckets [i] = (struct hash_bucket *)0;
 	}
 #endif
 
+	if (ptr != NULL) {
+		free_bucket_array(ptr, ptr -> buckets);
+		free_bucket_array(ptr, ptr -> old_buckets);
+	}
 	dfree((void *)ptr, MDL);
 	*tp = (struct hash_table *)0;
 }
 
-struct hash_bucket *free_hash_buckets;
-
-#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
-struct hash_bucket *hash_bucket_hunks;
-
-void relinquish_hash_bucket_hunks ()
-{
-	struct hash_bucket *c, *n, **p;
-
-	/* Account for all the hash buckets on the free list. */
-	p = &free_hash_buckets;
-	for (c = free_hash_buckets; c; c = c -> next) {
-		for (n = hash_bucket_hunks; n; n = n -> next) {
-			if (c > n && c < n + 127) {
-				*p = c -> next;
-				n -> len++;
-				break;
-			}
-		}
-		/* If we didn't delete the hash bucket from the free list,
-		   advance the pointer. */
-		if (!n)
-			p = &c -> next;
-	}
-
-	for (c = hash_bucket_hunks; c; c = n) {
-		n = c -> next;
-		if (c -> len != 126) {
-			log_info ("hashbucket %lx hash_buckets %d free %u",
-				  (unsigned long)c, 127, c -> len);
-		}
-		dfree (c, MDL);
-	}
-}
-#endif
+static struct dmalloc_pool hash_bucket_pool =
+	DMALLOC_POOL ("hash-bucket", struct hash_bucket);
 
 struct hash_bucket *new_hash_bucket (file, line)
 	const char *file;
 	int line;
 {
-	struct hash_bucket *rval;
-	int i = 0;
-	if (!free_hash_buckets) {
-		rval = dmalloc (127 * sizeof (struct hash_bucket),
-				file, line);
-		if (!rval)
-			return rval;
-# if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
-		rval -> next = hash_bucket_hunks;
-		hash_bucket_hunks = rval;
-		hash_bucket_hunks -> len = 0;
-		i++;
-		rval++;
-#endif
-		for (; i < 127; i++) {
-			rval -> next = free_hash_buckets;
-			free_hash_buckets = rval;
-			rval++;
-		}
-	}
-	rval = free_hash_buckets;
-	free_hash_buckets = rval -> next;
-	return rval;
+	return dmalloc_pool_get (&hash_bucket_pool, file, line);
 }
 
 void free_hash_bucket (ptr, file, line)
@@ -195,18 +165,7 @@ void free_hash_bucket (ptr, file, line)
 	const char *file;
 	int line;
 {
-#if defined (DEBUG_MALLOC_POOL)
-	struct hash_bucket *hp;
-
-	for (hp = free_hash_buckets; hp; hp = hp -> next) {
-		if (hp == ptr) {
-			log_error ("hash bucket freed twice!");
-			abort ();
-		}
-	}
-#endif
-	ptr -> next = free_hash_buckets;
-	free_hash_buckets = ptr;
+	dmalloc_pool_put (&hash_bucket_pool, ptr, file, line);
 }
 
 int new_hash(struct hash_table **rp,
@@ -340,45 +299,158 @@ do_ip4_hash(const void *key, unsigned len, unsigned size)
 	return number % size;
 }
 
-unsigned char *
-hash_report(struct hash_table *table)
+/*
+ * Allow a table to grow as entries are added.  Only tables that are
+ * never walked directly through their buckets may be made resizable.
+ */
+void
+hash_enable_resize(struct hash_table *table)
 {
-	static unsigned char retbuf[sizeof("Contents/Size (%): "
-					   "2147483647/2147483647 "
-					   "(2147483647%). "
-					   "Min/max: 2147483647/2147483647")];
-	unsigned curlen, pct, contents=0, minlen=UINT_MAX, maxlen=0;
-	unsigned i;
-	struct hash_bucket *bp;
+	if (table != NULL)
+		table->resizable = 1;
+}
 
-	if (table == NULL)
-		return (unsigned char *) "No table.";
+/*
+ * Move up to HASH_REHASH_STEP buckets from the old array into the
+ * current one.  Entries are appended to the destination chain so that,
+ * for duplicate keys, the most recently added entry is still found
+ * first: everything in the old array predates the resize.
+ */
+static void
+hash_rehash_step(struct hash_table *table)
+{
+	struct hash_bucket *bp, *next, **tail;
+	unsigned hashno, steps;
 
-	if (table->hash_count == 0)
-		return (unsigned char *) "Invalid hash table.";
+	if (table->old_buckets == NULL || table->foreach_depth != 0)
+		return;
 
-	for (i = 0 ; i < table->hash_count ; i++) {
+	for (steps = 0; steps < HASH_REHASH_STEP &&
+	     table->rehash_index < table->old_count; steps++) {
+		bp = table->old_buckets[table->rehash_index];
+		table->old_buckets[table->rehash_index] = NULL;
+		table->rehash_index++;
+
+		for (; bp != NULL; bp = next) {
+			next = bp->next;
+			hashno = (*table->do_hash)(bp->name, bp->len,
+						   table->hash_count);
+			for (tail = &table->buckets[hashno]; *tail != NULL;
+			     tail = &(*tail)->next)
+				;
+			bp->next = NULL;
+			*tail = bp;
+		}
+	}
+
+	if (table->rehash_index >= table->old_count) {
+		free_bucket_array(table, table->old_buckets);
+		table->old_buckets = NULL;
+		table->old_count = 0;
+		table->rehash_index = 0;
+	}
+}
+
+/*
+ * Start growing a resizable table whose load factor has gone past
+ * HASH_MAX_LOAD.  The new size is odd, as the hash functions reduce
+ * modulo the table size.  If the allocation fails the table simply
+ * keeps its current size.
+ */
+static void
+hash_maybe_grow(struct hash_table *table)
+{
+	struct hash_bucket **nb;
+	unsigned nsize;
+
+	if (!table->resizable || table->old_buckets != NULL ||
+	    table->foreach_depth != 0 ||
+	    table->entry_count <= table->hash_count * HASH_MAX_LOAD)
+		return;
+
+	if (table->hash_count > (UINT_MAX / sizeof(*nb) - 1) / 2)
+		return;
+	nsize = table->hash_count * 2 + 1;
+
+	nb = dmalloc(nsize * sizeof(*nb), MDL);
+	if (nb == NULL) {
+		log_error("Unable to grow hash table to %u buckets.", nsize);
+		return;
+	}
+
+	table->old_buckets = table->buckets;
+	table->old_count = table->hash_count;
+	table->rehash_index = 0;
+	table->buckets = nb;
+	table->hash_count = nsize;
+}
+
+/* Accumulate chain length statistics for one bucket array. */
+static void
+hash_report_array(struct hash_bucket **array, unsigned count,
+		  unsigned *contents, unsigned *used,
+		  unsigned *minlen, unsigned *maxlen)
+{
+	unsigned curlen, i;
+	struct hash_bucket *bp;
+
+	for (i = 0 ; i < count ; i++) {
 		curlen = 0;
 
-		bp = table->buckets[i];
+		bp = array[i];
 		while (bp != NULL) {
 			curlen++;
 			bp = bp->next;
 		}
 
-		if (curlen < minlen)
-			minlen = curlen;
-		if (curlen > maxlen)
-			maxlen = curlen;
+		if (curlen < *minlen)
+			*minlen = curlen;
+		if (curlen > *maxlen)
+			*maxlen = curlen;
+		if (curlen != 0)
+			(*used)++;
 
-		contents += curlen;
+		*contents += curlen;
 	}
+}
+
+unsigned char *
+hash_report(struct hash_table *table)
+{
+	static unsigned char retbuf[sizeof("Contents/Size (%): "
+					   "2147483647/2147483647 "
+					   "(2147483647%). "
+					   "Min/max: 2147483647/2147483647. "
+					   "Avg chain: 2147483647.99. "
+					   "Rehashing: 2147483647/2147483647")];
+	unsigned pct, contents=0, used=0, minlen=UINT_MAX, maxlen=0;
+	unsigned avg100, len;
+
+	if (table == NULL)
+		return (unsigned char *) "No table.";
+
+	if (table->hash_count == 0)
+		return (unsigned char *) "Invalid hash table.";
+
+	hash_report_array(table->buckets, table->hash_count,
+			  &contents, &used, &minlen, &maxlen);
+	if (table->old_buckets != NULL)
+		hash_report_array(table->old_buckets, table->old_count,
+				  &contents, &used, &minlen, &maxlen);
 
 	if (contents >= (UINT_MAX / 100))
 		pct = contents / ((table->hash_count / 100) + 1);
 	else
 		pct = (contents * 100) / table->hash_count;
 
+	/* Average length of the non-empty chains, in hundredths. */
+	if (used == 0)
+		avg100 = 0;
+	else if (contents >= (UINT_MAX / 100))
+		avg100 = (contents / used) * 100;
+	else
+		avg100 = (contents * 100) / used;
+
 	if (contents > 2147483647 ||
 	    table->hash_count > 2147483647 ||
 	    pct > 2147483647 ||
@@ -386,13 +458,54 @@ hash_report(struct hash_table *table)
 	    maxlen > 2147483647)
 		return (unsigned char *) "Report out of range for display.";
 
-	sprintf((char *)retbuf,
-		"Contents/Size (%%): %u/%u (%u%%). Min/max: %u/%u",
-		contents, table->hash_count, pct, minlen, maxlen);
+	len = sprintf((char *)retbuf,
+		      "Contents/Size (%%): %u/%u (%u%%). Min/max: %u/%u. "
+		      "Avg chain: %u.%02u",
+		      contents, table->hash_count, pct, minlen, maxlen,
+		      avg100 / 100, avg100 % 100);
+	if (table->old_buckets != NULL)
+		sprintf((char *)retbuf + len, ". Rehashing: %u/%u",
+			table->rehash_index, table->old_count);
 
 	return retbuf;
 }
 
+/* Find the first entry matching key in one bucket array, returning
+   the address of the pointer that refers to it. */
+static struct hash_bucket **
+hash_find_in(struct hash_table *table, struct hash_bucket **array,
+	     unsigned count, const void *key, unsigned len, int strkey)
+{
+	struct hash_bucket **bpp;
+	unsigned hashno;
+
+	hashno = (*table->do_hash)(key, len, count);
+	for (bpp = &array[hashno]; *bpp != NULL; bpp = &(*bpp)->next) {
+		if ((strkey && !(*bpp)->len &&
+		     !strcmp((const char *)(*bpp)->name, key)) ||
+		    ((*bpp)->len == len &&
+		     !(*table->cmp)((*bpp)->name, key, len)))
+			return bpp;
+	}
+	return NULL;
+}
+
+/* Find the entry for key in the current array or, while a resize is
+   in progress, in the old array. */
+static struct hash_bucket **
+hash_find(struct hash_table *table, const void *key, unsigned len,
+	  int strkey)
+{
+	struct hash_bucket **bpp;
+
+	bpp = hash_find_in(table, table->buckets, table->hash_count,
+			   key, len, strkey);
+	if (bpp == NULL && table->old_buckets != NULL)
+		bpp = hash_find_in(table, table->old_buckets,
+				   table->old_count, key, len, strkey);
+	return bpp;
+}
+
 void add_hash (table, key, len, pointer, file, line)
 	struct hash_table *table;
 	unsigned len;
@@ -411,6 +524,9 @@ void add_hash (table, key, len, pointer, file, line)
 	if (!len)
 		len = find_length(key, table->do_hash);
 
+	hash_maybe_grow(table);
+	hash_rehash_step(table);
+
 	hashno = (*table->do_hash)(key, len, table->hash_count);
 	bp = new_hash_bucket (file, line);
 
@@ -427,6 +543,7 @@ void add_hash (table, key, len, pointer, file, line)
 	bp -> next = table -> buckets [hashno];
 	bp -> len = len;
 	table -> buckets [hashno] = bp;
+	table -> entry_count++;
 }
 
 void delete_hash_entry (table, key, len, file, line)
@@ -436,8 +553,7 @@ void delete_hash_entry (table, key, len, file, line)
 	const char *file;
 	int line;
 {
-	int hashno;
-	struct hash_bucket *bp, *pbp = (struct hash_bucket *)0;
+	struct hash_bucket *bp, **bpp;
 	void *foo;
 
 	if (!table)
@@ -446,28 +562,19 @@ void delete_hash_entry (table, key, len, file, line)
 	if (!len)
 		len = find_length(key, table->do_hash);
 
-	hashno = (*table->do_hash)(key, len, table->hash_count);
+	hash_rehash_step(table);
 
-	/* Go through the list looking for an entry that matches;
-	   if we find it, delete it. */
-	for (bp = table -> buckets [hashno]; bp; bp = bp -> next) {
-		if ((!bp -> len &&
-		     !strcmp ((const char *)bp->name, key)) ||
-		    (bp -> len == len &&
-		     !(table -> cmp)(bp->name, key, len))) {
-			if (pbp) {
-				pbp -> next = bp -> next;
-			} else {
-				table -> buckets [hashno] = bp -> next;
-			}
-			if (bp -> value && table -> dereferencer) {
-				foo = &bp -> value;
-				(*(table -> dereferencer)) (foo, file, line);
-			}
-			free_hash_bucket (bp, file, line);
-			break;
+	/* Look for an entry that matches; if we find it, delete it. */
+	bpp = hash_find(table, key, len, 1);
+	if (bpp != NULL) {
+		bp = *bpp;
+		*bpp = bp -> next;
+		if (bp -> value && table -> dereferencer) {
+			foo = &bp -> value;
+			(*(table -> dereferencer)) (foo, file, line);
 		}
-		pbp = bp;	/* jwg, 9/6/96 - nice catch! */
+		free_hash_bucket (bp, file, line);
+		table -> entry_count--;
 	}
 }
 
@@ -479,8 +586,7 @@ int hash_lookup (vp, table, key, len, file, line)
 	const char *file;
 	int line;
 {
-	int hashno;
-	struct hash_bucket *bp;
+	struct hash_bucket **bpp;
 
 	if (!table)
 		return 0;
@@ -492,42 +598,59 @@ int hash_lookup (vp, table, key, len, file, line)
 			  "initialized to zero (from %s:%d).", file, line);
 	}
 
-	hashno = (*table->do_hash)(key, len, table->hash_count);
-
-	for (bp = table -> buckets [hashno]; bp; bp = bp -> next) {
-		if (len == bp -> len
-		    && !(*table->cmp)(bp->name, key, len)) {
-			if (table -> referencer)
-				(*table -> referencer) (vp, bp -> value,
-							file, line);
-			else
-				*vp = bp -> value;
-			return 1;
-		}
+	bpp = hash_find(table, key, len, 0);
+	if (bpp != NULL) {
+		if (table -> referencer)
+			(*table -> referencer) (vp, (*bpp) -> value,
+						file, line);
+		else
+			*vp = (*bpp) -> value;
+		return 1;
 	}
 	return 0;
 }
 
-int hash_foreach (struct hash_table *table, hash_foreach_func func)
+/* Walk one bucket array for hash_foreach(); returns nonzero if func
+   asked to stop. */
+static int
+hash_foreach_array(struct hash_bucket **array, unsigned count,
+		   hash_foreach_func func, int *countp)
 {
-	int i;
+	unsigned i;
 	struct hash_bucket *bp, *next;
-	int count = 0;
 
-	if (!table)
-		return 0;
-
-	for (i = 0; i < table -> hash_count; i++) {
-		bp = table -> buckets [i];
+	for (i = 0; i < count; i++) {
+		bp = array [i];
 		while (bp) {
 			next = bp -> next;
 			if ((*func)(bp->name, bp->len, bp->value)
 							!= ISC_R_SUCCESS)
-				return count;
+				return 1;
 			bp = next;
-			count++;
+			(*countp)++;
 		}
 	}
+	return 0;
+}
+
+int hash_foreach (struct hash_table *table, hash_foreach_func func)
+{
+	int count = 0;
+
+	if (!table)
+		return 0;
+
+	/* Entries still in the old array have not been moved yet; the
+	   resize is held off until the walk is done so that nothing is
+	   visited twice or skipped. */
+	table -> foreach_depth++;
+	if (!hash_foreach_array(table -> buckets, table -> hash_count,
+				func, &count) &&
+	    table -> old_buckets != NULL)
+		hash_foreach_array(table -> old_buckets, table -> old_count,
+				   func, &count);
+	table -> foreach_depth--;
+
 	return count;
 }
 
@@ -59,136 +59,480 @@ void classify_client (packet)
 			    &global_scope, default_classification_rules, NULL);
 }
 
-int check_collection (packet, lease, collection)
-	struct packet *packet;
-	struct lease *lease;
+/* Number of classes a collection needs before it is indexed. */
+#define CLASS_INDEX_MIN		8
+
+/* Candidate lists up to this size are kept on the stack. */
+#define CLASS_INDEX_STACK	64
+
+/*
+ * Most classes match on a single option, or a fixed prefix of one:
+ *
+ *	match if option agent.circuit-id = "...";
+ *	match if substring (option vendor-class-identifier, 0, N) = "...";
+ *
+ * A collection's index groups such classes by the option and prefix
+ * length they look at, and sorts each group by the constant the class
+ * compares against.   A packet then only has to look the option up once
+ * per group to find the classes it can possibly match; all the other
+ * indexed classes are skipped.   Classes of any other form are always
+ * checked.   The classes that are checked are still fully evaluated, in
+ * collection order.
+ */
+struct class_index_entry {
+	struct data_string key;
+	unsigned position;
+};
+
+struct class_index_group {
+	struct option *option;
+	unsigned prefix;		/* 0 for the whole option. */
+	struct class_index_entry *entries;
+	unsigned count;
+};
+
+struct class_index {
+	unsigned generation;
+	unsigned count;
+	struct class **classes;		/* Not referenced. */
+	unsigned *others;		/* Always checked. */
+	unsigned other_count;
+	struct class_index_group *groups;
+	unsigned group_count;
+};
+
+/* Bumped whenever a collection or a class's match expression changes. */
+static unsigned class_generation = 1;
+
+void class_index_invalidate ()
+{
+	class_generation++;
+}
+
+void class_index_free (collection)
 	struct collection *collection;
 {
-	struct class *class, *nc;
+	struct class_index *index = collection -> index;
+	struct class_index_group *group;
+	unsigned i, j;
+
+	if (!index)
+		return;
+	for (i = 0; i < index -> group_count; i++) {
+		group = &index -> groups [i];
+		for (j = 0; j < group -> count; j++)
+			data_string_forget (&group -> entries [j].key, MDL);
+		if (group -> entries)
+			dfree (group -> entries, MDL);
+		option_dereference (&group -> option, MDL);
+	}
+	if (index -> groups)
+		dfree (index -> groups, MDL);
+	if (index -> others)
+		dfree (index -> others, MDL);
+	if (index -> classes)
+		dfree (index -> classes, MDL);
+	dfree (index, MDL);
+	collection -> index = NULL;
+}
+
+/* If expr is an option, or a prefix of one, compared with a constant,
+   return the option, the prefix length and the constant. */
+static int class_index_shape (expr, option, prefix, key)
+	struct expression *expr;
+	struct option **option;
+	unsigned *prefix;
+	struct data_string **key;
+{
+	struct expression *data, *value;
+
+	if (!expr || expr -> op != expr_equal)
+		return 0;
+	if (expr -> data.equal [1] -> op == expr_const_data) {
+		data = expr -> data.equal [0];
+		value = expr -> data.equal [1];
+	} else if (expr -> data.equal [0] -> op == expr_const_data) {
+		data = expr -> data.equal [1];
+		value = expr -> data.equal [0];
+	} else
+		return 0;
+	*key = &value -> data.const_data;
+
+	if (data -> op == expr_option) {
+		*option = data -> data.option;
+		*prefix = 0;
+		return 1;
+	}
+
+	if (data -> op != expr_substring ||
+	    data -> data.substring.expr -> op != expr_option ||
+	    data -> data.substring.offset -> op != expr_const_int ||
+	    data -> data.substring.offset -> data.const_int != 0 ||
+	    data -> data.substring.len -> op != expr_const_int)
+		return 0;
+	*option = data -> data.substring.expr -> data.option;
+
+	/* A substring that is longer than the constant only matches an
+	   option that is exactly the constant.   One that is shorter
+	   never matches, and an empty one always does; both are left to
+	   the evaluator. */
+	if (data -> data.substring.len -> data.const_int > (*key) -> len)
+		*prefix = 0;
+	else if (data -> data.substring.len -> data.const_int == (*key) -> len &&
+		 (*key) -> len != 0)
+		*prefix = (*key) -> len;
+	else
+		return 0;
+	return 1;
+}
+
+static int class_index_compare (const void *a, const void *b)
+{
+	const struct class_index_entry *ea = a, *eb = b;
+	unsigned len = ea -> key.len < eb -> key.len
+		? ea -> key.len : eb -> key.len;
+	int cmp;
+
+	cmp = memcmp (ea -> key.data, eb -> key.data, len);
+	if (cmp)
+		return cmp;
+	if (ea -> key.len != eb -> key.len)
+		return ea -> key.len < eb -> key.len ? -1 : 1;
+	return ea -> position < eb -> position ? -1 : 1;
+}
+
+static void class_index_build (collection)
+	struct collection *collection;
+{
+	struct class_index *index;
+	struct class_index_group *group;
+	struct class_index_entry *entry;
+	struct data_string *key;
+	struct option *option;
+	struct class *class;
+	unsigned count, prefix, i, j;
+
+	class_index_free (collection);
+
+	index = dmalloc (sizeof *index, MDL);
+	if (!index)
+		log_fatal ("No memory for class index.");
+	index -> generation = class_generation;
+	collection -> index = index;
+
+	count = 0;
+	for (class = collection -> classes; class; class = class -> nic)
+		count++;
+	if (count < CLASS_INDEX_MIN)
+		return;
+
+	index -> count = count;
+	index -> classes = dmalloc (count * sizeof *index -> classes, MDL);
+	index -> others = dmalloc (count * sizeof *index -> others, MDL);
+	/* There can't be more groups than classes. */
+	index -> groups = dmalloc (count * sizeof *index -> groups, MDL);
+	if (!index -> classes || !index -> others || !index -> groups)
+		log_fatal ("No memory for class index.");
+
+	for (i = 0, class = collection -> classes; class;
+	     i++, class = class -> nic) {
+		index -> classes [i] = class;
+		if (!class_index_shape (class -> expr,
+					&option, &prefix, &key)) {
+			index -> others [index -> other_count++] = i;
+			continue;
+		}
+
+		for (j = 0; j < index -> group_count; j++) {
+			group = &index -> groups [j];
+			if (group -> option -> universe == option -> universe &&
+			    group -> option -> code == option -> code &&
+			    group -> prefix == prefix)
+				break;
+		}
+		group = &index -> groups [j];
+		if (j == index -> group_count) {
+			index -> group_count++;
+			option_reference (&group -> option, option, MDL);
+			group -> prefix = prefix;
+			/* Room for this and every later class. */
+			group -> entries =
+				dmalloc ((count - i) * sizeof *group -> entries,
+					 MDL);
+			if (!group -> entries)
+				log_fatal ("No memory for class index.");
+		}
+		entry = &group -> entries [group -> count++];
+		data_string_copy (&entry -> key, key, MDL);
+		entry -> position = i;
+	}
+
+	for (j = 0; j < index -> group_count; j++) {
+		group = &index -> groups [j];
+		qsort (group -> entries, group -> count,
+		       sizeof *group -> entries, class_index_compare);
+	}
+}
+
+/* Add the positions of the classes in group whose key is key. */
+static unsigned class_index_lookup (group, key, positions)
+	struct class_index_group *group;
+	struct data_string *key;
+	unsigned *positions;
+{
+	struct class_index_entry *entry;
+	unsigned lo = 0, hi = group -> count, mid, n = 0;
+	int cmp;
+
+	/* Find the first entry that isn't less than key. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		entry = &group -> entries [mid];
+		cmp = memcmp (entry -> key.data, key -> data,
+			      entry -> key.len < key -> len
+			      ? entry -> key.len : key -> len);
+		if (cmp < 0 || (cmp == 0 && entry -> key.len < key -> len))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < group -> count; lo++) {
+		entry = &group -> entries [lo];
+		if (entry -> key.len != key -> len ||
+		    memcmp (entry -> key.data, key -> data, key -> len))
+			break;
+		positions [n++] = entry -> position;
+	}
+	return n;
+}
+
+static int class_position_compare (const void *a, const void *b)
+{
+	unsigned pa = *(const unsigned *)a, pb = *(const unsigned *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+static int check_class (struct packet *packet, struct lease *lease,
+			struct class *class)
+{
+	struct class *nc;
 	struct data_string data;
-	int matched = 0;
 	int status;
 	int ignorep;
 	int classfound;
 
-	for (class = collection -> classes; class; class = class -> nic) {
 #if defined (DEBUG_CLASS_MATCHING)
-		log_info ("checking against class %s...", class -> name);
+	log_info ("checking against class %s...", class -> name);
 #endif
-		memset (&data, 0, sizeof data);
-
-		/* If there is a "match if" expression, check it.   If
-		   we get a match, and there's no subclass expression,
-		   it's a match.   If we get a match and there is a subclass
-		   expression, then we check the submatch.   If it's not a
-		   match, that's final - we don't check the submatch. */
-
-		if (class -> expr) {
+	memset (&data, 0, sizeof data);
+
+	/* If there is a "match if" expression, check it.   If
+	   we get a match, and there's no subclass expression,
+	   it's a match.   If we get a match and there is a subclass
+	   expression, then we check the submatch.   If it's not a
+	   match, that's final - we don't check the submatch. */
+
+	if (class -> expr) {
+		match_program_compile(&class->expr_program,
+				      class->expr, 1);
+		if (class->expr_program)
+			status = match_program_boolean
+				(&ignorep, class->expr_program,
+				 packet, lease, packet->options,
+				 lease ? &lease->scope : &global_scope);
+		else
 			status = (evaluate_boolean_expression_result
 				  (&ignorep, packet, lease,
 				   (struct client_state *)0,
-				   packet -> options, (struct option_state *)0,
-				   lease ? &lease -> scope : &global_scope,
+				   packet -> options,
+				   (struct option_state *)0,
+				   lease ? &lease -> scope
+					 : &global_scope,
 				   class -> expr));
-			if (status) {
-				if (!class -> submatch) {
-					matched = 1;
+		if (status) {
+			if (!class -> submatch) {
 #if defined (DEBUG_CLASS_MATCHING)
-					log_info ("matches class.");
+				log_info ("matches class.");
 #endif
-					classify (packet, class);
-					continue;
-				}
-			} else
-				continue;
-		}
+				classify (packet, class);
+				return 1;
+			}
+		} else
+			return 0;
+	}
 
-		/* Check to see if the client matches an existing subclass.
-		   If it doesn't, and this is a spawning class, spawn a new
-		   subclass and put the client in it. */
-		if (class -> submatch) {
+	/* Check to see if the client matches an existing subclass.
+	   If it doesn't, and this is a spawning class, spawn a new
+	   subclass and put the client in it. */
+	if (class -> submatch) {
+		match_program_compile(&class->submatch_program,
+				      class->submatch, 0);
+		if (class->submatch_program)
+			status = match_program_data
+				(&data, class->submatch_program,
+				 packet, lease, packet->options,
+				 lease ? &lease->scope : &global_scope);
+		else
 			status = (evaluate_data_expression
 				  (&data, packet, lease,
 				   (struct client_state *)0,
-				   packet -> options, (struct option_state *)0,
-				   lease ? &lease -> scope : &global_scope,
+				   packet -> options,
+				   (struct option_state *)0,
+				   lease ? &lease -> scope
+					 : &global_scope,
 				   class -> submatch, MDL));
-			if (status && data.len) {
-				nc = (struct class *)0;
-				classfound = class_hash_lookup (&nc, class -> hash,
-					(const char *)data.data, data.len, MDL);
+		if (status && data.len) {
+			nc = (struct class *)0;
+			classfound = class_hash_lookup (&nc, class -> hash,
+				(const char *)data.data, data.len, MDL);
 
 #ifdef LDAP_CONFIGURATION
-				if (!classfound && find_subclass_in_ldap (class, &nc, &data))
-					classfound = 1;
+			if (!classfound && find_subclass_in_ldap (class, &nc, &data))
+				classfound = 1;
 #endif
 
-				if (classfound) {
+			if (classfound) {
 #if defined (DEBUG_CLASS_MATCHING)
-					log_info ("matches subclass %s.",
-					      print_hex_1 (data.len,
-							   data.data, 60));
+				log_info ("matches subclass %s.",
+				      print_hex_1 (data.len,
+						   data.data, 60));
 #endif
-					data_string_forget (&data, MDL);
-					classify (packet, nc);
-					matched = 1;
-					class_dereference (&nc, MDL);
-					continue;
-				}
-				if (!class -> spawning) {
-					data_string_forget (&data, MDL);
-					continue;
-				}
-				/* XXX Write out the spawned class? */
+				data_string_forget (&data, MDL);
+				classify (packet, nc);
+				class_dereference (&nc, MDL);
+				return 1;
+			}
+			if (!class -> spawning) {
+				data_string_forget (&data, MDL);
+				return 0;
+			}
+			/* XXX Write out the spawned class? */
 #if defined (DEBUG_CLASS_MATCHING)
-				log_info ("spawning subclass %s.",
-				      print_hex_1 (data.len, data.data, 60));
+			log_info ("spawning subclass %s.",
+			      print_hex_1 (data.len, data.data, 60));
 #endif
-				status = class_allocate (&nc, MDL);
-				group_reference (&nc -> group,
-						 class -> group, MDL);
-				class_reference (&nc -> superclass,
-						 class, MDL);
-				nc -> lease_limit = class -> lease_limit;
-				nc -> dirty = 1;
-				if (nc -> lease_limit) {
-					nc -> billed_leases =
-						(dmalloc
-						 (nc -> lease_limit *
-						  sizeof (struct lease *),
-						  MDL));
-					if (!nc -> billed_leases) {
-						log_error ("no memory for%s",
-							   " billing");
-						data_string_forget
-							(&nc -> hash_string,
-							 MDL);
-						class_dereference (&nc, MDL);
-						data_string_forget (&data,
-								    MDL);
-						continue;
-					}
-					memset (nc -> billed_leases, 0,
-						(nc -> lease_limit *
-						 sizeof (struct lease *)));
+			status = class_allocate (&nc, MDL);
+			group_reference (&nc -> group,
+					 class -> group, MDL);
+			class_reference (&nc -> superclass,
+					 class, MDL);
+			nc -> lease_limit = class -> lease_limit;
+			nc -> dirty = 1;
+			if (nc -> lease_limit) {
+				nc -> billed_leases =
+					(dmalloc
+					 (nc -> lease_limit *
+					  sizeof (struct lease *),
+					  MDL));
+				if (!nc -> billed_leases) {
+					log_error ("no memory for%s",
+						   " billing");
+					data_string_forget
+						(&nc -> hash_string,
+						 MDL);
+					class_dereference (&nc, MDL);
+					data_string_forget (&data,
+							    MDL);
+					return 0;
 				}
-				data_string_copy (&nc -> hash_string, &data,
-						  MDL);
-				if (!class -> hash)
-				    class_new_hash(&class->hash,
-						   SCLASS_HASH_SIZE, MDL);
-				class_hash_add (class -> hash,
-						(const char *)
-						nc -> hash_string.data,
-						nc -> hash_string.len,
-						nc, MDL);
-				classify (packet, nc);
-				class_dereference (&nc, MDL);
+				memset (nc -> billed_leases, 0,
+					(nc -> lease_limit *
+					 sizeof (struct lease *)));
 			}
+			data_string_copy (&nc -> hash_string, &data,
+					  MDL);
+			if (!class -> hash)
+			    class_new_hash(&class->hash,
+					   SCLASS_HASH_SIZE, MDL);
+			class_hash_add (class -> hash,
+					(const char *)
+					nc -> hash_string.data,
+					nc -> hash_string.len,
+					nc, MDL);
+			classify (packet, nc);
+			class_dereference (&nc, MDL);
+		}
+
+		data_string_forget (&data, MDL);
+	}
+	return 0;
+}
 
-			data_string_forget (&data, MDL);
+int check_collection (packet, lease, collection)
+	struct packet *packet;
+	struct lease *lease;
+	struct collection *collection;
+{
+	struct class_index *index;
+	struct class_index_group *group;
+	struct class *class;
+	struct data_string data;
+	unsigned stack [CLASS_INDEX_STACK];
+	unsigned *candidates;
+	unsigned i, n;
+	int matched = 0;
+
+	if (!collection -> index ||
+	    collection -> index -> generation != class_generation)
+		class_index_build (collection);
+	index = collection -> index;
+
+	if (!index -> group_count) {
+		for (class = collection -> classes; class;
+		     class = class -> nic) {
+			if (check_class (packet, lease, class))
+				matched = 1;
 		}
+		return matched;
+	}
+
+	if (index -> count <= CLASS_INDEX_STACK)
+		candidates = stack;
+	else {
+		candidates = dmalloc (index -> count * sizeof *candidates,
+				      MDL);
+		if (!candidates)
+			log_fatal ("No memory for class candidates.");
 	}
+
+	memcpy (candidates, index -> others,
+		index -> other_count * sizeof *candidates);
+	n = index -> other_count;
+	for (i = 0; i < index -> group_count; i++) {
+		group = &index -> groups [i];
+		memset (&data, 0, sizeof data);
+		if (!packet -> options ||
+		    !get_option (&data, group -> option -> universe,
+				 packet, lease, NULL, packet -> options,
+				 NULL, packet -> options,
+				 lease ? &lease -> scope : &global_scope,
+				 group -> option -> code, MDL))
+			continue;
+		if (group -> prefix) {
+			if (data.len >= group -> prefix) {
+				data.len = group -> prefix;
+				n += class_index_lookup (group, &data,
+							 &candidates [n]);
+			}
+		} else
+			n += class_index_lookup (group, &data,
+						 &candidates [n]);
+		data_string_forget (&data, MDL);
+	}
+	if (n > index -> other_count)
+		qsort (candidates, n, sizeof *candidates,
+		       class_position_compare);
+
+	for (i = 0; i < n; i++) {
+		if (check_class (packet, lease,
+				 index -> classes [candidates [i]]))
+			matched = 1;
+	}
+
+	if (candidates != stack)
+		dfree (candidates, MDL);
 	return matched;
 }
 
@@ -221,6 +565,7 @@ isc_result_t unlink_class(struct class **class) {
 				}
 				cp->nic = 0;
 				class_dereference(class, MDL);
+				class_index_invalidate();
 
 				return ISC_R_SUCCESS;
 			}
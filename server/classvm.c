@@ -0,0 +1,558 @@
+/* classvm.c
+
+   Compiled class match expressions. */
+
+/*
+ * Copyright (C) 2026 Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *   Internet Systems Consortium, Inc.
+ *   PO Box 360
+ *   Newmarket, NH 03857 USA
+ *   <info@isc.org>
+ *   https://www.isc.org/
+ *
+ */
+
+#include "dhcpd.h"
+
+/*
+ * Every class's match and submatch expressions are evaluated against
+ * every packet, so they are compiled into a flat program for a small
+ * stack machine instead of being walked as a tree each time.   The
+ * operators that show up in match expressions - and, or, not, equality,
+ * option, exists, substring, suffix and constants - are compiled
+ * directly; substrings and suffixes of constants, and comparisons of
+ * two constants, are folded at compile time.   Anything else is
+ * compiled as a call to the tree evaluator for that subexpression, so
+ * a program always gives the same result as evaluating its tree.
+ */
+
+/* Deepest stack a program may use; deeper subexpressions are left to
+   the tree evaluator. */
+#define MATCH_STACK_DEPTH	16
+
+enum match_op {
+	MOP_DATA,		/* Push constant data. */
+	MOP_BOOL,		/* Push constant boolean a. */
+	MOP_OPTION,		/* Push an option from the packet. */
+	MOP_EXISTS,		/* Push whether the packet has an option. */
+	MOP_SUBSTRING,		/* Top = substring (top, a, b). */
+	MOP_SUFFIX,		/* Top = suffix (top, a). */
+	MOP_EQUAL,		/* Pop two, push whether they're equal. */
+	MOP_NOT_EQUAL,		/* Pop two, push whether they differ. */
+	MOP_NOT,		/* Top = not top. */
+	MOP_AND,		/* If top isn't true, make it NULL and jump. */
+	MOP_AND_JOIN,		/* Pop right, top = top and right. */
+	MOP_OR,			/* If top is true, jump. */
+	MOP_OR_JOIN,		/* Pop right, top = top or right. */
+	MOP_TREE_BOOL,		/* Push a boolean expression's value. */
+	MOP_TREE_DATA		/* Push a data expression's value. */
+};
+
+struct match_insn {
+	enum match_op op;
+	unsigned long a, b;
+	struct option *option;
+	struct expression *expr;
+	struct data_string data;
+};
+
+struct match_program {
+	struct expression *source;
+	unsigned len, max;
+	struct match_insn *code;
+};
+
+/* A stack slot.   status is zero for a NULL value. */
+struct match_value {
+	int status;
+	int value;
+	struct data_string data;
+};
+
+static int match_compile_boolean(struct match_program *,
+				 struct expression *, int);
+static int match_compile_data(struct match_program *,
+			      struct expression *, int);
+
+static struct match_insn *
+match_emit(struct match_program *prog, enum match_op op)
+{
+	struct match_insn *code;
+
+	if (prog->len == prog->max) {
+		code = dmalloc((prog->max + 16) * sizeof(*code), MDL);
+		if (code == NULL)
+			return (NULL);
+		if (prog->code != NULL) {
+			memcpy(code, prog->code, prog->len * sizeof(*code));
+			dfree(prog->code, MDL);
+		}
+		prog->code = code;
+		prog->max += 16;
+	}
+	code = &prog->code[prog->len++];
+	memset(code, 0, sizeof(*code));
+	code->op = op;
+	return (code);
+}
+
+/* Compile a call to the tree evaluator. */
+static int
+match_compile_tree(struct match_program *prog, struct expression *expr,
+		   enum match_op op)
+{
+	struct match_insn *insn;
+
+	insn = match_emit(prog, op);
+	if (insn == NULL)
+		return (0);
+	insn->expr = expr;
+	return (1);
+}
+
+/* Is this an expression that evaluate_expression() would evaluate as
+   a plain data expression? */
+static int
+match_is_data(struct expression *expr)
+{
+	return (expr->op != expr_variable_reference &&
+		expr->op != expr_funcall &&
+		!is_boolean_expression(expr) &&
+		!is_numeric_expression(expr) &&
+		is_data_expression(expr));
+}
+
+static int
+match_compile_data(struct match_program *prog, struct expression *expr,
+		   int depth)
+{
+	struct match_insn *insn, *last;
+	unsigned long offset, len;
+
+	if (depth >= MATCH_STACK_DEPTH)
+		return (0);
+
+	switch (expr->op) {
+	      case expr_const_data:
+		insn = match_emit(prog, MOP_DATA);
+		if (insn == NULL)
+			return (0);
+		data_string_copy(&insn->data, &expr->data.const_data, MDL);
+		return (1);
+
+	      case expr_option:
+		insn = match_emit(prog, MOP_OPTION);
+		if (insn == NULL)
+			return (0);
+		insn->option = expr->data.option;
+		return (1);
+
+	      case expr_substring:
+		if (expr->data.substring.offset->op != expr_const_int ||
+		    expr->data.substring.len->op != expr_const_int)
+			break;
+		offset = expr->data.substring.offset->data.const_int;
+		len = expr->data.substring.len->data.const_int;
+		if (!match_compile_data(prog, expr->data.substring.expr,
+					depth))
+			return (0);
+
+		/* Take the substring of a constant now. */
+		last = &prog->code[prog->len - 1];
+		if (last->op == MOP_DATA) {
+			if (last->data.len > offset) {
+				last->data.data += offset;
+				last->data.len -= offset;
+				if (last->data.len > len) {
+					last->data.len = len;
+					last->data.terminated = 0;
+				}
+			} else
+				data_string_forget(&last->data, MDL);
+			return (1);
+		}
+
+		insn = match_emit(prog, MOP_SUBSTRING);
+		if (insn == NULL)
+			return (0);
+		insn->a = offset;
+		insn->b = len;
+		return (1);
+
+	      case expr_suffix:
+		if (expr->data.suffix.len->op != expr_const_int)
+			break;
+		len = expr->data.suffix.len->data.const_int;
+		if (!match_compile_data(prog, expr->data.suffix.expr, depth))
+			return (0);
+
+		last = &prog->code[prog->len - 1];
+		if (last->op == MOP_DATA) {
+			if (last->data.len > len) {
+				last->data.data += last->data.len - len;
+				last->data.len = len;
+			}
+			return (1);
+		}
+
+		insn = match_emit(prog, MOP_SUFFIX);
+		if (insn == NULL)
+			return (0);
+		insn->a = len;
+		return (1);
+
+	      default:
+		break;
+	}
+
+	return (match_compile_tree(prog, expr, MOP_TREE_DATA));
+}
+
+static int
+match_compile_boolean(struct match_program *prog, struct expression *expr,
+		      int depth)
+{
+	struct match_insn *insn, *left, *right;
+	unsigned jump;
+	int equal;
+
+	if (depth >= MATCH_STACK_DEPTH)
+		return (0);
+
+	switch (expr->op) {
+	      case expr_and:
+	      case expr_or:
+		if (depth + 1 >= MATCH_STACK_DEPTH)
+			break;
+		if (!match_compile_boolean(prog, expr->data.and[0], depth))
+			return (0);
+		jump = prog->len;
+		if (match_emit(prog, expr->op == expr_and
+				     ? MOP_AND : MOP_OR) == NULL)
+			return (0);
+		if (!match_compile_boolean(prog, expr->data.and[1],
+					   depth + 1))
+			return (0);
+		if (match_emit(prog, expr->op == expr_and
+				     ? MOP_AND_JOIN : MOP_OR_JOIN) == NULL)
+			return (0);
+		prog->code[jump].a = prog->len;
+		return (1);
+
+	      case expr_not:
+		if (!match_compile_boolean(prog, expr->data.not, depth))
+			return (0);
+		insn = &prog->code[prog->len - 1];
+		if (insn->op == MOP_BOOL) {
+			insn->a = !insn->a;
+			return (1);
+		}
+		return (match_emit(prog, MOP_NOT) != NULL);
+
+	      case expr_equal:
+	      case expr_not_equal:
+		if (depth + 1 >= MATCH_STACK_DEPTH ||
+		    !match_is_data(expr->data.equal[0]) ||
+		    !match_is_data(expr->data.equal[1]))
+			break;
+		if (!match_compile_data(prog, expr->data.equal[0], depth) ||
+		    !match_compile_data(prog, expr->data.equal[1], depth + 1))
+			return (0);
+
+		/* Compare two constants now. */
+		left = &prog->code[prog->len - 2];
+		right = &prog->code[prog->len - 1];
+		if (left->op == MOP_DATA && right->op == MOP_DATA) {
+			equal = (left->data.len == right->data.len &&
+				 !memcmp(left->data.data, right->data.data,
+					 left->data.len));
+			data_string_forget(&left->data, MDL);
+			data_string_forget(&right->data, MDL);
+			prog->len--;
+			left->op = MOP_BOOL;
+			left->a = (expr->op == expr_equal) ? equal : !equal;
+			return (1);
+		}
+
+		return (match_emit(prog, expr->op == expr_equal
+					 ? MOP_EQUAL : MOP_NOT_EQUAL) != NULL);
+
+	      case expr_exists:
+		insn = match_emit(prog, MOP_EXISTS);
+		if (insn == NULL)
+			return (0);
+		insn->option = expr->data.exists;
+		return (1);
+
+	      default:
+		break;
+	}
+
+	return (match_compile_tree(prog, expr, MOP_TREE_BOOL));
+}
+
+/* Free a compiled program. */
+void
+match_program_free(struct match_program **progp)
+{
+	struct match_program *prog = *progp;
+	unsigned i;
+
+	if (prog == NULL)
+		return;
+	for (i = 0; i < prog->len; i++)
+		data_string_forget(&prog->code[i].data, MDL);
+	if (prog->code != NULL)
+		dfree(prog->code, MDL);
+	if (prog->source != NULL)
+		expression_dereference(&prog->source, MDL);
+	dfree(prog, MDL);
+	*progp = NULL;
+}
+
+/*
+ * Compile expr, a boolean expression if boolean is set and a data
+ * expression otherwise.   A program that is already compiled from expr
+ * is kept.   If expr can't be compiled, *progp is left NULL and the
+ * caller evaluates the tree.
+ */
+void
+match_program_compile(struct match_program **progp, struct expression *expr,
+		      int boolean)
+{
+	struct match_program *prog;
+	int status;
+
+	if (*progp != NULL) {
+		if ((*progp)->source == expr)
+			return;
+		match_program_free(progp);
+	}
+	if (expr == NULL)
+		return;
+
+	prog = dmalloc(sizeof(*prog), MDL);
+	if (prog == NULL)
+		return;
+	expression_reference(&prog->source, expr, MDL);
+
+	if (boolean)
+		status = match_compile_boolean(prog, expr, 0);
+	else
+		status = match_compile_data(prog, expr, 0);
+	if (!status) {
+		match_program_free(&prog);
+		return;
+	}
+	*progp = prog;
+}
+
+/*
+ * Run a program.   Returns the status the tree evaluator would have
+ * returned; the value is left in *result.
+ */
+static int
+match_program_run(struct match_program *prog, struct match_value *result,
+		  struct packet *packet, struct lease *lease,
+		  struct option_state *in_options,
+		  struct binding_scope **scope)
+{
+	struct match_value stack[MATCH_STACK_DEPTH], *top = NULL, *right;
+	struct match_insn *insn;
+	struct data_string tmp;
+	unsigned pc;
+	int sp = -1;
+	int equal;
+
+	for (pc = 0; pc < prog->len; pc++) {
+		insn = &prog->code[pc];
+		switch (insn->op) {
+		      case MOP_DATA:
+			top = &stack[++sp];
+			memset(top, 0, sizeof(*top));
+			data_string_copy(&top->data, &insn->data, MDL);
+			top->status = 1;
+			break;
+
+		      case MOP_BOOL:
+			top = &stack[++sp];
+			memset(top, 0, sizeof(*top));
+			top->status = 1;
+			top->value = insn->a;
+			break;
+
+		      case MOP_OPTION:
+			top = &stack[++sp];
+			memset(top, 0, sizeof(*top));
+			if (in_options)
+				top->status = get_option(&top->data,
+						insn->option->universe,
+						packet, lease, NULL,
+						in_options, NULL, in_options,
+						scope, insn->option->code,
+						MDL);
+			break;
+
+		      case MOP_EXISTS:
+			top = &stack[++sp];
+			memset(top, 0, sizeof(*top));
+			top->status = 1;
+			memset(&tmp, 0, sizeof(tmp));
+			if (in_options &&
+			    get_option(&tmp, insn->option->universe,
+				       packet, lease, NULL,
+				       in_options, NULL, in_options,
+				       scope, insn->option->code, MDL)) {
+				top->value = 1;
+				data_string_forget(&tmp, MDL);
+			}
+			break;
+
+		      case MOP_SUBSTRING:
+			if (!top->status)
+				break;
+			if (top->data.len > insn->a) {
+				top->data.data += insn->a;
+				top->data.len -= insn->a;
+				if (top->data.len > insn->b) {
+					top->data.len = insn->b;
+					top->data.terminated = 0;
+				}
+			} else
+				data_string_forget(&top->data, MDL);
+			break;
+
+		      case MOP_SUFFIX:
+			if (top->status && top->data.len > insn->a) {
+				top->data.data += top->data.len - insn->a;
+				top->data.len = insn->a;
+			}
+			break;
+
+		      case MOP_EQUAL:
+		      case MOP_NOT_EQUAL:
+			right = top;
+			top = &stack[--sp];
+			if (top->status && right->status)
+				equal = (top->data.len == right->data.len &&
+					 !memcmp(top->data.data,
+						 right->data.data,
+						 top->data.len));
+			else
+				equal = (!top->status && !right->status);
+			data_string_forget(&top->data, MDL);
+			data_string_forget(&right->data, MDL);
+			top->status = 1;
+			top->value = (insn->op == MOP_EQUAL) ? equal : !equal;
+			break;
+
+		      case MOP_NOT:
+			top->value = top->status ? !top->value : 0;
+			break;
+
+		      case MOP_AND:
+			if (!top->status || !top->value) {
+				top->status = 0;
+				top->value = 0;
+				pc = insn->a - 1;
+			}
+			break;
+
+		      case MOP_AND_JOIN:
+			right = top;
+			top = &stack[--sp];
+			top->status = right->status;
+			top->value = right->status && right->value;
+			break;
+
+		      case MOP_OR:
+			if (top->status && top->value) {
+				top->value = 1;
+				pc = insn->a - 1;
+			}
+			break;
+
+		      case MOP_OR_JOIN:
+			right = top;
+			top = &stack[--sp];
+			top->value = top->value || right->value;
+			top->status = top->status || right->status;
+			break;
+
+		      case MOP_TREE_BOOL:
+			top = &stack[++sp];
+			memset(top, 0, sizeof(*top));
+			top->status = evaluate_boolean_expression
+				(&top->value, packet, lease, NULL,
+				 in_options, NULL, scope, insn->expr);
+			break;
+
+		      case MOP_TREE_DATA:
+			top = &stack[++sp];
+			memset(top, 0, sizeof(*top));
+			top->status = evaluate_data_expression
+				(&top->data, packet, lease, NULL,
+				 in_options, NULL, scope, insn->expr, MDL);
+			break;
+		}
+
+		/* Only a data value that is there is kept. */
+		if (sp >= 0 && !top->status && top->data.buffer)
+			data_string_forget(&top->data, MDL);
+	}
+
+	*result = stack[0];
+	return (result->status);
+}
+
+/* Evaluate a compiled boolean expression the way
+   evaluate_boolean_expression_result() evaluates its tree. */
+int
+match_program_boolean(int *ignorep, struct match_program *prog,
+		      struct packet *packet, struct lease *lease,
+		      struct option_state *in_options,
+		      struct binding_scope **scope)
+{
+	struct match_value result;
+
+	if (!match_program_run(prog, &result, packet, lease,
+			       in_options, scope))
+		return (0);
+
+	if (result.value == 2) {
+		*ignorep = 1;
+		return (0);
+	}
+	*ignorep = 0;
+	return (result.value);
+}
+
+/* Evaluate a compiled data expression the way
+   evaluate_data_expression() evaluates its tree. */
+int
+match_program_data(struct data_string *result, struct match_program *prog,
+		   struct packet *packet, struct lease *lease,
+		   struct option_state *in_options,
+		   struct binding_scope **scope)
+{
+	struct match_value value;
+
+	if (!match_program_run(prog, &value, packet, lease,
+			       in_options, scope))
+		return (0);
+	*result = value.data;
+	return (1);
+}
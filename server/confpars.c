@@ -177,7 +177,10 @@ isc_result_t read_conf_file (const char *filename, struct group *group,
 	if (status != ISC_R_SUCCESS || cfile == NULL)
 		return status;
 
-	if (leasep)
+	if (leasep && lease_journal_check (cfile -> inbuf, cfile -> buflen))
+		status = lease_journal_read (cfile -> inbuf, cfile -> buflen,
+					     filename);
+	else if (leasep)
 		status = lease_file_subparse (cfile);
 	else
 		status = conf_file_subparse (cfile, group, group_type);
@@ -211,7 +214,11 @@ void trace_conf_input (trace_type_t *ttype, unsigned len, char *data)
 
 	status = new_parse(&cfile, -1, fbuf, flen, data, 0);
 	if (status == ISC_R_SUCCESS || cfile != NULL) {
-		if (ttype == trace_readleases_type)
+		if (ttype == trace_readleases_type &&
+		    lease_journal_check (cfile -> inbuf, cfile -> buflen))
+			lease_journal_read (cfile -> inbuf, cfile -> buflen,
+					    data);
+		else if (ttype == trace_readleases_type)
 			lease_file_subparse (cfile);
 		else
 			conf_file_subparse (cfile, root_group, ROOT_GROUP);
@@ -2584,6 +2591,9 @@ int parse_class_declaration (cp, cfile, group, type)
 		}
 	}
 
+	/* The class may be new, or its match expression may have changed. */
+	class_index_invalidate ();
+
 	if (cp)				/* should always be 0??? */
 		status = class_reference (cp, class, MDL);
 	class_dereference (&class, MDL);
@@ -2719,7 +2729,10 @@ common_subnet_parsing(struct parse *cfile,
 					      declaration);
 	} while (1);
 
-	/* Add the subnet to the list of subnets in this shared net. */
+	/* Add the subnet to the list of subnets in this shared net.  The
+	   first of two identical subnets stays ahead on the sibling list,
+	   so it also keeps its place in the index. */
+	subnet_tree_add(&share->subnet_tree, subnet, 0);
 	if (share->subnets == NULL) {
 		subnet_reference(&share->subnets, subnet, MDL);
 	} else {
@@ -4009,6 +4022,8 @@ add_ipv6_pool_to_subnet(struct subnet *subnet, u_int16_t type,
 	 */
 	ipv6_pool_reference(&pond->ipv6_pools[num_pools], pool, MDL);
 	pond->ipv6_pools[num_pools+1] = NULL;
+	if (pool->pool_type == D6O_IA_NA)
+		pond->num_na_pools++;
 
 	/* Update the number of elements in the pond.  Conveniently
 	 * we have the total size of the block in bits and the amount
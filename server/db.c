@@ -29,11 +29,30 @@
 #include "dhcpd.h"
 #include <ctype.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#if defined (ASYNC_FSYNC)
+#include <pthread.h>
+#endif
 
 #define LEASE_REWRITE_PERIOD 3600
 
 static isc_result_t write_binding_scope(FILE *db_file, struct binding *bnd,
 					char *prepend);
+static void commit_leases_rewrite(void);
+static int write_lease_text(struct lease *);
+static int write_lease_binary(struct lease *);
+static int write_host_text(struct host_decl *);
+static int write_group_text(struct group_object *);
+static isc_result_t write_named_billing_class_text(const void *, unsigned,
+						   void *);
+static int lease_journal_text_begin(void);
+static int lease_journal_text_end(int);
+static int install_lease_file(const char *);
+static int lease_file_compact(void);
+static void lease_file_compact_check(void *);
+static int lease_file_compact_finish(void);
+static void lease_file_compact_cancel(void);
 
 FILE *db_file;
 
@@ -42,6 +61,89 @@ static int count = 0;
 TIME write_time;
 int lease_file_is_corrupt = 0;
 
+/* Background lease file rewrite.   compaction_pid is the child's pid
+   while one is running, and -1 in the child itself. */
+static pid_t compaction_pid;
+static char compaction_fname[512];	/* File the child is writing. */
+static off_t compaction_offset;		/* Size of db_file at the fork. */
+
+/*
+ * Binary lease file.   With binary-lease-file enabled, the lease file is
+ * a journal of length-prefixed, checksummed records instead of text:
+ *
+ *	file   :== LEASE_JOURNAL_MAGIC record*
+ *	record :== length[4] type[2] reserved[2] crc32[4] reserved[4]
+ *		   payload[length] padding to a multiple of 8 bytes
+ *
+ * All numbers are in network byte order.   The checksum covers the
+ * first 8 bytes of the header as well as the payload.   IPv4 leases
+ * without binding scopes, on statements, agent options or a billing
+ * class are written as LJ_LEASE records, which are loaded without
+ * going through the parser.   Everything else is written in the usual
+ * text format and wrapped in an LJ_TEXT record, which is parsed on
+ * load.
+ */
+#define LEASE_JOURNAL_MAGIC	"\211DHCPLJ\n"
+#define LEASE_JOURNAL_MAGIC_LEN	8
+#define LJ_HEADER_LEN		16
+#define LJ_PAD(len)		(((len) + 7) & ~7U)
+
+#define LJ_TEXT			1	/* Lease file text. */
+#define LJ_LEASE		2	/* IPv4 lease. */
+
+/* LJ_LEASE payload: fixed part, then hardware address, uid and
+   client hostname. */
+#define LJ_LEASE_ADDR		0	/* 4 */
+#define LJ_LEASE_STARTS		4	/* 8 each */
+#define LJ_LEASE_ENDS		12
+#define LJ_LEASE_TSTP		20
+#define LJ_LEASE_TSFP		28
+#define LJ_LEASE_ATSFP		36
+#define LJ_LEASE_CLTT		44
+#define LJ_LEASE_STATE		52	/* 1 */
+#define LJ_LEASE_NEXT_STATE	53	/* 1 */
+#define LJ_LEASE_REWIND_STATE	54	/* 1 */
+#define LJ_LEASE_FLAGS		55	/* 1 */
+#define LJ_LEASE_UID_LEN	56	/* 2 */
+#define LJ_LEASE_HOSTNAME_LEN	58	/* 2 */
+#define LJ_LEASE_HLEN		60	/* 1, then 3 reserved */
+#define LJ_LEASE_FIXED_LEN	64
+
+static int db_file_binary;		/* db_file is a binary journal. */
+static FILE *journal_text_file;		/* Stream text records are built in. */
+#if defined (HAVE_OPEN_MEMSTREAM)
+static char *journal_text_buf;		/* journal_text_file's buffer. */
+static size_t journal_text_size;
+#endif
+static FILE *journal_saved_file;	/* db_file while writing to it. */
+static int journal_text_depth;
+
+#if defined (ASYNC_FSYNC)
+/*
+ * The lease file can be fsync()ed on a separate thread, so that the
+ * dispatch loop doesn't block on the disk while delayed ACKs are being
+ * committed.  The dispatch thread hands the file descriptor to the
+ * sync thread, and the sync thread writes a byte down a pipe when it
+ * is done; the pipe is registered with OMAPI so that the completion
+ * callback runs on the dispatch thread like any other I/O handler.
+ * Only one sync is outstanding at a time.
+ */
+static pthread_t sync_thread;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static int sync_fd = -1;		/* Descriptor to sync; guarded by
+					   sync_lock, -1 when idle. */
+static int sync_errno;			/* Result of the last fsync(). */
+static int sync_pipe[2] = { -1, -1 };
+static int sync_state;			/* 0: not started, 1: running,
+					   -1: unavailable. */
+static void (*sync_done)(void);		/* Set while a sync is pending. */
+static omapi_object_type_t *lease_sync_type;
+static omapi_object_t *lease_sync_object;
+
+static void lease_sync_wait(void);
+#endif /* ASYNC_FSYNC */
+
 /* Write a single binding scope value in parsable format.
  */
 
@@ -97,6 +199,30 @@ write_binding_scope(FILE *db_file, struct binding *bnd, char *prepend) {
 
 int write_lease (lease)
 	struct lease *lease;
+{
+	int rv;
+
+	/* If the lease file is corrupt, don't try to write any more leases
+	   until we've written a good lease file. */
+	if (lease_file_is_corrupt)
+		if (!new_lease_file (0))
+			return 0;
+
+	if (db_file_binary &&
+	    !(lease->billing_class && lease->ends > cur_time) &&
+	    !(lease->scope && lease->scope->bindings) &&
+	    !lease->agent_options &&
+	    !lease->on_star.on_expiry && !lease->on_star.on_release)
+		return write_lease_binary(lease);
+
+	if (!lease_journal_text_begin())
+		return 0;
+	rv = write_lease_text(lease);
+	return lease_journal_text_end(rv);
+}
+
+static int write_lease_text (lease)
+	struct lease *lease;
 {
 	int errors = 0;
 	struct binding *b;
@@ -297,6 +423,21 @@ int write_lease (lease)
 
 int write_host (host)
 	struct host_decl *host;
+{
+	int rv;
+
+	if (lease_file_is_corrupt)
+		if (!new_lease_file (0))
+			return 0;
+
+	if (!lease_journal_text_begin())
+		return 0;
+	rv = write_host_text(host);
+	return lease_journal_text_end(rv);
+}
+
+static int write_host_text (host)
+	struct host_decl *host;
 {
 	int errors = 0;
 	int i;
@@ -448,6 +589,21 @@ int write_host (host)
 
 int write_group (group)
 	struct group_object *group;
+{
+	int rv;
+
+	if (lease_file_is_corrupt)
+		if (!new_lease_file (0))
+			return 0;
+
+	if (!lease_journal_text_begin())
+		return 0;
+	rv = write_group_text(group);
+	return lease_journal_text_end(rv);
+}
+
+static int write_group_text (group)
+	struct group_object *group;
 {
 	int errors = 0;
 
@@ -514,8 +670,24 @@ int write_group (group)
 /*
  * Write an IA and the options it has.
  */
+static int write_ia_text(const struct ia_xx *ia);
+
 int
 write_ia(const struct ia_xx *ia) {
+	int rv;
+
+	if (lease_file_is_corrupt)
+		if (!new_lease_file(0))
+			return 0;
+
+	if (!lease_journal_text_begin())
+		return 0;
+	rv = write_ia_text(ia);
+	return lease_journal_text_end(rv);
+}
+
+static int
+write_ia_text(const struct ia_xx *ia) {
 	struct iasubopt *iasubopt;
 	struct binding *bnd;
 	int i;
@@ -705,8 +877,24 @@ error_exit:
 /*
  * Put a copy of the server DUID in the leases file.
  */
+static int write_server_duid_text(void);
+
 int
 write_server_duid(void) {
+	int rv;
+
+	if (lease_file_is_corrupt)
+		if (!new_lease_file(0))
+			return 0;
+
+	if (!lease_journal_text_begin())
+		return 0;
+	rv = write_server_duid_text();
+	return lease_journal_text_end(rv);
+}
+
+static int
+write_server_duid_text(void) {
 	struct data_string server_duid;
 	char *s;
 	int fprintf_ret;
@@ -763,7 +951,23 @@ error_exit:
 #endif /* DHCPv6 */
 
 #if defined (FAILOVER_PROTOCOL)
+static int write_failover_state_text (dhcp_failover_state_t *);
+
 int write_failover_state (dhcp_failover_state_t *state)
+{
+	int rv;
+
+	if (lease_file_is_corrupt)
+		if (!new_lease_file (0))
+			return 0;
+
+	if (!lease_journal_text_begin())
+		return 0;
+	rv = write_failover_state_text(state);
+	return lease_journal_text_end(rv);
+}
+
+static int write_failover_state_text (dhcp_failover_state_t *state)
 {
 	int errors = 0;
 	const char *tval;
@@ -877,6 +1081,19 @@ static int print_hash_string(FILE *fp, struct class *class)
 
 isc_result_t
 write_named_billing_class(const void *key, unsigned len, void *object)
+{
+	isc_result_t status;
+
+	if (!lease_journal_text_begin())
+		return ISC_R_IOERROR;
+	status = write_named_billing_class_text(key, len, object);
+	if (!lease_journal_text_end(status == ISC_R_SUCCESS))
+		return ISC_R_IOERROR;
+	return status;
+}
+
+static isc_result_t
+write_named_billing_class_text(const void *key, unsigned len, void *object)
 {
 	const unsigned char *name = key;
 	struct class *class = object;
@@ -1020,6 +1237,469 @@ int write_billing_class (class)
 	return !errors;
 }
 
+/* Update a CRC-32 (IEEE 802.3) with len more bytes of a binary lease
+   file record.   Start with a crc of 0. */
+static u_int32_t
+lease_journal_crc(u_int32_t crc, const unsigned char *data, unsigned len)
+{
+	static u_int32_t table[256];
+	u_int32_t c;
+	unsigned i, j;
+
+	if (table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	crc ^= 0xffffffff;
+	for (i = 0; i < len; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+/* The checksum of a record covers its length and type as well as the
+   payload, so that a damaged length is caught before it is used. */
+static u_int32_t
+lease_journal_record_crc(const unsigned char *header,
+			 const unsigned char *data, unsigned len)
+{
+	return lease_journal_crc(lease_journal_crc(0, header, 8), data, len);
+}
+
+/* Append a record to the binary lease file. */
+static int
+lease_journal_put(int type, const unsigned char *data, unsigned len)
+{
+	static const unsigned char zeroes[8];
+	unsigned char header[LJ_HEADER_LEN];
+
+	memset(header, 0, sizeof(header));
+	putULong(header, len);
+	putUShort(header + 4, type);
+	putULong(header + 8, lease_journal_record_crc(header, data, len));
+
+	if ((fwrite(header, sizeof(header), 1, db_file) != 1) ||
+	    ((len > 0) && (fwrite(data, len, 1, db_file) != 1)) ||
+	    ((LJ_PAD(len) > len) &&
+	     (fwrite(zeroes, LJ_PAD(len) - len, 1, db_file) != 1)))
+		return 0;
+	return 1;
+}
+
+/* Start writing text to the binary lease file: the text is collected
+   in memory, and becomes one LJ_TEXT record when the outermost
+   lease_journal_text_end() is called.   Does nothing if the lease file
+   is in text format. */
+static int
+lease_journal_text_begin(void)
+{
+	if (!db_file_binary || journal_text_depth++ > 0)
+		return 1;
+
+	if (journal_text_file == NULL) {
+#if defined (HAVE_OPEN_MEMSTREAM)
+		journal_text_file = open_memstream(&journal_text_buf,
+						   &journal_text_size);
+#else
+		journal_text_file = tmpfile();
+#endif
+		if (journal_text_file == NULL) {
+			log_error("Can't create lease file text buffer: %m");
+			journal_text_depth = 0;
+			lease_file_is_corrupt = 1;
+			return 0;
+		}
+	}
+	rewind(journal_text_file);
+
+	journal_saved_file = db_file;
+	db_file = journal_text_file;
+	return 1;
+}
+
+/* Finish a lease_journal_text_begin(); ok is the result of writing the
+   text, which is returned unless the record can't be written. */
+static int
+lease_journal_text_end(int ok)
+{
+	unsigned char *buf;
+	long len;
+
+	if (!db_file_binary || journal_text_depth == 0 ||
+	    --journal_text_depth > 0)
+		return ok;
+
+	db_file = journal_saved_file;
+	journal_saved_file = NULL;
+
+	len = ftell(journal_text_file);
+	if (!ok || len <= 0)
+		return ok;
+
+#if defined (HAVE_OPEN_MEMSTREAM)
+	/* The stream is reused for the next record, so its buffer only
+	   grows to the size of the largest record. */
+	if (fflush(journal_text_file) != 0) {
+		log_error("Can't flush lease file text buffer: %m");
+		lease_file_is_corrupt = 1;
+		return 0;
+	}
+	buf = (unsigned char *)journal_text_buf;
+	if (!lease_journal_put(LJ_TEXT, buf, len)) {
+		log_info("unable to write lease file record");
+		lease_file_is_corrupt = 1;
+		ok = 0;
+	}
+#else
+	buf = dmalloc(len, MDL);
+	if (buf == NULL)
+		log_fatal("No memory for lease file record.");
+	rewind(journal_text_file);
+	if ((fread(buf, len, 1, journal_text_file) != 1) ||
+	    !lease_journal_put(LJ_TEXT, buf, len)) {
+		log_info("unable to write lease file record");
+		lease_file_is_corrupt = 1;
+		ok = 0;
+	}
+	dfree(buf, MDL);
+#endif
+	return ok;
+}
+
+static void
+lease_journal_put_time(unsigned char *p, TIME t)
+{
+	isc_uint64_t v = (isc_uint64_t)t;
+
+	putULong(p, (u_int32_t)(v >> 32));
+	putULong(p + 4, (u_int32_t)v);
+}
+
+static TIME
+lease_journal_get_time(const unsigned char *p)
+{
+	isc_uint64_t v;
+
+	v = ((isc_uint64_t)getULong(p) << 32) | getULong(p + 4);
+	return (TIME)v;
+}
+
+/* Write an IPv4 lease as an LJ_LEASE record. */
+static int
+write_lease_binary(struct lease *lease)
+{
+	unsigned char sbuf[256], *buf, *p;
+	unsigned hlen, hostname_len, len;
+	int rv;
+
+	if (counting)
+		++count;
+
+	hlen = lease->hardware_addr.hlen;
+	hostname_len = lease->client_hostname ?
+		       strlen(lease->client_hostname) : 0;
+	if (hostname_len > 0xffff)
+		hostname_len = 0;
+	len = LJ_LEASE_FIXED_LEN + hlen + lease->uid_len + hostname_len;
+
+	buf = sbuf;
+	if (len > sizeof(sbuf)) {
+		buf = dmalloc(len, MDL);
+		if (buf == NULL)
+			log_fatal("No memory for lease file record.");
+	}
+	memset(buf, 0, LJ_LEASE_FIXED_LEN);
+
+	memcpy(buf + LJ_LEASE_ADDR, lease->ip_addr.iabuf, 4);
+	lease_journal_put_time(buf + LJ_LEASE_STARTS, lease->starts);
+	lease_journal_put_time(buf + LJ_LEASE_ENDS, lease->ends);
+	lease_journal_put_time(buf + LJ_LEASE_TSTP, lease->tstp);
+	lease_journal_put_time(buf + LJ_LEASE_TSFP, lease->tsfp);
+	lease_journal_put_time(buf + LJ_LEASE_ATSFP, lease->atsfp);
+	lease_journal_put_time(buf + LJ_LEASE_CLTT, lease->cltt);
+	buf[LJ_LEASE_STATE] = lease->binding_state;
+	buf[LJ_LEASE_NEXT_STATE] = lease->next_binding_state;
+	buf[LJ_LEASE_REWIND_STATE] = lease->rewind_binding_state;
+	buf[LJ_LEASE_FLAGS] = lease->flags & (RESERVED_LEASE | BOOTP_LEASE);
+	putUShort(buf + LJ_LEASE_UID_LEN, lease->uid_len);
+	putUShort(buf + LJ_LEASE_HOSTNAME_LEN, hostname_len);
+	buf[LJ_LEASE_HLEN] = hlen;
+
+	p = buf + LJ_LEASE_FIXED_LEN;
+	memcpy(p, lease->hardware_addr.hbuf, hlen);
+	p += hlen;
+	if (lease->uid_len)
+		memcpy(p, lease->uid, lease->uid_len);
+	p += lease->uid_len;
+	if (hostname_len)
+		memcpy(p, lease->client_hostname, hostname_len);
+
+	rv = lease_journal_put(LJ_LEASE, buf, len);
+	if (buf != sbuf)
+		dfree(buf, MDL);
+
+	if (!rv) {
+		log_info ("write_lease: unable to write lease %s",
+			  piaddr (lease -> ip_addr));
+		lease_file_is_corrupt = 1;
+	}
+	return rv;
+}
+
+/* Build a lease from an LJ_LEASE record, the way parse_lease_declaration()
+   would from its text form. */
+static int
+lease_journal_decode(struct lease **lp, const unsigned char *data,
+		     unsigned len)
+{
+	struct lease *lease = NULL;
+	unsigned hlen, uid_len, hostname_len;
+	const unsigned char *p;
+
+	if (len < LJ_LEASE_FIXED_LEN)
+		return 0;
+	hlen = data[LJ_LEASE_HLEN];
+	uid_len = getUShort(data + LJ_LEASE_UID_LEN);
+	hostname_len = getUShort(data + LJ_LEASE_HOSTNAME_LEN);
+	if ((hlen > sizeof(lease->hardware_addr.hbuf)) ||
+	    (len < LJ_LEASE_FIXED_LEN + hlen + uid_len + hostname_len))
+		return 0;
+
+	if (lease_allocate(&lease, MDL) != ISC_R_SUCCESS)
+		return 0;
+
+	lease->ip_addr.len = 4;
+	memcpy(lease->ip_addr.iabuf, data + LJ_LEASE_ADDR, 4);
+	lease->starts = lease_journal_get_time(data + LJ_LEASE_STARTS);
+	lease->ends = lease_journal_get_time(data + LJ_LEASE_ENDS);
+	lease->tstp = lease_journal_get_time(data + LJ_LEASE_TSTP);
+	lease->tsfp = lease_journal_get_time(data + LJ_LEASE_TSFP);
+	lease->atsfp = lease_journal_get_time(data + LJ_LEASE_ATSFP);
+	lease->cltt = lease_journal_get_time(data + LJ_LEASE_CLTT);
+
+	/* As for text, an invalid state reads as abandoned and an invalid
+	   rewind state as no rewind. */
+	lease->binding_state = data[LJ_LEASE_STATE];
+	if (lease->binding_state == 0 || lease->binding_state > FTS_LAST)
+		lease->binding_state = FTS_ABANDONED;
+	lease->next_binding_state = data[LJ_LEASE_NEXT_STATE];
+	if (lease->next_binding_state == 0 ||
+	    lease->next_binding_state > FTS_LAST)
+		lease->next_binding_state = FTS_ABANDONED;
+	lease->rewind_binding_state = data[LJ_LEASE_REWIND_STATE];
+	if (lease->rewind_binding_state == 0 ||
+	    lease->rewind_binding_state > FTS_LAST)
+		lease->rewind_binding_state = lease->binding_state;
+	lease->flags = data[LJ_LEASE_FLAGS] & (RESERVED_LEASE | BOOTP_LEASE);
+
+	/* The text format leaves out a tstp equal to ends. */
+	if (!lease->tstp)
+		lease->tstp = lease->ends;
+
+	p = data + LJ_LEASE_FIXED_LEN;
+	lease->hardware_addr.hlen = hlen;
+	memcpy(lease->hardware_addr.hbuf, p, hlen);
+	p += hlen;
+
+	if (uid_len) {
+		if (uid_len <= sizeof(lease->uid_buf)) {
+			lease->uid = lease->uid_buf;
+			lease->uid_max = sizeof(lease->uid_buf);
+		} else {
+			lease->uid = dmalloc(uid_len, MDL);
+			if (lease->uid == NULL)
+				log_fatal("No memory for lease uid");
+			lease->uid_max = uid_len;
+		}
+		memcpy(lease->uid, p, uid_len);
+		lease->uid_len = uid_len;
+	}
+	p += uid_len;
+
+	if (hostname_len) {
+		lease->client_hostname = dmalloc(hostname_len + 1, MDL);
+		if (lease->client_hostname == NULL)
+			log_fatal("No memory for lease client hostname");
+		memcpy(lease->client_hostname, p, hostname_len);
+		lease->client_hostname[hostname_len] = 0;
+	}
+
+	lease_reference(lp, lease, MDL);
+	lease_dereference(&lease, MDL);
+	return 1;
+}
+
+/* Return nonzero if a lease file's contents are a binary journal. */
+int lease_journal_check (const char *buf, unsigned len)
+{
+	return ((len >= LEASE_JOURNAL_MAGIC_LEN) &&
+		!memcmp(buf, LEASE_JOURNAL_MAGIC, LEASE_JOURNAL_MAGIC_LEN));
+}
+
+/* Return nonzero if a good record starts at off.   A record must fit
+   in the file, have a known type and zeroed reserved fields, and match
+   its checksum. */
+static int
+lease_journal_valid(const unsigned char *data, unsigned len, unsigned off)
+{
+	unsigned plen, type;
+
+	if (len - off < LJ_HEADER_LEN)
+		return 0;
+	plen = getULong(data + off);
+	type = getUShort(data + off + 4);
+	if ((plen > len - off - LJ_HEADER_LEN) ||
+	    ((type != LJ_TEXT) && (type != LJ_LEASE)) ||
+	    (getUShort(data + off + 6) != 0) ||
+	    (getULong(data + off + 12) != 0))
+		return 0;
+	return (getULong(data + off + 8) ==
+		lease_journal_record_crc(data + off, data + off + LJ_HEADER_LEN,
+					 plen));
+}
+
+/*
+ * Walk the records of a binary lease file.   If out is NULL the leases
+ * are loaded; otherwise they are written to out in text format.   The
+ * length of a damaged record can't be trusted, so the walk looks for
+ * the next good record at a record boundary and carries on from there.
+ * A damaged record with nothing good after it that runs past the end
+ * of the file is taken to be one cut short by a crash during a write,
+ * and is not an error.
+ */
+static isc_result_t
+lease_journal_walk(const char *buf, unsigned len, const char *name,
+		   FILE *out)
+{
+	const unsigned char *data = (const unsigned char *)buf;
+	const unsigned char *payload;
+	struct lease *lease;
+	struct parse *cfile;
+	isc_result_t status = ISC_R_SUCCESS;
+	unsigned off, next, plen, type;
+	FILE *saved;
+
+	off = LEASE_JOURNAL_MAGIC_LEN;
+	while (off < len) {
+		if (!lease_journal_valid(data, len, off)) {
+			for (next = off + 8; next < len; next += 8)
+				if (lease_journal_valid(data, len, next))
+					break;
+			if (next < len) {
+				log_error("%s: damaged record at offset %u, "
+					  "resuming at offset %u.",
+					  name, off, next);
+				status = DHCP_R_BADPARSE;
+				off = next;
+				continue;
+			}
+			if ((len - off < LJ_HEADER_LEN) ||
+			    (getULong(data + off) >
+			     len - off - LJ_HEADER_LEN)) {
+				log_error("%s: truncated record at offset %u "
+					  "ignored.", name, off);
+			} else {
+				log_error("%s: bad checksum in record at "
+					  "offset %u.", name, off);
+				status = DHCP_R_BADPARSE;
+			}
+			break;
+		}
+		plen = getULong(data + off);
+		type = getUShort(data + off + 4);
+		payload = data + off + LJ_HEADER_LEN;
+
+		switch (type) {
+		      case LJ_TEXT:
+			if (out != NULL) {
+				fwrite(payload, plen, 1, out);
+				break;
+			}
+			cfile = NULL;
+			if ((new_parse(&cfile, -1, (char *)payload, plen,
+				       name, 0) == ISC_R_SUCCESS) &&
+			    (cfile != NULL)) {
+				if (lease_file_subparse(cfile) != ISC_R_SUCCESS)
+					status = DHCP_R_BADPARSE;
+				end_parse(&cfile);
+			}
+			break;
+
+		      case LJ_LEASE:
+			lease = NULL;
+			if (!lease_journal_decode(&lease, payload, plen)) {
+				log_error("%s: bad lease record at offset %u.",
+					  name, off);
+				status = DHCP_R_BADPARSE;
+				break;
+			}
+			if (out != NULL) {
+				saved = db_file;
+				db_file = out;
+				write_lease_text(lease);
+				db_file = saved;
+			} else
+				enter_lease(lease);
+			lease_dereference(&lease, MDL);
+			break;
+
+		      default:
+			log_error("%s: unknown record type %u at offset %u.",
+				  name, type, off);
+			status = DHCP_R_BADPARSE;
+			break;
+		}
+		off += LJ_HEADER_LEN + LJ_PAD(plen);
+	}
+
+	return status;
+}
+
+/* Load the contents of a binary lease file. */
+isc_result_t lease_journal_read (const char *buf, unsigned len,
+				 const char *name)
+{
+	/* Anything appended to this file before it is rewritten has to
+	   be in the same format. */
+	db_file_binary = 1;
+
+	return lease_journal_walk(buf, len, name, NULL);
+}
+
+/* Print a binary lease file in text format, for inspection or to
+   convert it back to text. */
+isc_result_t lease_journal_dump (const char *name, FILE *out)
+{
+	struct parse *cfile = NULL;
+	isc_result_t status;
+	int file;
+
+	if ((file = open(name, O_RDONLY)) < 0) {
+		log_error("Can't open %s: %m", name);
+		return ISC_R_IOERROR;
+	}
+	status = new_parse(&cfile, file, NULL, 0, name, 0);
+	if ((status != ISC_R_SUCCESS) || (cfile == NULL)) {
+		close(file);
+		return status;
+	}
+
+	if (!lease_journal_check(cfile->inbuf, cfile->buflen)) {
+		/* Already text. */
+		fwrite(cfile->inbuf, cfile->buflen, 1, out);
+	} else {
+		fprintf(out, "# Converted from binary lease file %s\n", name);
+		status = lease_journal_walk(cfile->inbuf, cfile->buflen,
+					    name, out);
+	}
+	end_parse(&cfile);
+	return status;
+}
+
 /* Commit leases after a timeout. */
 void commit_leases_timeout (void *foo)
 {
@@ -1043,16 +1723,379 @@ int commit_leases ()
 		return (0);
 	}
 
-	/* If we haven't rewritten the lease database in over an
-	   hour, rewrite it now.  (The length of time should probably
-	   be configurable. */
+	commit_leases_rewrite();
+	return (1);
+}
+
+/* If we haven't rewritten the lease database in over an hour, rewrite
+   it now.  (The length of time should probably be configurable. */
+static void commit_leases_rewrite ()
+{
 	if (count && cur_time - write_time > LEASE_REWRITE_PERIOD) {
 		count = 0;
 		write_time = cur_time;
+		if (!lease_file_compact())
+			new_lease_file(0);
+	}
+}
+
+/*
+ * Rewrite the lease file in the background.   A child process is forked
+ * to write the new file; it gets a copy-on-write snapshot of the lease
+ * database as of the fork, so the parent can carry on serving requests
+ * and appending to the current lease file.   When the child is done, the
+ * parent appends whatever it wrote to the current file since the fork
+ * to the new file, and moves the new file into place.
+ *
+ * Returns 0 if the rewrite should be done synchronously instead.
+ */
+static int
+lease_file_compact(void)
+{
+	struct timeval tv;
+	struct stat st;
+	sigset_t sigs;
+	TIME t;
+	pid_t pid;
+
+	if (compaction_pid > 0)
+		return 1;
+	if (db_file == NULL || lease_file_is_corrupt || journal_text_depth)
+		return 0;
+#if defined (TRACING)
+	if (trace_playback() || trace_record())
+		return 0;
+#endif
+
+	/* Nothing may be left in the stdio buffer, or the child would
+	   write it out a second time when it closes the file. */
+	if (fflush(db_file) == EOF || fstat(fileno(db_file), &st) < 0)
+		return 0;
+
+	time(&t);
+	if (snprintf(compaction_fname, sizeof compaction_fname, "%s.%d",
+		     path_dhcpd_db, (int)t) >= sizeof compaction_fname)
+		log_fatal("lease_file_compact: lease file path too long");
+
+	pid = fork();
+	if (pid < 0) {
+		log_error("Can't fork to rewrite lease file: %m");
+		return 0;
+	}
+	if (pid == 0) {
+		/* The server's shutdown handlers don't apply here, and the
+		   signals may be blocked for the ISC library's benefit;
+		   let a signal simply end the child. */
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		sigemptyset(&sigs);
+		sigaddset(&sigs, SIGINT);
+		sigaddset(&sigs, SIGTERM);
+		sigprocmask(SIG_UNBLOCK, &sigs, NULL);
+		compaction_pid = -1;
+		_exit(new_lease_file(0) ? 0 : 1);
+	}
+
+	compaction_pid = pid;
+	compaction_offset = st.st_size;
+
+	tv.tv_sec = cur_tv.tv_sec + 1;
+	tv.tv_usec = cur_tv.tv_usec;
+	add_timeout(&tv, lease_file_compact_check, NULL, 0, 0);
+	return 1;
+}
+
+/* Poll for the compaction child to finish. */
+static void
+lease_file_compact_check(void *foo)
+{
+	struct timeval tv;
+	int status;
+	pid_t rv;
+
+	rv = waitpid(compaction_pid, &status, WNOHANG);
+	if (rv == 0) {
+		tv.tv_sec = cur_tv.tv_sec + 1;
+		tv.tv_usec = cur_tv.tv_usec;
+		add_timeout(&tv, lease_file_compact_check, NULL, 0, 0);
+		return;
+	}
+	if (rv < 0 && errno == EINTR) {
+		tv.tv_sec = cur_tv.tv_sec;
+		tv.tv_usec = cur_tv.tv_usec;
+		add_timeout(&tv, lease_file_compact_check, NULL, 0, 0);
+		return;
+	}
+	compaction_pid = 0;
+
+	if (rv < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		log_error("Background lease file rewrite failed.");
+		(void)unlink(compaction_fname);
 		new_lease_file(0);
+		return;
+	}
+
+	if (!lease_file_compact_finish()) {
+		(void)unlink(compaction_fname);
+		new_lease_file(0);
+	}
+}
+
+/* Append the tail of the current lease file to the one written by the
+   compaction child, then switch over to it. */
+static int
+lease_file_compact_finish(void)
+{
+	unsigned char buf[8192];
+	FILE *new_db_file;
+	ssize_t len;
+	int in, out;
+
+	if (fflush(db_file) == EOF) {
+		log_error("Can't flush lease file: %m");
+		return 0;
+	}
+
+	in = open(path_dhcpd_db, O_RDONLY);
+	if (in < 0) {
+		log_error("Can't open %s: %m", path_dhcpd_db);
+		return 0;
+	}
+	out = open(compaction_fname, O_WRONLY | O_APPEND);
+	if (out < 0) {
+		log_error("Can't open %s: %m", compaction_fname);
+		close(in);
+		return 0;
+	}
+	if (lseek(in, compaction_offset, SEEK_SET) < 0) {
+		log_error("Can't seek in %s: %m", path_dhcpd_db);
+		goto fail;
+	}
+	while ((len = read(in, buf, sizeof buf)) > 0) {
+		if (write(out, buf, len) != len) {
+			log_error("Can't write %s: %m", compaction_fname);
+			goto fail;
+		}
+	}
+	if (len < 0) {
+		log_error("Can't read %s: %m", path_dhcpd_db);
+		goto fail;
+	}
+	if (dont_use_fsync == 0 && fsync(out) < 0) {
+		log_error("Can't sync %s: %m", compaction_fname);
+		goto fail;
+	}
+	close(in);
+	in = -1;
+
+	if ((new_db_file = fdopen(out, "a")) == NULL) {
+		log_error("Can't fdopen new lease file: %m");
+		goto fail;
+	}
+	if (!install_lease_file(compaction_fname)) {
+		fclose(new_db_file);
+		return 0;
+	}
+
+#if defined (ASYNC_FSYNC)
+	lease_sync_wait();
+#endif
+	fclose(db_file);
+	db_file = new_db_file;
+	return 1;
+
+      fail:
+	if (in >= 0)
+		close(in);
+	close(out);
+	return 0;
+}
+
+/* Stop a background rewrite that is no longer wanted. */
+static void
+lease_file_compact_cancel(void)
+{
+	int status;
+
+	/* The child only writes its own temporary file, so there is
+	   nothing to lose by killing it outright, and it can't hold up
+	   the wait below. */
+	cancel_timeout(lease_file_compact_check, NULL);
+	kill(compaction_pid, SIGKILL);
+	while (waitpid(compaction_pid, &status, 0) < 0 && errno == EINTR)
+		;
+	(void)unlink(compaction_fname);
+	compaction_pid = 0;
+}
+
+#if defined (ASYNC_FSYNC)
+static void *
+lease_sync_main(void *arg)
+{
+	int fd, err;
+
+	pthread_mutex_lock(&sync_lock);
+	for (;;) {
+		while (sync_fd < 0)
+			pthread_cond_wait(&sync_cond, &sync_lock);
+		fd = sync_fd;
+		pthread_mutex_unlock(&sync_lock);
+
+		err = (fsync(fd) < 0) ? errno : 0;
+
+		pthread_mutex_lock(&sync_lock);
+		sync_errno = err;
+		sync_fd = -1;
+		pthread_cond_broadcast(&sync_cond);
+
+		/* Wake up the dispatch loop. */
+		while ((write(sync_pipe[1], "", 1) < 0) && (errno == EINTR))
+			;
 	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+static int
+lease_sync_readsocket(omapi_object_t *h)
+{
+	IGNORE_UNUSED(h);
+	return (sync_pipe[0]);
+}
+
+/* Called on the dispatch thread when the sync thread has finished. */
+static isc_result_t
+lease_sync_handler(omapi_object_t *h)
+{
+	void (*done)(void);
+	char buf[16];
+	int err;
+
+	IGNORE_UNUSED(h);
+
+	if (read(sync_pipe[0], buf, sizeof(buf)) <= 0)
+		return (ISC_R_SUCCESS);
+
+	pthread_mutex_lock(&sync_lock);
+	err = sync_errno;
+	pthread_mutex_unlock(&sync_lock);
+
+	if (err != 0)
+		log_info("commit_leases: unable to commit, fsync(): %s",
+			 strerror(err));
+
+	commit_leases_rewrite();
+
+	done = sync_done;
+	sync_done = NULL;
+	if (done != NULL)
+		(*done)();
+	return (ISC_R_SUCCESS);
+}
+
+/* Start the sync thread.   This is done on first use, so that it
+   happens after dhcpd has detached from the terminal. */
+static int
+lease_sync_start(void)
+{
+	isc_result_t status;
+	int rv;
+
+	if (pipe(sync_pipe) < 0) {
+		log_error("Can't create lease sync pipe: %m");
+		return (0);
+	}
+#if defined (F_SETFD)
+	if ((fcntl(sync_pipe[0], F_SETFD, 1) < 0) ||
+	    (fcntl(sync_pipe[1], F_SETFD, 1) < 0))
+		log_error("Can't set close-on-exec on lease sync pipe: %m");
+#endif
+
+	status = omapi_object_type_register(&lease_sync_type,
+					    "lease-sync",
+					    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+					    sizeof(omapi_object_t),
+					    0, RC_MISC);
+	if (status == ISC_R_SUCCESS)
+		status = omapi_object_allocate(&lease_sync_object,
+					       lease_sync_type, 0, MDL);
+	if (status == ISC_R_SUCCESS)
+		status = omapi_register_io_object(lease_sync_object,
+						  lease_sync_readsocket, 0,
+						  lease_sync_handler, 0, 0);
+	if (status != ISC_R_SUCCESS) {
+		log_error("Can't register lease sync handle: %s",
+			  isc_result_totext(status));
+		goto fail;
+	}
+
+	rv = pthread_create(&sync_thread, NULL, lease_sync_main, NULL);
+	if (rv != 0) {
+		log_error("Can't start lease sync thread: %s", strerror(rv));
+		omapi_unregister_io_object(lease_sync_object);
+		goto fail;
+	}
+	return (1);
+
+      fail:
+	if (lease_sync_object != NULL)
+		omapi_object_dereference(&lease_sync_object, MDL);
+	close(sync_pipe[0]);
+	close(sync_pipe[1]);
+	sync_pipe[0] = sync_pipe[1] = -1;
+	return (0);
+}
+
+/* Wait for the sync thread to finish any fsync() it is running. */
+static void
+lease_sync_wait(void)
+{
+	if (sync_state != 1)
+		return;
+	pthread_mutex_lock(&sync_lock);
+	while (sync_fd >= 0)
+		pthread_cond_wait(&sync_cond, &sync_lock);
+	pthread_mutex_unlock(&sync_lock);
+}
+
+/*
+ * Flush the lease file and fsync() it on the sync thread; done is
+ * called from the dispatch loop once the data is on disk.  Returns 1
+ * if the sync was started, or 0 if the caller should commit the
+ * leases synchronously instead (no fsync wanted, or no sync thread).
+ * The caller must not start another sync before done has been called.
+ */
+int commit_leases_async (void (*done)(void))
+{
+	if (dont_use_fsync || (sync_state < 0) || (db_file == NULL))
+		return (0);
+#if defined (TRACING)
+	if (trace_playback())
+		return (0);
+#endif
+
+	if (sync_state == 0)
+		sync_state = lease_sync_start() ? 1 : -1;
+	if (sync_state < 0)
+		return (0);
+
+	if (sync_done != NULL)
+		log_fatal("commit_leases_async: sync already pending.");
+
+	/* If the flush fails, let commit_leases() try again and
+	   report it. */
+	if (fflush (db_file) == EOF)
+		return (0);
+
+	sync_done = done;
+	pthread_mutex_lock(&sync_lock);
+	sync_fd = fileno(db_file);
+	pthread_cond_broadcast(&sync_cond);
+	pthread_mutex_unlock(&sync_lock);
 	return (1);
 }
+#endif /* ASYNC_FSYNC */
 
 /*
  * rewrite the lease file about once an hour
@@ -1127,18 +2170,89 @@ void db_startup (int test_mode)
 	log_info("Lease UID hash: %s", lease_id_hash_report(lease_uid_hash));
 	log_info("Lease HW hash:  %s",
 		 lease_id_hash_report(lease_hw_addr_hash));
+#if defined (DHCPv6)
+	log_info("IA_NA hash:     %s", ia_hash_report(ia_na_active));
+	log_info("IA_TA hash:     %s", ia_hash_report(ia_ta_active));
+	log_info("IA_PD hash:     %s", ia_hash_report(ia_pd_active));
+#endif
 #endif
 }
 
+/* Move a newly written lease file into place, keeping the old one as
+   a backup.   Returns 1 on success. */
+static int
+install_lease_file(const char *newfname)
+{
+	char backfname [512];
+
+#if defined (TRACING)
+	if (!trace_playback ()) {
+#endif
+	    /* %Audit% Truncated filename causes panic. %2004.06.17,Safe%
+	     * This should never happen since the path is a configuration
+	     * variable from build-time or command-line.  But if it should,
+	     * either by malice or ignorance, we panic, since the potential
+	     * for havoc is too high.
+	     */
+	    if (snprintf (backfname, sizeof backfname, "%s~", path_dhcpd_db)
+			>= sizeof backfname)
+		log_fatal("new_lease_file: backup lease file path too long");
+
+	    /* Get the old database out of the way... */
+	    if (unlink (backfname) < 0 && errno != ENOENT) {
+		log_error ("Can't remove old lease database backup %s: %m",
+			   backfname);
+		return 0;
+	    }
+	    if (link(path_dhcpd_db, backfname) < 0) {
+		if (errno == ENOENT) {
+			log_error("%s is missing - no lease db to backup.",
+				  path_dhcpd_db);
+		} else {
+			log_error("Can't backup lease database %s to %s: %m",
+				  path_dhcpd_db, backfname);
+			return 0;
+		}
+	    }
+#if defined (TRACING)
+	}
+#endif
+
+	/* Move in the new file... */
+	if (rename (newfname, path_dhcpd_db) < 0) {
+		log_error ("Can't install new lease database %s to %s: %m",
+			   newfname, path_dhcpd_db);
+		return 0;
+	}
+	return 1;
+}
+
 int new_lease_file (int test_mode)
 {
 	char newfname [512];
-	char backfname [512];
 	TIME t;
 	int db_fd;
 	int db_validity;
 	FILE *new_db_file;
 
+	/* A synchronous rewrite supersedes a background one. */
+	if (compaction_pid > 0)
+		lease_file_compact_cancel();
+
+#if defined (ASYNC_FSYNC)
+	/* Don't close the file under an fsync() that is still running.
+	   A compaction child has no sync thread to wait for. */
+	if (compaction_pid == 0)
+		lease_sync_wait();
+#endif
+
+	/* db_file is a scratch file while a binary lease file text record
+	   is being written; writing a new lease file then would lose it. */
+	if (journal_text_depth) {
+		log_error("new_lease_file: lease file record in progress.");
+		return 0;
+	}
+
 	/* Make a temporary lease file... */
 	time(&t);
 
@@ -1150,8 +2264,10 @@ int new_lease_file (int test_mode)
 	 * either by malice or ignorance, we panic, since the potential
 	 * for havoc is high.
 	 */
-	if (snprintf (newfname, sizeof newfname, "%s.%d",
-		     path_dhcpd_db, (int)t) >= sizeof newfname)
+	if (compaction_pid < 0)
+		strcpy(newfname, compaction_fname);
+	else if (snprintf (newfname, sizeof newfname, "%s.%d",
+			  path_dhcpd_db, (int)t) >= sizeof newfname)
 		log_fatal("new_lease_file: lease file path too long");
 
 	db_fd = open (newfname, O_WRONLY | O_TRUNC | O_CREAT, 0664);
@@ -1185,28 +2301,41 @@ int new_lease_file (int test_mode)
 	if (db_file)
 		fclose(db_file);
 	db_file = new_db_file;
+	db_file_binary = binary_lease_file;
 
 	errno = 0;
-	fprintf (db_file, "# The format of this file is documented in the %s",
-		 "dhcpd.leases(5) manual page.\n");
+	if (db_file_binary) {
+		fwrite(LEASE_JOURNAL_MAGIC, LEASE_JOURNAL_MAGIC_LEN, 1,
+		       db_file);
+		if (errno)
+			goto fail;
+	} else {
+		fprintf (db_file, "# The format of this file is documented "
+			 "in the %s", "dhcpd.leases(5) manual page.\n");
 
-	if (errno)
-		goto fail;
+		if (errno)
+			goto fail;
 
-	fprintf (db_file, "# This lease file was written by isc-dhcp-%s\n\n",
-		 PACKAGE_VERSION);
-	if (errno)
-		goto fail;
+		fprintf (db_file, "# This lease file was written by "
+			 "isc-dhcp-%s\n\n", PACKAGE_VERSION);
+		if (errno)
+			goto fail;
 
-	fprintf (db_file, "# authoring-byte-order entry is generated,"
-                          " DO NOT DELETE\n");
-	if (errno)
-		goto fail;
+		fprintf (db_file, "# authoring-byte-order entry is generated,"
+			 " DO NOT DELETE\n");
+		if (errno)
+			goto fail;
+	}
 
+	/* The byte order still matters for the text records of a binary
+	   lease file. */
+	if (!lease_journal_text_begin())
+		goto fail;
+	errno = 0;
 	fprintf (db_file, "authoring-byte-order %s;\n\n",
 		 (DHCP_BYTE_ORDER == LITTLE_ENDIAN ?
 		  "little-endian" : "big-endian"));
-	if (errno)
+	if (!lease_journal_text_end(!errno))
 		goto fail;
 
 	/* At this point we have a new lease file that, so far, could not
@@ -1227,45 +2356,16 @@ int new_lease_file (int test_mode)
 		return (1);
 	}
 
-#if defined (TRACING)
-	if (!trace_playback ()) {
-#endif
-	    /* %Audit% Truncated filename causes panic. %2004.06.17,Safe%
-	     * This should never happen since the path is a configuration
-	     * variable from build-time or command-line.  But if it should,
-	     * either by malice or ignorance, we panic, since the potential
-	     * for havoc is too high.
-	     */
-	    if (snprintf (backfname, sizeof backfname, "%s~", path_dhcpd_db)
-			>= sizeof backfname)
-		log_fatal("new_lease_file: backup lease file path too long");
-
-	    /* Get the old database out of the way... */
-	    if (unlink (backfname) < 0 && errno != ENOENT) {
-		log_error ("Can't remove old lease database backup %s: %m",
-			   backfname);
-		goto fail;
-	    }
-	    if (link(path_dhcpd_db, backfname) < 0) {
-		if (errno == ENOENT) {
-			log_error("%s is missing - no lease db to backup.",
-				  path_dhcpd_db);
-		} else {
-			log_error("Can't backup lease database %s to %s: %m",
-				  path_dhcpd_db, backfname);
+	/* A compaction child leaves installing the file to the parent. */
+	if (compaction_pid < 0) {
+		if (fflush(db_file) == EOF ||
+		    (dont_use_fsync == 0 && fsync(fileno(db_file)) < 0))
 			goto fail;
-		}
-	    }
-#if defined (TRACING)
+		return 1;
 	}
-#endif
 
-	/* Move in the new file... */
-	if (rename (newfname, path_dhcpd_db) < 0) {
-		log_error ("Can't install new lease database %s to %s: %m",
-			   newfname, path_dhcpd_db);
+	if (!install_lease_file(newfname))
 		goto fail;
-	}
 
 	counting = 1;
 	return 1;
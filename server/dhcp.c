@@ -51,10 +51,19 @@ int outstanding_pings;
 #if defined(DELAYED_ACK)
 static void delayed_ack_enqueue(struct lease *);
 static void delayed_acks_timer(void *);
-
+static void delayed_acks_send(struct leasequeue *);
+#if defined(ASYNC_FSYNC)
+static void delayed_acks_committed(void);
+
+/* ACKs waiting for the sync thread to commit their leases, and whether
+   such a commit is running. */
+static struct leasequeue *commitqueue_tail;
+static int commit_pending;
+#endif
 
 struct leasequeue *ackqueue_head, *ackqueue_tail;
-static struct leasequeue *free_ackqueue;
+static struct dmalloc_pool ackqueue_pool =
+	DMALLOC_POOL ("ackqueue", struct leasequeue);
 static struct timeval max_fsync;
 
 int outstanding_acks;
@@ -230,6 +239,7 @@ dhcp (struct packet *packet) {
 		if (packet->options->universe_count <= agent_universe.index)
 			packet->options->universe_count =
 						agent_universe.index + 1;
+		packet->options->stamp = ++option_state_stamp;
 
 		packet->agent_options_stashed = ISC_TRUE;
 	}
@@ -3744,16 +3754,9 @@ delayed_ack_enqueue(struct lease *lease)
 
 	if (!write_lease(lease))
 		return;
-	if (free_ackqueue) {
-	   	q = free_ackqueue;
-		free_ackqueue = q->next;
-	} else {
-		q = ((struct leasequeue *)
-			     dmalloc(sizeof(struct leasequeue), MDL));
-		if (!q)
-			log_fatal("delayed_ack_enqueue: no memory!");
-	}
-	memset(q, 0, sizeof *q);
+	q = dmalloc_pool_get(&ackqueue_pool, MDL);
+	if (!q)
+		log_fatal("delayed_ack_enqueue: no memory!");
 	/* prepend to ackqueue*/
 	lease_reference(&q->lease, lease, MDL);
 	q->next = ackqueue_head;
@@ -3807,12 +3810,12 @@ delayed_ack_enqueue(struct lease *lease)
  * Commits the leases and then for each delayed ack:
  *  - Update the failover peer if we're in failover
  *  - Send the REPLY to the client
+ * With ASYNC_FSYNC the commit runs on the lease sync thread, and the
+ * acks are sent from delayed_acks_committed() when it has finished.
  */
 static void
 delayed_acks_timer(void *foo)
 {
-	struct leasequeue *ack, *p;
-
 	/* Reset max fsync */
 	memset(&max_fsync, 0, sizeof(max_fsync));
 
@@ -3821,17 +3824,71 @@ delayed_acks_timer(void *foo)
 		return;
 	}
 
+#if defined(ASYNC_FSYNC)
+	/* If a commit is already running, these ACKs will go out with the
+	   next one, which is started as soon as it finishes. */
+	if (commit_pending)
+		return;
+
+	/* Commit the leases on the sync thread; the ACKs are sent by
+	   delayed_acks_committed() once they are on disk. */
+	if (commit_leases_async(delayed_acks_committed)) {
+		commitqueue_tail = ackqueue_tail;
+		commit_pending = 1;
+
+		ackqueue_head = NULL;
+		ackqueue_tail = NULL;
+		outstanding_acks = 0;
+		return;
+	}
+#endif
+
 	/* Commit the leases first */
 	commit_leases();
 
-	/* Now process the delayed ACKs
-	 - update failover peer
-	 - send out the ACK packets
-	 - move the queue slots to the free list
-	*/
+	delayed_acks_send(ackqueue_tail);
+
+	ackqueue_head = NULL;
+	ackqueue_tail = NULL;
+	outstanding_acks = 0;
+}
+
+#if defined(ASYNC_FSYNC)
+/* Called once the sync thread has committed the leases for the ACKs on
+ * the commit queue:
+ *  - Send those ACKs
+ *  - Start committing any ACKs that were queued in the meantime
+ */
+static void
+delayed_acks_committed(void)
+{
+	struct leasequeue *tail;
+
+	tail = commitqueue_tail;
+	commitqueue_tail = NULL;
+	commit_pending = 0;
+
+	delayed_acks_send(tail);
+
+	if (outstanding_acks) {
+		cancel_timeout(delayed_acks_timer, NULL);
+		delayed_acks_timer(NULL);
+	}
+}
+#endif
+
+/* Sends the delayed ACKs on a queue whose leases have been committed:
+ *  - update failover peer
+ *  - send out the ACK packets
+ *  - move the queue slots to the free list
+ */
+static void
+delayed_acks_send(struct leasequeue *tail)
+{
+	struct leasequeue *ack, *p;
 
 	/*  process from bottom to retain packet order */
-	for (ack = ackqueue_tail ; ack ; ack = p) {
+	for (ack = tail ; ack ; ack = p) {
 		p = ack->prev;
 
 #if defined(FAILOVER_PROTOCOL)
@@ -3856,13 +3913,8 @@ delayed_acks_timer(void *foo)
 		}
 
 		lease_dereference(&ack->lease, MDL);
-		ack->next = free_ackqueue;
-		free_ackqueue = ack;
+		dmalloc_pool_put(&ackqueue_pool, ack, MDL);
 	}
-
-	ackqueue_head = NULL;
-	ackqueue_tail = NULL;
-	outstanding_acks = 0;
 }
 
 #if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
@@ -3873,12 +3925,14 @@ relinquish_ackqueue(void)
 
 	for (q = ackqueue_head ; q ; q = n) {
 		n = q->next;
-		dfree(q, MDL);
+		dmalloc_pool_put(&ackqueue_pool, q, MDL);
 	}
-	for (q = free_ackqueue ; q ; q = n) {
-		n = q->next;
-		dfree(q, MDL);
+#if defined(ASYNC_FSYNC)
+	for (q = commitqueue_tail ; q ; q = n) {
+		n = q->prev;
+		dmalloc_pool_put(&ackqueue_pool, q, MDL);
 	}
+#endif
 }
 #endif
 
@@ -79,6 +79,7 @@ u_int16_t ddns_conflict_mask;
 
 int ddns_update_style;
 int dont_use_fsync = 0; /* 0 = default, use fsync, 1 = don't use fsync */
+int binary_lease_file = 0; /* 1 = write the lease file in binary format */
 int server_id_check = 0; /* 0 = default, don't check server id, 1 = do check */
 
 #ifdef DHCPv6
@@ -182,7 +183,7 @@ static void omapi_listener_start (void *foo)
 #endif /* TRACING */
 
 #define DHCPD_USAGEC \
-"             [-pf pid-file] [--no-pid] [-s server]\n" \
+"             [-pf pid-file] [--no-pid] [--dump-leases] [-s server]\n" \
 "             [if0 [...ifN]]"
 
 #define DHCPD_USAGEH "{--version|--help|-h}"
@@ -228,6 +229,31 @@ usage(const char *sfmt, const char *sarg) {
 		  DHCPD_USAGEH);
 }
 
+/* Handle a received packet with its temporaries in the packet arena.
+ * The server only keeps what it allocates for a packet until the reply
+ * is sent, if need be after a delayed ACK, unlike dhclient, which keeps
+ * the packet's options as its lease's.
+ */
+static void
+do_arena_packet(struct interface_info *interface, struct dhcp_packet *packet,
+		unsigned len, unsigned int from_port, struct iaddr from,
+		struct hardware *hfrom) {
+	dmalloc_arena_enter();
+	do_packet(interface, packet, len, from_port, from, hfrom);
+	dmalloc_arena_leave();
+}
+
+#ifdef DHCPv6
+static void
+do_arena_packet6(struct interface_info *interface, const char *packet,
+		 int len, int from_port, const struct iaddr *from,
+		 isc_boolean_t was_unicast) {
+	dmalloc_arena_enter();
+	do_packet6(interface, packet, len, from_port, from, was_unicast);
+	dmalloc_arena_leave();
+}
+#endif /* DHCPv6 */
+
 /* Note: If we add unit tests to test setup_chroot it will
  * need to be moved to be outside the ifndef UNIT_TEST block.
  */
@@ -256,6 +282,7 @@ main(int argc, char **argv) {
 	char *s;
 	int cftest = 0;
 	int lftest = 0;
+	int lfdump = 0;
 	int pid;
 	char pbuf [20];
 #ifndef DEBUG
@@ -477,6 +504,10 @@ main(int argc, char **argv) {
 			have_dhcpd_pid = 1;
 		} else if (!strcmp(argv[i], "--no-pid")) {
 			no_pid_file = ISC_TRUE;
+		} else if (!strcmp(argv[i], "--dump-leases")) {
+			/* print the lease file as text and exit */
+			lfdump = 1;
+			log_perror = -1;
                 } else if (!strcmp (argv [i], "-t")) {
 			/* test configurations only */
 #ifndef DEBUG
@@ -761,10 +792,10 @@ main(int argc, char **argv) {
 
 	/* Set up various hooks. */
 	dhcp_interface_setup_hook = dhcpd_interface_setup_hook;
-	bootp_packet_handler = do_packet;
+	bootp_packet_handler = do_arena_packet;
 #ifdef DHCPv6
 	add_enumeration (&prefix_length_modes);
-	dhcpv6_packet_handler = do_packet6;
+	dhcpv6_packet_handler = do_arena_packet6;
 #endif /* DHCPv6 */
 
 #if defined (NSUPDATE)
@@ -815,14 +846,25 @@ main(int argc, char **argv) {
 	if (!ia_new_hash(&ia_na_active, DEFAULT_HASH_SIZE, MDL)) {
 		log_fatal("Out of memory creating hash for active IA_NA.");
 	}
+	ia_hash_enable_resize(ia_na_active);
 	if (!ia_new_hash(&ia_ta_active, DEFAULT_HASH_SIZE, MDL)) {
 		log_fatal("Out of memory creating hash for active IA_TA.");
 	}
+	ia_hash_enable_resize(ia_ta_active);
 	if (!ia_new_hash(&ia_pd_active, DEFAULT_HASH_SIZE, MDL)) {
 		log_fatal("Out of memory creating hash for active IA_PD.");
 	}
+	ia_hash_enable_resize(ia_pd_active);
 #endif /* DHCPv6 */
 
+	/* Print the lease file in text format, converting it from the
+	   binary format if necessary, and exit. */
+	if (lfdump) {
+		if (lease_journal_dump (path_dhcpd_db, stdout) != ISC_R_SUCCESS)
+			exit (1);
+		exit (0);
+	}
+
 	/* Read the dhcpd.conf file... */
 	if (readconf () != ISC_R_SUCCESS)
 		log_fatal ("Configuration file errors encountered -- exiting");
@@ -1392,6 +1434,13 @@ void postconf_initialization (int quiet)
 		log_error("Not using fsync() to flush lease writes");
 	}
 
+	oc = lookup_option(&server_universe, options, SV_BINARY_LEASE_FILE);
+	if (oc != NULL)
+		binary_lease_file =
+			evaluate_boolean_option_cache(NULL, NULL, NULL, NULL,
+						      options, NULL,
+						      &global_scope, oc, MDL);
+
        oc = lookup_option(&server_universe, options, SV_SERVER_ID_CHECK);
        if ((oc != NULL) &&
 	   evaluate_boolean_option_cache(NULL, NULL, NULL, NULL, options, NULL,
@@ -1730,6 +1779,7 @@ static isc_result_t dhcp_io_shutdown_countdown (void *vlp)
 	    free_everything ();
 	    omapi_print_dmalloc_usage_by_caller ();
 #endif
+	    expression_memo_report ();
 	    if (no_pid_file == ISC_FALSE)
 		    (void) unlink(path_dhcpd_pid);
 	    exit (0);
@@ -1741,6 +1791,7 @@ static isc_result_t dhcp_io_shutdown_countdown (void *vlp)
 		free_everything ();
 		omapi_print_dmalloc_usage_by_caller ();
 #endif
+		expression_memo_report ();
 		if (no_pid_file == ISC_FALSE)
 			(void) unlink(path_dhcpd_pid);
 		exit (0);
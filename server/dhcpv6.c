@@ -66,6 +66,7 @@ struct reply_state {
 	struct option_state *opt_state;
 	struct packet *packet;
 	struct data_string client_id;
+	u_int32_t permit_gen;	/* key for pond permit results, 0 for none */
 
 	/* IA level persistent state */
 	unsigned ia_count;
@@ -165,10 +166,13 @@ static struct iasubopt *prefix_compare(struct reply_state *reply,
 				       struct iasubopt *alpha,
 				       struct iasubopt *beta);
 static void schedule_lease_timeout_reply(struct reply_state *reply);
+static int pond_permitted(struct reply_state *reply,
+			  struct ipv6_pond *pond);
 
 static int eval_prefix_mode(int thislen, int preflen, int prefix_mode);
 static isc_result_t pick_v6_prefix_helper(struct reply_state *reply,
 					  int prefix_mode);
+static void log_prefix_pool_space(struct reply_state *reply);
 
 static void unicast_reject(struct data_string *reply_ret, struct packet *packet,
 		  const struct data_string *client_id,
@@ -323,6 +327,32 @@ schedule_lease_timeout_reply(struct reply_state *reply) {
 	}
 }
 
+/*
+ * Check a pond's permit and prohibit lists against the packet in the
+ * reply.  A reply may look at the same pond several times (once for
+ * each IA, and again for each prefix length mode), so the result is
+ * kept in the pond keyed by reply->permit_gen, which lease_to_client()
+ * sets afresh for each packet.
+ */
+static u_int32_t permit_generation;
+
+static int
+pond_permitted(struct reply_state *reply, struct ipv6_pond *pond) {
+	int ok;
+
+	if ((reply->permit_gen != 0) && (pond->permit_gen == reply->permit_gen))
+		return (pond->permit_ok);
+
+	ok = !(((pond->prohibit_list != NULL) &&
+		(permitted(reply->packet, pond->prohibit_list))) ||
+	       ((pond->permit_list != NULL) &&
+		(!permitted(reply->packet, pond->permit_list))));
+
+	pond->permit_gen = reply->permit_gen;
+	pond->permit_ok = ok;
+	return (ok);
+}
+
 /*
  * This function returns the time since DUID time start for the
  * given time_t value.
@@ -1286,11 +1316,12 @@ try_client_v6_address(struct iasubopt **addr,
  * ISC_R_SUCCESS = we were able to find an address and are returning a
  *                 pointer to the lease
  * ISC_R_NORESOURCES = there don't appear to be any free addresses.  This
- *                     is probabalistic.  We don't exhaustively try the
- *                     address range, instead we hash the duid and if
- *                     the address derived from the hash is in use we
- *                     hash the address.  After a number of failures we
- *                     conclude the pool is basically full.
+ *                     is probabalistic for large pools.  We don't
+ *                     exhaustively try the address range, instead we
+ *                     hash the duid and if the address derived from the
+ *                     hash is in use we hash the address.  After a number
+ *                     of failures we conclude the pool is basically full.
+ *                     Small pools are searched exhaustively.
  */
 static isc_result_t
 pick_v6_address(struct reply_state *reply)
@@ -1310,23 +1341,16 @@ pick_v6_address(struct reply_state *reply)
 			     reply->shared->name : "(no name)");
 
 	/*
-	 * Do a quick walk through of the ponds and pools
+	 * Do a quick walk through of the ponds
 	 * to see if we have any NA address pools
 	 */
 	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
-		if (pond->ipv6_pools == NULL)
-			continue;
-
-		for (i = 0; (p = pond->ipv6_pools[i]) != NULL; i++) {
-			if (p->pool_type == D6O_IA_NA)
-				break;
-		}
-		if (p != NULL)
+		if (pond->num_na_pools > 0)
 			break;
 	}
 
-	/* If we get here and p is NULL we have no useful pools */
-	if (p == NULL) {
+	/* If we get here and pond is NULL we have no useful pools */
+	if (pond == NULL) {
 		log_debug("Unable to pick client address: "
 			  "no IPv6 pools on this shared network");
 		return ISC_R_NORESOURCES;
@@ -1341,15 +1365,13 @@ pick_v6_address(struct reply_state *reply)
 	 * Within a given pond we start looking at the last pool we
 	 * allocated from, unless it had a collision trying to allocate
 	 * an address. This will tend to move us into less-filled pools.
+	 * Pools known to be full are passed over without a search.
 	 */
 
 	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
 		isc_result_t result = ISC_R_FAILURE;
 
-		if (((pond->prohibit_list != NULL) &&
-		     (permitted(reply->packet, pond->prohibit_list))) ||
-		    ((pond->permit_list != NULL) &&
-		     (!permitted(reply->packet, pond->permit_list))))
+		if ((pond->num_na_pools == 0) || !pond_permitted(reply, pond))
 			continue;
 
 #ifdef EUI_64
@@ -1365,7 +1387,9 @@ pick_v6_address(struct reply_state *reply)
 		i = start_pool;
 		do {
 			p = pond->ipv6_pools[i];
-			if (p->pool_type == D6O_IA_NA) {
+			if ((p->pool_type == D6O_IA_NA) && IPV6_POOL_FULL(p)) {
+				result = ISC_R_NORESOURCES;
+			} else if (p->pool_type == D6O_IA_NA) {
 #ifdef EUI_64
 				if (pond->use_eui_64) {
 					result =
@@ -1629,9 +1653,57 @@ pick_v6_prefix(struct reply_state *reply) {
 	 * Presumably that means we have no prefixes for the client.
 	*/
 	log_debug("Unable to pick client prefix: no prefixes available");
+	log_prefix_pool_space(reply);
 	return ISC_R_NORESOURCES;
 }
 
+/*!
+ *
+ * \brief Log the free space in the PD pools open to the client
+ *
+ * Called when no prefix could be picked.  A pool with free prefixes whose
+ * largest free prefix is longer than the client asked for is fragmented,
+ * which is otherwise hard to tell apart from a full pool.  Pools too
+ * large to keep a free prefix index are skipped.
+ *
+ * \param reply = the state structure for the current work on this request
+ */
+static void
+log_prefix_pool_space(struct reply_state *reply) {
+	struct ipv6_pool *p;
+	struct ipv6_pond *pond;
+	isc_uint64_t num_free;
+	int largest;
+	int i;
+	char tmp_buf[INET6_ADDRSTRLEN];
+
+	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
+		if (!pond_permitted(reply, pond))
+			continue;
+
+		for (i = 0; (p = pond->ipv6_pools[i]) != NULL; i++) {
+			if ((p->pool_type != D6O_IA_PD) ||
+			    !prefix6_pool_space(p, &num_free, &largest))
+				continue;
+
+			if (largest == 0) {
+				log_debug("Prefix pool %s/%d: no free /%d "
+					  "prefixes",
+					  inet_ntop(AF_INET6, &p->start_addr,
+						    tmp_buf, sizeof(tmp_buf)),
+					  p->bits, p->units);
+			} else {
+				log_debug("Prefix pool %s/%d: %llu free /%d "
+					  "prefixes, largest free prefix /%d",
+					  inet_ntop(AF_INET6, &p->start_addr,
+						    tmp_buf, sizeof(tmp_buf)),
+					  p->bits, (unsigned long long)num_free,
+					  p->units, largest);
+			}
+		}
+	}
+}
+
 /*!
  *
  * \brief  Get an IPv6 prefix for the client based upon selection mode.
@@ -1648,12 +1720,13 @@ pick_v6_prefix(struct reply_state *reply) {
  * \return
  * ISC_R_SUCCESS = we were able to find a prefix and are returning a
  *                 pointer to the lease
- * ISC_R_NORESOURCES = there don't appear to be any free addresses.  This
- *                     is probabalistic.  We don't exhaustively try the
- *                     address range, instead we hash the duid and if
- *                     the address derived from the hash is in use we
- *                     hash the address.  After a number of failures we
- *                     conclude the pool is basically full.
+ * ISC_R_NORESOURCES = there don't appear to be any free prefixes.  For
+ *                     pools with a free prefix index this is exact, and
+ *                     a full pool is passed over without a search.  For
+ *                     larger pools this is probabalistic: we hash the
+ *                     duid and if the prefix derived from the hash is
+ *                     in use we hash the prefix.  After a number of
+ *                     failures we conclude the pool is basically full.
  */
 isc_result_t
 pick_v6_prefix_helper(struct reply_state *reply, int prefix_mode) {
@@ -1664,14 +1737,12 @@ pick_v6_prefix_helper(struct reply_state *reply, int prefix_mode) {
 	struct iasubopt **pref = &reply->lease;
 
 	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
-		if (((pond->prohibit_list != NULL) &&
-		     (permitted(reply->packet, pond->prohibit_list))) ||
-		    ((pond->permit_list != NULL) &&
-		     (!permitted(reply->packet, pond->permit_list))))
+		if (!pond_permitted(reply, pond))
 			continue;
 
 		for (i = 0; (p = pond->ipv6_pools[i]) != NULL; i++) {
 			if ((p->pool_type == D6O_IA_PD) &&
+			    !IPV6_POOL_FULL(p) &&
 			    (eval_prefix_mode(p->units, reply->preflen,
 					      prefix_mode) == 1) &&
 			    (create_prefix6(p, pref, &attempts,
@@ -1780,6 +1851,9 @@ lease_to_client(struct data_string *reply_ret,
 	 */
 	packet_reference(&reply.packet, packet, MDL);
 	data_string_copy(&reply.client_id, client_id, MDL);
+	if (++permit_generation == 0)
+		permit_generation = 1;
+	reply.permit_gen = permit_generation;
 
 	if (!start_reply(packet, client_id, server_id, &reply.opt_state,
 			 &reply.buf.reply))
@@ -2805,10 +2879,7 @@ address_is_owned(struct reply_state *reply, struct iaddr *addr) {
 			}
 
 			pond = tmp->ipv6_pool->ipv6_pond;
-			if (((pond->prohibit_list != NULL) &&
-			     (permitted(reply->packet, pond->prohibit_list))) ||
-			    ((pond->permit_list != NULL) &&
-			     (!permitted(reply->packet, pond->permit_list))))
+			if (!pond_permitted(reply, pond))
 				return (ISC_FALSE);
 
 			iasubopt_reference(&reply->lease, tmp, MDL);
@@ -3400,10 +3471,7 @@ temporary_is_available(struct reply_state *reply, struct iaddr *addr) {
 	 * Verify that this address is in a temporary pool and try to get it.
 	 */
 	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
-		if (((pond->prohibit_list != NULL) &&
-		     (permitted(reply->packet, pond->prohibit_list))) ||
-		    ((pond->permit_list != NULL) &&
-		     (!permitted(reply->packet, pond->permit_list))))
+		if (!pond_permitted(reply, pond))
 			continue;
 
 		for (i = 0 ; (pool = pond->ipv6_pools[i]) != NULL ; i++) {
@@ -3476,10 +3544,7 @@ find_client_temporaries(struct reply_state *reply) {
 	 */
 
 	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
-		if (((pond->prohibit_list != NULL) &&
-		     (permitted(reply->packet, pond->prohibit_list))) ||
-		    ((pond->permit_list != NULL) &&
-		     (!permitted(reply->packet, pond->permit_list))))
+		if (!pond_permitted(reply, pond))
 			continue;
 
 		for (i = 0; (p = pond->ipv6_pools[i]) != NULL; i++) {
@@ -3581,10 +3646,7 @@ reply_process_try_addr(struct reply_state *reply, struct iaddr *addr) {
 	 */
 
 	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
-		if (((pond->prohibit_list != NULL) &&
-		     (permitted(reply->packet, pond->prohibit_list))) ||
-		    ((pond->permit_list != NULL) &&
-		     (!permitted(reply->packet, pond->permit_list))))
+		if (!pond_permitted(reply, pond))
 			continue;
 
 		for (i = 0 ; (pool = pond->ipv6_pools[i]) != NULL ; i++) {
@@ -3650,10 +3712,7 @@ find_client_address(struct reply_state *reply) {
 			    (lease6_usable(lease) != ISC_TRUE))
 				continue;
 
-			if (((pond->prohibit_list != NULL) &&
-			     (permitted(reply->packet, pond->prohibit_list))) ||
-			    ((pond->permit_list != NULL) &&
-			     (!permitted(reply->packet, pond->permit_list))))
+			if (!pond_permitted(reply, pond))
 				continue;
 
 			best_lease = lease_compare(lease, best_lease);
@@ -4752,10 +4811,7 @@ prefix_is_owned(struct reply_state *reply, struct iaddrcidrnet *pref) {
 			}
 
 			pond = tmp->ipv6_pool->ipv6_pond;
-			if (((pond->prohibit_list != NULL) &&
-			     (permitted(reply->packet, pond->prohibit_list))) ||
-			    ((pond->permit_list != NULL) &&
-			     (!permitted(reply->packet, pond->permit_list))))
+			if (!pond_permitted(reply, pond))
 				return (ISC_FALSE);
 
 			iasubopt_reference(&reply->lease, tmp, MDL);
@@ -4823,10 +4879,7 @@ reply_process_try_prefix(struct reply_state *reply,
 	 */
 
 	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
-		if (((pond->prohibit_list != NULL) &&
-		     (permitted(reply->packet, pond->prohibit_list))) ||
-		    ((pond->permit_list != NULL) &&
-		     (!permitted(reply->packet, pond->permit_list))))
+		if (!pond_permitted(reply, pond))
 			continue;
 
 		for (i = 0; (pool = pond->ipv6_pools[i]) != NULL; i++) {
@@ -4916,10 +4969,7 @@ find_client_prefix(struct reply_state *reply) {
 			 * And check if the prefix is still permitted
 			 */
 
-			if (((pond->prohibit_list != NULL) &&
-			     (permitted(reply->packet, pond->prohibit_list))) ||
-			    ((pond->permit_list != NULL) &&
-			     (!permitted(reply->packet, pond->permit_list))))
+			if (!pond_permitted(reply, pond))
 				continue;
 
 			best_prefix = prefix_compare(reply, prefix,
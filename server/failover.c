@@ -1970,7 +1970,7 @@ isc_result_t dhcp_failover_set_state (dhcp_failover_state_t *state,
 	    break;
 
 	  case partner_down:
-	    /* For every expired lease, set a timeout for it to become free. */
+	    /* For every expired lease, work out when it may become free. */
 	    for (s = shared_networks; s; s = s->next) {
 		for (p = s->pools; p; p = p->next) {
 #if defined (BINARY_LEASES)
@@ -1993,22 +1993,6 @@ isc_result_t dhcp_failover_set_state (dhcp_failover_state_t *state,
 #endif
 
 			}
-
-			l = LEASE_GET_FIRST(p->expired);
-			if (l && (l->sort_time < p->next_event_time)) {
-
-			    p->next_event_time = l->sort_time;
-#if defined (DEBUG_FAILOVER_TIMING)
-			    log_info ("add_timeout +%d %s",
-				      (int)(cur_time - p->next_event_time),
-				      "pool_timer");
-#endif
-			    tv.tv_sec = p->next_event_time;
-			    tv.tv_usec = 0;
-			    add_timeout(&tv, pool_timer, p,
-					(tvref_t)pool_reference,
-					(tvunref_t)pool_dereference);
-			}
 		    }
 		}
 	    }
@@ -2018,6 +2002,15 @@ isc_result_t dhcp_failover_set_state (dhcp_failover_state_t *state,
 	    break;
     }
 
+    /* Leases that were passed over for expiry in the old state may be
+       due in the new one. */
+    for (s = shared_networks; s; s = s->next) {
+	for (p = s->pools; p; p = p->next) {
+	    if (p->failover_peer == state)
+		lease_expiry_requeue(p);
+	}
+    }
+
     return ISC_R_SUCCESS;
 }
 
@@ -3979,6 +3972,54 @@ const char *dhcp_failover_option_name (unsigned type)
 	}
 }
 
+/*
+ * Options are built by dhcp_failover_make_option() as the arguments to
+ * dhcp_failover_put_message(), which copies them into the message and
+ * frees them.  Rather than allocate each one, they are carved out of
+ * ft_option_space, and put_message releases the lot once the message is
+ * built.  Anything that doesn't fit is allocated as before.  The message
+ * itself is assembled in ft_message, which is kept for the next one.
+ */
+#define FAILOVER_OPTION_SPACE	8192
+
+static failover_option_t ft_option_space [FAILOVER_OPTION_SPACE /
+					  sizeof (failover_option_t)];
+static unsigned ft_option_used;
+static u_int8_t *ft_message;
+static unsigned ft_message_max;
+
+static failover_option_t *ft_option_alloc (unsigned size)
+{
+	failover_option_t *op;
+	unsigned len;
+
+	/* Keep the next option aligned. */
+	len = sizeof (failover_option_t) + size;
+	len = ((len + sizeof (failover_option_t) - 1) /
+	       sizeof (failover_option_t)) * sizeof (failover_option_t);
+
+	if (ft_option_used + len <= sizeof ft_option_space) {
+		op = (failover_option_t *)
+			((u_int8_t *)ft_option_space + ft_option_used);
+		ft_option_used += len;
+	} else {
+		op = dmalloc (len, MDL);
+		if (!op)
+			return (failover_option_t *)0;
+	}
+	op -> count = size;
+	op -> data = (u_int8_t *)(op + 1);
+	return op;
+}
+
+static void ft_option_free (failover_option_t *op)
+{
+	if ((u_int8_t *)op < (u_int8_t *)ft_option_space ||
+	    (u_int8_t *)op >= (u_int8_t *)ft_option_space +
+			      sizeof ft_option_space)
+		dfree (op, MDL);
+}
+
 failover_option_t *dhcp_failover_option_printf (unsigned code,
 						char *obuf,
 						unsigned *obufix,
@@ -4026,7 +4067,7 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 	   input than on output - on input, count is an element count, and
 	   on output it's the number of bytes total in the option, including
 	   the option code and option length. */
-	failover_option_t option, *op;
+	failover_option_t *op;
 
 
 	/* Bogus option code? */
@@ -4087,16 +4128,15 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 	size += 4;
 
 	/* Allocate a buffer for the option. */
-	option.count = size;
-	option.data = dmalloc (option.count, MDL);
-	if (!option.data) {
+	op = ft_option_alloc (size);
+	if (!op) {
 		va_end (va);
 		return &null_failover_option;
 	}
 
 	/* Put in the option code and option length. */
-	putUShort (option.data, code);
-	putUShort (&option.data [2], size - 4);
+	putUShort (op -> data, code);
+	putUShort (&op -> data [2], size - 4);
 
 #if defined (DEBUG_FAILOVER_MESSAGES)
 	/* %Audit% Truncation causes panic. %2004.06.17,Revisit%
@@ -4107,7 +4147,7 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 	 * a fatal log.
 	 */
 	if (snprintf (tbuf, sizeof tbuf, " (%s<%d>", info -> name,
-			option.count) >= sizeof tbuf)
+			op -> count) >= sizeof tbuf)
 		log_fatal ("dhcp_failover_make_option: tbuf overflow");
 	failover_print (obuf, obufix, obufmax, tbuf);
 #endif
@@ -4122,7 +4162,7 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 			sprintf (tbuf, " %d", val);
 			failover_print (obuf, obufix, obufmax, tbuf);
 #endif
-			option.data [i + 4] = val;
+			op -> data [i + 4] = val;
 		}
 		break;
 
@@ -4130,7 +4170,7 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 		for (i = 0; i < count; i++) {
 			iaddr = va_arg (va, u_int8_t *);
 			if (ilen != 4) {
-				dfree (option.data, MDL);
+				ft_option_free (op);
 				log_error ("IP addrlen=%d, should be 4.",
 					   ilen);
 				va_end (va);
@@ -4143,7 +4183,7 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 				  iaddr [0], iaddr [1], iaddr [2], iaddr [3]);
 			failover_print (obuf, obufix, obufmax, tbuf);
 #endif
-			memcpy (&option.data [4 + i * ilen], iaddr, ilen);
+			memcpy (&op -> data [4 + i * ilen], iaddr, ilen);
 		}
 		break;
 
@@ -4155,7 +4195,7 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 			sprintf (tbuf, " %d", val);
 			failover_print (obuf, obufix, obufmax, tbuf);
 #endif
-			putULong (&option.data [4 + i * 4], val);
+			putULong (&op -> data [4 + i * 4], val);
 		}
 		break;
 
@@ -4169,7 +4209,7 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 			failover_print (obuf, obufix, obufmax, tbuf);
 		}
 #endif
-		memcpy (&option.data [4], bval, count);
+		memcpy (&op -> data [4], bval, count);
 		break;
 
 		/* On output, TEXT_OR_BYTES is _always_ text, and always NUL
@@ -4190,20 +4230,20 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 			log_fatal ("dhcp_failover_make_option: tbuf overflow");
 		failover_print (obuf, obufix, obufmax, tbuf);
 #endif
-		memcpy (&option.data [4], txt, count);
+		memcpy (&op -> data [4], txt, count);
 		break;
 
 	      case FT_DDNS:
 	      case FT_DDNS1:
-		option.data [4] = va_arg (va, unsigned);
+		op -> data [4] = va_arg (va, unsigned);
 		if (count == 2)
-			option.data [5] = va_arg (va, unsigned);
+			op -> data [5] = va_arg (va, unsigned);
 		bval = va_arg (va, u_int8_t *);
-		memcpy (&option.data [4 + count], bval, size - count - 4);
+		memcpy (&op -> data [4 + count], bval, size - count - 4);
 #if defined (DEBUG_FAILOVER_MESSAGES)
 		for (i = 4; i < size; i++) {
 			/*%Audit% Cannot exceed 24 bytes. %2004.06.17,Safe%*/
-			sprintf (tbuf, " %d", option.data [i]);
+			sprintf (tbuf, " %d", op -> data [i]);
 			failover_print (obuf, obufix, obufmax, tbuf);
 		}
 #endif
@@ -4217,7 +4257,7 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 			sprintf (tbuf, " %d", val);
 			failover_print (obuf, obufix, obufmax, tbuf);
 #endif
-			putUShort (&option.data [4 + i * 2], val);
+			putUShort (&op -> data [4 + i * 2], val);
 		}
 		break;
 
@@ -4231,14 +4271,6 @@ failover_option_t *dhcp_failover_make_option (unsigned code,
 #endif
 	va_end (va);
 
-	/* Now allocate a place to store what we just set up. */
-	op = dmalloc (sizeof (failover_option_t), MDL);
-	if (!op) {
-		dfree (option.data, MDL);
-		return &null_failover_option;
-	}
-
-	*op = option;
 	return op;
 }
 
@@ -4248,18 +4280,17 @@ isc_result_t dhcp_failover_put_message (dhcp_failover_link_t *link,
 					omapi_object_t *connection,
 					int msg_type, u_int32_t xid, ...)
 {
-	unsigned size = 0;
+	unsigned size = 12;
 	int bad_option = 0;
-	int opix = 0;
+	unsigned opix;
 	va_list list;
 	failover_option_t *option;
-	unsigned char *opbuf;
+	u_int8_t *mbuf;
 	isc_result_t status = ISC_R_SUCCESS;
-	unsigned char cbuf;
 	struct timeval tv;
 
 	/* Run through the argument list once to compute the length of
-	   the option portion of the message. */
+	   the message. */
 	va_start (list, xid);
 	while ((option = va_arg (list, failover_option_t *))) {
 		if (option != &skip_failover_option)
@@ -4269,69 +4300,54 @@ isc_result_t dhcp_failover_put_message (dhcp_failover_link_t *link,
 	}
 	va_end (list);
 
-	/* Allocate an option buffer, unless we got an error. */
-	if (!bad_option && size) {
-		opbuf = dmalloc (size, MDL);
-		if (!opbuf)
+	/* Make sure the message buffer is big enough. */
+	if (!bad_option && size > ft_message_max) {
+		mbuf = dmalloc (size, MDL);
+		if (mbuf) {
+			if (ft_message)
+				dfree (ft_message, MDL);
+			ft_message = mbuf;
+			ft_message_max = size;
+		} else
 			status = ISC_R_NOMEMORY;
-	} else
-		opbuf = (unsigned char *)0;
+	}
 
+	/* Copy the options into the message after the header, and free
+	   them. */
+	opix = 12;
 	va_start (list, xid);
 	while ((option = va_arg (list, failover_option_t *))) {
-		if (option == &skip_failover_option)
-		    continue;
-		if (!bad_option && opbuf)
-			memcpy (&opbuf [opix],
+		if (option == &skip_failover_option ||
+		    option == &null_failover_option)
+			continue;
+		if (!bad_option && status == ISC_R_SUCCESS) {
+			memcpy (&ft_message [opix],
 				option -> data, option -> count);
-		if (option != &null_failover_option &&
-		    option != &skip_failover_option) {
 			opix += option -> count;
-			dfree (option -> data, MDL);
-			dfree (option, MDL);
 		}
+		ft_option_free (option);
 	}
 	va_end(list);
+	ft_option_used = 0;
 
 	if (bad_option)
 		return DHCP_R_INVALIDARG;
-
-	/* Now send the message header. */
-
-	/* Message length. */
-	status = omapi_connection_put_uint16 (connection, size + 12);
 	if (status != ISC_R_SUCCESS)
 		goto err;
 
-	/* Message type. */
-	cbuf = msg_type;
-	status = omapi_connection_copyin (connection, &cbuf, 1);
-	if (status != ISC_R_SUCCESS)
-		goto err;
-
-	/* Payload offset. */
-	cbuf = 12;
-	status = omapi_connection_copyin (connection, &cbuf, 1);
-	if (status != ISC_R_SUCCESS)
-		goto err;
+	/* Now fill in the header: message length, message type, payload
+	   offset, current time and transaction ID. */
+	putUShort (&ft_message [0], size);
+	ft_message [2] = msg_type;
+	ft_message [3] = 12;
+	putULong (&ft_message [4], (u_int32_t)cur_time);
+	putULong (&ft_message [8], xid);
 
-	/* Current time. */
-	status = omapi_connection_put_uint32 (connection, (u_int32_t)cur_time);
+	/* And hand the whole message to the connection at once. */
+	status = omapi_connection_copyin (connection, ft_message, size);
 	if (status != ISC_R_SUCCESS)
 		goto err;
 
-	/* Transaction ID. */
-	status = omapi_connection_put_uint32(connection, xid);
-	if (status != ISC_R_SUCCESS)
-		goto err;
-
-	/* Payload. */
-	if (opbuf) {
-		status = omapi_connection_copyin (connection, opbuf, size);
-		if (status != ISC_R_SUCCESS)
-			goto err;
-		dfree (opbuf, MDL);
-	}
 	if (link -> state_object &&
 	    link -> state_object -> link_to_peer == link) {
 #if defined (DEBUG_FAILOVER_CONTACT_TIMING)
@@ -4352,8 +4368,6 @@ isc_result_t dhcp_failover_put_message (dhcp_failover_link_t *link,
 	return status;
 
       err:
-	if (opbuf)
-		dfree (opbuf, MDL);
 	log_info ("dhcp_failover_put_message: something went wrong.");
 	omapi_disconnect (connection, 1);
 	return status;
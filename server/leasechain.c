@@ -59,9 +59,16 @@
  * The linked list is maintained in an ordered state.  Inserting an entry is
  * accomplished by doing a binary search on the array to find the proper place
  * in the list and then updating the pointers in the linked list to include the
- * new entry.  The entry is added into the array by copying the remainder of
- * the array to provide space for the new entry.
+ * new entry.  The entry is added into the array by moving the entries on one
+ * side of it to provide space for the new entry.
  * Removing an entry is the reverse.
+ *
+ * The array may have free space at its start as well as at its end, and
+ * an insert or remove moves whichever side of the entry is shorter.  The
+ * allocator takes leases from the front of the free and backup queues,
+ * while leases coming back onto a queue usually go near its end, so
+ * neither of the common cases moves more than a few pointers.
+ *
  * The arrays for the queues will be pre-allocated but not all of them will be
  * large enough to hold all of the leases.  If additional space is required the
  * array will be grown.
@@ -285,10 +292,14 @@ lc_binary_search_lease(struct leasechain *lc,
 
 /*!
  *
- * \brief Increase the size of the array for the lease chain
+ * \brief Make room at the end of the array for the lease chain
  *
  * \param lc The leasechain to expand
  *
+ * If a good part of the array is free space at its start, the entries
+ * are moved down to the start of the array.  Otherwise the array is
+ * grown.
+ *
  * If we are unable to allocate memory we log a fatal error.  There's
  * not much else to do as we can't figure out where to put the lease.
  *
@@ -304,6 +315,13 @@ lc_grow_chain(struct leasechain *lc) {
 	void *p;
 	size_t temp_size;
 
+	if ((size_t)(lc->list - lc->base) > lc->total / 4) {
+		memmove(lc->base, lc->list,
+			sizeof(struct lease *) * lc->nelem);
+		lc->list = lc->base;
+		return;
+	}
+
 	if (lc->growth == 0)
 		temp_size = lc->total + LC_GROWTH_DELTA;
 	else
@@ -316,11 +334,11 @@ lc_grow_chain(struct leasechain *lc) {
 	}
 
 	/* Success, copy the lease chain and install the new one */
-	if (lc->list != NULL) {
+	if (lc->base != NULL) {
 		memcpy(p, lc->list, sizeof(struct lease *) * lc->nelem);
-		dfree(lc->list, MDL);
+		dfree(lc->base, MDL);
 	}
-	lc->list = (struct lease **) p;
+	lc->list = lc->base = (struct lease **) p;
 	lc->total = temp_size;
 
 	return;
@@ -347,23 +365,29 @@ lc_link_lcp(struct leasechain *lc, struct lease *lp, size_t n) {
 	INSIST (lp != NULL);
 #endif
 
-	if (lc->nelem == lc->total) {
-		lc_grow_chain(lc);
-	}
-
 #if defined (DEBUG_BINARY_LEASES)
 	log_debug("LC Link lcp position %zu, elem %zu, %s:%d",
 		  n, lc->nelem, MDL);
 #endif
 
-	/* create room for the new pointer */
-	if (n < lc->nelem) {
+	/* create room for the new pointer, moving the entries before it
+	 * down if there are fewer of them and there is room, or else the
+	 * entries after it up */
+	if (n < lc->nelem / 2 && lc->list > lc->base) {
+		memmove(lc->list - 1, lc->list, sizeof(struct lease *) * n);
+		lc->list--;
+	} else {
+		if ((size_t)(lc->list - lc->base) + lc->nelem == lc->total) {
+			lc_grow_chain(lc);
+		}
+		if (n < lc->nelem) {
 #if defined (DEBUG_BINARY_LEASES)
-		log_debug("LC link lcp moving position %zu, moving %zu. %s:%d",
-			  n, (lc->nelem-n), MDL);
+			log_debug("LC link lcp moving position %zu, "
+				  "moving %zu. %s:%d", n, (lc->nelem-n), MDL);
 #endif
-		memmove(lc->list + n + 1,  lc->list + n,
-			sizeof(struct lease *) * (lc->nelem-n));
+			memmove(lc->list + n + 1,  lc->list + n,
+				sizeof(struct lease *) * (lc->nelem-n));
+		}
 	}
 
 	/* clean any stale pointer info from this position before calling
@@ -547,7 +571,7 @@ lc_add_sorted_lease(struct leasechain *lc, struct lease *lp) {
 /*!
  *
  * \brief Remove the Nth pointer from a leasechain structure and update counters.
- * The pointers in the array will be moved to fill in the hole if necessary.
+ * The pointers on the shorter side of the hole will be moved to fill it in.
  *
  * \param lc The lease chain to update
  * \param n the entry to remove from the lease chain
@@ -567,12 +591,22 @@ lc_unlink_lcp(struct leasechain *lc, size_t n) {
 	/* Clear the pointer from the LC to the lease */
 	lease_dereference(&(lc->list[n]), MDL);
 
-	/*  memove unless we are removing the last element */
-	if ((lc->nelem-1) > n) {
+	if (n < lc->nelem / 2) {
+		/* Move the entries before the hole up; from the first
+		 * element this moves nothing */
+		memmove(lc->list + 1, lc->list, sizeof(struct lease *) * n);
+		lc->list++;
+	} else if ((lc->nelem-1) > n) {
+		/* memove unless we are removing the last element */
 		memmove(lc->list + n, lc->list + n + 1,
 			sizeof(struct lease *) * (lc->nelem-1-n));
 	}
 	lc->nelem--;
+
+	/* An empty chain starts over at the start of the array */
+	if (lc->nelem == 0) {
+		lc->list = lc->base;
+	}
 }
 
 /*!
@@ -634,7 +668,17 @@ lc_unlink_lease(struct leasechain *lc, struct lease *lp) {
 	INSIST(lp->lc == lc );
 #endif
 
-	size_t pos = lc_binary_search_lease(lc, lp, 0, lc->nelem-1);
+	size_t pos;
+
+	/* The allocator takes leases from the front of a queue and the
+	 * newest lease is at its end, so check both before searching */
+	if (lc->nelem > 0 && lc->list[0] == lp) {
+		pos = 0;
+	} else if (lc->nelem > 0 && lc->list[lc->nelem-1] == lp) {
+		pos = lc->nelem - 1;
+	} else {
+		pos = lc_binary_search_lease(lc, lp, 0, lc->nelem-1);
+	}
 	if (pos == SIZE_MAX) {
 		/* fatal, lease not found in leasechain */
 		log_fatal("Lease with binding state %s not on its queue.",
@@ -670,8 +714,9 @@ lc_delete_all(struct leasechain *lc) {
 	}
 
 	/* and then get rid of the list itself */
-	if (lc->list != NULL) {
-		dfree(lc->list, MDL);
+	if (lc->base != NULL) {
+		dfree(lc->base, MDL);
+		lc->base = NULL;
 		lc->list = NULL;
 	}
 
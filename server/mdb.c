@@ -31,6 +31,9 @@
 
 struct subnet *subnets;
 struct shared_network *shared_networks;
+
+/* Index over the subnets list, used by find_subnet(). */
+static struct subnet_tree subnet_index;
 host_hash_t *host_hw_addr_hash;
 host_hash_t *host_uid_hash;
 host_hash_t *host_name_hash;
@@ -94,6 +97,7 @@ isc_result_t enter_class(cd, dynamicp, commit)
 			/* nothing */ ;
 		class_reference (&c -> nic, cd, MDL);
 	}
+	class_index_invalidate();
 
 	if (dynamicp && commit) {
 		const char *name = cd->name;
@@ -120,6 +124,8 @@ isc_result_t enter_class(cd, dynamicp, commit)
 #define SS_QFOLLOW	2
 static int server_starting = 0;
 
+static void lease_expiry_arm(void);
+
 static int find_uid_statement (struct executable_statement *esp,
 			       void *vp, int condp)
 {
@@ -186,6 +192,7 @@ change_host_uid(struct host_decl *host, const char *uid, int len) {
 		if (!host_new_hash(&host_uid_hash, HOST_HASH_SIZE, MDL)) {
 			log_fatal("Can't allocate host/uid hash");
 		}
+		host_hash_enable_resize(host_uid_hash);
 	}
 
 	/*
@@ -286,6 +293,7 @@ isc_result_t enter_host (hd, dynamicp, commit)
 			if (!host_new_hash(&host_hw_addr_hash,
 					   HOST_HASH_SIZE, MDL))
 				log_fatal ("Can't allocate host/hw hash");
+			host_hash_enable_resize(host_hw_addr_hash);
 		} else {
 			/* If there isn't already a host decl matching this
 			   address, add it to the hash table. */
@@ -350,6 +358,7 @@ isc_result_t enter_host (hd, dynamicp, commit)
 			if (!host_new_hash(&host_uid_hash,
 					   HOST_HASH_SIZE, MDL))
 				log_fatal ("Can't allocate host/uid hash");
+			host_hash_enable_resize(host_uid_hash);
 
 			host_hash_add (host_uid_hash,
 				       hd -> client_identifier.data,
@@ -804,20 +813,25 @@ void new_address_range (cfile, low, high, subnet, pool, lpchain)
 		       netbuf, piaddr (subnet -> netmask));
 	}
 
-	/* Initialize the hash table if it hasn't been done yet. */
+	/* Initialize the hash table if it hasn't been done yet.  These
+	   grow with the number of leases rather than staying at
+	   LEASE_HASH_SIZE buckets. */
 	if (!lease_uid_hash) {
 		if (!lease_id_new_hash(&lease_uid_hash, LEASE_HASH_SIZE, MDL))
 			log_fatal ("Can't allocate lease/uid hash");
+		lease_id_hash_enable_resize(lease_uid_hash);
 	}
 	if (!lease_ip_addr_hash) {
 		if (!lease_ip_new_hash(&lease_ip_addr_hash, LEASE_HASH_SIZE,
 				       MDL))
 			log_fatal ("Can't allocate lease/ip hash");
+		lease_ip_hash_enable_resize(lease_ip_addr_hash);
 	}
 	if (!lease_hw_addr_hash) {
 		if (!lease_id_new_hash(&lease_hw_addr_hash, LEASE_HASH_SIZE,
 				       MDL))
 			log_fatal ("Can't allocate lease/hw hash");
+		lease_id_hash_enable_resize(lease_hw_addr_hash);
 	}
 
 	/* Make sure that high and low addresses are in this subnet. */
@@ -858,8 +872,8 @@ void new_address_range (cfile, low, high, subnet, pool, lpchain)
 #if defined (COMPACT_LEASES)
 	s = (num_addrs + 1) * sizeof (struct lease);
 	/* Check unsigned overflow in new_leases().
-	   With 304 byte lease structure (x64_86), this happens at
-	   range 10.0.0.0 10.215.148.52; */
+	   With 320 byte lease structure (x64_86), this happens at
+	   range 10.0.0.0 10.204.204.203; */
 	if (((s % sizeof (struct lease)) != 0) ||
 	    ((s / sizeof (struct lease)) != (num_addrs + 1))) {
 		strcpy (lowbuf, piaddr (low));
@@ -929,11 +943,162 @@ void new_address_range (cfile, low, high, subnet, pool, lpchain)
 	}
 }
 
+/*
+ * Subnet index.
+ *
+ * A node holds a prefix of 'bits' bits; it either names a subnet or is
+ * a branch point created where two prefixes diverge.  Nodes with no
+ * subnet always have two children.  The subnets themselves are held
+ * by reference from the subnet and sibling lists, so the index only
+ * keeps plain pointers.  The index is released by subnet_tree_free()
+ * in common/comapi.c, since shared networks are destroyed there.
+ */
+
+static int
+subnet_tree_bit(const unsigned char *key, int bit)
+{
+	return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/* Number of leading bits, up to max, that a and b have in common. */
+static int
+subnet_tree_common(const unsigned char *a, const unsigned char *b, int max)
+{
+	int i, bits = 0;
+	unsigned char diff;
+
+	for (i = 0; bits < max; i++, bits += 8) {
+		diff = a[i] ^ b[i];
+		if (diff != 0) {
+			while ((diff & 0x80) == 0) {
+				diff <<= 1;
+				bits++;
+			}
+			break;
+		}
+	}
+	return (bits < max ? bits : max);
+}
+
+/* Prefix length of a netmask, or -1 if the mask isn't contiguous. */
+static int
+subnet_mask_bits(const struct iaddr *mask)
+{
+	int bits = 0, i;
+
+	while (bits < mask->len * 8 && subnet_tree_bit(mask->iabuf, bits))
+		bits++;
+	for (i = bits; i < mask->len * 8; i++)
+		if (subnet_tree_bit(mask->iabuf, i))
+			return -1;
+	return bits;
+}
+
+static struct subnet_tree_node *
+subnet_tree_node_new(const unsigned char *key, int bits,
+		     struct subnet *subnet)
+{
+	struct subnet_tree_node *node;
+
+	node = dmalloc(sizeof(*node), MDL);
+	if (node == NULL)
+		log_fatal("No memory for subnet index.");
+	memcpy(node->key, key, (bits + 7) / 8);
+	if ((bits & 7) != 0)
+		node->key[bits >> 3] &= 0xff << (8 - (bits & 7));
+	node->bits = bits;
+	node->subnet = subnet;
+	return node;
+}
+
+/*
+ * Add a subnet to an index.  If a subnet with the same prefix is
+ * already present it is only replaced when 'replace' is set, which
+ * mirrors the order in which the list being indexed is searched.
+ */
+void
+subnet_tree_add(struct subnet_tree *tree, struct subnet *subnet, int replace)
+{
+	struct subnet_tree_node **np, *n, *leaf, *branch;
+	const unsigned char *key = subnet->net.iabuf;
+	int bits, common;
+
+	bits = subnet_mask_bits(&subnet->netmask);
+	if (bits < 0 || subnet->net.len != subnet->netmask.len ||
+	    (subnet->net.len != 4 && subnet->net.len != 16)) {
+		tree->unindexed++;
+		return;
+	}
+
+	np = &tree->root[subnet->net.len == 16];
+	while ((n = *np) != NULL) {
+		common = subnet_tree_common(n->key, key,
+					    n->bits < bits ? n->bits : bits);
+		if (common < n->bits) {
+			leaf = subnet_tree_node_new(key, bits, subnet);
+			if (common == bits) {
+				/* The new prefix covers this node. */
+				leaf->child[subnet_tree_bit(n->key, bits)] = n;
+				*np = leaf;
+			} else {
+				/* The prefixes diverge at bit 'common'. */
+				branch = subnet_tree_node_new(key, common,
+							      NULL);
+				branch->child[subnet_tree_bit(n->key,
+							      common)] = n;
+				branch->child[subnet_tree_bit(key,
+							      common)] = leaf;
+				*np = branch;
+			}
+			return;
+		}
+		if (n->bits == bits) {
+			if (n->subnet == NULL || replace)
+				n->subnet = subnet;
+			return;
+		}
+		np = &n->child[subnet_tree_bit(key, n->bits)];
+	}
+	*np = subnet_tree_node_new(key, bits, subnet);
+}
+
+/* Return the subnet with the longest prefix containing addr. */
+struct subnet *
+subnet_tree_lookup(const struct subnet_tree *tree, const struct iaddr *addr)
+{
+	struct subnet_tree_node *n;
+	struct subnet *best = NULL;
+
+	if (addr->len != 4 && addr->len != 16)
+		return NULL;
+
+	n = tree->root[addr->len == 16];
+	while (n != NULL) {
+		if (subnet_tree_common(n->key, addr->iabuf, n->bits) < n->bits)
+			break;
+		if (n->subnet != NULL)
+			best = n->subnet;
+		if (n->bits >= addr->len * 8)
+			break;
+		n = n->child[subnet_tree_bit(addr->iabuf, n->bits)];
+	}
+	return best;
+}
+
 int find_subnet (struct subnet **sp,
 		 struct iaddr addr, const char *file, int line)
 {
 	struct subnet *rv;
 
+	/* Use the index unless some subnet couldn't be entered in it. */
+	if (!subnet_index.unindexed) {
+		rv = subnet_tree_lookup(&subnet_index, &addr);
+		if (rv == NULL ||
+		    subnet_reference(sp, rv, file, line) != ISC_R_SUCCESS)
+			return 0;
+		return 1;
+	}
+
 	for (rv = subnets; rv; rv = rv -> next_subnet) {
 #if defined(DHCP4o6)
 		if (addr.len != rv->netmask.len)
@@ -955,6 +1120,18 @@ int find_grouped_subnet (struct subnet **sp,
 {
 	struct subnet *rv;
 
+	/* Every subnet on the sibling list is also in the shared
+	   network's index, if that has been built. */
+	if ((share->subnet_tree.root[0] != NULL ||
+	     share->subnet_tree.root[1] != NULL) &&
+	    !share->subnet_tree.unindexed) {
+		rv = subnet_tree_lookup(&share->subnet_tree, &addr);
+		if (rv == NULL ||
+		    subnet_reference(sp, rv, file, line) != ISC_R_SUCCESS)
+			return 0;
+		return 1;
+	}
+
 	for (rv = share -> subnets; rv; rv = rv -> next_sibling) {
 #if defined(DHCP4o6)
 		if (addr.len != rv->netmask.len)
@@ -1011,6 +1188,10 @@ void enter_subnet (subnet)
 	struct subnet *next = (struct subnet *)0;
 	struct subnet *prev = (struct subnet *)0;
 
+	/* The most recently entered of two identical subnets is found
+	   first on the list, so it replaces the older one in the index. */
+	subnet_tree_add(&subnet_index, subnet, 1);
+
 	/* Check for duplicates... */
 	if (subnets)
 	    subnet_reference (&next, subnets, MDL);
@@ -1159,7 +1340,6 @@ int supersede_lease (comp, lease, commit, propogate, pimmediate, from_pool)
 	int from_pool;
 {
 	LEASE_STRUCT_PTR lq;
-	struct timeval tv;
 #if defined (FAILOVER_PROTOCOL)
 	int do_pool_check = 0;
 
@@ -1338,7 +1518,7 @@ int supersede_lease (comp, lease, commit, propogate, pimmediate, from_pool)
 	/*
 	 * Atsfp should be cleared upon any state change that implies
 	 * propagation whether supersede_lease was given a copy lease
-	 * structure or not (often from the pool_timer()).
+	 * structure or not (often from lease_expiry_run()).
 	 */
 	if (propogate)
 		comp->atsfp = 0;
@@ -1404,6 +1584,7 @@ int supersede_lease (comp, lease, commit, propogate, pimmediate, from_pool)
 	/* Remove the lease from its current place in its current
 	   timer sequence. */
 	LEASE_REMOVEP(lq, comp);
+	lease_expiry_cancel(comp);
 
 	/* Now that we've done the flag-affected queue removal
 	 * we can update the new lease's flags, if there's an
@@ -1422,30 +1603,17 @@ int supersede_lease (comp, lease, commit, propogate, pimmediate, from_pool)
 	if (!lease_enqueue (comp))
 		return 0;
 
-	/* If this is the next lease that will timeout on the pool,
-	   zap the old timeout and set the timeout on this pool to the
-	   time that the lease's next event will happen.
+	/* If this is now the next lease that will time out, move the
+	   expiry timer up to the time that the lease's next event will
+	   happen.
 
-	   We do not actually set the timeout unless commit is true -
+	   We do not actually set the timer unless commit is true -
 	   we don't want to thrash the timer queue when reading the
-	   lease database.  Instead, the database code calls the
-	   expiry event on each pool after reading in the lease file,
-	   and the expiry code sets the timer if there's anything left
-	   to expire after it's run any outstanding expiry events on
-	   the pool. */
-	if ((commit || !pimmediate) &&
-	    comp -> sort_time != MIN_TIME &&
-	    comp -> sort_time > cur_time &&
-	    (comp -> sort_time < comp -> pool -> next_event_time ||
-	     comp -> pool -> next_event_time == MIN_TIME)) {
-		comp -> pool -> next_event_time = comp -> sort_time;
-		tv . tv_sec = comp -> pool -> next_event_time;
-		tv . tv_usec = 0;
-		add_timeout (&tv,
-			     pool_timer, comp -> pool,
-			     (tvref_t)pool_reference,
-			     (tvunref_t)pool_dereference);
-	}
+	   lease database.  Instead, the database code runs the expiry
+	   events after reading in the lease file, and that sets the
+	   timer if there's anything left to expire. */
+	if (commit || !pimmediate)
+		lease_expiry_arm ();
 
 	if (commit) {
 #if defined(FAILOVER_PROTOCOL)
@@ -1485,7 +1653,7 @@ int supersede_lease (comp, lease, commit, propogate, pimmediate, from_pool)
 #endif
 
 	/* If the current binding state has already expired and we haven't
-	 * been called from pool_timer, do an expiry event right now.
+	 * been called from lease_expiry_run, do an expiry event right now.
 	 */
 	/* XXX At some point we should optimize this so that we don't
 	   XXX write the lease twice, but this is a safe way to fix the
@@ -1494,7 +1662,7 @@ int supersede_lease (comp, lease, commit, propogate, pimmediate, from_pool)
 	    (commit || !pimmediate) &&
 	    (comp->sort_time < cur_time) &&
 	    (comp->next_binding_state != comp->binding_state))
-		pool_timer(comp->pool);
+		lease_expiry_run(NULL);
 
 	return 1;
 }
@@ -1909,141 +2077,275 @@ void dissociate_lease (lease)
 }
 #endif
 
-/* Timer called when a lease in a particular pool expires. */
-void pool_timer (vpool)
-	void *vpool;
-{
-	struct pool *pool;
-	struct lease *next = NULL;
-	struct lease *lease = NULL;
-	struct lease *ltemp = NULL;
+/*
+ * Lease expiry index.   Every lease with a state change pending (its
+ * next binding state differs from its binding state) is kept in a
+ * 4-ary min-heap on sort_time that is shared by all pools, and a single
+ * timer is set for the lease at the top.   When the timer goes off,
+ * lease_expiry_run() makes the state change on each lease that is due,
+ * so the work done is proportional to the number of leases that expire
+ * rather than to the number of pools and queues.
+ *
+ * lease_enqueue() puts a lease into the heap, or moves it, whenever it
+ * requeues the lease; lease->expiry_slot is the lease's position in the
+ * heap (one-based, zero when it isn't in it), so both take O(log n).
+ * The pool queues are still kept in sort_time order, because the
+ * allocator takes the oldest lease from the front of them.
+ *
+ * With failover, a lease that isn't allowed to expire in the current
+ * failover state is dropped from the heap when it comes due;
+ * lease_expiry_requeue() puts such leases back when the state changes.
+ */
 #define FREE_LEASES 0
 #define ACTIVE_LEASES 1
 #define EXPIRED_LEASES 2
 #define ABANDONED_LEASES 3
 #define BACKUP_LEASES 4
 #define RESERVED_LEASES 5
-	LEASE_STRUCT_PTR lptr[RESERVED_LEASES+1];
-	TIME next_expiry = MAX_TIME;
-	int i;
+
+#define EXPIRY_ARITY 4
+
+static struct lease **expiry_heap;
+static unsigned expiry_count, expiry_max;
+static TIME expiry_timer_time;		/* MIN_TIME if no timer is set. */
+static int expiry_running;
+
+static void
+expiry_place(unsigned i, struct lease *lease)
+{
+	expiry_heap[i] = lease;
+	lease->expiry_slot = i + 1;
+}
+
+static void
+expiry_sift_up(unsigned i)
+{
+	struct lease *lease = expiry_heap[i];
+	unsigned parent;
+
+	while (i > 0) {
+		parent = (i - 1) / EXPIRY_ARITY;
+		if (expiry_heap[parent]->sort_time <= lease->sort_time)
+			break;
+		expiry_place(i, expiry_heap[parent]);
+		i = parent;
+	}
+	expiry_place(i, lease);
+}
+
+static void
+expiry_sift_down(unsigned i)
+{
+	struct lease *lease = expiry_heap[i];
+	unsigned child, best, last;
+
+	for (;;) {
+		child = i * EXPIRY_ARITY + 1;
+		if (child >= expiry_count)
+			break;
+		last = child + EXPIRY_ARITY;
+		if (last > expiry_count)
+			last = expiry_count;
+		for (best = child++; child < last; child++)
+			if (expiry_heap[child]->sort_time <
+			    expiry_heap[best]->sort_time)
+				best = child;
+		if (lease->sort_time <= expiry_heap[best]->sort_time)
+			break;
+		expiry_place(i, expiry_heap[best]);
+		i = best;
+	}
+	expiry_place(i, lease);
+}
+
+/* Take a lease out of the expiry index, if it is in it. */
+void
+lease_expiry_cancel(struct lease *lease)
+{
+	unsigned i;
+
+	if (lease->expiry_slot == 0)
+		return;
+	i = lease->expiry_slot - 1;
+	lease->expiry_slot = 0;
+
+	if (i == --expiry_count)
+		return;
+	expiry_place(i, expiry_heap[expiry_count]);
+	if (i > 0 && expiry_heap[i]->sort_time <
+		     expiry_heap[(i - 1) / EXPIRY_ARITY]->sort_time)
+		expiry_sift_up(i);
+	else
+		expiry_sift_down(i);
+}
+
+/* Put a lease into the expiry index, or move it there after its
+   sort_time has changed.   A lease with no state change pending is left
+   out. */
+void
+lease_expiry_schedule(struct lease *lease)
+{
+	struct lease **heap;
+	unsigned max;
+
+	if (lease->next_binding_state == lease->binding_state) {
+		lease_expiry_cancel(lease);
+		return;
+	}
+
+	if (lease->expiry_slot != 0) {
+		expiry_sift_up(lease->expiry_slot - 1);
+		expiry_sift_down(lease->expiry_slot - 1);
+		return;
+	}
+
+	if (expiry_count == expiry_max) {
+		max = expiry_max ? expiry_max * 2 : 1024;
+		heap = dmalloc(max * sizeof(*heap), MDL);
+		if (heap == NULL)
+			log_fatal("No memory for lease expiry index.");
+		if (expiry_heap != NULL) {
+			memcpy(heap, expiry_heap,
+			       expiry_count * sizeof(*heap));
+			dfree(expiry_heap, MDL);
+		}
+		expiry_heap = heap;
+		expiry_max = max;
+	}
+	expiry_place(expiry_count, lease);
+	expiry_sift_up(expiry_count++);
+}
+
+/* Make sure the timer goes off when the first lease in the index is due. */
+static void
+lease_expiry_arm(void)
+{
 	struct timeval tv;
+	TIME when;
+
+	if (expiry_count == 0 || expiry_running)
+		return;
+	when = expiry_heap[0]->sort_time;
+	if (when < cur_time)
+		when = cur_time;
+	if (expiry_timer_time != MIN_TIME && expiry_timer_time <= when)
+		return;
 
-	pool = (struct pool *)vpool;
+	expiry_timer_time = when;
+	tv.tv_sec = when;
+	tv.tv_usec = 0;
+	add_timeout(&tv, lease_expiry_run, NULL, NULL, NULL);
+}
 
-	lptr[FREE_LEASES] = &pool->free;
-	lptr[ACTIVE_LEASES] = &pool->active;
-	lptr[EXPIRED_LEASES] = &pool->expired;
-	lptr[ABANDONED_LEASES] = &pool->abandoned;
-	lptr[BACKUP_LEASES] = &pool->backup;
-	lptr[RESERVED_LEASES] = &pool->reserved;
+/* Put the leases of a pool that may have been passed over back into the
+   expiry index; called when the pool's failover state changes. */
+void
+lease_expiry_requeue(struct pool *pool)
+{
+	struct lease *lease;
 
-	for (i = FREE_LEASES; i <= RESERVED_LEASES; i++) {
-		/* If there's nothing on the queue, skip it. */
-		if (!(LEASE_NOT_EMPTYP(lptr[i])))
-			continue;
+	for (lease = LEASE_GET_FIRST(pool->active); lease != NULL;
+	     lease = LEASE_GET_NEXT(pool->active, lease))
+		lease_expiry_schedule(lease);
+	for (lease = LEASE_GET_FIRST(pool->expired); lease != NULL;
+	     lease = LEASE_GET_NEXT(pool->expired, lease))
+		lease_expiry_schedule(lease);
+	lease_expiry_arm();
+}
 
+/* Nonzero if the pending state change on a lease may be made now. */
+static int
+lease_expiry_permitted(struct lease *lease)
+{
 #if defined (FAILOVER_PROTOCOL)
-		if (pool->failover_peer &&
-		    pool->failover_peer->me.state != partner_down) {
-			/*
-			 * Normally the secondary doesn't initiate expiration
-			 * events (unless in partner-down), but rather relies
-			 * on the primary to expire the lease.  However, when
-			 * disconnected from its peer, the server is allowed to
-			 * rewind a lease to the previous state that the peer
-			 * would have recorded it.  This means there may be
-			 * opportunities for active->free or active->backup
-			 * expirations while out of contact.
-			 *
-			 * Q: Should we limit this expiration to
-			 *    comms-interrupt rather than not-normal?
-			 */
-			if ((i == ACTIVE_LEASES) &&
-			    (pool->failover_peer->i_am == secondary) &&
-			    (pool->failover_peer->me.state == normal))
-				continue;
+	dhcp_failover_state_t *peer = lease->pool->failover_peer;
 
-			/* Leases in an expired state don't move to
-			   free because of a timeout unless we're in
-			   partner_down. */
-			if (i == EXPIRED_LEASES)
-				continue;
-		}
-#endif
-		lease_reference(&lease, LEASE_GET_FIRSTP(lptr[i]), MDL);
+	if (peer != NULL && peer->me.state != partner_down) {
+		/*
+		 * Normally the secondary doesn't initiate expiration
+		 * events (unless in partner-down), but rather relies
+		 * on the primary to expire the lease.  However, when
+		 * disconnected from its peer, the server is allowed to
+		 * rewind a lease to the previous state that the peer
+		 * would have recorded it.  This means there may be
+		 * opportunities for active->free or active->backup
+		 * expirations while out of contact.
+		 *
+		 * Q: Should we limit this expiration to
+		 *    comms-interrupt rather than not-normal?
+		 */
+		if (lease->binding_state == FTS_ACTIVE &&
+		    peer->i_am == secondary && peer->me.state == normal)
+			return 0;
 
-		while (lease) {
-			/* Remember the next lease in the list. */
-			if (next)
-				lease_dereference(&next, MDL);
-			ltemp = LEASE_GET_NEXTP(lptr[i], lease);
-			if (ltemp)
-				lease_reference(&next, ltemp, MDL);
-
-			/* If we've run out of things to expire on this list,
-			   stop. */
-			if (lease->sort_time > cur_time) {
-				if (lease->sort_time < next_expiry)
-					next_expiry = lease->sort_time;
-				break;
-			}
+		/* Leases in an expired state don't move to
+		   free because of a timeout unless we're in
+		   partner_down. */
+		if (lease->binding_state == FTS_EXPIRED ||
+		    lease->binding_state == FTS_RELEASED ||
+		    lease->binding_state == FTS_RESET)
+			return 0;
+	}
+#endif
+	return 1;
+}
 
-			/* If there is a pending state change, and
-			   this lease has gotten to the time when the
-			   state change should happen, just call
-			   supersede_lease on it to make the change
-			   happen. */
-			if (lease->next_binding_state != lease->binding_state)
-			{
-#if defined(FAILOVER_PROTOCOL)
-				dhcp_failover_state_t *peer = NULL;
-
-				if (lease->pool != NULL)
-					peer = lease->pool->failover_peer;
-
-				/* Can we rewind the lease to a free state? */
-				if (peer != NULL &&
-				    peer->service_state == not_cooperating &&
-				    lease->next_binding_state == FTS_EXPIRED &&
-				    ((peer->i_am == primary &&
-				      lease->rewind_binding_state == FTS_FREE)
-					||
-				     (peer->i_am == secondary &&
-				      lease->rewind_binding_state ==
-								FTS_BACKUP)))
-					lease->next_binding_state =
-						   lease->rewind_binding_state;
+/* Timer called when the first lease in the expiry index is due. */
+void
+lease_expiry_run(void *unused)
+{
+	struct lease *lease = NULL;
+	binding_state_t state;
+#if defined (FAILOVER_PROTOCOL)
+	dhcp_failover_state_t *peer;
 #endif
-				supersede_lease(lease, NULL, 1, 1, 1, 1);
-			}
 
+	if (expiry_running)
+		return;
+	expiry_running = 1;
+	expiry_timer_time = MIN_TIME;
+
+	while (expiry_count > 0 && expiry_heap[0]->sort_time <= cur_time) {
+		lease_reference(&lease, expiry_heap[0], MDL);
+		lease_expiry_cancel(lease);
+
+		if (lease->pool == NULL || !lease_expiry_permitted(lease)) {
 			lease_dereference(&lease, MDL);
-			if (next)
-				lease_reference(&lease, next, MDL);
+			continue;
 		}
-		if (next)
-			lease_dereference(&next, MDL);
-		if (lease)
-			lease_dereference(&lease, MDL);
-	}
 
-	/* If we found something to expire and its expiration time
-	 * is either less than the current expiration time or the
-	 * current expiration time is already expired update the
-	 * timer.
-	 */
-	if ((next_expiry != MAX_TIME) &&
-	    ((pool->next_event_time > next_expiry) ||
-	     (pool->next_event_time <= cur_time))) {
-		pool->next_event_time = next_expiry;
-		tv.tv_sec = pool->next_event_time;
-		tv.tv_usec = 0;
-		add_timeout (&tv, pool_timer, pool,
-			     (tvref_t)pool_reference,
-			     (tvunref_t)pool_dereference);
-	} else
-		pool->next_event_time = MIN_TIME;
+		/* This lease has gotten to the time when its pending
+		   state change should happen, so just call
+		   supersede_lease on it to make the change happen. */
+#if defined(FAILOVER_PROTOCOL)
+		peer = lease->pool->failover_peer;
+
+		/* Can we rewind the lease to a free state? */
+		if (peer != NULL &&
+		    peer->service_state == not_cooperating &&
+		    lease->next_binding_state == FTS_EXPIRED &&
+		    ((peer->i_am == primary &&
+		      lease->rewind_binding_state == FTS_FREE)
+			||
+		     (peer->i_am == secondary &&
+		      lease->rewind_binding_state == FTS_BACKUP)))
+			lease->next_binding_state =
+				lease->rewind_binding_state;
+#endif
+		state = lease->binding_state;
+		supersede_lease(lease, NULL, 1, 1, 1, 1);
+
+		/* If the state change didn't happen, don't try it again
+		   until the lease is requeued. */
+		if (lease->binding_state == state &&
+		    lease->sort_time <= cur_time)
+			lease_expiry_cancel(lease);
 
+		lease_dereference(&lease, MDL);
+	}
+
+	expiry_running = 0;
+	lease_expiry_arm();
 }
 
 /* Locate the lease associated with a given IP address... */
@@ -2667,7 +2969,7 @@ void lease_insert(struct lease **lq, struct lease *comp)
  * state, it also keeps track of the number of FREE and BACKUP leases in
  * existence, and sets the sort_time on the lease.
  *
- * Sort_time is used in pool_timer() to determine when the lease will
+ * Sort_time is used by lease_expiry_run() to determine when the lease will
  * bubble to the top of the list and be supersede_lease()'d into its next
  * state (possibly, if all goes well).  Example, ACTIVE leases move to
  * EXPIRED state when the 'ends' value is reached, so that is its sort
@@ -2752,6 +3054,7 @@ int lease_enqueue (struct lease *comp)
 	}
 
 	LEASE_INSERTP(lq, comp);
+	lease_expiry_schedule(comp);
 
 	return 1;
 }
@@ -2870,17 +3173,18 @@ void expire_all_pools ()
 	   on the appropriate lists. */
 	lease_ip_hash_foreach(lease_ip_addr_hash, lease_instantiate);
 
-	/* Loop through each pool in each shared network and call the
-	 * expiry routine on the pool.  It is no longer safe to follow
-	 * the queue insertion point, as expiration of a lease can move
-	 * it between queues (and this may be the lease that function
+	/* Run the expiry events that are due.  It is no longer safe to
+	 * follow the queue insertion point, as expiration of a lease can
+	 * move it between queues (and this may be the lease that function
 	 * points at).
 	 */
 	server_starting &= ~SS_QFOLLOW;
+	lease_expiry_run (NULL);
+
+	/* Loop through each pool in each shared network and count its
+	 * leases. */
 	for (s = shared_networks; s; s = s -> next) {
 	    for (p = s -> pools; p; p = p -> next) {
-		pool_timer (p);
-
 		p -> lease_count = 0;
 		p -> free_leases = 0;
 		p -> backup_leases = 0;
@@ -3067,6 +3371,7 @@ void free_everything(void)
 		} while (cn);
 		class_dereference (&lp -> classes, MDL);
 	    }
+	    class_index_free (lp);
 	}
 
 	if (interface_vector) {
@@ -3100,8 +3405,10 @@ void free_everything(void)
 	    } while (in);
 	    interface_dereference (&interfaces, MDL);
 	}
+	interface_ifindex_free ();
 
 	/* Subnets are complicated because of the extra links. */
+	subnet_tree_free(&subnet_index);
 	if (subnets) {
 	    subnet_reference (&sn, subnets, MDL);
 	    do {
@@ -3185,6 +3492,7 @@ void free_everything(void)
 
 				    /* remove the current lease from the queue */
 				    LEASE_REMOVEP(lptr[i], lc);
+				    lease_expiry_cancel(lc);
 
 				    if (lc -> billing_class)
 				       class_dereference (&lc -> billing_class,
@@ -3264,7 +3572,6 @@ void free_everything(void)
 	}
 	dfree (universes, MDL);
 
-	relinquish_free_lease_states ();
 	relinquish_free_pairs ();
 	relinquish_free_expressions ();
 	relinquish_free_binding_values ();
@@ -3273,7 +3580,11 @@ void free_everything(void)
 #if defined(COMPACT_LEASES)
 	relinquish_lease_hunks ();
 #endif
-	relinquish_hash_bucket_hunks ();
+	if (expiry_heap != NULL) {
+		dfree (expiry_heap, MDL);
+		expiry_heap = NULL;
+		expiry_count = expiry_max = 0;
+	}
 	omapi_type_relinquish ();
 }
 #endif /* DEBUG_MEMORY_LEAKAGE_ON_EXIT */
@@ -190,6 +190,8 @@ HASH_FUNCTIONS(iasubopt, struct in6_addr *, struct iasubopt, iasubopt_hash_t,
 struct ipv6_pool **pools;
 int num_pools;
 
+static void pool_expiry_cancel(struct ipv6_pool *pool);
+
 /*
  * Create a new IAADDR/PREFIX structure.
  *
@@ -614,6 +616,199 @@ inactive_changed(void *iasubopt, unsigned int new_heap_index) {
 	((struct iasubopt *)iasubopt)->inactive_index = new_heap_index;
 }
 
+/*
+ * Free prefix index for prefix delegation pools.
+ *
+ * A prefix pool holds 2^(units - bits) prefixes of the same length.  For
+ * pools of up to PREFIX6_INDEX_BITS such bits we keep a buddy tree over
+ * them: a complete binary tree stored as an array, leaves at
+ * [2^depth, 2^(depth+1)), where each node holds one more than the order
+ * of the largest entirely free aligned block below it (0 when nothing
+ * below is free).  A node of height h that is wholly free holds h + 1.
+ *
+ * This finds a free prefix near a given one in O(log n), picking the
+ * best fitting free block on the way down so large aggregates are split
+ * last, and gives the largest free aggregate at the root for reporting
+ * fragmentation.  The index mirrors the pool's leases hash: every add to
+ * or delete from the hash on a prefix pool is followed by a call to
+ * prefix6_index_sync().
+ */
+#define PREFIX6_INDEX_BITS	20
+
+/* Return the slot number of a prefix within its pool. */
+static u_int32_t
+prefix6_slot(const struct ipv6_pool *pool, const struct in6_addr *pref) {
+	u_int32_t slot = 0;
+	int b;
+
+	for (b = pool->bits; b < pool->units; b++) {
+		slot = (slot << 1) |
+		       ((pref->s6_addr[b / 8] >> (7 - (b % 8))) & 1);
+	}
+	return slot;
+}
+
+/* Build the prefix for a slot number, the inverse of prefix6_slot(). */
+static void
+prefix6_from_slot(const struct ipv6_pool *pool, u_int32_t slot,
+		  struct in6_addr *pref) {
+	int b;
+
+	*pref = pool->start_addr;
+	for (b = 127; b >= pool->bits; b--) {
+		pref->s6_addr[b / 8] &= ~(0x80 >> (b % 8));
+		if (b < pool->units) {
+			if (slot & 1)
+				pref->s6_addr[b / 8] |= 0x80 >> (b % 8);
+			slot >>= 1;
+		}
+	}
+}
+
+static void
+prefix6_index_create(struct ipv6_pool *pool, const char *file, int line) {
+	u_int32_t node, leaves;
+	int depth, h;
+
+	depth = pool->units - pool->bits;
+	if ((pool->pool_type != D6O_IA_PD) || (depth < 0) ||
+	    (depth > PREFIX6_INDEX_BITS))
+		return;
+
+	/*
+	 * The index is an optimization, so do without it if we can't
+	 * get the memory.
+	 */
+	leaves = 1U << depth;
+	pool->free_index = dmalloc(leaves * 2, file, line);
+	if (pool->free_index == NULL)
+		return;
+	pool->free_index_depth = depth;
+	pool->num_free = leaves;
+
+	/* Everything is free to start with. */
+	for (h = 0; h <= depth; h++) {
+		for (node = leaves >> h; node < (leaves >> h) * 2; node++)
+			pool->free_index[node] = h + 1;
+	}
+}
+
+/* Record whether a slot is in use, and fix up the nodes above it. */
+static void
+prefix6_index_set(struct ipv6_pool *pool, u_int32_t slot, int used) {
+	u_int8_t *tree = pool->free_index;
+	u_int8_t l, r;
+	u_int32_t node;
+	int h;
+
+	node = (1U << pool->free_index_depth) + slot;
+	if ((tree[node] == 0) == (used != 0))
+		return;
+	tree[node] = used ? 0 : 1;
+	if (used)
+		pool->num_free--;
+	else
+		pool->num_free++;
+
+	for (h = 1, node >>= 1; node >= 1; h++, node >>= 1) {
+		l = tree[node * 2];
+		r = tree[node * 2 + 1];
+		if ((l == h) && (r == h))
+			tree[node] = h + 1;
+		else
+			tree[node] = (l > r) ? l : r;
+	}
+}
+
+/*
+ * Bring the index entry for a prefix into line with the pool's leases
+ * hash.  The hash may hold more than one entry for a prefix (a lease and
+ * a host reservation, say), so we look rather than count.
+ */
+static void
+prefix6_index_sync(struct ipv6_pool *pool, const struct in6_addr *pref) {
+	struct iasubopt *test_iapref;
+
+	if (pool->free_index == NULL)
+		return;
+
+	test_iapref = NULL;
+	if (iasubopt_hash_lookup(&test_iapref, pool->leases,
+				 (void *)pref, sizeof(*pref), MDL)) {
+		iasubopt_dereference(&test_iapref, MDL);
+		prefix6_index_set(pool, prefix6_slot(pool, pref), 1);
+	} else {
+		prefix6_index_set(pool, prefix6_slot(pool, pref), 0);
+	}
+}
+
+/*
+ * Find the free slot nearest to hint: the hint itself if it is free,
+ * otherwise the best fitting free block in the smallest enclosing
+ * aggregate that has one.
+ */
+static isc_boolean_t
+prefix6_index_find(const struct ipv6_pool *pool, u_int32_t hint,
+		   u_int32_t *slot) {
+	const u_int8_t *tree = pool->free_index;
+	u_int32_t leaves, node;
+	u_int8_t l, r;
+
+	if (tree[1] == 0)
+		return ISC_FALSE;
+
+	leaves = 1U << pool->free_index_depth;
+	node = leaves + hint;
+	while ((node > 1) && (tree[node] == 0)) {
+		if (tree[node ^ 1] != 0) {
+			node ^= 1;
+			break;
+		}
+		node >>= 1;
+	}
+
+	while (node < leaves) {
+		l = tree[node * 2];
+		r = tree[node * 2 + 1];
+		if ((l != 0) && ((r == 0) || (l <= r)))
+			node = node * 2;
+		else
+			node = node * 2 + 1;
+	}
+	*slot = node - leaves;
+	return ISC_TRUE;
+}
+
+/*!
+ *
+ * \brief Report free space in a prefix pool
+ *
+ * \param[in]  pool     = The prefix pool to report on
+ * \param[out] num_free = The number of free prefixes in the pool
+ * \param[out] largest  = The length of the shortest free prefix that
+ *			 could be carved from the pool, or 0 when it is
+ *			 full.  The further this is from the pool length for
+ *			 a given amount of free space, the more fragmented
+ *			 the pool.
+ *
+ * \return
+ * ISC_TRUE  = The pool is indexed, and num_free and largest were filled in
+ * ISC_FALSE = The pool is not a prefix pool or is too large to index
+ */
+isc_boolean_t
+prefix6_pool_space(const struct ipv6_pool *pool, isc_uint64_t *num_free,
+		   int *largest) {
+	if (pool->free_index == NULL)
+		return ISC_FALSE;
+
+	*num_free = pool->num_free;
+	if (pool->free_index[1] == 0)
+		*largest = 0;
+	else
+		*largest = pool->units - (pool->free_index[1] - 1);
+	return ISC_TRUE;
+}
+
 /*!
  *
  * \brief Create a new IPv6 lease pool structure
@@ -661,10 +856,15 @@ ipv6_pool_allocate(struct ipv6_pool **pool, u_int16_t type,
 	tmp->start_addr = *start_addr;
 	tmp->bits = bits;
 	tmp->units = units;
+	if ((units - bits) < 64)
+		tmp->capacity = (isc_uint64_t)1 << (units - bits);
+	else
+		tmp->capacity = ISC_UINT64_MAX;
 	if (!iasubopt_new_hash(&tmp->leases, DEFAULT_HASH_SIZE, file, line)) {
 		dfree(tmp, file, line);
 		return ISC_R_NOMEMORY;
 	}
+	iasubopt_hash_enable_resize(tmp->leases);
 	if (isc_heap_create(dhcp_gbl_ctx.mctx, lease_older, active_changed,
 			    0, &(tmp->active_timeouts)) != ISC_R_SUCCESS) {
 		iasubopt_free_hash_table(&(tmp->leases), file, line);
@@ -679,6 +879,8 @@ ipv6_pool_allocate(struct ipv6_pool **pool, u_int16_t type,
 		return ISC_R_NOMEMORY;
 	}
 
+	prefix6_index_create(tmp, file, line);
+
 	*pool = tmp;
 	return ISC_R_SUCCESS;
 }
@@ -799,6 +1001,9 @@ ipv6_pool_dereference(struct ipv6_pool **pool, const char *file, int line) {
 		isc_heap_foreach(tmp->inactive_timeouts, 
 				 dereference_heap_entry, NULL);
 		isc_heap_destroy(&(tmp->inactive_timeouts));
+		pool_expiry_cancel(tmp);
+		if (tmp->free_index != NULL)
+			dfree(tmp->free_index, file, line);
 		dfree(tmp, file, line);
 	}
 
@@ -1007,6 +1212,79 @@ static struct in6_addr rtany;
 /* Reserved Subnet Anycasts ::fdff:ffff:ffff:ff80-::fdff:ffff:ffff:ffff. */
 static struct in6_addr resany;
 
+/*
+ * Pools with at most this many host bits are dense: once hashing has
+ * failed V6_DENSE_HASH_ATTEMPTS times we sweep the whole range rather
+ * than keep guessing, so a free address is always found if one exists.
+ */
+#define V6_DENSE_POOL_BITS	16
+#define V6_DENSE_HASH_ATTEMPTS	10
+/* Number of hashed candidates tried on larger pools. */
+#define V6_HASH_ATTEMPTS	100
+
+/*
+ * Check for reserved interface IDs. (cf. RFC 5453)
+ */
+static isc_boolean_t
+reserved_iid6(const struct in6_addr *addr) {
+	if (memcmp(&addr->s6_addr[8], &rtany.s6_addr[8], 8) == 0) {
+		return ISC_TRUE;
+	}
+	if ((memcmp(&addr->s6_addr[8], &resany.s6_addr[8], 7) == 0) &&
+	    ((addr->s6_addr[15] & 0x80) == 0x80)) {
+		return ISC_TRUE;
+	}
+	return ISC_FALSE;
+}
+
+/*
+ * Find a free address in a dense pool, starting from the last hashed
+ * candidate in addr.
+ *
+ * The host part of the address is stepped through x -> 5x + c modulo
+ * 2^host_bits, which with c odd visits every value exactly once before
+ * repeating.  Deriving c from the starting point spreads clients that
+ * collide on the same region of the pool over different paths, and as
+ * the walk is a pure function of addr no per-pool state has to be kept
+ * in step with the lease hash.
+ */
+static isc_result_t
+sweep_pool6(struct ipv6_pool *pool, struct in6_addr *addr,
+	    unsigned int *attempts) {
+	struct iasubopt *test_iaaddr;
+	u_int32_t mask, start, off, step, n;
+
+	mask = (1U << (128 - pool->bits)) - 1;
+	start = ((u_int32_t)addr->s6_addr[13] << 16) |
+		((u_int32_t)addr->s6_addr[14] << 8) |
+		(u_int32_t)addr->s6_addr[15];
+	start &= mask;
+	step = (start << 1) | 1;
+
+	off = start;
+	for (n = 0; n <= mask; n++) {
+		addr->s6_addr[13] = (addr->s6_addr[13] & ~(mask >> 16)) |
+				    ((off >> 16) & (mask >> 16));
+		addr->s6_addr[14] = (addr->s6_addr[14] & ~(mask >> 8)) |
+				    ((off >> 8) & (mask >> 8));
+		addr->s6_addr[15] = (addr->s6_addr[15] & ~mask) |
+				    (off & mask);
+		(*attempts)++;
+
+		test_iaaddr = NULL;
+		if (!reserved_iid6(addr) &&
+		    (iasubopt_hash_lookup(&test_iaaddr, pool->leases,
+					  addr, sizeof(*addr), MDL) == 0)) {
+			return ISC_R_SUCCESS;
+		}
+		if (test_iaaddr != NULL)
+			iasubopt_dereference(&test_iaaddr, MDL);
+
+		off = (5 * off + step) & mask;
+	}
+	return ISC_R_NORESOURCES;
+}
+
 /*
  * Create a lease for the given address and client duid.
  *
@@ -1016,7 +1294,9 @@ static struct in6_addr resany;
  * Right now we simply hash the DUID, and if we get a collision, we hash 
  * again until we find a free address. We try this a fixed number of times,
  * to avoid getting stuck in a loop (this is important on small pools
- * where we can run out of space).
+ * where we can run out of space).  On dense pools (V6_DENSE_POOL_BITS
+ * host bits or fewer) we fall back to sweeping the range from the last
+ * hashed candidate, so we only fail when the pool really is full.
  *
  * We return the number of attempts that it took to find an available
  * lease. This tells callers when a pool is are filling up, as
@@ -1025,8 +1305,6 @@ static struct in6_addr resany;
  * a free lease. Realistically this will only happen in very full
  * pools.
  *
- * We probably want different algorithms depending on the network size, in
- * the long term.
  */
 isc_result_t
 create_lease6(struct ipv6_pool *pool, struct iasubopt **addr, 
@@ -1038,7 +1316,7 @@ create_lease6(struct ipv6_pool *pool, struct iasubopt **addr,
 	struct data_string new_ds;
 	struct iasubopt *iaaddr;
 	isc_result_t result;
-	isc_boolean_t reserved_iid;
+	unsigned int limit;
 	static isc_boolean_t init_resiid = ISC_FALSE;
 
 	/*
@@ -1058,14 +1336,28 @@ create_lease6(struct ipv6_pool *pool, struct iasubopt **addr,
 	memset(&ds, 0, sizeof(ds));
 	data_string_copy(&ds, (struct data_string *)uid, MDL);
 
+	if (128 - pool->bits <= V6_DENSE_POOL_BITS)
+		limit = V6_DENSE_HASH_ATTEMPTS;
+	else
+		limit = V6_HASH_ATTEMPTS;
+
 	*attempts = 0;
 	for (;;) {
 		/*
-		 * Give up at some point.
+		 * Give up at some point, or on a dense pool search the
+		 * rest of the range in order.
 		 */
-		if (++(*attempts) > 100) {
+		if (++(*attempts) > limit) {
 			data_string_forget(&ds, MDL);
-			return ISC_R_NORESOURCES;
+			if (limit != V6_DENSE_HASH_ATTEMPTS)
+				return ISC_R_NORESOURCES;
+			(*attempts)--;
+			result = sweep_pool6(pool, &tmp, attempts);
+			if (result != ISC_R_SUCCESS) {
+				pool->capacity = pool->num_active;
+				return result;
+			}
+			break;
 		}
 
 		/* 
@@ -1094,23 +1386,11 @@ create_lease6(struct ipv6_pool *pool, struct iasubopt **addr,
 		}
 
 		/*
-		 * Avoid reserved interface IDs. (cf. RFC 5453)
-		 */
-		reserved_iid = ISC_FALSE;
-		if (memcmp(&tmp.s6_addr[8], &rtany.s6_addr[8], 8) == 0) {
-			reserved_iid = ISC_TRUE;
-		}
-		if (!reserved_iid &&
-		    (memcmp(&tmp.s6_addr[8], &resany.s6_addr[8], 7) == 0) &&
-		    ((tmp.s6_addr[15] & 0x80) == 0x80)) {
-			reserved_iid = ISC_TRUE;
-		}
-
-		/*
-		 * If this address is not in use, we're happy with it
+		 * If this address is not in use and not a reserved
+		 * interface ID, we're happy with it
 		 */
 		test_iaaddr = NULL;
-		if (!reserved_iid &&
+		if (!reserved_iid6(&tmp) &&
 		    (iasubopt_hash_lookup(&test_iaaddr, pool->leases,
 					  &tmp, sizeof(tmp), MDL) == 0)) {
 			break;
@@ -1381,6 +1661,7 @@ cleanup_lease6(ia_hash_t *ia_table,
 
 	iasubopt_hash_delete(pool->leases, &test_iasubopt->addr,
 			     sizeof(test_iasubopt->addr), MDL);
+	prefix6_index_sync(pool, &test_iasubopt->addr);
 	ia_remove_iasubopt(old_ia, test_iasubopt, MDL);
 	if (old_ia->num_iasubopt <= 0) {
 		ia_hash_delete(ia_table,
@@ -1459,6 +1740,7 @@ add_lease6(struct ipv6_pool *pool, struct iasubopt *lease,
 
 		iasubopt_hash_delete(pool->leases, &test_iasubopt->addr, 
 				     sizeof(test_iasubopt->addr), MDL);
+		prefix6_index_sync(pool, &test_iasubopt->addr);
 
 		/*
 		 * We're going to do a bit of evil trickery here.
@@ -1483,6 +1765,7 @@ add_lease6(struct ipv6_pool *pool, struct iasubopt *lease,
 		tmp_iasubopt->hard_lifetime_end_time = valid_lifetime_end_time;
 		iasubopt_hash_add(pool->leases, &tmp_iasubopt->addr, 
 				  sizeof(tmp_iasubopt->addr), lease, MDL);
+		prefix6_index_sync(pool, &tmp_iasubopt->addr);
 		insert_result = isc_heap_insert(pool->active_timeouts,
 						tmp_iasubopt);
 		if (insert_result == ISC_R_SUCCESS) {
@@ -1507,6 +1790,7 @@ add_lease6(struct ipv6_pool *pool, struct iasubopt *lease,
 	if (insert_result != ISC_R_SUCCESS) {
 		iasubopt_hash_delete(pool->leases, &lease->addr, 
 				     sizeof(lease->addr), MDL);
+		prefix6_index_sync(pool, &lease->addr);
 		iasubopt_dereference(&tmp_iasubopt, MDL);
 		return insert_result;
 	}
@@ -1579,6 +1863,7 @@ move_lease_to_active(struct ipv6_pool *pool, struct iasubopt *lease) {
 	if (insert_result == ISC_R_SUCCESS) {
        		iasubopt_hash_add(pool->leases, &lease->addr, 
 				  sizeof(lease->addr), lease, MDL);
+		prefix6_index_sync(pool, &lease->addr);
 		isc_heap_delete(pool->inactive_timeouts,
 				lease->inactive_index);
 		pool->num_active++;
@@ -1712,6 +1997,7 @@ move_lease_to_inactive(struct ipv6_pool *pool, struct iasubopt *lease,
 
 		iasubopt_hash_delete(pool->leases, 
 				     &lease->addr, sizeof(lease->addr), MDL);
+		prefix6_index_sync(pool, &lease->addr);
 		isc_heap_delete(pool->active_timeouts, lease->active_index);
 		lease->state = state;
 		pool->num_active--;
@@ -1870,37 +2156,17 @@ build_prefix6(struct in6_addr *pref,
 }
 
 /*
- * Create a lease for the given prefix and client duid.
- *
- * - pool must be a pointer to a (struct ipv6_pool *) pointer previously
- *   initialized to NULL
- *
- * Right now we simply hash the DUID, and if we get a collision, we hash 
+ * Pick a prefix by hashing the DUID, and if we get a collision, hashing
  * again until we find a free prefix. We try this a fixed number of times,
  * to avoid getting stuck in a loop (this is important on small pools
  * where we can run out of space).
- *
- * We return the number of attempts that it took to find an available
- * prefix. This tells callers when a pool is are filling up, as
- * well as an indication of how full the pool is; statistically the 
- * more full a pool is the more attempts must be made before finding
- * a free prefix. Realistically this will only happen in very full
- * pools.
- *
- * We probably want different algorithms depending on the network size, in
- * the long term.
  */
-isc_result_t
-create_prefix6(struct ipv6_pool *pool, struct iasubopt **pref, 
-	       unsigned int *attempts,
-	       const struct data_string *uid,
-	       time_t soft_lifetime_end_time) {
+static isc_result_t
+hash_prefix6(struct ipv6_pool *pool, struct in6_addr *pref,
+	     unsigned int *attempts, const struct data_string *uid) {
 	struct data_string ds;
-	struct in6_addr tmp;
 	struct iasubopt *test_iapref;
 	struct data_string new_ds;
-	struct iasubopt *iapref;
-	isc_result_t result;
 
 	/* 
 	 * Use the UID as our initial seed for the hash
@@ -1921,7 +2187,7 @@ create_prefix6(struct ipv6_pool *pool, struct iasubopt **pref,
 		/* 
 		 * Build a prefix
 		 */
-		build_prefix6(&tmp, &pool->start_addr,
+		build_prefix6(pref, &pool->start_addr,
 			      pool->bits, pool->units, &ds);
 
 		/*
@@ -1929,7 +2195,7 @@ create_prefix6(struct ipv6_pool *pool, struct iasubopt **pref,
 		 */
 		test_iapref = NULL;
 		if (iasubopt_hash_lookup(&test_iapref, pool->leases,
-					 &tmp, sizeof(tmp), MDL) == 0) {
+					 pref, sizeof(*pref), MDL) == 0) {
 			break;
 		}
 		iasubopt_dereference(&test_iapref, MDL);
@@ -1938,20 +2204,92 @@ create_prefix6(struct ipv6_pool *pool, struct iasubopt **pref,
 		 * Otherwise, we create a new input, adding the prefix
 		 */
 		memset(&new_ds, 0, sizeof(new_ds));
-		new_ds.len = ds.len + sizeof(tmp);
+		new_ds.len = ds.len + sizeof(*pref);
 		if (!buffer_allocate(&new_ds.buffer, new_ds.len, MDL)) {
 			data_string_forget(&ds, MDL);
 			return ISC_R_NOMEMORY;
 		}
 		new_ds.data = new_ds.buffer->data;
 		memcpy(new_ds.buffer->data, ds.data, ds.len);
-		memcpy(&new_ds.buffer->data[0] + ds.len, &tmp, sizeof(tmp));
+		memcpy(&new_ds.buffer->data[0] + ds.len, pref, sizeof(*pref));
 		data_string_forget(&ds, MDL);
 		data_string_copy(&ds, &new_ds, MDL);
 		data_string_forget(&new_ds, MDL);
 	}
 
 	data_string_forget(&ds, MDL);
+	return ISC_R_SUCCESS;
+}
+
+/*
+ * Pick a prefix from the free prefix index.  The prefix the DUID hashes
+ * to is used if it is free, so clients keep getting the same prefix as
+ * with hashing; otherwise we take the nearest free one.
+ */
+static isc_result_t
+index_prefix6(struct ipv6_pool *pool, struct in6_addr *pref,
+	      unsigned int *attempts, const struct data_string *uid) {
+	struct iasubopt *test_iapref;
+	u_int32_t hint, slot;
+
+	build_prefix6(pref, &pool->start_addr, pool->bits, pool->units, uid);
+	hint = prefix6_slot(pool, pref);
+
+	for (;;) {
+		if (!prefix6_index_find(pool, hint, &slot)) {
+			pool->capacity = pool->num_active;
+			return ISC_R_NORESOURCES;
+		}
+		prefix6_from_slot(pool, slot, pref);
+
+		/*
+		 * The index should agree with the hash, but if it
+		 * doesn't, believe the hash and look again.
+		 */
+		test_iapref = NULL;
+		if (iasubopt_hash_lookup(&test_iapref, pool->leases,
+					 pref, sizeof(*pref), MDL) == 0) {
+			*attempts = (slot == hint) ? 1 : 2;
+			return ISC_R_SUCCESS;
+		}
+		iasubopt_dereference(&test_iapref, MDL);
+		log_error("index_prefix6: free prefix index out of step.");
+		prefix6_index_set(pool, slot, 1);
+	}
+}
+
+/*
+ * Create a lease for the given prefix and client duid.
+ *
+ * - pool must be a pointer to a (struct ipv6_pool *) pointer previously
+ *   initialized to NULL
+ *
+ * Prefix pools small enough to have a free prefix index are allocated
+ * from that, which finds a free prefix in O(log n) however full the pool
+ * is.  Larger pools fall back to hashing the DUID.
+ *
+ * We return the number of attempts that it took to find an available
+ * prefix. This tells callers when a pool is are filling up, as
+ * well as an indication of how full the pool is; statistically the 
+ * more full a pool is the more attempts must be made before finding
+ * a free prefix. Realistically this will only happen in very full
+ * pools.
+ */
+isc_result_t
+create_prefix6(struct ipv6_pool *pool, struct iasubopt **pref, 
+	       unsigned int *attempts,
+	       const struct data_string *uid,
+	       time_t soft_lifetime_end_time) {
+	struct in6_addr tmp;
+	struct iasubopt *iapref;
+	isc_result_t result;
+
+	if (pool->free_index != NULL)
+		result = index_prefix6(pool, &tmp, attempts, uid);
+	else
+		result = hash_prefix6(pool, &tmp, attempts, uid);
+	if (result != ISC_R_SUCCESS)
+		return result;
 
 	/* 
 	 * We're happy with the prefix, create an IAPREFIX
@@ -2013,6 +2351,7 @@ mark_lease_unavailable(struct ipv6_pool *pool, const struct in6_addr *addr) {
 		dummy_iasubopt->addr = *addr;
 		iasubopt_hash_add(pool->leases, &dummy_iasubopt->addr,
 				  sizeof(*addr), dummy_iasubopt, MDL);
+		prefix6_index_sync(pool, &dummy_iasubopt->addr);
 	}
 	return result;
 }
@@ -2042,15 +2381,20 @@ add_ipv6_pool(struct ipv6_pool *pool) {
 	return ISC_R_SUCCESS;
 }
 
-static void
-cleanup_old_expired(struct ipv6_pool *pool) {
+/*
+ * Remove up to budget expired or released leases that have been kept
+ * long enough, returning the number removed.
+ */
+static int
+cleanup_old_expired(struct ipv6_pool *pool, int budget) {
 	struct iasubopt *tmp;
 	struct ia_xx *ia;
 	struct ia_xx *ia_active;
 	unsigned char *tmpd;
 	time_t timeout;
+	int count = 0;
 	
-	while (pool->num_inactive > 0) {
+	while ((pool->num_inactive > 0) && (count < budget)) {
 		tmp = (struct iasubopt *)
 				isc_heap_element(pool->inactive_timeouts, 1);
 		if (tmp->hard_lifetime_end_time != 0) {
@@ -2065,6 +2409,7 @@ cleanup_old_expired(struct ipv6_pool *pool) {
 
 		isc_heap_delete(pool->inactive_timeouts, tmp->inactive_index);
 		pool->num_inactive--;
+		count++;
 
 		if (tmp->ia != NULL) {
 			/*
@@ -2105,15 +2450,19 @@ cleanup_old_expired(struct ipv6_pool *pool) {
 		}
 		iasubopt_dereference(&tmp, MDL);
 	}
+	return count;
 }
 
-static void
-lease_timeout_support(void *vpool) {
-	struct ipv6_pool *pool;
+/*
+ * Expire up to budget leases in a pool, and clean up old expired ones
+ * with what is left of the budget.  Returns the number of leases handled.
+ */
+static int
+lease_timeout_support(struct ipv6_pool *pool, int budget) {
 	struct iasubopt *lease;
+	int count = 0;
 	
-	pool = (struct ipv6_pool *)vpool;
-	for (;;) {
+	while (count < budget) {
 		/*
 		 * Get the next lease scheduled to expire.
 		 *
@@ -2137,8 +2486,111 @@ lease_timeout_support(void *vpool) {
 		write_ia(lease->ia);
 
 		iasubopt_dereference(&lease, MDL);
+		count++;
+	}
+
+	/*
+	 * Do some cleanup of our expired leases.
+	 */
+	if (count < budget)
+		count += cleanup_old_expired(pool, budget - count);
+
+	return count;
+}
+
+/*
+ * All pools share one expiry timer.  Pools with a lease timeout pending
+ * are kept on a heap ordered by their next timeout, and the timer is
+ * set for the pool at the top.
+ *
+ * Each run of the timer handles at most V6_EXPIRY_BUDGET leases across
+ * all pools.  If more are due, say after a restart or a jump in the
+ * clock, the timer is set again for straight away so the dispatcher can
+ * serve packets before the next run.  ipv6_expiry_backlog is how far
+ * behind (in seconds) the oldest pending timeout was when the last run
+ * ended, and ipv6_expiry_deferred counts the runs that had to leave
+ * work over.
+ */
+static isc_heap_t *expiry_pools;
+static isc_boolean_t expiry_running;
+static int expiry_catchup_runs;
+static isc_uint64_t expiry_catchup_leases;
+time_t ipv6_expiry_backlog;
+isc_uint64_t ipv6_expiry_deferred;
+
+static void ipv6_expiry_run(void *what);
+
+static isc_boolean_t
+pool_expires_sooner(void *a, void *b) {
+	return ((struct ipv6_pool *)a)->next_expiry <
+	       ((struct ipv6_pool *)b)->next_expiry;
+}
+
+static void
+pool_expiry_changed(void *pool, unsigned int new_heap_index) {
+	((struct ipv6_pool *)pool)->expiry_index = new_heap_index;
+}
+
+/*
+ * Take a pool off the expiry heap, as when it is destroyed.
+ */
+static void
+pool_expiry_cancel(struct ipv6_pool *pool) {
+	if (pool->expiry_index != 0) {
+		isc_heap_delete(expiry_pools, pool->expiry_index);
+		pool->expiry_index = 0;
+	}
+}
+
+/*
+ * Set the expiry timer for the pool with the soonest timeout.  When the
+ * last run left work over that time has already passed, and the timer
+ * runs again as soon as the dispatcher gets to it.
+ */
+static void
+ipv6_expiry_arm(void) {
+	struct ipv6_pool *pool;
+	struct timeval tv;
+
+	pool = NULL;
+	if (expiry_pools != NULL)
+		pool = isc_heap_element(expiry_pools, 1);
+	if (pool == NULL) {
+		cancel_timeout(ipv6_expiry_run, NULL);
+		return;
 	}
 
+	tv.tv_sec = pool->next_expiry;
+	tv.tv_usec = 0;
+	add_timeout(&tv, ipv6_expiry_run, NULL, NULL, NULL);
+}
+
+static void
+ipv6_expiry_run(void *what) {
+	struct ipv6_pool *pool;
+	int budget, count;
+
+	expiry_running = ISC_TRUE;
+	budget = V6_EXPIRY_BUDGET;
+	while ((budget > 0) &&
+	       ((pool = isc_heap_element(expiry_pools, 1)) != NULL) &&
+	       (pool->next_expiry <= cur_time)) {
+		count = lease_timeout_support(pool, budget);
+		budget -= count;
+		schedule_lease_timeout(pool);
+
+		/*
+		 * A pool that is due but couldn't do anything would
+		 * otherwise hold up the rest; try it again later.
+		 */
+		if ((count == 0) && (pool->expiry_index != 0) &&
+		    (pool->next_expiry <= cur_time)) {
+			pool->next_expiry = cur_time + 1;
+			isc_heap_decreased(expiry_pools, pool->expiry_index);
+		}
+	}
+	expiry_running = ISC_FALSE;
+
 	/*
 	 * If appropriate commit and rotate the lease file
 	 * As commit_leases_timed() checks to see if we've done any writes
@@ -2146,27 +2598,37 @@ lease_timeout_support(void *vpool) {
 	 */
 	(void) commit_leases_timed();
 
-	/*
-	 * Do some cleanup of our expired leases.
-	 */
-	cleanup_old_expired(pool);
+	expiry_catchup_leases += V6_EXPIRY_BUDGET - budget;
+	pool = isc_heap_element(expiry_pools, 1);
+	if ((budget == 0) && (pool != NULL) && (pool->next_expiry <= cur_time)) {
+		ipv6_expiry_backlog = cur_time - pool->next_expiry;
+		ipv6_expiry_deferred++;
+		expiry_catchup_runs++;
+		ipv6_expiry_arm();
+		return;
+	}
 
-	/*
-	 * Schedule next round of expirations.
-	 */
-	schedule_lease_timeout(pool);
+	if (expiry_catchup_runs != 0) {
+		log_info("IPv6 lease expiry caught up: %llu leases "
+			 "in %d runs.",
+			 (unsigned long long)expiry_catchup_leases,
+			 expiry_catchup_runs + 1);
+	}
+	ipv6_expiry_backlog = 0;
+	expiry_catchup_runs = 0;
+	expiry_catchup_leases = 0;
+	ipv6_expiry_arm();
 }
 
 /*
- * For a given pool, add a timer that will remove the next
- * lease to expire.
+ * For a given pool, work out when the next lease needs to be expired
+ * or cleaned up, and make sure the expiry timer will run by then.
  */
 void 
 schedule_lease_timeout(struct ipv6_pool *pool) {
 	struct iasubopt *tmp;
 	time_t timeout;
 	time_t next_timeout;
-	struct timeval tv;
 
 	next_timeout = MAX_TIME;
 
@@ -2192,13 +2654,25 @@ schedule_lease_timeout(struct ipv6_pool *pool) {
 		}
 	}
 
+	if ((expiry_pools == NULL) &&
+	    (isc_heap_create(dhcp_gbl_ctx.mctx, pool_expires_sooner,
+			     pool_expiry_changed, 0,
+			     &expiry_pools) != ISC_R_SUCCESS)) {
+		log_fatal("Unable to create IPv6 expiry heap.");
+	}
+
+	pool_expiry_cancel(pool);
 	if (next_timeout < MAX_TIME) {
-		tv.tv_sec = next_timeout;
-		tv.tv_usec = 0;
-		add_timeout(&tv, lease_timeout_support, pool,
-			    (tvref_t)ipv6_pool_reference, 
-			    (tvunref_t)ipv6_pool_dereference);
+		pool->next_expiry = next_timeout;
+		if (isc_heap_insert(expiry_pools, pool) != ISC_R_SUCCESS)
+			log_fatal("Unable to schedule IPv6 lease expiry.");
 	}
+
+	/*
+	 * The running timer sets itself again when it is done.
+	 */
+	if (!expiry_running)
+		ipv6_expiry_arm();
 }
 
 /*
@@ -2013,6 +2013,8 @@ isc_result_t dhcp_class_destroy (omapi_object_t *h, const char *file, int line)
 	}
 	data_string_forget (&class -> hash_string, file, line);
 
+	match_program_free(&class->expr_program);
+	match_program_free(&class->submatch_program);
 	if (class -> expr)
 		expression_dereference (&class -> expr, file, line);
 	if (class -> submatch)
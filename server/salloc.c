@@ -169,7 +169,8 @@ isc_result_t host_dereference (struct host_decl **ptr,
 }
 #endif
 
-struct lease_state *free_lease_states;
+static struct dmalloc_pool lease_state_pool =
+	DMALLOC_POOL ("lease-state", struct lease_state);
 
 struct lease_state *new_lease_state (file, line)
 	const char *file;
@@ -177,17 +178,9 @@ struct lease_state *new_lease_state (file, line)
 {
 	struct lease_state *rval;
 
-	if (free_lease_states) {
-		rval = free_lease_states;
-		free_lease_states =
-			(struct lease_state *)(free_lease_states -> next);
- 		dmalloc_reuse (rval, file, line, 0);
-	} else {
-		rval = dmalloc (sizeof (struct lease_state), file, line);
-		if (!rval)
-			return rval;
-	}
-	memset (rval, 0, sizeof *rval);
+	rval = dmalloc_pool_get (&lease_state_pool, file, line);
+	if (!rval)
+		return rval;
 	if (!option_state_allocate (&rval -> options, file, line)) {
 		free_lease_state (rval, file, line);
 		return (struct lease_state *)0;
@@ -211,25 +204,9 @@ void free_lease_state (ptr, file, line)
 	data_string_forget (&ptr -> parameter_request_list, file, line);
 	data_string_forget (&ptr -> filename, file, line);
 	data_string_forget (&ptr -> server_name, file, line);
-	ptr -> next = free_lease_states;
-	free_lease_states = ptr;
-	dmalloc_reuse (free_lease_states, (char *)0, 0, 0);
+	dmalloc_pool_put (&lease_state_pool, ptr, file, line);
 }
 
-#if defined (DEBUG_MEMORY_LEAKAGE) || \
-		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
-void relinquish_free_lease_states ()
-{
-	struct lease_state *cs, *ns;
-
-	for (cs = free_lease_states; cs; cs = ns) {
-		ns = cs -> next;
-		dfree (cs, MDL);
-	}
-	free_lease_states = (struct lease_state *)0;
-}
-#endif
-
 struct permit *new_permit (file, line)
 	const char *file;
 	int line;
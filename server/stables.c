@@ -293,6 +293,7 @@ static struct option server_options[] = {
 	{ "bind-local-address6", "f",	&server_universe,  SV_BIND_LOCAL_ADDRESS6, 1 },
 	{ "ping-cltt-secs", "T",	&server_universe,  SV_PING_CLTT_SECS, 1 },
 	{ "ping-timeout-ms", "T",       &server_universe,  SV_PING_TIMEOUT_MS, 1 },
+	{ "binary-lease-file", "f",	&server_universe,  SV_BINARY_LEASE_FILE, 1 },
 	{ NULL, NULL, NULL, 0, 0 }
 };
 
@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2026 Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <atf-c.h>
+
+/*
+ * Tests for compiled class match expressions and the class index.   Each
+ * expression is evaluated both by the tree evaluator and by its compiled
+ * program, and the two must agree on every packet.   Classification
+ * through an indexed collection must pick the same classes, in the same
+ * order, as checking every class.
+ */
+
+static struct expression *
+const_data(const char *str) {
+	struct expression *expr = NULL;
+
+	if (!make_const_data(&expr, (const unsigned char *)str, strlen(str),
+			     1, 1, MDL))
+		atf_tc_fail("make_const_data failed");
+	return (expr);
+}
+
+static struct expression *
+const_int(unsigned long val) {
+	struct expression *expr = NULL;
+
+	if (!make_const_int(&expr, val))
+		atf_tc_fail("make_const_int failed");
+	return (expr);
+}
+
+static struct expression *
+option_expr(unsigned code) {
+	struct expression *expr = NULL;
+
+	if (!expression_allocate(&expr, MDL))
+		atf_tc_fail("expression_allocate failed");
+	expr->op = expr_option;
+	if (!option_code_hash_lookup(&expr->data.option,
+				     dhcp_universe.code_hash, &code, 0, MDL))
+		atf_tc_fail("no option %u", code);
+	return (expr);
+}
+
+static struct expression *
+binary_expr(enum expr_op op, struct expression *left,
+	    struct expression *right) {
+	struct expression *expr = NULL;
+
+	if (!expression_allocate(&expr, MDL))
+		atf_tc_fail("expression_allocate failed");
+	expr->op = op;
+	expr->data.and[0] = left;
+	expr->data.and[1] = right;
+	return (expr);
+}
+
+static struct expression *
+substring_expr(struct expression *data, unsigned offset, unsigned len) {
+	struct expression *expr = NULL;
+	struct expression *off = const_int(offset), *length = const_int(len);
+
+	if (!make_substring(&expr, data, off, length))
+		atf_tc_fail("make_substring failed");
+	expression_dereference(&data, MDL);
+	expression_dereference(&off, MDL);
+	expression_dereference(&length, MDL);
+	return (expr);
+}
+
+static struct packet *
+make_packet(const char *host_name, const char *vendor_class) {
+	struct packet *packet = NULL;
+
+	if (!packet_allocate(&packet, MDL))
+		atf_tc_fail("packet_allocate failed");
+	if (!option_state_allocate(&packet->options, MDL))
+		atf_tc_fail("option_state_allocate failed");
+	if (host_name != NULL &&
+	    !add_option(packet->options, DHO_HOST_NAME,
+			(void *)host_name, strlen(host_name)))
+		atf_tc_fail("add_option failed");
+	if (vendor_class != NULL &&
+	    !add_option(packet->options, DHO_VENDOR_CLASS_IDENTIFIER,
+			(void *)vendor_class, strlen(vendor_class)))
+		atf_tc_fail("add_option failed");
+	return (packet);
+}
+
+/* Evaluate expr both ways on every test packet and compare. */
+static void
+check_boolean(struct expression *expr, struct packet **packets, int count) {
+	struct match_program *prog = NULL;
+	int i, tree, compiled, tree_ignore, compiled_ignore;
+
+	match_program_compile(&prog, expr, 1);
+	ATF_REQUIRE(prog != NULL);
+
+	for (i = 0; i < count; i++) {
+		tree_ignore = compiled_ignore = -1;
+		tree = evaluate_boolean_expression_result
+			(&tree_ignore, packets[i], NULL, NULL,
+			 packets[i]->options, NULL, &global_scope, expr);
+		compiled = match_program_boolean
+			(&compiled_ignore, prog, packets[i], NULL,
+			 packets[i]->options, &global_scope);
+		if (tree != compiled || tree_ignore != compiled_ignore)
+			atf_tc_fail("packet %d: tree %d/%d, compiled %d/%d",
+				    i, tree, tree_ignore,
+				    compiled, compiled_ignore);
+	}
+
+	/* Compiling the same expression again keeps the program. */
+	match_program_compile(&prog, expr, 1);
+	ATF_CHECK(prog != NULL);
+	match_program_free(&prog);
+	ATF_CHECK(prog == NULL);
+}
+
+ATF_TC(classvm_boolean);
+
+ATF_TC_HEAD(classvm_boolean, tc) {
+	atf_tc_set_md_var(tc, "descr", "Verify that compiled boolean match "
+			  "expressions agree with the tree evaluator.");
+}
+
+ATF_TC_BODY(classvm_boolean, tc) {
+	struct packet *packets[5];
+	struct expression *expr, *prefix, *name, *vendor, *folded;
+	int i;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+	initialize_common_option_spaces();
+
+	packets[0] = make_packet("foobar", "MSFT 5.0");
+	packets[1] = make_packet("bar", NULL);
+	packets[2] = make_packet("fo", "PXEClient:Arch:00000");
+	packets[3] = make_packet(NULL, "MSFT 5.0");
+	packets[4] = make_packet(NULL, NULL);
+
+	/* substring(option host-name, 0, 3) = "foo" */
+	prefix = binary_expr(expr_equal,
+			     substring_expr(option_expr(DHO_HOST_NAME), 0, 3),
+			     const_data("foo"));
+	check_boolean(prefix, packets, 5);
+
+	/* option host-name = "bar" */
+	name = binary_expr(expr_equal, option_expr(DHO_HOST_NAME),
+			   const_data("bar"));
+	check_boolean(name, packets, 5);
+
+	/* option vendor-class-identifier != "MSFT 5.0" */
+	vendor = binary_expr(expr_not_equal,
+			     option_expr(DHO_VENDOR_CLASS_IDENTIFIER),
+			     const_data("MSFT 5.0"));
+	check_boolean(vendor, packets, 5);
+
+	/* Combinations, including ones where an operand fails. */
+	expr = binary_expr(expr_or, NULL, NULL);
+	expression_reference(&expr->data.or[0], prefix, MDL);
+	expression_reference(&expr->data.or[1], name, MDL);
+	check_boolean(expr, packets, 5);
+	expression_dereference(&expr, MDL);
+
+	expr = binary_expr(expr_and, NULL, NULL);
+	expression_reference(&expr->data.and[0], vendor, MDL);
+	expression_reference(&expr->data.and[1], prefix, MDL);
+	check_boolean(expr, packets, 5);
+	expression_dereference(&expr, MDL);
+
+	/* Constant subexpressions are folded. */
+	folded = binary_expr(expr_equal,
+			     substring_expr(const_data("foobar"), 3, 3),
+			     const_data("bar"));
+	expr = binary_expr(expr_and, folded, NULL);
+	expression_reference(&expr->data.and[1], vendor, MDL);
+	check_boolean(expr, packets, 5);
+	expression_dereference(&expr, MDL);
+
+	expression_dereference(&prefix, MDL);
+	expression_dereference(&name, MDL);
+	expression_dereference(&vendor, MDL);
+	for (i = 0; i < 5; i++)
+		packet_dereference(&packets[i], MDL);
+}
+
+ATF_TC(classvm_data);
+
+ATF_TC_HEAD(classvm_data, tc) {
+	atf_tc_set_md_var(tc, "descr", "Verify that compiled submatch "
+			  "expressions produce the tree evaluator's data.");
+}
+
+ATF_TC_BODY(classvm_data, tc) {
+	struct match_program *prog = NULL;
+	struct data_string tree, compiled;
+	struct packet *packets[3];
+	struct expression *expr;
+	int i, tree_status, compiled_status;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+	initialize_common_option_spaces();
+
+	packets[0] = make_packet(NULL, "PXEClient:Arch:00007");
+	packets[1] = make_packet(NULL, "PXE");
+	packets[2] = make_packet(NULL, NULL);
+
+	/* substring(option vendor-class-identifier, 10, 5) */
+	expr = substring_expr(option_expr(DHO_VENDOR_CLASS_IDENTIFIER), 10, 5);
+	match_program_compile(&prog, expr, 0);
+	ATF_REQUIRE(prog != NULL);
+
+	for (i = 0; i < 3; i++) {
+		memset(&tree, 0, sizeof(tree));
+		memset(&compiled, 0, sizeof(compiled));
+		tree_status = evaluate_data_expression
+			(&tree, packets[i], NULL, NULL, packets[i]->options,
+			 NULL, &global_scope, expr, MDL);
+		compiled_status = match_program_data
+			(&compiled, prog, packets[i], NULL,
+			 packets[i]->options, &global_scope);
+		ATF_CHECK_EQ(tree_status, compiled_status);
+		ATF_CHECK_EQ(tree.len, compiled.len);
+		if (tree.len == compiled.len)
+			ATF_CHECK(memcmp(tree.data, compiled.data,
+					 tree.len) == 0);
+		data_string_forget(&tree, MDL);
+		data_string_forget(&compiled, MDL);
+	}
+
+	match_program_free(&prog);
+	expression_dereference(&expr, MDL);
+	for (i = 0; i < 3; i++)
+		packet_dereference(&packets[i], MDL);
+}
+
+static struct expression *
+prefix_match(unsigned code, unsigned len, const char *value) {
+	return (binary_expr(expr_equal,
+			    substring_expr(option_expr(code), 0, len),
+			    const_data(value)));
+}
+
+ATF_TC(class_index);
+
+ATF_TC_HEAD(class_index, tc) {
+	atf_tc_set_md_var(tc, "descr", "Verify that an indexed collection "
+			  "classifies packets like a linear scan.");
+}
+
+ATF_TC_BODY(class_index, tc) {
+	struct collection collection = { NULL, "test", NULL, NULL };
+	struct class *classes[10], **tail;
+	struct packet *packets[6];
+	int expect[PACKET_MAX_CLASSES];
+	int i, j, n, ignorep;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+	initialize_common_option_spaces();
+
+	for (i = 0; i < 10; i++) {
+		classes[i] = NULL;
+		if (class_allocate(&classes[i], MDL) != ISC_R_SUCCESS)
+			atf_tc_fail("class_allocate failed");
+	}
+	classes[0]->expr = prefix_match(DHO_VENDOR_CLASS_IDENTIFIER,
+					9, "PXEClient");
+	classes[1]->expr = prefix_match(DHO_VENDOR_CLASS_IDENTIFIER, 4, "MSFT");
+	classes[2]->expr = binary_expr(expr_equal, const_data("bar"),
+				       option_expr(DHO_HOST_NAME));
+	/* Not indexed: always checked. */
+	classes[3]->expr = binary_expr(expr_not_equal,
+				       option_expr(DHO_HOST_NAME),
+				       const_data("bar"));
+	classes[4]->expr = prefix_match(DHO_VENDOR_CLASS_IDENTIFIER,
+					9, "PXEClient");
+	/* A substring longer than the constant is an exact match. */
+	classes[5]->expr = prefix_match(DHO_VENDOR_CLASS_IDENTIFIER, 20, "PXE");
+	classes[6]->expr = prefix_match(DHO_HOST_NAME, 3, "foo");
+	classes[7]->expr = binary_expr(expr_equal, option_expr(DHO_HOST_NAME),
+				       const_data("foobar"));
+	classes[8]->expr = prefix_match(DHO_VENDOR_CLASS_IDENTIFIER,
+					9, "PXEClienX");
+	/* No match expression: never matches. */
+	classes[9]->expr = NULL;
+
+	tail = &collection.classes;
+	for (i = 0; i < 10; i++) {
+		class_reference(tail, classes[i], MDL);
+		tail = &classes[i]->nic;
+	}
+	class_index_invalidate();
+
+	packets[0] = make_packet("foobar", "PXEClient:Arch:00000");
+	packets[1] = make_packet("bar", "MSFT 5.0");
+	packets[2] = make_packet("foo", "PXE");
+	packets[3] = make_packet(NULL, "PXEClien");
+	packets[4] = make_packet(NULL, NULL);
+	packets[5] = make_packet("fo", "MS");
+
+	for (i = 0; i < 6; i++) {
+		n = 0;
+		for (j = 0; j < 10; j++) {
+			if (classes[j]->expr != NULL &&
+			    evaluate_boolean_expression_result
+				(&ignorep, packets[i], NULL, NULL,
+				 packets[i]->options, NULL, &global_scope,
+				 classes[j]->expr))
+				expect[n++] = j;
+		}
+
+		check_collection(packets[i], NULL, &collection);
+		ATF_REQUIRE(collection.index != NULL);
+		if (packets[i]->class_count != n)
+			atf_tc_fail("packet %d: %d classes, expected %d",
+				    i, packets[i]->class_count, n);
+		for (j = 0; j < n; j++) {
+			if (packets[i]->classes[j] != classes[expect[j]])
+				atf_tc_fail("packet %d: class %d out of order",
+					    i, j);
+		}
+	}
+
+	/* Taking a class out of the collection rebuilds the index. */
+	class_dereference(&classes[1]->nic, MDL);
+	class_reference(&classes[1]->nic, classes[3], MDL);
+	class_index_invalidate();
+	for (i = 0; i < PACKET_MAX_CLASSES; i++) {
+		if (packets[1]->classes[i] != NULL)
+			class_dereference(&packets[1]->classes[i], MDL);
+	}
+	packets[1]->class_count = 0;
+	check_collection(packets[1], NULL, &collection);
+	ATF_CHECK_EQ(packets[1]->class_count, 1);
+	ATF_CHECK(packets[1]->classes[0] == classes[1]);
+
+	class_index_free(&collection);
+	ATF_CHECK(collection.index == NULL);
+	for (i = 0; i < 6; i++)
+		packet_dereference(&packets[i], MDL);
+}
+
+ATF_TP_ADD_TCS(tp) {
+	ATF_TP_ADD_TC(tp, classvm_boolean);
+	ATF_TP_ADD_TC(tp, classvm_data);
+	ATF_TP_ADD_TC(tp, class_index);
+
+	return (atf_no_error());
+}
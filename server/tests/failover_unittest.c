@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2026 Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+#include <omapip/omapip_p.h>
+#include <sys/socket.h>
+
+#include <atf-c.h>
+
+/*
+ * Tests for building and sending failover messages.   Messages are
+ * queued on an OMAPI connection whose socket is one end of a socket
+ * pair, standing in for the peer, and flushed with the connection
+ * writer while the other end is drained.
+ */
+
+#if defined (FAILOVER_PROTOCOL)
+
+static omapi_connection_object_t *
+make_connection(int *peer) {
+	omapi_connection_object_t *c = NULL;
+	int sv[2];
+
+	if (omapi_init() != ISC_R_SUCCESS)
+		atf_tc_fail("omapi_init failed");
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		atf_tc_fail("socketpair: %s", strerror(errno));
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+	if (omapi_connection_allocate(&c, MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("omapi_connection_allocate failed");
+	c->socket = sv[0];
+	c->state = omapi_connection_connected;
+	*peer = sv[1];
+	return c;
+}
+
+static isc_result_t
+send_bndupd(dhcp_failover_link_t *link, omapi_connection_object_t *c,
+	    u_int32_t xid) {
+	u_int8_t addr[4] = { 192, 0, 2, 1 };
+
+	addr[2] = (xid >> 8) & 0xff;
+	addr[3] = xid & 0xff;
+	return dhcp_failover_put_message
+		(link, (omapi_object_t *)c, FTM_BNDUPD, xid,
+		 dhcp_failover_make_option(FTO_ASSIGNED_IP_ADDRESS,
+					   (char *)0, (unsigned *)0, 0,
+					   4, addr),
+		 dhcp_failover_make_option(FTO_BINDING_STATUS,
+					   (char *)0, (unsigned *)0, 0,
+					   FTS_ACTIVE),
+		 dhcp_failover_make_option(FTO_CLIENT_IDENTIFIER,
+					   (char *)0, (unsigned *)0, 0,
+					   7, "\001\000\021\042\063\104\125"),
+		 dhcp_failover_make_option(FTO_CHADDR,
+					   (char *)0, (unsigned *)0, 0,
+					   7, "\001\000\021\042\063\104\125"),
+		 dhcp_failover_make_option(FTO_LEASE_EXPIRY,
+					   (char *)0, (unsigned *)0, 0,
+					   (unsigned)cur_time + 3600),
+		 dhcp_failover_make_option(FTO_POTENTIAL_EXPIRY,
+					   (char *)0, (unsigned *)0, 0,
+					   (unsigned)cur_time + 7200),
+		 dhcp_failover_make_option(FTO_STOS,
+					   (char *)0, (unsigned *)0, 0,
+					   (unsigned)cur_time),
+		 dhcp_failover_make_option(FTO_CLTT,
+					   (char *)0, (unsigned *)0, 0,
+					   (unsigned)cur_time),
+		 (failover_option_t *)0);
+}
+
+/* Flush the connection and read back whatever the peer has received. */
+static size_t
+drain(omapi_connection_object_t *c, int peer, unsigned char *first) {
+	unsigned char buf[65536];
+	size_t total = 0;
+	ssize_t n;
+
+	do {
+		omapi_connection_writer((omapi_object_t *)c);
+		while ((n = read(peer, buf, sizeof buf)) > 0) {
+			if (first != NULL && total == 0)
+				memcpy(first, buf, 12);
+			total += n;
+		}
+	} while (c->out_bytes != 0);
+	return total;
+}
+
+ATF_TC(put_message);
+
+ATF_TC_HEAD(put_message, tc) {
+	atf_tc_set_md_var(tc, "descr", "Verify the layout of a message "
+			  "built by dhcp_failover_put_message.");
+}
+
+ATF_TC_BODY(put_message, tc) {
+	dhcp_failover_link_t link;
+	omapi_connection_object_t *c;
+	unsigned char hdr[12];
+	size_t len;
+	int peer;
+
+	memset(&link, 0, sizeof link);
+	c = make_connection(&peer);
+	cur_time = 1700000000;
+
+	ATF_REQUIRE(send_bndupd(&link, c, 0x1234) == ISC_R_SUCCESS);
+	len = c->out_bytes;
+	ATF_REQUIRE(drain(c, peer, hdr) == len);
+
+	/* Header, then the options: 4+4, 4+1, 4+7, 4+7 and four times. */
+	ATF_CHECK_EQ(len, 12 + 8 + 5 + 11 + 11 + 4 * 8);
+	ATF_CHECK_EQ(getUShort(&hdr[0]), len);
+	ATF_CHECK_EQ(hdr[2], FTM_BNDUPD);
+	ATF_CHECK_EQ(hdr[3], 12);
+	ATF_CHECK_EQ(getULong(&hdr[4]), 1700000000);
+	ATF_CHECK_EQ(getULong(&hdr[8]), 0x1234);
+
+	/* A bad option fails the message without queueing anything. */
+	ATF_CHECK(dhcp_failover_put_message
+		  (&link, (omapi_object_t *)c, FTM_BNDUPD, 1,
+		   dhcp_failover_make_option(FTO_ASSIGNED_IP_ADDRESS,
+					     (char *)0, (unsigned *)0, 0,
+					     3, "\300\000\002"),
+		   (failover_option_t *)0) == DHCP_R_INVALIDARG);
+	ATF_CHECK_EQ(c->out_bytes, 0);
+
+	close(peer);
+}
+
+#endif /* FAILOVER_PROTOCOL */
+
+ATF_TP_ADD_TCS(tp) {
+#if defined (FAILOVER_PROTOCOL)
+	ATF_TP_ADD_TC(tp, put_message);
+#endif
+
+	return (atf_no_error());
+}
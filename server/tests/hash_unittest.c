@@ -594,12 +594,87 @@ ATF_TC_BODY(uid_hash_rt29851, tc) {
 }
 #endif
 
+/* Number of hosts stored in the resize test; enough to force several
+   resizes of a table that starts with 7 buckets. */
+#define RESIZE_TEST_HOSTS 5000
+
+static isc_result_t
+count_entry(const void *name, unsigned len, void *value) {
+    return (ISC_R_SUCCESS);
+}
+
+ATF_TC(host_hash_resize);
+
+ATF_TC_HEAD(host_hash_resize, tc) {
+    atf_tc_set_md_var(tc, "descr", "Verify that a resizable hash grows "
+                      "and stays consistent during incremental rehash.");
+}
+
+ATF_TC_BODY(host_hash_resize, tc) {
+    static unsigned char keys[RESIZE_TEST_HOSTS][4];
+    struct host_decl *host = NULL, *check = NULL;
+    host_hash_t *table = NULL;
+    int i, j;
+
+    dhcp_db_objects_setup ();
+    dhcp_common_objects_setup ();
+
+    ATF_REQUIRE(host_new_hash(&table, 7, MDL) != 0);
+    host_hash_enable_resize(table);
+    ATF_REQUIRE(host_allocate(&host, MDL) == ISC_R_SUCCESS);
+
+    for (i = 0; i < RESIZE_TEST_HOSTS; i++) {
+        keys[i][0] = i >> 24;
+        keys[i][1] = i >> 16;
+        keys[i][2] = i >> 8;
+        keys[i][3] = i;
+        host_hash_add(table, keys[i], sizeof(keys[i]), host, MDL);
+
+        /* Every entry must stay reachable while buckets are moved. */
+        if ((i % 97) == 0) {
+            for (j = 0; j <= i; j++) {
+                if (!host_hash_lookup(&check, table, keys[j],
+                                      sizeof(keys[j]), MDL))
+                    atf_tc_fail("entry %d lost after %d adds", j, i + 1);
+                host_dereference(&check, MDL);
+            }
+        }
+    }
+
+    if (table->hash_count <= 7)
+        atf_tc_fail("table did not grow: %s", host_hash_report(table));
+    if (table->entry_count != RESIZE_TEST_HOSTS)
+        atf_tc_fail("wrong entry count %u", table->entry_count);
+    if (host_hash_foreach(table, count_entry) != RESIZE_TEST_HOSTS)
+        atf_tc_fail("foreach did not visit every entry");
+
+    for (i = 0; i < RESIZE_TEST_HOSTS; i += 2)
+        host_hash_delete(table, keys[i], sizeof(keys[i]), MDL);
+
+    for (i = 0; i < RESIZE_TEST_HOSTS; i++) {
+        if (host_hash_lookup(&check, table, keys[i], sizeof(keys[i]), MDL)) {
+            host_dereference(&check, MDL);
+            if ((i % 2) == 0)
+                atf_tc_fail("deleted entry %d still present", i);
+        } else if ((i % 2) != 0) {
+            atf_tc_fail("entry %d missing after deletes", i);
+        }
+    }
+
+    if (table->entry_count != RESIZE_TEST_HOSTS / 2)
+        atf_tc_fail("wrong entry count %u after deletes",
+                    table->entry_count);
+    if (host->refcnt != 1 + RESIZE_TEST_HOSTS / 2)
+        atf_tc_fail("wrong host refcnt %d", host->refcnt);
+}
+
 ATF_TP_ADD_TCS(tp) {
     ATF_TP_ADD_TC(tp, lease_hash_basic_2hosts);
     ATF_TP_ADD_TC(tp, lease_hash_basic_3hosts);
     ATF_TP_ADD_TC(tp, lease_hash_string_2hosts);
     ATF_TP_ADD_TC(tp, lease_hash_string_3hosts);
     ATF_TP_ADD_TC(tp, lease_hash_negative1);
+    ATF_TP_ADD_TC(tp, host_hash_resize);
 #if 0 /* see comment in function */
     ATF_TP_ADD_TC(tp, uid_hash_rt29851);
 #endif
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2026 Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <atf-c.h>
+
+/*
+ * Tests for the binary lease file.   Leases are written to a scratch
+ * lease file with write_lease(), and the file is read back with
+ * lease_journal_dump(), which decodes the records the same way the
+ * loader does and prints them in text format.
+ */
+
+#define LEASEFILE_MAGIC "\211DHCPLJ\n"
+
+extern FILE *db_file;
+
+static char lf_path[] = "/tmp/leasefile_unittest.XXXXXX";
+
+/* Point db_file at a new, empty binary lease file. */
+static void
+leasefile_open(void) {
+	int fd;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+
+	strcpy(lf_path, "/tmp/leasefile_unittest.XXXXXX");
+	fd = mkstemp(lf_path);
+	if (fd < 0)
+		atf_tc_fail("mkstemp: %s", strerror(errno));
+	db_file = fdopen(fd, "w");
+	if (db_file == NULL)
+		atf_tc_fail("fdopen: %s", strerror(errno));
+
+	/* Loading a binary lease file makes further writes binary. */
+	lease_journal_read(LEASEFILE_MAGIC, 8, lf_path);
+	fwrite(LEASEFILE_MAGIC, 8, 1, db_file);
+}
+
+/* Close the lease file and return its text form in buf. */
+static isc_result_t
+leasefile_dump(char *buf, size_t len) {
+	isc_result_t status;
+	FILE *out;
+	size_t n;
+
+	fclose(db_file);
+	db_file = NULL;
+
+	out = tmpfile();
+	if (out == NULL)
+		atf_tc_fail("tmpfile: %s", strerror(errno));
+	status = lease_journal_dump(lf_path, out);
+	rewind(out);
+	n = fread(buf, 1, len - 1, out);
+	buf[n] = 0;
+	fclose(out);
+	return status;
+}
+
+static struct lease *
+make_lease(const char *addr) {
+	struct lease *lease = NULL;
+	struct in_addr ia;
+
+	if (lease_allocate(&lease, MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("lease_allocate failed");
+	inet_pton(AF_INET, addr, &ia);
+	lease->ip_addr.len = 4;
+	memcpy(lease->ip_addr.iabuf, &ia, 4);
+	lease->starts = 1700000000;
+	lease->ends = 1700003600;
+	lease->cltt = 1700000000;
+	lease->binding_state = FTS_ACTIVE;
+	lease->next_binding_state = FTS_FREE;
+	lease->rewind_binding_state = FTS_FREE;
+	return lease;
+}
+
+ATF_TC(leasefile_roundtrip);
+
+ATF_TC_HEAD(leasefile_roundtrip, tc) {
+	atf_tc_set_md_var(tc, "descr", "Verify that binary and text records "
+			  "in a binary lease file read back correctly.");
+}
+
+ATF_TC_BODY(leasefile_roundtrip, tc) {
+	struct lease *lease1, *lease2;
+	struct binding *bnd;
+	char text[4096];
+
+	leasefile_open();
+
+	/* A plain lease is written as a binary record. */
+	lease1 = make_lease("192.0.2.1");
+	lease1->hardware_addr.hlen = 7;
+	lease1->hardware_addr.hbuf[0] = HTYPE_ETHER;
+	memcpy(&lease1->hardware_addr.hbuf[1], "\x00\x11\x22\x33\x44\x55", 6);
+	lease1->uid = lease1->uid_buf;
+	lease1->uid_max = sizeof(lease1->uid_buf);
+	memcpy(lease1->uid, "\x01\x00\x11\x22\x33\x44\x55", 7);
+	lease1->uid_len = 7;
+	lease1->client_hostname = dmalloc(6, MDL);
+	strcpy(lease1->client_hostname, "alpha");
+	ATF_REQUIRE(write_lease(lease1));
+
+	/* One with a binding scope is written as text. */
+	lease2 = make_lease("192.0.2.2");
+	ATF_REQUIRE(binding_scope_allocate(&lease2->scope, MDL));
+	bnd = dmalloc(sizeof(*bnd), MDL);
+	bnd->name = dmalloc(4, MDL);
+	strcpy(bnd->name, "foo");
+	ATF_REQUIRE(binding_value_allocate(&bnd->value, MDL));
+	bnd->value->type = binding_numeric;
+	bnd->value->value.intval = 42;
+	lease2->scope->bindings = bnd;
+	ATF_REQUIRE(write_lease(lease2));
+
+	ATF_REQUIRE(leasefile_dump(text, sizeof(text)) == ISC_R_SUCCESS);
+
+	ATF_CHECK(strstr(text, "lease 192.0.2.1 {") != NULL);
+	ATF_CHECK(strstr(text, "binding state active;") != NULL);
+	ATF_CHECK(strstr(text, "next binding state free;") != NULL);
+	ATF_CHECK(strstr(text, "hardware ethernet 00:11:22:33:44:55;")
+		  != NULL);
+	ATF_CHECK(strstr(text, "client-hostname \"alpha\";") != NULL);
+	ATF_CHECK(strstr(text, "lease 192.0.2.2 {") != NULL);
+	ATF_CHECK(strstr(text, "set foo = %42;") != NULL);
+
+	lease_dereference(&lease1, MDL);
+	lease_dereference(&lease2, MDL);
+	unlink(lf_path);
+}
+
+ATF_TC(leasefile_damage);
+
+ATF_TC_HEAD(leasefile_damage, tc) {
+	atf_tc_set_md_var(tc, "descr", "Verify that bad checksums and "
+			  "truncated records are detected.");
+}
+
+ATF_TC_BODY(leasefile_damage, tc) {
+	struct lease *lease1, *lease2;
+	char text[4096];
+	struct stat st;
+	FILE *fp;
+
+	leasefile_open();
+	lease1 = make_lease("192.0.2.1");
+	lease2 = make_lease("192.0.2.2");
+	ATF_REQUIRE(write_lease(lease1));
+	ATF_REQUIRE(write_lease(lease2));
+	fflush(db_file);
+	ATF_REQUIRE(stat(lf_path, &st) == 0);
+
+	/* Cut the last record short, as a crash during a write would. */
+	ATF_REQUIRE(truncate(lf_path, st.st_size - 8) == 0);
+	ATF_CHECK(leasefile_dump(text, sizeof(text)) == ISC_R_SUCCESS);
+	ATF_CHECK(strstr(text, "lease 192.0.2.1 {") != NULL);
+	ATF_CHECK(strstr(text, "lease 192.0.2.2 {") == NULL);
+
+	/* Corrupt the address in the first record. */
+	fp = fopen(lf_path, "r+");
+	ATF_REQUIRE(fp != NULL);
+	fseek(fp, 8 + 16, SEEK_SET);
+	fputc(0xff, fp);
+	fclose(fp);
+	ATF_CHECK(lease_journal_dump(lf_path, stdout) == DHCP_R_BADPARSE);
+
+	lease_dereference(&lease1, MDL);
+	lease_dereference(&lease2, MDL);
+	unlink(lf_path);
+}
+
+ATF_TC(leasefile_resync);
+
+ATF_TC_HEAD(leasefile_resync, tc) {
+	atf_tc_set_md_var(tc, "descr", "Verify that a record with a damaged "
+			  "length is skipped without losing the records "
+			  "after it.");
+}
+
+ATF_TC_BODY(leasefile_resync, tc) {
+	struct lease *lease1, *lease2, *lease3;
+	char text[4096];
+	FILE *fp;
+
+	leasefile_open();
+	lease1 = make_lease("192.0.2.1");
+	lease2 = make_lease("192.0.2.2");
+	lease3 = make_lease("192.0.2.3");
+	ATF_REQUIRE(write_lease(lease1));
+	ATF_REQUIRE(write_lease(lease2));
+	ATF_REQUIRE(write_lease(lease3));
+	fflush(db_file);
+
+	/* Shorten the first record's length; the checksum covers it. */
+	fp = fopen(lf_path, "r+");
+	ATF_REQUIRE(fp != NULL);
+	fseek(fp, 8 + 3, SEEK_SET);
+	fputc(0x08, fp);
+	fclose(fp);
+
+	ATF_CHECK(leasefile_dump(text, sizeof(text)) == DHCP_R_BADPARSE);
+	ATF_CHECK(strstr(text, "lease 192.0.2.1 {") == NULL);
+	ATF_CHECK(strstr(text, "lease 192.0.2.2 {") != NULL);
+	ATF_CHECK(strstr(text, "lease 192.0.2.3 {") != NULL);
+
+	lease_dereference(&lease1, MDL);
+	lease_dereference(&lease2, MDL);
+	lease_dereference(&lease3, MDL);
+	unlink(lf_path);
+}
+
+ATF_TP_ADD_TCS(tp) {
+	ATF_TP_ADD_TC(tp, leasefile_roundtrip);
+	ATF_TP_ADD_TC(tp, leasefile_damage);
+	ATF_TP_ADD_TC(tp, leasefile_resync);
+
+	return (atf_no_error());
+}
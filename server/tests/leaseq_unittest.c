@@ -490,6 +490,123 @@ ATF_TC_BODY(leaseq_same_time, tc)
 
 }
 
+/* Test the way the allocator uses the free queue: leases are taken
+ * from the front and come back at the end.
+ */
+ATF_TC(leaseq_rotate);
+ATF_TC_HEAD(leaseq_rotate, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify taking leases from the front "
+			  "and adding them at the end");
+}
+
+ATF_TC_BODY(leaseq_rotate, tc)
+{
+	LEASE_STRUCT lq;
+	struct lease test_lease[100], *check_lease;
+	int i;
+
+	INIT_LQ(lq);
+#if defined (BINARY_LEASES)
+	lc_init_growth(&lq, 16);
+#endif
+
+	for (i = 0; i < 100; i++) {
+		memset(&test_lease[i], 0, sizeof(struct lease));
+		test_lease[i].sort_time = i;
+		check_lease = NULL;
+		lease_reference(&check_lease, &test_lease[i], MDL);
+
+		LEASE_INSERTP(&lq, &test_lease[i]);
+	}
+
+	for (i = 100; i < 1000; i++) {
+		check_lease = LEASE_GET_FIRST(lq);
+		if (check_lease != &test_lease[i % 100])
+			atf_tc_fail("wrong first lease at %d", i);
+		LEASE_REMOVEP(&lq, check_lease);
+		check_lease->sort_time = i;
+		LEASE_INSERTP(&lq, check_lease);
+	}
+
+	/* Take some from the middle too, and put them back. */
+	for (i = 10; i < 100; i += 20) {
+		LEASE_REMOVEP(&lq, &test_lease[i]);
+	}
+	for (i = 10; i < 100; i += 20) {
+		LEASE_INSERTP(&lq, &test_lease[i]);
+	}
+
+	check_lease = LEASE_GET_FIRST(lq);
+	for (i = 0; i < 100; i++) {
+		if (check_lease != &test_lease[i])
+			atf_tc_fail("leases don't match, %d", i);
+		check_lease = LEASE_GET_NEXT(lq, check_lease);
+	}
+	if (check_lease != NULL)
+		atf_tc_fail("extra lease on queue");
+}
+
+/* Test the expiry index: leases come out of it in sort_time order, and
+ * moving or cancelling a lease is reflected.  The leases have no pool,
+ * so lease_expiry_run() just drops them from the index once they are
+ * due.
+ */
+ATF_TC(lease_expiry_index);
+ATF_TC_HEAD(lease_expiry_index, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify the lease expiry index");
+}
+
+ATF_TC_BODY(lease_expiry_index, tc)
+{
+	struct lease test_lease[200], *check_lease;
+	TIME now;
+	int i;
+
+	dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			    NULL, NULL);
+
+	for (i = 0; i < 200; i++) {
+		memset(&test_lease[i], 0, sizeof(struct lease));
+		test_lease[i].sort_time = 1000 + (i * 37) % 200;
+		test_lease[i].binding_state = FTS_ACTIVE;
+		test_lease[i].next_binding_state = FTS_EXPIRED;
+		check_lease = NULL;
+		lease_reference(&check_lease, &test_lease[i], MDL);
+
+		lease_expiry_schedule(&test_lease[i]);
+	}
+
+	/* Move some leases, cancel some, and leave one with no state
+	 * change pending out of the index. */
+	for (i = 0; i < 200; i += 10) {
+		test_lease[i].sort_time = 1000 + 199 - (i / 10);
+		lease_expiry_schedule(&test_lease[i]);
+	}
+	for (i = 5; i < 200; i += 50)
+		lease_expiry_cancel(&test_lease[i]);
+	test_lease[7].next_binding_state = FTS_ACTIVE;
+	lease_expiry_schedule(&test_lease[7]);
+	if (test_lease[7].expiry_slot != 0)
+		atf_tc_fail("lease with no state change was indexed");
+
+	for (now = 990; now < 1210; now += 7) {
+		cur_tv.tv_sec = now;
+		lease_expiry_run(NULL);
+		for (i = 0; i < 200; i++) {
+			if (i == 7 || i % 50 == 5)
+				continue;
+			if ((test_lease[i].expiry_slot == 0) !=
+			    (test_lease[i].sort_time <= now))
+				atf_tc_fail("lease %d with sort time %d "
+					    "wrong at %d", i,
+					    (int)test_lease[i].sort_time,
+					    (int)now);
+		}
+	}
+}
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, leaseq_basic);
@@ -499,5 +616,7 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, leaseq_cycle);
 	ATF_TP_ADD_TC(tp, leaseq_long);
 	ATF_TP_ADD_TC(tp, leaseq_same_time);
+	ATF_TP_ADD_TC(tp, leaseq_rotate);
+	ATF_TP_ADD_TC(tp, lease_expiry_index);
 	return (atf_no_error());
 }
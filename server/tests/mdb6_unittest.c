@@ -862,6 +862,320 @@ ATF_TC_BODY(small_pool, tc)
     }
 }
 
+/*
+ * Give client number 'client' an active lease from pool, as a client
+ * would get one: create it with a DUID made from the number, then renew
+ * it.  Returns the result of create_lease6() or create_prefix6(); on
+ * success *lease holds the new lease.
+ */
+static isc_result_t
+make_client_lease(struct ipv6_pool *pool, int client, time_t lifetime,
+                  struct iasubopt **lease, unsigned int *attempts)
+{
+    char uid[32];
+    struct data_string ds;
+    isc_result_t status;
+
+    memset(&ds, 0, sizeof(ds));
+    ds.len = snprintf(uid, sizeof(uid), "client%d", client);
+    if (!buffer_allocate(&ds.buffer, ds.len, MDL)) {
+        atf_tc_fail("Out of memory");
+    }
+    ds.data = ds.buffer->data;
+    memcpy((char *)ds.data, uid, ds.len);
+
+    *lease = NULL;
+    if (pool->pool_type == D6O_IA_PD) {
+        status = create_prefix6(pool, lease, attempts, &ds, lifetime);
+    } else {
+        status = create_lease6(pool, lease, attempts, &ds, lifetime);
+    }
+    if ((status == ISC_R_SUCCESS) &&
+        (renew_lease6(pool, *lease) != ISC_R_SUCCESS)) {
+        atf_tc_fail("ERROR: renew_lease6() %s:%d", MDL);
+    }
+    data_string_forget(&ds, MDL);
+    return status;
+}
+
+/*
+ * Pool capacity.
+ * check that a pool is seen to be full once a search of it finds
+ * nothing, even though a reserved address leaves it short of its size.
+ */
+ATF_TC(pool_capacity);
+ATF_TC_HEAD(pool_capacity, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that a full "
+                      "pool is recognised as such.");
+}
+ATF_TC_BODY(pool_capacity, tc)
+{
+    struct in6_addr addr;
+    struct ipv6_pool *pool;
+    struct iasubopt *iaaddr;
+    unsigned int attempts;
+    int i;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+
+    /* 1:2:3:4::/126 holds four addresses, but ::0 is reserved */
+    inet_pton(AF_INET6, "1:2:3:4::", &addr);
+    pool = NULL;
+    if (ipv6_pool_allocate(&pool, D6O_IA_NA, &addr,
+                           126, 128, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+    if ((pool->capacity != 4) || IPV6_POOL_FULL(pool)) {
+        atf_tc_fail("ERROR: bad initial capacity %d", (int)pool->capacity);
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (make_client_lease(pool, i, 42, &iaaddr, &attempts) !=
+            ((i < 3) ? ISC_R_SUCCESS : ISC_R_NORESOURCES)) {
+            atf_tc_fail("ERROR: create_lease6() %d %s:%d", i, MDL);
+        }
+        if (iaaddr != NULL) {
+            iasubopt_dereference(&iaaddr, MDL);
+        }
+    }
+
+    if ((pool->capacity != 3) || !IPV6_POOL_FULL(pool)) {
+        atf_tc_fail("ERROR: bad full capacity %d", (int)pool->capacity);
+    }
+    if (ipv6_pool_dereference(&pool, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_dereference() %s:%d", MDL);
+    }
+}
+
+/*
+ * Dense pool.
+ * check that a small pool can be filled almost completely.
+ */
+
+/* Host bits of the dense pool, and how full to make it (percent). */
+#define DENSE_POOL_BITS 8
+#define DENSE_POOL_FILL 99
+
+ATF_TC(dense_pool);
+ATF_TC_HEAD(dense_pool, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that a dense "
+                      "pool can be filled to 99% without failures.");
+}
+ATF_TC_BODY(dense_pool, tc)
+{
+    struct in6_addr addr;
+    struct ipv6_pool *pool;
+    struct iasubopt *iaaddr;
+    unsigned int attempts;
+    int count, i;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+
+    inet_pton(AF_INET6, "1:2:3:4::", &addr);
+    pool = NULL;
+    if (ipv6_pool_allocate(&pool, D6O_IA_NA, &addr,
+                           128 - DENSE_POOL_BITS, 128, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+
+    count = (1 << DENSE_POOL_BITS) * DENSE_POOL_FILL / 100;
+    for (i = 0; i < count; i++) {
+        if (make_client_lease(pool, i, 42, &iaaddr,
+                              &attempts) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: create_lease6() failed at %d of %d",
+                        i, count);
+        }
+        /* at most ten hashed tries and one sweep of the range */
+        if (attempts == 0 || attempts > 10 + (1 << DENSE_POOL_BITS)) {
+            atf_tc_fail("ERROR: %u attempts at %d", attempts, i);
+        }
+        if (iasubopt_dereference(&iaaddr, MDL) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: iasubopt_dereference() %s:%d", MDL);
+        }
+    }
+
+    if (pool->num_active != count) {
+        atf_tc_fail("ERROR: %d active leases, expected %d",
+                    (int)pool->num_active, count);
+    }
+    if (ipv6_pool_dereference(&pool, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_dereference() %s:%d", MDL);
+    }
+}
+
+/*
+ * Prefix pool index.
+ * check that a prefix pool hands out every prefix exactly once and
+ * reports its free space.
+ */
+ATF_TC(prefix_index);
+ATF_TC_HEAD(prefix_index, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that the free "
+                      "prefix index fills a prefix pool completely.");
+}
+ATF_TC_BODY(prefix_index, tc)
+{
+    struct in6_addr addr;
+    struct ipv6_pool *pool;
+    struct iasubopt *iapref;
+    struct iasubopt *seen[256];
+    unsigned int attempts;
+    isc_uint64_t nfree;
+    int largest;
+    int i, j;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+
+    /* a /48 delegating /56s has 256 prefixes */
+    inet_pton(AF_INET6, "2001:db8:1::", &addr);
+    pool = NULL;
+    if (ipv6_pool_allocate(&pool, D6O_IA_PD, &addr,
+                           48, 56, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+    if (!prefix6_pool_space(pool, &nfree, &largest) ||
+        (nfree != 256) || (largest != 48)) {
+        atf_tc_fail("ERROR: empty pool space %d/%d", (int)nfree, largest);
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (make_client_lease(pool, i, 42, &seen[i],
+                              &attempts) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: create_prefix6() failed at %d", i);
+        }
+        if (seen[i]->plen != 56) {
+            atf_tc_fail("ERROR: bad prefix length %d", seen[i]->plen);
+        }
+        for (j = 0; j < i; j++) {
+            if (memcmp(&seen[i]->addr, &seen[j]->addr,
+                       sizeof(addr)) == 0) {
+                atf_tc_fail("ERROR: prefix %d handed out twice", j);
+            }
+        }
+
+        /* allocation splits the smallest free block it can */
+        if ((i == 0) &&
+            (!prefix6_pool_space(pool, &nfree, &largest) ||
+             (nfree != 255) || (largest != 49))) {
+            atf_tc_fail("ERROR: pool space %d/%d", (int)nfree, largest);
+        }
+    }
+
+    if (!prefix6_pool_space(pool, &nfree, &largest) ||
+        (nfree != 0) || (largest != 0)) {
+        atf_tc_fail("ERROR: full pool space %d/%d", (int)nfree, largest);
+    }
+    if (make_client_lease(pool, 256, 42, &iapref,
+                          &attempts) != ISC_R_NORESOURCES) {
+        atf_tc_fail("ERROR: create_prefix6() on a full pool");
+    }
+
+    for (i = 0; i < 256; i++) {
+        iasubopt_dereference(&seen[i], MDL);
+    }
+    if (ipv6_pool_dereference(&pool, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_dereference() %s:%d", MDL);
+    }
+}
+
+/*
+ * Expiry budget.
+ * check that a run of the expiry timer stops after V6_EXPIRY_BUDGET
+ * leases and leaves the rest to the next run.
+ */
+extern FILE *db_file;
+
+ATF_TC(expire_budget);
+ATF_TC_HEAD(expire_budget, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that lease "
+                      "expiry is done a budget at a time.");
+}
+ATF_TC_BODY(expire_budget, tc)
+{
+    struct in6_addr addr;
+    struct ipv6_pool *pool;
+    struct iasubopt *iaaddr;
+    struct ia_xx *ia;
+    unsigned int attempts;
+    int count, i;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+    db_file = fopen("/dev/null", "w");
+    if (db_file == NULL) {
+        atf_tc_fail("ERROR: can't open /dev/null");
+    }
+
+    inet_pton(AF_INET6, "1:2:3:4::", &addr);
+    pool = NULL;
+    if (ipv6_pool_allocate(&pool, D6O_IA_NA, &addr,
+                           64, 128, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+    if (add_ipv6_pool(pool) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: add_ipv6_pool() %s:%d", MDL);
+    }
+
+    /* two and a bit budgets' worth of leases, all expired at 100 */
+    count = V6_EXPIRY_BUDGET * 2 + 10;
+    for (i = 0; i < count; i++) {
+        if (make_client_lease(pool, i, 100, &iaaddr,
+                              &attempts) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+        }
+        ia = NULL;
+        if (ia_allocate(&ia, i, "client", 6, MDL) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: ia_allocate() %s:%d", MDL);
+        }
+        if (ia_add_iasubopt(ia, iaaddr, MDL) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: ia_add_iasubopt() %s:%d", MDL);
+        }
+        ia_dereference(&ia, MDL);
+        iasubopt_dereference(&iaaddr, MDL);
+    }
+
+    cur_tv.tv_sec = 1000;
+    cur_tv.tv_usec = 0;
+    schedule_all_ipv6_lease_timeouts();
+
+    for (i = 1; i <= 3; i++) {
+        if (timeouts == NULL) {
+            atf_tc_fail("ERROR: no expiry timer for run %d", i);
+        }
+        (*timeouts->func)(timeouts->what);
+
+        if (i < 3) {
+            if (pool->num_active != count - i * V6_EXPIRY_BUDGET) {
+                atf_tc_fail("ERROR: run %d left %d active", i,
+                            (int)pool->num_active);
+            }
+            if ((ipv6_expiry_deferred != i) ||
+                (ipv6_expiry_backlog != 1000 - 101)) {
+                atf_tc_fail("ERROR: run %d backlog %d/%d", i,
+                            (int)ipv6_expiry_deferred,
+                            (int)ipv6_expiry_backlog);
+            }
+        }
+    }
+    if ((pool->num_active != 0) || (ipv6_expiry_backlog != 0)) {
+        atf_tc_fail("ERROR: %d active after catching up",
+                    (int)pool->num_active);
+    }
+
+    ipv6_pool_dereference(&pool, MDL);
+}
+
 /*
  * Address to pool mapping.
  * Verify that we find the proper pool for an address
@@ -967,6 +1281,10 @@ ATF_TP_ADD_TCS(tp)
     ATF_TP_ADD_TC(tp, expire_order);
     ATF_TP_ADD_TC(tp, expire_order_reduce);
     ATF_TP_ADD_TC(tp, small_pool);
+    ATF_TP_ADD_TC(tp, pool_capacity);
+    ATF_TP_ADD_TC(tp, dense_pool);
+    ATF_TP_ADD_TC(tp, prefix_index);
+    ATF_TP_ADD_TC(tp, expire_budget);
     ATF_TP_ADD_TC(tp, many_pools);
 
     return (atf_no_error());
@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2026 Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmarks for the server.   These are not unit tests and are not run
+ * by "make check"; build them with "make server_bench" in this directory
+ * and run ./server_bench.   Each benchmark prints how long it took.
+ */
+
+#include <config.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include "dhcpd.h"
+#include <omapip/omapip_p.h>
+
+/* Host bits of the dense pool benchmark, and how full to make it. */
+#define DENSE_POOL_BITS 16
+#define DENSE_POOL_FILL 99
+
+/* Number of failover binding updates sent, and how many are queued
+   between flushes, as when the update queue is run. */
+#define BNDUPD_BENCH_COUNT 200000
+#define BNDUPD_BENCH_BATCH 64
+
+/* Size of the pool in the lease queue benchmark, and how many times a
+   lease is allocated from it. */
+#define LEASEQ_BENCH_SIZE 1048576
+#define LEASEQ_BENCH_COUNT 3000000
+
+static double
+elapsed(struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+/* Fill a /112 pool to 99%, one new client at a time. */
+static void
+dense_pool_bench(void) {
+	struct in6_addr addr;
+	struct ipv6_pool *pool = NULL;
+	struct iasubopt *iaaddr;
+	struct data_string ds;
+	struct timeval start;
+	char uid[32];
+	unsigned int attempts, total, worst;
+	int count, i;
+
+	inet_pton(AF_INET6, "1:2:3:4::", &addr);
+	if (ipv6_pool_allocate(&pool, D6O_IA_NA, &addr,
+			       128 - DENSE_POOL_BITS, 128, MDL) != ISC_R_SUCCESS)
+		log_fatal("ipv6_pool_allocate failed");
+
+	count = (1 << DENSE_POOL_BITS) * DENSE_POOL_FILL / 100;
+	total = worst = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) {
+		memset(&ds, 0, sizeof(ds));
+		ds.len = snprintf(uid, sizeof(uid), "client%d", i);
+		if (!buffer_allocate(&ds.buffer, ds.len, MDL))
+			log_fatal("no memory");
+		ds.data = ds.buffer->data;
+		memcpy((char *)ds.data, uid, ds.len);
+
+		iaaddr = NULL;
+		if (create_lease6(pool, &iaaddr, &attempts,
+				  &ds, 42) != ISC_R_SUCCESS)
+			log_fatal("create_lease6 failed at %d of %d", i, count);
+		if (renew_lease6(pool, iaaddr) != ISC_R_SUCCESS)
+			log_fatal("renew_lease6 failed");
+		iasubopt_dereference(&iaaddr, MDL);
+		data_string_forget(&ds, MDL);
+
+		total += attempts;
+		if (attempts > worst)
+			worst = attempts;
+	}
+	printf("dense pool fill:  %d leases in %.3fs, %u attempts (worst %u)\n",
+	       count, elapsed(&start), total, worst);
+
+	ipv6_pool_dereference(&pool, MDL);
+}
+
+#if defined (BINARY_LEASES)
+/* Run a pool at 90% use: every tick the oldest free lease is allocated
+   for 90% of the pool size in ticks, and leases that have run out go
+   back on the free queue.   The leases are not set up as OMAPI objects,
+   so each holds an extra reference to keep it from being freed. */
+static void
+leaseq_bench(void) {
+	struct leasechain free_q, active_q;
+	struct lease *leases, *lp, *ref;
+	struct timeval start;
+	long len, tick;
+	int i;
+
+	memset(&free_q, 0, sizeof(free_q));
+	memset(&active_q, 0, sizeof(active_q));
+	lc_init_growth(&free_q, LEASEQ_BENCH_SIZE);
+	lc_init_growth(&active_q, LEASEQ_BENCH_SIZE / 2);
+
+	leases = dmalloc(LEASEQ_BENCH_SIZE * sizeof(struct lease), MDL);
+	if (leases == NULL)
+		log_fatal("no memory");
+	for (i = 0; i < LEASEQ_BENCH_SIZE; i++) {
+		leases[i].sort_time = i - LEASEQ_BENCH_SIZE;
+		ref = NULL;
+		lease_reference(&ref, &leases[i], MDL);
+		lc_add_sorted_lease(&free_q, &leases[i]);
+	}
+
+	len = LEASEQ_BENCH_SIZE / 10 * 9;
+	gettimeofday(&start, NULL);
+	for (tick = 0; tick < LEASEQ_BENCH_COUNT; tick++) {
+		while ((lp = lc_get_first_lease(&active_q)) != NULL &&
+		       lp->sort_time <= tick) {
+			lc_unlink_lease(&active_q, lp);
+			lp->sort_time = tick;
+			lc_add_sorted_lease(&free_q, lp);
+		}
+		lp = lc_get_first_lease(&free_q);
+		lc_unlink_lease(&free_q, lp);
+		lp->sort_time = tick + len;
+		lc_add_sorted_lease(&active_q, lp);
+	}
+	printf("lease queues:     %d allocations from %d leases in %.3fs\n",
+	       LEASEQ_BENCH_COUNT, LEASEQ_BENCH_SIZE, elapsed(&start));
+
+	lc_delete_all(&free_q);
+	lc_delete_all(&active_q);
+	dfree(leases, MDL);
+}
+#endif /* BINARY_LEASES */
+
+#if defined (FAILOVER_PROTOCOL)
+/* Send failover messages on one end of a socket pair standing in for the
+   peer, and drain them from the other. */
+static omapi_connection_object_t *
+make_connection(int *peer) {
+	omapi_connection_object_t *c = NULL;
+	int sv[2];
+
+	if (omapi_init() != ISC_R_SUCCESS)
+		log_fatal("omapi_init failed");
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		log_fatal("socketpair: %m");
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+	if (omapi_connection_allocate(&c, MDL) != ISC_R_SUCCESS)
+		log_fatal("omapi_connection_allocate failed");
+	c->socket = sv[0];
+	c->state = omapi_connection_connected;
+	*peer = sv[1];
+	return c;
+}
+
+static isc_result_t
+send_bndupd(dhcp_failover_link_t *link, omapi_connection_object_t *c,
+	    u_int32_t xid) {
+	u_int8_t addr[4] = { 192, 0, 2, 1 };
+
+	addr[2] = (xid >> 8) & 0xff;
+	addr[3] = xid & 0xff;
+	return dhcp_failover_put_message
+		(link, (omapi_object_t *)c, FTM_BNDUPD, xid,
+		 dhcp_failover_make_option(FTO_ASSIGNED_IP_ADDRESS,
+					   (char *)0, (unsigned *)0, 0,
+					   4, addr),
+		 dhcp_failover_make_option(FTO_BINDING_STATUS,
+					   (char *)0, (unsigned *)0, 0,
+					   FTS_ACTIVE),
+		 dhcp_failover_make_option(FTO_CLIENT_IDENTIFIER,
+					   (char *)0, (unsigned *)0, 0,
+					   7, "\001\000\021\042\063\104\125"),
+		 dhcp_failover_make_option(FTO_CHADDR,
+					   (char *)0, (unsigned *)0, 0,
+					   7, "\001\000\021\042\063\104\125"),
+		 dhcp_failover_make_option(FTO_LEASE_EXPIRY,
+					   (char *)0, (unsigned *)0, 0,
+					   (unsigned)cur_time + 3600),
+		 dhcp_failover_make_option(FTO_POTENTIAL_EXPIRY,
+					   (char *)0, (unsigned *)0, 0,
+					   (unsigned)cur_time + 7200),
+		 dhcp_failover_make_option(FTO_STOS,
+					   (char *)0, (unsigned *)0, 0,
+					   (unsigned)cur_time),
+		 dhcp_failover_make_option(FTO_CLTT,
+					   (char *)0, (unsigned *)0, 0,
+					   (unsigned)cur_time),
+		 (failover_option_t *)0);
+}
+
+/* Flush the connection and count what the peer has received. */
+static size_t
+drain(omapi_connection_object_t *c, int peer) {
+	unsigned char buf[65536];
+	size_t total = 0;
+	ssize_t n;
+
+	do {
+		omapi_connection_writer((omapi_object_t *)c);
+		while ((n = read(peer, buf, sizeof buf)) > 0)
+			total += n;
+	} while (c->out_bytes != 0);
+	return total;
+}
+
+/* Build and send a large number of binding updates to a local peer. */
+static void
+bndupd_bench(void) {
+	dhcp_failover_link_t link;
+	omapi_connection_object_t *c;
+	struct timeval start;
+	size_t msglen, total = 0;
+	int peer, i;
+
+	memset(&link, 0, sizeof link);
+	c = make_connection(&peer);
+	cur_time = 1700000000;
+
+	if (send_bndupd(&link, c, 0) != ISC_R_SUCCESS)
+		log_fatal("put_message failed");
+	msglen = drain(c, peer);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BNDUPD_BENCH_COUNT; i++) {
+		if (send_bndupd(&link, c, i) != ISC_R_SUCCESS)
+			log_fatal("put_message failed at %d", i);
+		if ((i % BNDUPD_BENCH_BATCH) == BNDUPD_BENCH_BATCH - 1)
+			total += drain(c, peer);
+	}
+	total += drain(c, peer);
+	printf("failover bndupd:  %d updates, %lu bytes in %.3fs\n",
+	       BNDUPD_BENCH_COUNT, (unsigned long)total, elapsed(&start));
+
+	if (total != msglen * BNDUPD_BENCH_COUNT)
+		log_fatal("peer received %lu bytes, expected %lu",
+			  (unsigned long)total,
+			  (unsigned long)(msglen * BNDUPD_BENCH_COUNT));
+	close(peer);
+}
+#endif /* FAILOVER_PROTOCOL */
+
+int
+main(int argc, char **argv) {
+	dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			    NULL, NULL);
+
+	dense_pool_bench();
+#if defined (BINARY_LEASES)
+	leaseq_bench();
+#endif
+#if defined (FAILOVER_PROTOCOL)
+	bndupd_bench();
+#endif
+
+	return (0);
+}